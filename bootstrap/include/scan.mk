@@ -8,69 +8,23 @@ include $(TOPDIR)/include/host.mk
 SCAN_TARGET ?= packageinfo
 SCAN_NAME ?= package
 SCAN_DIR ?= package
-TARGET_STAMP:=$(TMP_DIR)/info/.files-$(SCAN_TARGET).stamp
-FILELIST:=$(TMP_DIR)/info/.files-$(SCAN_TARGET)-$(SCAN_COOKIE)
-
-ifeq ($(IS_TTY),1)
-  define progress
-	printf "\033[M\r$(1)" >&2;
-  endef
-else
-  define progress
-	:;
-  endef
-endif
-
-define PackageDir
-  $(TMP_DIR)/.$(SCAN_TARGET): $(TMP_DIR)/info/.$(SCAN_TARGET)-$(1)
-  $(TMP_DIR)/info/.$(SCAN_TARGET)-$(1): $(SCAN_DIR)/$(2)/Makefile $(SCAN_STAMP) $(foreach DEP,$(DEPS_$(SCAN_DIR)/$(2)/Makefile) $(SCAN_DEPS),$(wildcard $(if $(filter /%,$(DEP)),$(DEP),$(SCAN_DIR)/$(2)/$(DEP))))
-	{ \
-		$$(call progress,Collecting $(SCAN_NAME) info: $(SCAN_DIR)/$(2)) \
-		echo Source-Makefile: $(SCAN_DIR)/$(2)/Makefile; \
-		$(NO_TRACE_MAKE) --no-print-dir -r DUMP=1 -C $(SCAN_DIR)/$(2) $(SCAN_MAKEOPTS) 2>/dev/null || { \
-			mkdir -p "$(TOPDIR)/logs/$(SCAN_DIR)/$(2)"; \
-			$(NO_TRACE_MAKE) --no-print-dir -r DUMP=1 -C $(SCAN_DIR)/$(2) $(SCAN_MAKEOPTS) > $(TOPDIR)/logs/$(SCAN_DIR)/$(2)/dump.txt 2>&1; \
-			$$(call progress,ERROR: please fix $(SCAN_DIR)/$(2)/Makefile - see logs/$(SCAN_DIR)/$(2)/dump.txt for details\n) \
-			rm -f $$@; \
-		}; \
-		echo; \
-	} > $$@ || true
-endef
-
-$(FILELIST):
-	rm -f $(TMP_DIR)/info/.files-$(SCAN_TARGET)-*
-	$(call FIND_L, $(SCAN_DIR)) $(SCAN_EXTRA) -mindepth 1 $(if $(SCAN_DEPTH),-maxdepth $(SCAN_DEPTH)) -name Makefile | xargs grep -HE 'call (Build/DefaultTargets|Build(Package|Target)|.+Package)' | sed -e 's#^$(SCAN_DIR)/##' -e 's#/Makefile:.*##' | uniq > $@
-
-$(TMP_DIR)/info/.files-$(SCAN_TARGET).mk: $(FILELIST)
-	( \
-		cat $< | awk '{print "$(SCAN_DIR)/" $$0 "/Makefile" }' | xargs grep -HE '^ *SCAN_DEPS *= *' | awk -F: '{ gsub(/^.*DEPS *= */, "", $$2); print "DEPS_" $$1 "=" $$2 }'; \
-		awk -v deps="$$DEPS" '{ \
-			info=$$0; \
-			gsub(/\//, "_", info); \
-			print "$$(eval $$(call PackageDir," info "," $$0 "))"; \
-		} ' < $<; \
-		true; \
-	) > $@
-
--include $(TMP_DIR)/info/.files-$(SCAN_TARGET).mk
-
-$(TARGET_STAMP)::
-	+( \
-		$(NO_TRACE_MAKE) $(FILELIST); \
-		MD5SUM=$$(cat $(FILELIST) | (md5sum || md5) 2>/dev/null | awk '{print $$1}'); \
-		[ -f "$@.$$MD5SUM" ] || { \
-			rm -f $@.*; \
-			touch $@.$$MD5SUM; \
-			touch $@; \
-		} \
-	)
-
-$(TMP_DIR)/.$(SCAN_TARGET): $(TARGET_STAMP) $(SCAN_STAMP)
-	$(call progress,Collecting $(SCAN_NAME) info: merging...)
-	-cat $(FILELIST) | awk '{gsub(/\//, "_", $$0);print "$(TMP_DIR)/info/.$(SCAN_TARGET)-" $$0}' | xargs cat > $@ 2>/dev/null
-	$(call progress,Collecting $(SCAN_NAME) info: done)
-	echo
+SCAN_JOBS ?= $(shell getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+
+# scan.pl keeps one dump per Makefile in $(TMP_DIR)/info, reruns only those
+# whose Makefile or included .mk files changed, and only rewrites the
+# merged file when its contents change
+$(TMP_DIR)/.$(SCAN_TARGET): FORCE
+	mkdir -p $(TMP_DIR)/info
+	$(call FIND_L, $(SCAN_DIR)) $(SCAN_EXTRA) -mindepth 1 $(if $(SCAN_DEPTH),-maxdepth $(SCAN_DEPTH)) -name Makefile | \
+		$(TOPDIR)/scripts/scan.pl \
+			--target="$(SCAN_TARGET)" \
+			--name="$(SCAN_NAME)" \
+			--dir="$(SCAN_DIR)" \
+			--tmp="$(TMP_DIR)" \
+			--topdir="$(TOPDIR)" \
+			--deps="$(SCAN_DEPS)" \
+			--makeopts="$(SCAN_MAKEOPTS)" \
+			--jobs="$(SCAN_JOBS)"
 
 FORCE:
 .PHONY: FORCE
-.NOTPARALLEL:
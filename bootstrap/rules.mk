@@ -15,6 +15,7 @@ include $(TOPDIR)/include/debug.mk
 include $(TOPDIR)/include/verbose.mk
 
 export TMP_DIR:=$(TOPDIR)/tmp
+export FILE_STATE_CACHE:=$(TMP_DIR)/.file-state
 
 qstrip=$(strip $(subst ",,$(1)))
 #"))
@@ -0,0 +1,945 @@
+/*
+ * Released under the terms of the GNU GPL v2.0.
+ *
+ * Pre-parsed Kconfig cache. When $KCONFIG_CACHE names a file, conf_parse()
+ * saves the finished symbol, property, menu and expression graph there,
+ * and the next run maps the file and rebuilds the graph from it instead of
+ * lexing, parsing and finalizing every sourced Kconfig file again. Records
+ * refer to each other by index, and strings are offsets into one block
+ * that is used in place from the mapping.
+ *
+ * A cache is only used while every sourced file is unchanged (same mtime
+ * and size, or failing that the same contents), every wildcard source
+ * still matches the same files, and the environment the Kconfig files
+ * read is the same. Anything else just means a normal parse, which then
+ * writes a new cache.
+ */
+
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#define CACHE_MAGIC	0x4b434331	/* "KCC1", also catches a byte swap */
+#define CACHE_VERSION	1
+
+#define CACHE_NONE	(-1)
+/* symbol references below CACHE_NONE are the static symbols */
+#define CACHE_SYM_YES	(-2)
+#define CACHE_SYM_MOD	(-3)
+#define CACHE_SYM_NO	(-4)
+#define CACHE_SYM_EMPTY	(-5)
+
+/*
+ * The file is the header, then the tables in the order below, then the
+ * string block. All references are int32 indices, CACHE_NONE for NULL.
+ */
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	int64_t written;	/* files changed since are always hashed */
+	int32_t root;		/* the Kconfig file conf was given */
+	int32_t uname;		/* what UNAME_RELEASE defaulted to */
+	int32_t modules_sym;
+	int32_t defconfig_list;
+	int32_t env_list;
+	uint32_t n_files;
+	uint32_t n_globs;
+	uint32_t n_envs;
+	uint32_t n_syms;
+	uint32_t n_props;
+	uint32_t n_menus;	/* the first one is rootmenu */
+	uint32_t n_exprs;
+	uint32_t n_strings;	/* bytes */
+	uint32_t pad;
+};
+
+struct cache_file {
+	int64_t mtime;
+	int64_t size;
+	uint64_t hash;
+	int32_t name;
+	int32_t parent;
+	int32_t lineno;
+	int32_t pad;
+};
+
+struct cache_glob {
+	int32_t pattern;
+	int32_t matches;	/* the paths found, one per line */
+};
+
+struct cache_env {
+	int32_t name;
+	int32_t value;		/* CACHE_NONE if it was not set */
+};
+
+struct cache_sym {
+	int32_t name;
+	int32_t bucket;		/* in symbol_hash, chains keep their order */
+	int32_t type;
+	int32_t flags;
+	int32_t prop;
+	int32_t dir_dep;
+	int32_t rev_dep;
+};
+
+struct cache_prop {
+	int32_t next;
+	int32_t sym;
+	int32_t type;
+	int32_t text;
+	int32_t visible;
+	int32_t expr;
+	int32_t menu;
+	int32_t file;
+	int32_t lineno;
+};
+
+struct cache_menu {
+	int32_t next;
+	int32_t parent;
+	int32_t list;
+	int32_t sym;
+	int32_t prompt;
+	int32_t visibility;
+	int32_t dep;
+	int32_t flags;
+	int32_t help;
+	int32_t file;
+	int32_t lineno;
+};
+
+struct cache_expr {
+	int32_t type;
+	int32_t left;
+	int32_t right;
+};
+
+/* Wildcard sources seen while parsing, checked again before a load */
+struct cache_glob_note {
+	struct cache_glob_note *next;
+	char *pattern;
+	struct gstr matches;
+};
+
+static struct cache_glob_note *cache_globs;
+
+static const char *conf_get_cachename(void)
+{
+	char *name = getenv("KCONFIG_CACHE");
+
+	return name && *name ? name : NULL;
+}
+
+static uint64_t cache_hash_file(const char *name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	unsigned char buf[8192];
+	ssize_t len, i;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < len; i++)
+			hash = (hash ^ buf[i]) * 1099511628211ULL;
+	}
+	close(fd);
+	return hash;
+}
+
+/* Finds a file the way zconf_fopen() does */
+static const char *cache_stat(const char *name, struct stat *st)
+{
+	static char fullname[PATH_MAX+1];
+	char *env;
+
+	if (!stat(name, st))
+		return name;
+	if (name[0] == '/')
+		return NULL;
+	env = getenv(SRCTREE);
+	if (!env)
+		return NULL;
+	snprintf(fullname, sizeof(fullname), "%s/%s", env, name);
+	return stat(fullname, st) ? NULL : fullname;
+}
+
+static struct gstr cache_glob_join(size_t n, char **paths)
+{
+	struct gstr gs = str_new();
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		str_append(&gs, paths[i]);
+		str_append(&gs, "\n");
+	}
+	return gs;
+}
+
+static struct gstr cache_glob_matches(const char *pattern)
+{
+	struct gstr gs;
+	glob_t gl;
+
+	if (glob(pattern, GLOB_ERR | GLOB_MARK, NULL, &gl))
+		return str_new();
+	gs = cache_glob_join(gl.gl_pathc, gl.gl_pathv);
+	globfree(&gl);
+	return gs;
+}
+
+/* Called for each source statement with what its pattern matched */
+void conf_cache_note_glob(const char *pattern, size_t n, char **paths)
+{
+	struct cache_glob_note *note;
+
+	if (!strpbrk(pattern, "*?["))
+		return;
+	note = xmalloc(sizeof(*note));
+	note->pattern = strdup(pattern);
+	note->matches = cache_glob_join(n, paths);
+	note->next = cache_globs;
+	cache_globs = note;
+}
+
+/*
+ * Writing: every object gets an index the first time it is seen, kept in
+ * a pointer hash, and is then written out as a record of indices.
+ */
+struct cache_map {
+	const void **keys;
+	int *vals;
+	size_t size;
+	size_t used;
+};
+
+static size_t cache_map_slot(struct cache_map *map, const void *p)
+{
+	size_t i = ((uintptr_t)p >> 4) * 2654435761U;
+
+	for (i &= map->size - 1; map->keys[i] && map->keys[i] != p;
+	     i = (i + 1) & (map->size - 1))
+		;
+	return i;
+}
+
+static int cache_map_get(struct cache_map *map, const void *p)
+{
+	size_t i;
+
+	if (!map->size)
+		return CACHE_NONE;
+	i = cache_map_slot(map, p);
+	return map->keys[i] ? map->vals[i] : CACHE_NONE;
+}
+
+static void cache_map_put(struct cache_map *map, const void *p, int val)
+{
+	struct cache_map old = *map;
+	size_t i;
+
+	if ((map->used + 1) * 2 > map->size) {
+		map->size = map->size ? map->size * 2 : 4096;
+		map->keys = xcalloc(map->size, sizeof(*map->keys));
+		map->vals = xcalloc(map->size, sizeof(*map->vals));
+		map->used = 0;
+		for (i = 0; i < old.size; i++)
+			if (old.keys[i])
+				cache_map_put(map, old.keys[i], old.vals[i]);
+		free(old.keys);
+		free(old.vals);
+	}
+	i = cache_map_slot(map, p);
+	if (!map->keys[i])
+		map->used++;
+	map->keys[i] = p;
+	map->vals[i] = val;
+}
+
+struct cache_writer {
+	struct cache_map map;
+	int bad;		/* something pointed outside the graph */
+	char *strings;
+	size_t n_strings, strings_size;
+	struct cache_expr *exprs;
+	int n_exprs, exprs_size;
+	int n_syms, n_props, n_menus, n_files;
+};
+
+static int cache_ref(struct cache_writer *w, const void *p)
+{
+	int idx;
+
+	if (!p)
+		return CACHE_NONE;
+	idx = cache_map_get(&w->map, p);
+	if (idx == CACHE_NONE)
+		w->bad = 1;
+	return idx;
+}
+
+static int cache_sym_ref(struct cache_writer *w, struct symbol *sym)
+{
+	if (sym == &symbol_yes)
+		return CACHE_SYM_YES;
+	if (sym == &symbol_mod)
+		return CACHE_SYM_MOD;
+	if (sym == &symbol_no)
+		return CACHE_SYM_NO;
+	if (sym == &symbol_empty)
+		return CACHE_SYM_EMPTY;
+	return cache_ref(w, sym);
+}
+
+static int cache_string(struct cache_writer *w, const char *s)
+{
+	size_t len, off = w->n_strings;
+
+	if (!s)
+		return CACHE_NONE;
+	len = strlen(s) + 1;
+	if (off + len > INT32_MAX) {
+		w->bad = 1;
+		return CACHE_NONE;
+	}
+	if (off + len > w->strings_size) {
+		w->strings_size = (off + len) * 2;
+		w->strings = realloc(w->strings, w->strings_size);
+		if (!w->strings) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+	memcpy(w->strings + off, s, len);
+	w->n_strings += len;
+	return off;
+}
+
+/* Expressions may be shared, so they are indexed like everything else */
+static int cache_expr(struct cache_writer *w, struct expr *e)
+{
+	struct cache_expr r;
+	int idx;
+
+	if (!e)
+		return CACHE_NONE;
+	idx = cache_map_get(&w->map, e);
+	if (idx != CACHE_NONE)
+		return idx;
+
+	if (w->n_exprs == w->exprs_size) {
+		w->exprs_size = w->exprs_size ? w->exprs_size * 2 : 4096;
+		w->exprs = realloc(w->exprs, w->exprs_size * sizeof(*w->exprs));
+		if (!w->exprs) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+	idx = w->n_exprs++;
+	cache_map_put(&w->map, e, idx);
+
+	r.type = e->type;
+	r.left = r.right = CACHE_NONE;
+	switch (e->type) {
+	case E_SYMBOL:
+		r.left = cache_sym_ref(w, e->left.sym);
+		break;
+	case E_EQUAL:
+	case E_UNEQUAL:
+	case E_RANGE:
+		r.left = cache_sym_ref(w, e->left.sym);
+		r.right = cache_sym_ref(w, e->right.sym);
+		break;
+	case E_NOT:
+		r.left = cache_expr(w, e->left.expr);
+		break;
+	case E_AND:
+	case E_OR:
+		r.left = cache_expr(w, e->left.expr);
+		r.right = cache_expr(w, e->right.expr);
+		break;
+	case E_LIST:
+		r.left = cache_expr(w, e->left.expr);
+		r.right = cache_sym_ref(w, e->right.sym);
+		break;
+	default:
+		break;
+	}
+	w->exprs[idx] = r;
+	return idx;
+}
+
+static struct menu *cache_menu_next(struct menu *menu)
+{
+	if (menu->list)
+		return menu->list;
+	for (; menu; menu = menu->parent)
+		if (menu->next)
+			return menu->next;
+	return NULL;
+}
+
+static void cache_prop(struct cache_writer *w, struct cache_prop *r,
+		       struct property *prop)
+{
+	r->next = cache_ref(w, prop->next);
+	r->sym = cache_sym_ref(w, prop->sym);
+	r->type = prop->type;
+	r->text = cache_string(w, prop->text);
+	r->visible = cache_expr(w, prop->visible.expr);
+	r->expr = cache_expr(w, prop->expr);
+	r->menu = cache_ref(w, prop->menu);
+	r->file = cache_ref(w, prop->file);
+	r->lineno = prop->lineno;
+}
+
+static void cache_menu(struct cache_writer *w, struct cache_menu *r,
+		       struct menu *menu)
+{
+	r->next = cache_ref(w, menu->next);
+	r->parent = cache_ref(w, menu->parent);
+	r->list = cache_ref(w, menu->list);
+	r->sym = cache_sym_ref(w, menu->sym);
+	r->prompt = cache_ref(w, menu->prompt);
+	r->visibility = cache_expr(w, menu->visibility);
+	r->dep = cache_expr(w, menu->dep);
+	r->flags = menu->flags;
+	r->help = cache_string(w, menu->help);
+	r->file = cache_ref(w, menu->file);
+	r->lineno = menu->lineno;
+}
+
+static int cache_fwrite(FILE *out, const void *p, size_t size, size_t n)
+{
+	return n && fwrite(p, size, n, out) != n;
+}
+
+void conf_cache_write(const char *name)
+{
+	const char *path = conf_get_cachename();
+	struct cache_writer w;
+	struct cache_header hdr;
+	struct cache_file *files;
+	struct cache_glob *globs;
+	struct cache_env *envs;
+	struct cache_sym *syms;
+	struct cache_prop *props;
+	struct cache_menu *menus;
+	struct property **prop_list;
+	struct cache_glob_note *note;
+	struct symbol *sym, *env_sym;
+	struct property *prop;
+	struct menu *menu;
+	struct file *file;
+	struct expr *e;
+	struct stat st;
+	struct utsname uts;
+	const char *found;
+	char tmpname[PATH_MAX+1];
+	FILE *out;
+	int i, n, err;
+
+	if (!path)
+		return;
+	memset(&w, 0, sizeof(w));
+	memset(&hdr, 0, sizeof(hdr));
+
+	/* Number everything that can be pointed at, menus in tree order */
+	for (file = file_list; file; file = file->next)
+		cache_map_put(&w.map, file, w.n_files++);
+	for (i = 0; i < SYMBOL_HASHSIZE; i++)
+		for (sym = symbol_hash[i]; sym; sym = sym->next) {
+			/* only a bare parse is cached, no values */
+			if (sym->flags & (SYMBOL_DEF_USER|SYMBOL_DEF_AUTO|
+					  SYMBOL_DEF3|SYMBOL_DEF4))
+				goto out_map;
+			cache_map_put(&w.map, sym, w.n_syms++);
+			for (prop = sym->prop; prop; prop = prop->next)
+				w.n_props++;
+		}
+	for (menu = &rootmenu; menu; menu = cache_menu_next(menu)) {
+		cache_map_put(&w.map, menu, w.n_menus++);
+		if (menu->prompt && !menu->prompt->sym)
+			w.n_props++;
+	}
+
+	prop_list = xcalloc(w.n_props + 1, sizeof(*prop_list));
+	n = 0;
+	for (i = 0; i < SYMBOL_HASHSIZE; i++)
+		for (sym = symbol_hash[i]; sym; sym = sym->next)
+			for (prop = sym->prop; prop; prop = prop->next)
+				prop_list[n++] = prop;
+	for (menu = &rootmenu; menu; menu = cache_menu_next(menu))
+		if (menu->prompt && !menu->prompt->sym)
+			prop_list[n++] = menu->prompt;
+	for (i = 0; i < n; i++)
+		cache_map_put(&w.map, prop_list[i], i);
+
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.written = time(NULL);
+	hdr.root = cache_string(&w, name);
+	uname(&uts);
+	hdr.uname = cache_string(&w, uts.release);
+	hdr.modules_sym = cache_sym_ref(&w, modules_sym);
+	hdr.defconfig_list = cache_sym_ref(&w, sym_defconfig_list);
+	hdr.env_list = cache_expr(&w, sym_env_list);
+
+	files = xcalloc(w.n_files + 1, sizeof(*files));
+	n = 0;
+	for (file = file_list; file; file = file->next, n++) {
+		found = cache_stat(file->name, &st);
+		if (!found) {
+			w.bad = 1;
+			break;
+		}
+		files[n].mtime = st.st_mtime;
+		files[n].size = st.st_size;
+		files[n].hash = cache_hash_file(found);
+		files[n].name = cache_string(&w, file->name);
+		files[n].parent = cache_ref(&w, file->parent);
+		files[n].lineno = file->lineno;
+	}
+	hdr.n_files = w.n_files;
+
+	for (note = cache_globs; note; note = note->next)
+		hdr.n_globs++;
+	globs = xcalloc(hdr.n_globs + 1, sizeof(*globs));
+	n = 0;
+	for (note = cache_globs; note; note = note->next, n++) {
+		globs[n].pattern = cache_string(&w, note->pattern);
+		globs[n].matches = cache_string(&w, str_get(&note->matches));
+	}
+
+	/* srctree decides where files are found, so it is always checked */
+	hdr.n_envs = 1;
+	expr_list_for_each_sym(sym_env_list, e, sym)
+		hdr.n_envs++;
+	envs = xcalloc(hdr.n_envs, sizeof(*envs));
+	envs[0].name = cache_string(&w, SRCTREE);
+	envs[0].value = cache_string(&w, getenv(SRCTREE));
+	n = 1;
+	expr_list_for_each_sym(sym_env_list, e, sym) {
+		env_sym = prop_get_symbol(sym_get_env_prop(sym));
+		envs[n].name = cache_string(&w, env_sym->name);
+		envs[n].value = cache_string(&w, getenv(env_sym->name));
+		n++;
+	}
+
+	syms = xcalloc(w.n_syms + 1, sizeof(*syms));
+	n = 0;
+	for (i = 0; i < SYMBOL_HASHSIZE; i++)
+		for (sym = symbol_hash[i]; sym; sym = sym->next, n++) {
+			syms[n].name = cache_string(&w, sym->name);
+			syms[n].bucket = i;
+			syms[n].type = sym->type;
+			/* values are worked out again after loading */
+			syms[n].flags = sym->flags & ~SYMBOL_VALID;
+			syms[n].prop = cache_ref(&w, sym->prop);
+			syms[n].dir_dep = cache_expr(&w, sym->dir_dep.expr);
+			syms[n].rev_dep = cache_expr(&w, sym->rev_dep.expr);
+		}
+	hdr.n_syms = w.n_syms;
+
+	props = xcalloc(w.n_props + 1, sizeof(*props));
+	for (i = 0; i < w.n_props; i++)
+		cache_prop(&w, &props[i], prop_list[i]);
+	hdr.n_props = w.n_props;
+
+	menus = xcalloc(w.n_menus + 1, sizeof(*menus));
+	n = 0;
+	for (menu = &rootmenu; menu; menu = cache_menu_next(menu))
+		cache_menu(&w, &menus[n++], menu);
+	hdr.n_menus = w.n_menus;
+
+	hdr.n_exprs = w.n_exprs;
+	hdr.n_strings = w.n_strings;
+
+	if (w.bad)
+		goto out;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", path, (int)getpid());
+	out = fopen(tmpname, "w");
+	if (!out)
+		goto out;
+	err = cache_fwrite(out, &hdr, sizeof(hdr), 1);
+	err |= cache_fwrite(out, files, sizeof(*files), hdr.n_files);
+	err |= cache_fwrite(out, globs, sizeof(*globs), hdr.n_globs);
+	err |= cache_fwrite(out, envs, sizeof(*envs), hdr.n_envs);
+	err |= cache_fwrite(out, syms, sizeof(*syms), hdr.n_syms);
+	err |= cache_fwrite(out, props, sizeof(*props), hdr.n_props);
+	err |= cache_fwrite(out, menus, sizeof(*menus), hdr.n_menus);
+	err |= cache_fwrite(out, w.exprs, sizeof(*w.exprs), hdr.n_exprs);
+	err |= cache_fwrite(out, w.strings, 1, hdr.n_strings);
+	err |= fclose(out);
+	if (err || rename(tmpname, path))
+		unlink(tmpname);
+
+out:
+	free(files);
+	free(globs);
+	free(envs);
+	free(syms);
+	free(props);
+	free(menus);
+	free(prop_list);
+	free(w.exprs);
+	free(w.strings);
+out_map:
+	free(w.map.keys);
+	free(w.map.vals);
+}
+
+/*
+ * Loading. Nothing global is touched until every record has been checked,
+ * so a stale or damaged cache just falls back to parsing.
+ */
+struct cache_reader {
+	const struct cache_header *hdr;
+	const char *strings;
+	struct symbol *syms;
+	struct property *props;
+	struct menu *menus;
+	struct expr *exprs;
+	struct file *files;
+	int bad;
+};
+
+static const char *cache_rd_string(struct cache_reader *r, int32_t off)
+{
+	if (off == CACHE_NONE)
+		return NULL;
+	if (off < 0 || (uint32_t)off >= r->hdr->n_strings) {
+		r->bad = 1;
+		return NULL;
+	}
+	return r->strings + off;
+}
+
+static int cache_rd_index(struct cache_reader *r, int32_t idx, uint32_t n)
+{
+	if (idx == CACHE_NONE)
+		return -1;
+	if (idx < 0 || (uint32_t)idx >= n) {
+		r->bad = 1;
+		return -1;
+	}
+	return idx;
+}
+
+static struct symbol *cache_rd_sym(struct cache_reader *r, int32_t idx)
+{
+	switch (idx) {
+	case CACHE_SYM_YES:
+		return &symbol_yes;
+	case CACHE_SYM_MOD:
+		return &symbol_mod;
+	case CACHE_SYM_NO:
+		return &symbol_no;
+	case CACHE_SYM_EMPTY:
+		return &symbol_empty;
+	}
+	idx = cache_rd_index(r, idx, r->hdr->n_syms);
+	return idx < 0 ? NULL : &r->syms[idx];
+}
+
+static struct property *cache_rd_prop(struct cache_reader *r, int32_t idx)
+{
+	idx = cache_rd_index(r, idx, r->hdr->n_props);
+	return idx < 0 ? NULL : &r->props[idx];
+}
+
+static struct menu *cache_rd_menu(struct cache_reader *r, int32_t idx)
+{
+	idx = cache_rd_index(r, idx, r->hdr->n_menus);
+	if (idx < 0)
+		return NULL;
+	return idx ? &r->menus[idx] : &rootmenu;
+}
+
+static struct expr *cache_rd_expr(struct cache_reader *r, int32_t idx)
+{
+	idx = cache_rd_index(r, idx, r->hdr->n_exprs);
+	return idx < 0 ? NULL : &r->exprs[idx];
+}
+
+static struct file *cache_rd_file(struct cache_reader *r, int32_t idx)
+{
+	idx = cache_rd_index(r, idx, r->hdr->n_files);
+	return idx < 0 ? NULL : &r->files[idx];
+}
+
+static bool cache_same_string(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+/* Is everything the cached parse was made from still the same? */
+static bool cache_fresh(struct cache_reader *r, const char *name,
+			const struct cache_file *files,
+			const struct cache_glob *globs,
+			const struct cache_env *envs)
+{
+	const struct cache_header *hdr = r->hdr;
+	struct utsname uts;
+	struct stat st;
+	struct gstr gs;
+	const char *found, *s;
+	uint32_t i;
+	bool same;
+
+	if (!cache_same_string(cache_rd_string(r, hdr->root), name))
+		return false;
+	uname(&uts);
+	if (!cache_same_string(cache_rd_string(r, hdr->uname), uts.release))
+		return false;
+
+	for (i = 0; i < hdr->n_envs; i++) {
+		s = cache_rd_string(r, envs[i].name);
+		if (!s || !cache_same_string(cache_rd_string(r, envs[i].value),
+					     getenv(s)))
+			return false;
+	}
+
+	for (i = 0; i < hdr->n_globs; i++) {
+		s = cache_rd_string(r, globs[i].pattern);
+		if (!s)
+			return false;
+		gs = cache_glob_matches(s);
+		same = cache_same_string(cache_rd_string(r, globs[i].matches),
+					 str_get(&gs));
+		str_free(&gs);
+		if (!same)
+			return false;
+	}
+
+	for (i = 0; i < hdr->n_files; i++) {
+		s = cache_rd_string(r, files[i].name);
+		if (!s)
+			return false;
+		found = cache_stat(s, &st);
+		if (!found)
+			return false;
+		/* a file changed in the second the cache was written is hashed */
+		if (st.st_mtime == files[i].mtime && st.st_size == files[i].size &&
+		    st.st_mtime < hdr->written)
+			continue;
+		if (cache_hash_file(found) != files[i].hash)
+			return false;
+	}
+
+	return !r->bad;
+}
+
+static void cache_load_expr(struct cache_reader *r, struct expr *e,
+			    const struct cache_expr *c)
+{
+	e->type = c->type;
+	switch (e->type) {
+	case E_SYMBOL:
+		e->left.sym = cache_rd_sym(r, c->left);
+		break;
+	case E_EQUAL:
+	case E_UNEQUAL:
+	case E_RANGE:
+		e->left.sym = cache_rd_sym(r, c->left);
+		e->right.sym = cache_rd_sym(r, c->right);
+		break;
+	case E_NOT:
+		e->left.expr = cache_rd_expr(r, c->left);
+		break;
+	case E_AND:
+	case E_OR:
+		e->left.expr = cache_rd_expr(r, c->left);
+		e->right.expr = cache_rd_expr(r, c->right);
+		break;
+	case E_LIST:
+		e->left.expr = cache_rd_expr(r, c->left);
+		e->right.sym = cache_rd_sym(r, c->right);
+		break;
+	case E_NONE:
+		break;
+	default:
+		r->bad = 1;
+		break;
+	}
+}
+
+bool conf_cache_load(const char *name)
+{
+	const char *path = conf_get_cachename();
+	const struct cache_header *hdr;
+	const struct cache_file *files;
+	const struct cache_glob *globs;
+	const struct cache_env *envs;
+	const struct cache_sym *syms;
+	const struct cache_prop *props;
+	const struct cache_menu *menus;
+	const struct cache_expr *exprs;
+	struct cache_reader r;
+	struct symbol *tail[SYMBOL_HASHSIZE];
+	struct symbol *sym;
+	struct property *prop;
+	struct menu root, *menu;
+	struct stat st;
+	uint64_t size;
+	const char *p;
+	void *map;
+	uint32_t i;
+	int fd;
+
+	if (!path)
+		return false;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return false;
+	}
+	/* private and writable, strings are used in place */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		   fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr = map;
+	if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION)
+		goto fail;
+	size = sizeof(*hdr) +
+	    (uint64_t)hdr->n_files * sizeof(*files) +
+	    (uint64_t)hdr->n_globs * sizeof(*globs) +
+	    (uint64_t)hdr->n_envs * sizeof(*envs) +
+	    (uint64_t)hdr->n_syms * sizeof(*syms) +
+	    (uint64_t)hdr->n_props * sizeof(*props) +
+	    (uint64_t)hdr->n_menus * sizeof(*menus) +
+	    (uint64_t)hdr->n_exprs * sizeof(*exprs) +
+	    hdr->n_strings;
+	if (size != (uint64_t)st.st_size || !hdr->n_menus || !hdr->n_strings)
+		goto fail;
+
+	p = (const char *)(hdr + 1);
+	files = (const void *)p;
+	p += hdr->n_files * sizeof(*files);
+	globs = (const void *)p;
+	p += hdr->n_globs * sizeof(*globs);
+	envs = (const void *)p;
+	p += hdr->n_envs * sizeof(*envs);
+	syms = (const void *)p;
+	p += hdr->n_syms * sizeof(*syms);
+	props = (const void *)p;
+	p += hdr->n_props * sizeof(*props);
+	menus = (const void *)p;
+	p += hdr->n_menus * sizeof(*menus);
+	exprs = (const void *)p;
+	p += hdr->n_exprs * sizeof(*exprs);
+
+	memset(&r, 0, sizeof(r));
+	r.hdr = hdr;
+	r.strings = p;
+	if (r.strings[hdr->n_strings - 1])
+		goto fail;
+	if (!cache_fresh(&r, name, files, globs, envs))
+		goto fail;
+
+	r.syms = xcalloc(hdr->n_syms + 1, sizeof(*r.syms));
+	r.props = xcalloc(hdr->n_props + 1, sizeof(*r.props));
+	r.menus = xcalloc(hdr->n_menus, sizeof(*r.menus));
+	r.exprs = xcalloc(hdr->n_exprs + 1, sizeof(*r.exprs));
+	r.files = xcalloc(hdr->n_files + 1, sizeof(*r.files));
+
+	for (i = 0; i < hdr->n_files; i++) {
+		r.files[i].next = i + 1 < hdr->n_files ? &r.files[i + 1] : NULL;
+		r.files[i].parent = cache_rd_file(&r, files[i].parent);
+		r.files[i].name = cache_rd_string(&r, files[i].name);
+		r.files[i].lineno = files[i].lineno;
+	}
+
+	for (i = 0; i < hdr->n_syms; i++) {
+		sym = &r.syms[i];
+		sym->name = (char *)cache_rd_string(&r, syms[i].name);
+		sym->type = syms[i].type;
+		sym->flags = syms[i].flags;
+		sym->prop = cache_rd_prop(&r, syms[i].prop);
+		sym->dir_dep.expr = cache_rd_expr(&r, syms[i].dir_dep);
+		sym->rev_dep.expr = cache_rd_expr(&r, syms[i].rev_dep);
+		if (syms[i].bucket < 0 || syms[i].bucket >= SYMBOL_HASHSIZE)
+			r.bad = 1;
+	}
+
+	for (i = 0; i < hdr->n_props; i++) {
+		prop = &r.props[i];
+		prop->next = cache_rd_prop(&r, props[i].next);
+		prop->sym = cache_rd_sym(&r, props[i].sym);
+		prop->type = props[i].type;
+		prop->text = cache_rd_string(&r, props[i].text);
+		prop->visible.expr = cache_rd_expr(&r, props[i].visible);
+		prop->expr = cache_rd_expr(&r, props[i].expr);
+		prop->menu = cache_rd_menu(&r, props[i].menu);
+		prop->file = cache_rd_file(&r, props[i].file);
+		prop->lineno = props[i].lineno;
+	}
+
+	memset(&root, 0, sizeof(root));
+	for (i = 0; i < hdr->n_menus; i++) {
+		menu = i ? &r.menus[i] : &root;
+		menu->next = cache_rd_menu(&r, menus[i].next);
+		menu->parent = cache_rd_menu(&r, menus[i].parent);
+		menu->list = cache_rd_menu(&r, menus[i].list);
+		menu->sym = cache_rd_sym(&r, menus[i].sym);
+		menu->prompt = cache_rd_prop(&r, menus[i].prompt);
+		menu->visibility = cache_rd_expr(&r, menus[i].visibility);
+		menu->dep = cache_rd_expr(&r, menus[i].dep);
+		menu->flags = menus[i].flags;
+		menu->help = (char *)cache_rd_string(&r, menus[i].help);
+		menu->file = cache_rd_file(&r, menus[i].file);
+		menu->lineno = menus[i].lineno;
+	}
+
+	for (i = 0; i < hdr->n_exprs; i++)
+		cache_load_expr(&r, &r.exprs[i], &exprs[i]);
+
+	if (r.bad) {
+		free(r.syms);
+		free(r.props);
+		free(r.menus);
+		free(r.exprs);
+		free(r.files);
+		goto fail;
+	}
+
+	/* All good, hook it up */
+	for (i = 0; i < SYMBOL_HASHSIZE; i++) {
+		symbol_hash[i] = NULL;
+		tail[i] = NULL;
+	}
+	for (i = 0; i < hdr->n_syms; i++) {
+		sym = &r.syms[i];
+		if (tail[syms[i].bucket])
+			tail[syms[i].bucket]->next = sym;
+		else
+			symbol_hash[syms[i].bucket] = sym;
+		tail[syms[i].bucket] = sym;
+	}
+	rootmenu = root;
+	file_list = hdr->n_files ? r.files : NULL;
+	modules_sym = cache_rd_sym(&r, hdr->modules_sym);
+	sym_defconfig_list = cache_rd_sym(&r, hdr->defconfig_list);
+	sym_env_list = cache_rd_expr(&r, hdr->env_list);
+	return true;
+
+fail:
+	munmap(map, st.st_size);
+	return false;
+}
@@ -40,9 +40,34 @@ static int tty_stdio;
 static int valid_stdin = 1;
 static int sync_kconfig;
 static int conf_cnt;
+static int timing;
+static struct timeval timing_start;
 static char line[128];
 static struct menu *rootEntry;
 
+/*
+ * --timing: report how long each phase took and how much work the
+ * symbol evaluation did, on stderr so the output files are unchanged.
+ */
+static void timing_report(const char *phase)
+{
+	struct timeval now;
+
+	if (!timing)
+		return;
+
+	gettimeofday(&now, NULL);
+	fprintf(stderr, "timing: %-8s %6ld ms, %lu values computed, "
+		"%lu full and %lu partial invalidations (%lu symbols)\n",
+		phase,
+		(now.tv_sec - timing_start.tv_sec) * 1000 +
+		(now.tv_usec - timing_start.tv_usec) / 1000,
+		sym_stats.calc, sym_stats.clear_all, sym_stats.clear_deps,
+		sym_stats.invalidated);
+	memset(&sym_stats, 0, sizeof(sym_stats));
+	timing_start = now;
+}
+
 static void print_help(struct menu *menu)
 {
 	struct gstr help = str_new();
@@ -464,6 +489,7 @@ static struct option long_opts[] = {
 	 * value but not 'n') with the counter-intuitive name.
 	 */
 	{"oldnoconfig",     no_argument,       NULL, olddefconfig},
+	{"timing",          no_argument,       NULL, 't'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -485,6 +511,8 @@ static void conf_usage(const char *progname)
 	printf("  --allmodconfig          New config where all options are answered with mod\n");
 	printf("  --alldefconfig          New config with all symbols set to default\n");
 	printf("  --randconfig            New config with random answer to all options\n");
+	printf("\n");
+	printf("  --timing                Report time and symbol evaluations per phase\n");
 }
 
 int main(int ac, char **av)
@@ -540,6 +568,10 @@ int main(int ac, char **av)
 		case 'w':
 			output_file = optarg;
 			continue;
+		case 't':
+			timing = 1;
+			gettimeofday(&timing_start, NULL);
+			continue;
 		case '?':
 			conf_usage(progname);
 			exit(1);
@@ -554,6 +586,7 @@ int main(int ac, char **av)
 	}
 	name = av[optind];
 	conf_parse(name);
+	timing_report("parse");
 	//zconfdump(stdout);
 	if (sync_kconfig) {
 		name = conf_get_configname();
@@ -595,6 +628,7 @@ int main(int ac, char **av)
 	default:
 		break;
 	}
+	timing_report("read");
 
 	if (sync_kconfig) {
 		if (conf_get_changed()) {
@@ -647,6 +681,7 @@ int main(int ac, char **av)
 			  input_mode != olddefconfig));
 		break;
 	}
+	timing_report("update");
 
 	if (sync_kconfig) {
 		/* silentoldconfig is used during the build so we shall update autoconf.
@@ -673,6 +708,7 @@ int main(int ac, char **av)
 			exit(1);
 		}
 	}
+	timing_report("write");
 	return 0;
 }
 
@@ -80,6 +80,11 @@ void zconf_nextfile(const char *name);
 int zconf_lineno(void);
 const char *zconf_curname(void);
 
+/* cache.c */
+bool conf_cache_load(const char *name);
+void conf_cache_write(const char *name);
+void conf_cache_note_glob(const char *pattern, size_t n, char **paths);
+
 /* confdata.c */
 const char *conf_get_configname(void);
 const char *conf_get_autoconfig_name(void);
@@ -144,8 +149,18 @@ const char *str_get(struct gstr *gs);
 /* symbol.c */
 extern struct expr *sym_env_list;
 
+struct sym_stats {
+	unsigned long calc;		/* values computed */
+	unsigned long clear_all;	/* every symbol invalidated */
+	unsigned long clear_deps;	/* only a symbol's dependents invalidated */
+	unsigned long invalidated;	/* symbols invalidated by clear_deps */
+};
+extern struct sym_stats sym_stats;
+
 void sym_init(void);
+void sym_build_dependents(void);
 void sym_clear_all_valid(void);
+void sym_clear_valid_dependents(struct symbol *sym);
 void sym_set_all_changed(void);
 void sym_set_changed(struct symbol *sym);
 struct symbol *sym_choice_default(struct symbol *sym);
@@ -34,6 +34,7 @@ struct symbol *modules_sym;
 tristate modules_val;
 
 struct expr *sym_env_list;
+struct sym_stats sym_stats;
 
 static void sym_add_default(struct symbol *sym, const char *def)
 {
@@ -301,6 +302,7 @@ void sym_calc_value(struct symbol *sym)
 	if (sym->flags & SYMBOL_VALID)
 		return;
 	sym->flags |= SYMBOL_VALID;
+	sym_stats.calc++;
 
 	oldval = sym->curr;
 
@@ -434,6 +436,129 @@ void sym_clear_all_valid(void)
 
 	for_all_symbols(i, sym)
 		sym->flags &= ~SYMBOL_VALID;
+	sym_stats.clear_all++;
+	sym_add_change_count(1);
+	if (modules_sym)
+		sym_calc_value(modules_sym);
+}
+
+/*
+ * Reverse dependencies: for every symbol, the symbols whose value,
+ * visibility or defaults are computed from it. A changed value then only
+ * has to invalidate what can be reached from it here, not every symbol.
+ */
+static struct symbol **dep_queue;
+
+static void sym_add_dependent(struct symbol *sym, struct symbol *dep)
+{
+	struct expr *e;
+
+	if (!sym || sym == dep || sym->flags & SYMBOL_CONST)
+		return;
+	/* dependents are added one symbol at a time, so a repeat is first */
+	if (sym->dependents && sym->dependents->right.sym == dep)
+		return;
+	e = expr_alloc_one(E_LIST, sym->dependents);
+	e->right.sym = dep;
+	sym->dependents = e;
+}
+
+static void sym_add_expr_dependents(struct expr *e, struct symbol *dep)
+{
+	if (!e)
+		return;
+
+	switch (e->type) {
+	case E_SYMBOL:
+		sym_add_dependent(e->left.sym, dep);
+		break;
+	case E_EQUAL:
+	case E_UNEQUAL:
+	case E_RANGE:
+		sym_add_dependent(e->left.sym, dep);
+		sym_add_dependent(e->right.sym, dep);
+		break;
+	case E_NOT:
+		sym_add_expr_dependents(e->left.expr, dep);
+		break;
+	case E_AND:
+	case E_OR:
+		sym_add_expr_dependents(e->left.expr, dep);
+		sym_add_expr_dependents(e->right.expr, dep);
+		break;
+	case E_LIST:
+		for (; e; e = e->left.expr)
+			sym_add_dependent(e->right.sym, dep);
+		break;
+	default:
+		break;
+	}
+}
+
+void sym_build_dependents(void)
+{
+	struct symbol *sym;
+	struct property *prop;
+	int i, cnt = 0;
+
+	for_all_symbols(i, sym) {
+		cnt++;
+		for (prop = sym->prop; prop; prop = prop->next) {
+			/* a select acts through the target's rev_dep */
+			if (prop->type == P_SELECT)
+				continue;
+			sym_add_expr_dependents(prop->expr, sym);
+			sym_add_expr_dependents(prop->visible.expr, sym);
+		}
+		sym_add_expr_dependents(sym->dir_dep.expr, sym);
+		sym_add_expr_dependents(sym->rev_dep.expr, sym);
+	}
+	/* every symbol is queued at most once, plus one made after parsing */
+	dep_queue = xcalloc(cnt + 1, sizeof(*dep_queue));
+}
+
+/*
+ * Invalidate sym and everything that depends on it. Anything reaching
+ * modules_sym changes what tristate means for every symbol, so that
+ * still falls back to sym_clear_all_valid().
+ */
+void sym_clear_valid_dependents(struct symbol *sym)
+{
+	struct symbol *dep;
+	struct expr *e;
+	int head, tail = 0;
+	bool all = false;
+
+	if (!dep_queue) {
+		sym_clear_all_valid();
+		return;
+	}
+
+	dep_queue[tail++] = sym;
+	sym->flags |= SYMBOL_DEPQUEUED;
+	for (head = 0; head < tail; head++) {
+		sym = dep_queue[head];
+		sym->flags &= ~SYMBOL_VALID;
+		if (sym == modules_sym) {
+			all = true;
+			break;
+		}
+		expr_list_for_each_sym(sym->dependents, e, dep) {
+			if (dep->flags & SYMBOL_DEPQUEUED)
+				continue;
+			dep->flags |= SYMBOL_DEPQUEUED;
+			dep_queue[tail++] = dep;
+		}
+	}
+	for (head = 0; head < tail; head++)
+		dep_queue[head]->flags &= ~SYMBOL_DEPQUEUED;
+
+	if (all) {
+		sym_clear_all_valid();
+		return;
+	}
+	sym_stats.clear_deps++;
+	sym_stats.invalidated += tail;
 	sym_add_change_count(1);
 	if (modules_sym)
 		sym_calc_value(modules_sym);
@@ -509,7 +634,7 @@ bool sym_set_tristate_value(struct symbol *sym, tristate val)
 
 	sym->def[S_DEF_USER].tri = val;
 	if (oldval != val)
-		sym_clear_all_valid();
+		sym_clear_valid_dependents(sym);
 
 	return true;
 }
@@ -666,7 +791,7 @@ bool sym_set_string_value(struct symbol *sym, const char *newval)
 
 	strcpy(val, newval);
 	free((void *)oldval);
-	sym_clear_all_valid();
+	sym_clear_valid_dependents(sym);
 
 	return true;
 }
@@ -499,6 +499,12 @@ void conf_parse(const char *name)
 	struct symbol *sym;
 	int i;
 
+	if (conf_cache_load(name)) {
+		sym_build_dependents();
+		sym_set_change_count(1);
+		return;
+	}
+
 	zconf_initscan(name);
 
 	sym_init();
@@ -532,6 +538,8 @@ void conf_parse(const char *name)
         }
 	if (zconfnerrs)
 		exit(1);
+	sym_build_dependents();
+	conf_cache_write(name);
 	sym_set_change_count(1);
 }
 
@@ -750,3 +758,4 @@ void zconfdump(FILE *out)
 #include "expr.c"
 #include "symbol.c"
 #include "menu.c"
+#include "cache.c"
@@ -0,0 +1,277 @@
+#!/usr/bin/env perl
+#
+# Copyright (C) 2014 OpenWrt.org
+#
+# This is free software, licensed under the GNU General Public License v2.
+# See /LICENSE for more information.
+#
+# Writes the Packages index for the .ipk files below a directory. Each
+# package is read once: MD5 and SHA256 are computed while the outer
+# tar.gz is inflated, and the control file is taken out of the embedded
+# control.tar.gz without running tar. Packages are indexed by several
+# processes at once.
+#
+# When IPKG_INDEX_CACHE names a file, the entries are kept there and
+# reused for packages whose size, mtime and inode did not change.
+#
+
+use strict;
+use Cwd qw(abs_path);
+use Digest::MD5;
+use Digest::SHA;
+use Compress::Raw::Zlib;
+use IO::Select;
+use Storable qw(nstore retrieve);
+
+my $jobs;
+if (@ARGV > 1 and $ARGV[0] =~ /^-j(\d*)$/) {
+	shift @ARGV;
+	$jobs = $1 ne "" ? $1 : shift @ARGV;
+}
+my $pkg_dir = $ARGV[0];
+
+if (!$pkg_dir or !-d $pkg_dir) {
+	print STDERR "Usage: ipkg-make-index.pl [-j <jobs>] <package_directory>\n";
+	exit 1;
+}
+$jobs ||= `getconf _NPROCESSORS_ONLN 2>/dev/null` || 1;
+chomp $jobs;
+$jobs > 0 or $jobs = 1;
+
+my $cache_file = $ENV{IPKG_INDEX_CACHE};
+my $cache_version = 1;
+
+# Walks the members of a tar stream fed to it in pieces; $want decides
+# which members are collected, $found gets their name and contents
+sub tar_reader($$) {
+	my $want = shift;
+	my $found = shift;
+	my $buf = "";
+	my $skip = 0;
+	my ($name, $size, $data, $longname);
+
+	return sub {
+		$buf .= shift;
+		while (1) {
+			if ($skip) {
+				my $n = length($buf) < $skip ? length($buf) : $skip;
+				$data .= substr($buf, 0, $n) if defined $data;
+				substr($buf, 0, $n) = "";
+				$skip -= $n;
+				last if $skip;
+				if (defined $longname) {
+					$longname = $data;
+					$longname =~ s/\0.*//s;
+				} elsif (defined $data) {
+					$found->($name, substr($data, 0, $size));
+				}
+				undef $data;
+				next;
+			}
+			last if length($buf) < 512;
+			my $hdr = substr($buf, 0, 512, "");
+			next if $hdr =~ /^\0*$/;
+
+			my $type = substr($hdr, 156, 1);
+			my $sizefield = substr($hdr, 124, 12);
+			if (ord($sizefield) & 0x80) {
+				$size = 0;
+				$size = $size * 256 + ord($_) for split //, substr($sizefield, 1);
+			} else {
+				$sizefield =~ s/[\0 ]+$//;
+				$size = oct($sizefield || "0");
+			}
+
+			if ($type eq 'L') {
+				$longname = "";
+				$data = "";
+			} else {
+				$name = substr($hdr, 0, 100);
+				my $prefix = substr($hdr, 345, 155);
+				$name =~ s/\0.*//s;
+				$prefix =~ s/\0.*//s;
+				if (substr($hdr, 257, 5) eq 'ustar' and $prefix ne "") {
+					$name = "$prefix/$name";
+				}
+				if (defined $longname) {
+					$name = $longname;
+					undef $longname;
+				}
+				$data = ($type eq '0' or $type eq "\0") && $want->($name) ? "" : undef;
+			}
+			$skip = ($size + 511) & ~511;
+			if (!$skip and defined $data) {
+				$found->($name, "");
+				undef $data;
+			}
+		}
+	};
+}
+
+sub gunzip($) {
+	my $data = shift;
+	my ($inflate, $status) = Compress::Raw::Zlib::Inflate->new(
+		-WindowBits => WANT_GZIP,
+		-ConsumeInput => 1,
+	);
+	my $out;
+	$status = $inflate->inflate($data, $out);
+	return ($status == Z_OK or $status == Z_STREAM_END) ? $out : undef;
+}
+
+sub is_control($) {
+	my $name = shift;
+	$name =~ s/^\.\///;
+	return $name eq "control.tar.gz";
+}
+
+sub index_package($) {
+	my $pkg = shift;
+	my $md5 = Digest::MD5->new;
+	my $sha256 = Digest::SHA->new(256);
+	my ($inflate) = Compress::Raw::Zlib::Inflate->new(
+		-WindowBits => WANT_GZIP,
+		-ConsumeInput => 1,
+	);
+	my $control_tgz;
+	my $tar = tar_reader(\&is_control, sub { $control_tgz = $_[1] });
+	my $inflating = 1;
+	my $size = 0;
+
+	open my $fh, "<", $pkg or return undef;
+	binmode $fh;
+	while (my $n = sysread($fh, my $chunk, 65536)) {
+		$size += $n;
+		$md5->add($chunk);
+		$sha256->add($chunk);
+		next unless $inflating;
+		my $out;
+		my $status = $inflate->inflate($chunk, $out);
+		$tar->($out) if length $out;
+		$inflating = 0 if $status != Z_OK;
+	}
+	close $fh;
+
+	my $control = "";
+	if (defined $control_tgz) {
+		my $tgz = gunzip($control_tgz);
+		tar_reader(sub { $_[0] eq "./control" }, sub { $control = $_[1] })->($tgz)
+			if defined $tgz;
+	}
+
+	(my $filename = $pkg) =~ s/^\.\///;
+	my $fields = "Filename: $filename\n" .
+		"Size: $size\n" .
+		"MD5Sum: " . $md5->hexdigest . "\n" .
+		"SHA256sum: " . $sha256->hexdigest . "\n";
+	$control =~ s/^Description:/${fields}Description:/mg;
+	return "$control\n";
+}
+
+my @pkgs;
+open FIND, "find $pkg_dir -name '*.ipk' |";
+while (<FIND>) {
+	chomp;
+	my $name = $_;
+	$name =~ s/^.*\///;
+	$name =~ s/_.*//;
+	next if $name eq "kernel" or $name eq "libc";
+	push @pkgs, $_;
+}
+close FIND;
+@pkgs = sort @pkgs;
+
+my $cache;
+$cache = eval { retrieve($cache_file) } if $cache_file and -f $cache_file;
+$cache = undef unless $cache and $cache->{version} == $cache_version;
+
+my $now = time();
+my @entries;
+my @todo;
+my %key;
+foreach my $i (0 .. $#pkgs) {
+	my @st = stat $pkgs[$i] or next;
+	my $key = join(" ", abs_path($pkgs[$i]), @st[7, 9, 1]);
+	$key{$i} = $key;
+	# a package written in the second the cache was saved may change
+	# again without its size or mtime changing
+	if ($cache and exists $cache->{entries}->{$key} and $st[9] < $cache->{time}) {
+		$entries[$i] = $cache->{entries}->{$key};
+	} else {
+		push @todo, $i;
+	}
+}
+
+# Each worker indexes every $jobs-th package and sends back
+# "<index> <length>\n<entry>" records
+my @workers;
+$jobs = @todo if $jobs > @todo;
+foreach my $w (0 .. $jobs - 1) {
+	pipe my $rd, my $wr or die "Cannot create pipe: $!\n";
+	my $pid = fork();
+	defined $pid or die "Cannot fork: $!\n";
+	if (!$pid) {
+		close $rd;
+		binmode $wr;
+		for (my $j = $w; $j < @todo; $j += $jobs) {
+			my $i = $todo[$j];
+			print STDERR "Generating index for package $pkgs[$i]\n";
+			my $entry = index_package($pkgs[$i]);
+			defined $entry or next;
+			print $wr "$i " . length($entry) . "\n$entry";
+		}
+		close $wr;
+		exit 0;
+	}
+	close $wr;
+	push @workers, [ $pid, $rd ];
+}
+
+# The pipes are read as data comes in, a worker whose pipe is full would
+# otherwise wait for the ones before it to finish
+my $select = IO::Select->new;
+my %buf;
+foreach my $worker (@workers) {
+	my $rd = $worker->[1];
+	binmode $rd;
+	$select->add($rd);
+	$buf{fileno $rd} = "";
+}
+while ($select->count) {
+	foreach my $rd ($select->can_read) {
+		my $buf = \$buf{fileno $rd};
+		if (!sysread($rd, $$buf, 65536, length $$buf)) {
+			$select->remove($rd);
+			close $rd;
+			next;
+		}
+		while ($$buf =~ /^(\d+) (\d+)\n/ and length($$buf) >= $+[0] + $2) {
+			my ($i, $hdr, $len) = ($1, $+[0], $2);
+			$entries[$i] = substr($$buf, $hdr, $len);
+			substr($$buf, 0, $hdr + $len) = "";
+		}
+	}
+}
+
+my $failed = 0;
+foreach my $worker (@workers) {
+	waitpid $worker->[0], 0;
+	$? and $failed = 1;
+}
+$failed and die "Failed to index packages\n";
+
+foreach my $i (0 .. $#pkgs) {
+	print $entries[$i] if defined $entries[$i];
+}
+
+if ($cache_file) {
+	my %entries;
+	foreach my $i (keys %key) {
+		$entries{$key{$i}} = $entries[$i] if defined $entries[$i];
+	}
+	nstore({
+		version => $cache_version,
+		time => $now,
+		entries => \%entries,
+	}, "$cache_file.$$") and rename "$cache_file.$$", $cache_file;
+}
@@ -3,8 +3,24 @@ use FindBin;
 use lib "$FindBin::Bin";
 use strict;
 use metadata;
+use Time::HiRes qw(time);
 
 my %board;
+my $profile;
+my $profile_mark = time();
+my %profile_time;
+my @profile_phases;
+
+# --profile: time spent since the last call is charged to $phase
+sub profile($) {
+	my $phase = shift;
+	my $now = time();
+
+	$profile or return;
+	exists $profile_time{$phase} or push @profile_phases, $phase;
+	$profile_time{$phase} += $now - $profile_mark;
+	$profile_mark = $now;
+}
 
 sub confstr($) {
 	my $conf = shift;
@@ -267,6 +283,7 @@ EOF
 
 sub gen_target_config() {
 	my @target = parse_target_metadata();
+	profile("parse");
 	my %defaults;
 
 	my @target_sort = sort {
@@ -403,45 +420,105 @@ EOF
 	}
 }
 
-my %dep_check;
-sub __find_package_dep($$) {
+# Packages from %$members that $pkg depends on, directly or through
+# packages outside of %$members. Their closure is everything it needs.
+sub package_member_deps($$) {
 	my $pkg = shift;
-	my $name = shift;
-	my $deps = ($pkg->{vdepends} or $pkg->{depends});
-
-	return 0 unless defined $deps;
-	foreach my $dep (@{$deps}) {
-		next if $dep_check{$dep};
-		$dep_check{$dep} = 1;
-		return 1 if $dep eq $name;
-		return 1 if ($package{$dep} and (__find_package_dep($package{$dep},$name) == 1));
+	my $members = shift;
+	my %seen;
+	my @found;
+	my @stack = ($pkg);
+
+	while (my $p = pop @stack) {
+		my $deps = ($p->{vdepends} or $p->{depends});
+		defined $deps or next;
+		foreach my $dep (@$deps) {
+			next if $seen{$dep}++;
+			if ($members->{$dep}) {
+				push @found, $dep if $dep ne $pkg->{name};
+				next;
+			}
+			push @stack, $package{$dep} if $package{$dep};
+		}
 	}
-	return 0;
+	return @found;
 }
 
-# wrapper to avoid infinite recursion
-sub find_package_dep($$) {
-	my $pkg = shift;
-	my $name = shift;
-
-	%dep_check = ();
-	return __find_package_dep($pkg, $name);
-}
-
-sub package_depends($$) {
-	my $a = shift;
-	my $b = shift;
-	my $ret;
-
-	return 0 if ($a->{submenu} ne $b->{submenu});
-	if (find_package_dep($a, $b->{name}) == 1) {
-		$ret = 1;
-	} elsif (find_package_dep($b, $a->{name}) == 1) {
-		$ret = -1;
-	} else {
-		return 0;
+# Orders the packages of one submenu so that each comes after everything
+# it depends on, and otherwise by name. The dependencies between them are
+# worked out once per package; packages that depend on each other are
+# found with Tarjan's algorithm, reported, and kept together in name order.
+sub sort_packages_by_deps($@) {
+	my $menu = shift;
+	my @pkgs = sort { $a->{name} cmp $b->{name} } @_;
+	my %members = map { $_->{name} => $_ } @pkgs;
+	my %deps;
+	my %index;
+	my %low;
+	my %scc;
+	my @sccs;
+	my @stack;
+	my %on_stack;
+	my $n = 0;
+	my @sorted;
+
+	foreach my $pkg (@pkgs) {
+		$deps{$pkg->{name}} = [ package_member_deps($pkg, \%members) ];
+	}
+
+	my $strongconnect;
+	$strongconnect = sub {
+		my $name = shift;
+		$index{$name} = $low{$name} = $n++;
+		push @stack, $name;
+		$on_stack{$name} = 1;
+		foreach my $dep (@{$deps{$name}}) {
+			if (!defined $index{$dep}) {
+				$strongconnect->($dep);
+				$low{$name} = $low{$dep} if $low{$dep} < $low{$name};
+			} elsif ($on_stack{$dep}) {
+				$low{$name} = $index{$dep} if $index{$dep} < $low{$name};
+			}
+		}
+		return unless $low{$name} == $index{$name};
+
+		my @scc;
+		my $member;
+		do {
+			$member = pop @stack;
+			delete $on_stack{$member};
+			$scc{$member} = scalar @sccs;
+			push @scc, $member;
+		} while ($member ne $name);
+		@scc = sort @scc;
+		@scc > 1 and warn "Dependency loop in menu '$menu': @scc\n";
+		push @sccs, \@scc;
+	};
+	foreach my $pkg (@pkgs) {
+		defined $index{$pkg->{name}} or $strongconnect->($pkg->{name});
+	}
+	undef $strongconnect;
+
+	# Kahn's algorithm over the loops, taking the lowest name first
+	my @pending = map { 0 } @sccs;
+	my @users = map { {} } @sccs;
+	foreach my $name (keys %deps) {
+		foreach my $dep (@{$deps{$name}}) {
+			next if $scc{$dep} == $scc{$name};
+			next if $users[$scc{$dep}]->{$scc{$name}}++;
+			$pending[$scc{$name}]++;
+		}
 	}
-	return $ret;
+	my @ready = sort { $sccs[$a]->[0] cmp $sccs[$b]->[0] }
+		grep { !$pending[$_] } 0 .. $#sccs;
+	while (@ready) {
+		my $i = shift @ready;
+		push @sorted, map { $members{$_} } @{$sccs[$i]};
+		my @now_ready = grep { !--$pending[$_] } keys %{$users[$i]};
+		@now_ready or next;
+		@ready = sort { $sccs[$a]->[0] cmp $sccs[$b]->[0] } @ready, @now_ready;
+	}
+	return @sorted;
 }
 
 sub mconf_depends {
@@ -547,10 +624,10 @@ sub print_package_config_category($) {
 	} keys %menus;
 
 	foreach my $menu (@menus) {
-		my @pkgs = sort {
-			package_depends($a, $b) or
-			($a->{name} cmp $b->{name})
-		} @{$menus{$menu}};
+		profile("output");
+		my @pkgs = sort_packages_by_deps(($menu eq 'undef' ? $cat : $menu),
+						 @{$menus{$menu}});
+		profile("sort");
 		if ($menu ne 'undef') {
 			$menu_dep{$menu} and print "if $menu_dep{$menu}\n";
 			print "menu \"$menu\"\n";
@@ -621,6 +698,7 @@ EOF
 
 sub gen_package_config() {
 	parse_package_metadata($ARGV[0]) or exit 1;
+	profile("parse");
 	print "menuconfig IMAGEOPT\n\tbool \"Image configuration\"\n\tdefault n\n";
 	foreach my $preconfig (keys %preconfig) {
 		foreach my $cfg (keys %{$preconfig{$preconfig}}) {
@@ -667,6 +745,7 @@ sub gen_package_mk() {
 	my $line;
 
 	parse_package_metadata($ARGV[0]) or exit 1;
+	profile("parse");
 	foreach my $name (sort {uc($a) cmp uc($b)} keys %package) {
 		my $config;
 		my $pkg = $package{$name};
@@ -834,6 +913,7 @@ EOF
 
 sub gen_package_source() {
 	parse_package_metadata($ARGV[0]) or exit 1;
+	profile("parse");
 	foreach my $name (sort {uc($a) cmp uc($b)} keys %package) {
 		my $pkg = $package{$name};
 		if ($pkg->{name} && $pkg->{source}) {
@@ -844,6 +924,10 @@ sub gen_package_source() {
 }
 
 sub parse_command() {
+	if ($ARGV[0] eq '--profile') {
+		shift @ARGV;
+		$profile = 1;
+	}
 	my $cmd = shift @ARGV;
 	for ($cmd) {
 		/^target_config$/ and return gen_target_config();
@@ -860,7 +944,16 @@ Available Commands:
 	$0 kconfig [file] [config]	Kernel config overrides
 	$0 package_source [file] 	Package source file information
 
+	--profile before the command prints the time taken per phase.
+
 EOF
 }
 
 parse_command();
+
+if ($profile) {
+	profile("output");
+	foreach my $phase (@profile_phases) {
+		printf STDERR "profile: %-8s %8.1f ms\n", $phase, $profile_time{$phase} * 1000;
+	}
+}
@@ -0,0 +1,379 @@
+#!/usr/bin/env perl
+#
+# Copyright (C) 2014 OpenWrt.org
+#
+# This is free software, licensed under the GNU General Public License v2.
+# See /LICENSE for more information.
+#
+# Collects the DUMP=1 output of every package (or target) Makefile into
+# tmp/.<target>, running the dumps in parallel and keeping each one in
+# tmp/info/.<target>-<dir> together with a hash of the Makefile and the
+# .mk files it includes. Only dumps whose hash changed are run again, and
+# the merged file is only rewritten when its contents change. Makefiles
+# including something scan.pl cannot work out are dumped every time.
+#
+# The Makefiles to look at are read from stdin, one per line.
+#
+
+use strict;
+use Getopt::Long;
+use Digest::MD5 qw(md5_hex);
+use POSIX qw(:sys_wait_h);
+
+my $VERSION = 2;
+
+my $target = "packageinfo";
+my $name = "package";
+my $scan_dir = "package";
+my $tmp_dir = "tmp";
+my $topdir = $ENV{TOPDIR};
+my $deps = "";
+my $makeopts = "";
+my $jobs = 1;
+
+GetOptions(
+	"target=s" => \$target,
+	"name=s" => \$name,
+	"dir=s" => \$scan_dir,
+	"tmp=s" => \$tmp_dir,
+	"topdir=s" => \$topdir,
+	"deps:s" => \$deps,
+	"makeopts:s" => \$makeopts,
+	"jobs=i" => \$jobs,
+) or die "Usage: $0 [--target=T] [--name=N] [--dir=D] [--tmp=DIR] [--topdir=DIR] [--deps=GLOBS] [--makeopts=OPTS] [--jobs=N] < makefiles\n";
+
+$topdir or $topdir = `pwd`;
+chomp $topdir;
+$jobs > 0 or $jobs = 1;
+
+my $make = $ENV{NO_TRACE_MAKE} || "make";
+my $info_dir = "$tmp_dir/info";
+my $index_file = "$info_dir/.$target.scan";
+my $merged_file = "$tmp_dir/.$target";
+
+sub progress($) {
+	my $msg = shift;
+	$ENV{IS_TTY} eq '1' and print STDERR "\033[M\r$msg";
+}
+
+# What was known about files and dumps after the last scan
+my %file;	# path => [ mtime, size, md5, is_package, include lines joined by ; ]
+my %dump;	# dir => key
+my $last_list = "";
+my $last_time = 0;	# when the last scan started
+my $now = time();
+
+if (open INDEX, "<$index_file") {
+	my $version = <INDEX>;
+	chomp $version;
+	if ($version eq "scan $VERSION") {
+		while (<INDEX>) {
+			chomp;
+			my @f = split /\t/, $_, -1;
+			if ($f[0] eq 'F' and @f == 7) {
+				$file{$f[1]} = [ @f[2 .. 6] ];
+			} elsif ($f[0] eq 'D' and @f == 3) {
+				$dump{$f[1]} = $f[2];
+			} elsif ($f[0] eq 'L' and @f == 2) {
+				$last_list = $f[1];
+			} elsif ($f[0] eq 'T' and @f == 2) {
+				$last_time = $f[1];
+			}
+		}
+	}
+	close INDEX;
+}
+
+my %seen_file;
+
+# Content hash, package flag and include lines of a file, redone only
+# when its mtime or size changes
+sub file_info($) {
+	my $path = shift;
+	my @st = stat $path or return undef;
+	my $f = $file{$path};
+
+	$seen_file{$path} = 1;
+	# a file written in the second the last scan started may have been
+	# changed again without its size or mtime changing
+	return $f if $f and $f->[0] == $st[9] and $f->[1] == $st[7] and
+		$st[9] < $last_time;
+
+	open my $fh, "<", $path or return undef;
+	local $/;
+	my $data = <$fh>;
+	close $fh;
+
+	my $is_package = ($data =~ /call (Build\/DefaultTargets|Build(Package|Target)|.+Package)/m) ? 1 : 0;
+	my @includes;
+	# includes in ifndef DUMP or ifeq ($(DUMP)...,) are never reached
+	# by a dump; any other conditional may go either way
+	my @dead;
+	foreach (split /\n/, $data) {
+		if (/^[ \t]*if(n?eq|n?def)[ \t]/) {
+			push @dead, (/^[ \t]*ifndef[ \t]+DUMP[ \t]*$/ or
+				/^[ \t]*ifeq[ \t]*\(\$\(DUMP\)[^,]*,[ \t]*\)/) ? 1 : 0;
+		} elsif (/^[ \t]*else\b/) {
+			$dead[-1] = 0 if @dead;
+		} elsif (/^[ \t]*endif\b/) {
+			pop @dead;
+		} elsif (/^[ \t]*-?include[ \t]+(.+?)[ \t]*$/) {
+			next if grep { $_ } @dead;
+			my $inc = $1;
+			$inc =~ s/\t/ /g;
+			push @includes, $inc;
+		}
+	}
+	$f = [ $st[9], $st[7], md5_hex($data), $is_package, join(";", @includes) ];
+	$file{$path} = $f;
+	return $f;
+}
+
+# The variables includes are written with, as globs for every value they
+# can have in a dump. TMP_CONFIG is made in the dump from the kernel
+# configs, which the targetinfo scan has in its SCAN_DEPS.
+my %include_var = (
+	TOPDIR => $topdir,
+	INCLUDE_DIR => "$topdir/include",
+	TMP_DIR => "$topdir/tmp",
+	PLATFORM_DIR => ($makeopts =~ /\bTARGET_BUILD=1\b/) ?
+		'$(CURDIR)' : "$topdir/target/linux/*",
+	PLATFORM_SUBDIR => '$(PLATFORM_DIR){,/*}',
+	SUBTARGET => '*',
+	TMP_CONFIG => '',
+);
+
+# The files an include line names, as make would see them when run in
+# $cwd, whether that depends on $cwd and whether some of the line could
+# not be worked out
+sub include_files($$) {
+	my $line = shift;
+	my $cwd = shift;
+	my %var = (%include_var, CURDIR => $cwd);
+	my @files;
+	my $local = 0;
+	my $unresolved = 0;
+
+	1 while $line =~ s/\$[({](\w+)[)}]/
+		$local = 1 if $1 eq 'CURDIR';
+		exists $var{$1} ? $var{$1} : "\$?$1"/e;
+	1 while $line =~ s/\$\((?:sort|wildcard)\s+([^()]*)\)/$1/;
+
+	foreach my $word (split /\s+/, $line) {
+		next if $word eq '';
+		if ($word =~ /\$/) {
+			$unresolved = 1;
+			next;
+		}
+		unless ($word =~ /^\//) {
+			$word = "$cwd/$word";
+			$local = 1;
+		}
+		push @files, grep { -f $_ } glob($word);
+	}
+	return (\@files, $local, $unresolved);
+}
+
+# Everything a Makefile pulls in through include, with the .mk files it
+# includes in turn, and whether it includes something that could not be
+# worked out. Closures that do not depend on the directory make runs in
+# are shared between packages.
+my %closure;
+sub include_closure($$$);
+sub include_closure($$$) {
+	my $path = shift;
+	my $cwd = shift;
+	my $visiting = shift;
+	my %files;
+	my $shared = 1;
+	my $unresolved = 0;
+
+	return ({}, 1, 0) if $visiting->{$path};
+	return ($closure{$path}->[0], 1, $closure{$path}->[1]) if $closure{$path};
+
+	my $f = file_info($path) or return ({}, 1, 0);
+	$visiting->{$path} = 1;
+	$files{$path} = $f->[2];
+	foreach my $line (split /;/, $f->[4]) {
+		my ($incs, $local, $line_unresolved) = include_files($line, $cwd);
+		$shared = 0 if $local;
+		$unresolved ||= $line_unresolved;
+		foreach my $inc (@$incs) {
+			next unless $inc =~ /\.mk$/ or $inc =~ /\/Makefile$/;
+			my ($sub, $sub_shared, $sub_unresolved) =
+				include_closure($inc, $cwd, $visiting);
+			$shared &&= $sub_shared;
+			$unresolved ||= $sub_unresolved;
+			%files = (%files, %$sub);
+		}
+	}
+	delete $visiting->{$path};
+	$closure{$path} = [ \%files, $unresolved ] if $shared;
+	return (\%files, $shared, $unresolved);
+}
+
+# The key a dump is cached under: everything it can depend on, or undef
+# if that is not known
+sub dump_key($) {
+	my $dir = shift;
+	my $path = "$scan_dir/$dir";
+	my $makefile = "$path/Makefile";
+	my ($files, $shared, $unresolved) = include_closure($makefile, $path, {});
+	my %files = %$files;
+
+	return undef if $unresolved;
+	my @deps = split /\s+/, $deps;
+
+	# SCAN_DEPS from the command line and from the Makefile itself
+	open my $fh, "<", $makefile;
+	while (<$fh>) {
+		/^ *SCAN_DEPS *= *(.*)$/ and push @deps, split /\s+/, $1;
+	}
+	close $fh;
+	foreach my $dep (@deps) {
+		next if $dep eq '';
+		$dep =~ s/\$\(TOPDIR\)/$topdir/g;
+		$dep = "$path/$dep" unless $dep =~ /^\//;
+		foreach my $file (glob($dep)) {
+			my $f = file_info($file) or next;
+			$files{$file} = $f->[2];
+		}
+	}
+
+	return md5_hex(join("\n", "scan $VERSION", $makeopts,
+		map { "$_ $files{$_}" } sort keys %files));
+}
+
+sub info_file($) {
+	my $dir = shift;
+	$dir =~ s/\//_/g;
+	return "$info_dir/.$target-$dir";
+}
+
+# The directories to scan, in the order find gave their Makefiles
+my @dirs;
+my %dir_seen;
+while (<STDIN>) {
+	chomp;
+	my $makefile = $_;
+	my $f = file_info($makefile) or next;
+	$f->[3] or next;
+	my $dir = $makefile;
+	$dir =~ s/^\Q$scan_dir\E\///;
+	$dir =~ s/\/Makefile$//;
+	next if $dir_seen{$dir}++;
+	push @dirs, $dir;
+}
+
+my %key;
+my @queue;
+foreach my $dir (@dirs) {
+	$key{$dir} = dump_key($dir);
+	next if defined $key{$dir} and $dump{$dir} and $dump{$dir} eq $key{$dir} and
+		-f info_file($dir);
+	delete $dump{$dir};
+	push @queue, $dir;
+}
+
+sub dump_done($$) {
+	my $dir = shift;
+	my $ok = shift;
+	my $info = info_file($dir);
+
+	if ($ok and open my $out, ">", "$info.new") {
+		open my $in, "<", "$info.tmp";
+		my $data = "Source-Makefile: $scan_dir/$dir/Makefile\n";
+		{
+			local $/;
+			$data .= <$in>;
+		}
+		$data .= "\n";
+		print $out $data;
+		close $in;
+		close $out;
+		rename "$info.new", $info;
+		# a dump without a key is redone every time, what it gave
+		# tells the merge below whether anything changed
+		$dump{$dir} = defined $key{$dir} ? $key{$dir} : "-" . md5_hex($data);
+	} else {
+		# run it again to keep the errors
+		my $log = "$topdir/logs/$scan_dir/$dir";
+		system("mkdir", "-p", $log);
+		system("$make --no-print-dir -r DUMP=1 -C $scan_dir/$dir $makeopts > $log/dump.txt 2>&1");
+		progress("ERROR: please fix $scan_dir/$dir/Makefile - see logs/$scan_dir/$dir/dump.txt for details\n");
+		unlink $info;
+	}
+	unlink "$info.tmp";
+}
+
+my %running;
+while (@queue or %running) {
+	while (@queue and keys(%running) < $jobs) {
+		my $dir = shift @queue;
+		my $info = info_file($dir);
+		progress("Collecting $name info: $scan_dir/$dir");
+		my $pid = fork();
+		defined $pid or die "Cannot fork: $!\n";
+		if (!$pid) {
+			open STDOUT, ">", "$info.tmp" or exit 1;
+			open STDERR, ">", "/dev/null";
+			exec("sh", "-c", "$make --no-print-dir -r DUMP=1 -C $scan_dir/$dir $makeopts");
+			exit 1;
+		}
+		$running{$pid} = $dir;
+	}
+	my $pid = waitpid(-1, 0);
+	last if $pid < 0;
+	my $dir = delete $running{$pid} or next;
+	dump_done($dir, $? == 0);
+}
+
+# Merge, leaving the result alone if nothing in it changed
+my $list = md5_hex(join("\n", map { "$_ " . ($dump{$_} || "") } @dirs));
+if ($list ne $last_list or !-f $merged_file) {
+	progress("Collecting $name info: merging...");
+	my $data = "";
+	foreach my $dir (@dirs) {
+		open my $in, "<", info_file($dir) or next;
+		local $/;
+		$data .= <$in>;
+		close $in;
+	}
+	my $old;
+	if (open my $in, "<", $merged_file) {
+		local $/;
+		$old = <$in>;
+		close $in;
+	}
+	if (!defined $old or $old ne $data) {
+		open my $out, ">", "$merged_file.new" or die "Cannot write $merged_file: $!\n";
+		print $out $data;
+		close $out;
+		rename "$merged_file.new", $merged_file;
+	}
+}
+
+# Dumps of directories that went away are dropped
+my %current = map { info_file($_) => 1 } @dirs;
+foreach my $info (glob("$info_dir/.$target-*")) {
+	next if $current{$info} or $info =~ /\.(tmp|new)$/;
+	unlink $info;
+}
+
+if (open my $out, ">", "$index_file.new") {
+	print $out "scan $VERSION\n";
+	print $out "T\t$now\n";
+	print $out "L\t$list\n";
+	foreach my $path (sort keys %seen_file) {
+		print $out join("\t", "F", $path, @{$file{$path}}) . "\n";
+	}
+	foreach my $dir (sort keys %dump) {
+		next unless $dir_seen{$dir};
+		print $out "D\t$dir\t$dump{$dir}\n";
+	}
+	close $out;
+	rename "$index_file.new", $index_file;
+}
+
+progress("Collecting $name info: done");
+print "\n";
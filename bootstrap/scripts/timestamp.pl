@@ -7,46 +7,217 @@
 #
 
 use strict;
+use Digest::MD5 qw(md5_hex);
+use Storable qw(nstore retrieve);
+
+# When FILE_STATE_CACHE names a directory, the listing of every directory
+# walked is kept there, one file per tree, and only directories whose
+# inode change time moved are read again. The output is the same as that
+# of the plain find below, which is used when there is no cache, and for
+# -f since links can point anywhere.
+my $cache_dir = $ENV{FILE_STATE_CACHE};
+my $cache_version = 1;
+
+# find -path patterns are fnmatch() patterns without FNM_PATHNAME
+sub glob_re($) {
+	my $glob = shift;
+	my $re = "";
+
+	while (length $glob) {
+		if ($glob =~ s/^\\(.)//s) {
+			$re .= quotemeta $1;
+		} elsif ($glob =~ s/^\*//) {
+			$re .= ".*";
+		} elsif ($glob =~ s/^\?//) {
+			$re .= ".";
+		} elsif ($glob =~ s/^\[([!^]?\]?[^\]]*)\]//) {
+			my $class = $1;
+			$class =~ s/^!/^/;
+			$class =~ s/\\/\\\\/g;
+			$re .= "[$class]";
+		} else {
+			$glob =~ s/^(.)//s;
+			$re .= quotemeta $1;
+		}
+	}
+	# leading and trailing stars are left out rather than matched
+	$re = "^$re" unless $re =~ s/^\.\*//;
+	$re = "$re\$" unless $re =~ s/(?<!\\)\.\*$//;
+	return qr/$re/s;
+}
+
+sub find_files($$$) {
+	my $path = shift;
+	my $findopts = shift;
+	my $files = shift;
+
+	open FIND, "find $path -type f $findopts 2>/dev/null |";
+	while (<FIND>) {
+		chomp;
+		push @$files, $_;
+	}
+	close FIND;
+}
+
+# What find $dir -type f prints below a directory: its entries in the
+# order readdir returned them, descending into each subdirectory as it
+# comes up
+sub walk_dir($$$$$$);
+sub walk_dir($$$$$$) {
+	my ($dir, $ino, $ctime, $cache, $dirs, $files) = @_;
+	my $prefix = ($dir =~ /\/$/) ? $dir : "$dir/";
+	(my $key = $dir) =~ s/\/+$//;
+	my $old = $cache ? $cache->{dirs}->{$key} : undef;
+	my $entries;
+
+	# a directory changed in the second the cache was written may have
+	# changed again unnoticed
+	if ($old and $old->[0] == $ino and $old->[1] == $ctime and
+	    $ctime < $cache->{time}) {
+		$entries = $old->[2];
+	} else {
+		$entries = [];
+		opendir my $dh, $dir or do {
+			$dirs->{$key} = [ $ino, $ctime, $entries ];
+			return;
+		};
+		foreach my $name (readdir $dh) {
+			next if $name eq '.' or $name eq '..';
+			lstat "$prefix$name" or next;
+			if (-f _) {
+				push @$entries, "f$name";
+			} elsif (-d _) {
+				push @$entries, "d$name";
+			}
+		}
+		closedir $dh;
+	}
+	$dirs->{$key} = [ $ino, $ctime, $entries ];
+
+	foreach my $entry (@$entries) {
+		my $path = $prefix . substr($entry, 1);
+		if (substr($entry, 0, 1) eq 'f') {
+			push @$files, $path;
+		} elsif (my @st = lstat $path) {
+			walk_dir($path, $st[1], $st[10], $cache, $dirs, $files);
+		}
+	}
+}
+
+# Appends to @$files what find $path -type f would print, in find's order
+sub cached_files($$) {
+	my $path = shift;
+	my $files = shift;
+	(my $root = $path) =~ s/\/+$//;
+	my $file = "$cache_dir/" . md5_hex($root);
+	my $cache;
+	my %dirs;
+	my $now = time();
+
+	$cache = eval { retrieve($file) } if -f $file;
+	$cache = undef unless $cache and $cache->{version} == $cache_version;
+
+	my @st = ($path =~ /\/$/) ? stat($path) : lstat($path);
+	@st or return;
+	if (-f _) {
+		push @$files, $path;
+		return;
+	}
+	-d _ or return;
+
+	# nothing to walk if no directory in the tree changed
+	if ($cache) {
+		my $valid = 1;
+		foreach my $dir (keys %{$cache->{dirs}}) {
+			my $old = $cache->{dirs}->{$dir};
+			my @dst = ($dir eq $root) ? @st : lstat($dir);
+			next if @dst and $dst[1] == $old->[0] and $dst[10] == $old->[1] and
+				$dst[10] < $cache->{time};
+			$valid = 0;
+			last;
+		}
+		if ($valid) {
+			push @$files, @{$cache->{files}};
+			return;
+		}
+	}
+
+	my @found;
+	walk_dir($path, $st[1], $st[10], $cache, \%dirs, \@found);
+	push @$files, @found;
+	mkdir $cache_dir;
+	nstore({
+		version => $cache_version,
+		time => $now,
+		dirs => \%dirs,
+		files => \@found,
+	}, "$file.$$") and rename "$file.$$", $file;
+}
+
+sub list_files($$$) {
+	my $path = shift;
+	my $options = shift;
+	my $files = shift;
+
+	if ($cache_dir and !$options->{follow}) {
+		my @found;
+		my $exclude = join("|", @{$options->{exclude}});
+		cached_files($path, \@found);
+		push @$files, $exclude ? grep { !/$exclude/ } @found : @found;
+		return 1;
+	} else {
+		find_files($path, $options->{findopts}, $files);
+		return 0;
+	}
+}
 
 sub get_ts($$) {
 	my $path = shift;
 	my $options = shift;
 	my $ts = 0;
 	my $fn = "";
+	my @files;
 	$path .= "/" if( -d $path);
-	open FIND, "find $path -type f -and -not -path \\*/.svn\\* -and -not -path \\*CVS\\* $options 2>/dev/null |";
-	while (<FIND>) {
-		chomp;
-		my $file = $_;
-		next if -l $file;
+	# what comes from the cache is known not to be a link
+	my $cached = list_files($path, {
+		%$options,
+		exclude => [ glob_re("*/.svn*"), glob_re("*CVS*"), @{$options->{exclude}} ],
+		findopts => "-and -not -path \\*/.svn\\* -and -not -path \\*CVS\\* $options->{findopts}",
+	}, \@files);
+	foreach my $file (@files) {
+		next if !$cached and -l $file;
 		my $mt = (stat $file)[9];
 		if ($mt > $ts) {
 			$ts = $mt;
 			$fn = $file;
 		}
 	}
-	close FIND;
 	return ($ts, $fn);
 }
 
 (@ARGV > 0) or push @ARGV, ".";
 my $ts = 0;
 my $n = ".";
-my %options;
+my @md5_files;
+my %options = (exclude => []);
 while (@ARGV > 0) {
 	my $path = shift @ARGV;
 	if ($path =~ /^-x/) {
 		my $str = shift @ARGV;
-		$options{"findopts"} .= " -and -not -path '".$str."'"
+		$options{"findopts"} .= " -and -not -path '".$str."'";
+		push @{$options{exclude}}, glob_re($str);
 	} elsif ($path =~ /^-f/) {
 		$options{"findopts"} .= " -follow";
+		$options{follow} = 1;
 	} elsif ($path =~ /^-n/) {
 		my $arg = $ARGV[0];
 		$options{$path} = $arg;
 	} elsif ($path =~ /^-/) {
 		$options{$path} = 1;
+	} elsif ($options{"-m"}) {
+		list_files($path, \%options, \@md5_files);
 	} else {
-		my ($tmp, $fname) = get_ts($path, $options{"findopts"});
+		my ($tmp, $fname) = get_ts($path, \%options);
 		if ($tmp > $ts) {
 			if ($options{'-F'}) {
 				$n = $fname;
@@ -58,7 +229,9 @@ while (@ARGV > 0) {
 	}
 }
 
-if ($options{"-n"}) {
+if ($options{"-m"}) {
+	print md5_hex(join("", map { "$_\n" } @md5_files)) . "\n";
+} elsif ($options{"-n"}) {
 	exit ($n eq $options{"-n"} ? 0 : 1);
 } elsif ($options{"-p"}) {
 	print "$n\n";
@@ -74,11 +74,21 @@ __FBSDID("$FreeBSD: src/sys/opencrypto/crypto.c,v 1.16 2005/01/07 02:29:16 imp E
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/interrupt.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,4)
 #include <linux/kthread.h>
 #endif
+#include <asm/div64.h>
 #include <cryptodev.h>
 
+#define CREATE_TRACE_POINTS
+#include <ocf-trace.h>
+
 /*
  * keep track of whether or not we have been initialised, a big
  * issue if we are linked into the kernel and a driver gets started before
@@ -140,31 +150,94 @@ struct cryptocap {
 
 	int		cc_flags;		/* (d) flags */
 #define CRYPTOCAP_F_CLEANUP	0x80000000	/* needs resource cleanup */
-	int		cc_qblocked;		/* (q) symmetric q blocked */
 	int		cc_kqblocked;		/* (q) asymmetric q blocked */
 
-	int		cc_unqblocked;		/* (q) symmetric q blocked */
 	int		cc_unkqblocked;		/* (q) asymmetric q blocked */
+
+	struct crypto_drvq *cc_q;		/* symmetric submission ring */
+};
+
+/*
+ * The driver table only grows,  and every cryptocap stays where it was
+ * allocated until crypto_exit(),  so a cap found by crypto_checkdriver()
+ * can be used after the lookup.  What moves when the table grows is the
+ * array of pointers:  crypto_drivers and crypto_drivers_num are used with
+ * CRYPTO_DRIVER_LOCK() held,  the crypto threads and other unlocked
+ * readers go through crypto_drvtab under rcu_read_lock(),  and a
+ * replaced array is freed after a grace period.
+ */
+struct crypto_drvtab {
+	struct rcu_head	dt_rcu;
+	int		dt_num;
+	struct cryptocap *dt_cap[0];
 };
-static struct cryptocap *crypto_drivers = NULL;
+static struct crypto_drvtab *crypto_drvtab = NULL;
+static struct cryptocap **crypto_drivers = NULL;
 static int crypto_drivers_num = 0;
 
 /*
- * There are two queues for crypto requests; one for symmetric (e.g.
- * cipher) operations and one for asymmetric (e.g. MOD)operations.
- * A single mutex is used to lock access to both queues.  We could
- * have one per-queue but having one simplifies handling of block/unblock
- * operations.
+ * Symmetric requests are queued per driver.  Each driver owns a fixed size
+ * ring that any number of submitters can add to without taking a lock: a
+ * slot is claimed by advancing dq_head with cmpxchg and published by
+ * writing its sequence number.  The consumer side of a ring is owned by
+ * whoever holds CRYPTO_DQ_RUNNING, so a driver is only ever fed by one
+ * thread at a time while different drivers are fed in parallel by the
+ * per-cpu crypto_proc threads.  A driver that returns ERESTART only
+ * blocks its own ring; the refused request is parked in dq_retry and is
+ * the first one handed to the driver after crypto_unblock().
+ */
+struct crypto_dq_slot {
+	atomic_t	ds_seq;			/* ring position this slot holds */
+	struct cryptop	*ds_crp;
+};
+
+/*
+ * Where a driver's requests spend their time,  kept when crypto_timing
+ * is set and shown in ocf/drivers in debugfs.
+ */
+#define CRYPTO_TSTAT_QUEUE	0	/* crypto_dispatch -> crypto_invoke */
+#define CRYPTO_TSTAT_SERVICE	1	/* crypto_invoke -> crypto_done */
+#define CRYPTO_TSTAT_CBWAIT	2	/* crypto_done -> callback */
+#define CRYPTO_TSTAT_CALLBACK	3	/* callback -> callback return */
+#define CRYPTO_TSTAT_MAX	4
+
+struct crypto_tstat {
+	u_int64_t	ts_acc;			/* total ns */
+	u_int64_t	ts_max;			/* longest ns */
+	u_int32_t	ts_count;		/* number of observations */
+};
+
+struct crypto_drvq {
+	atomic_t	dq_head;		/* next slot to claim (submitters) */
+	unsigned int	dq_tail;		/* next slot to consume (owner) */
+	unsigned int	dq_mask;		/* ring size - 1 */
+	unsigned long	dq_state;
+#define CRYPTO_DQ_RUNNING	0		/* consumer side is owned */
+	int		dq_blocked;		/* driver returned ERESTART */
+	atomic_t	dq_unblocks;		/* bumped by crypto_unblock() */
+	struct cryptop	*dq_retry;		/* (o) op refused with ERESTART */
+	spinlock_t	dq_tlock;		/* protects dq_tstat */
+	struct crypto_tstat dq_tstat[CRYPTO_TSTAT_MAX];
+	struct crypto_dq_slot dq_slot[0];
+};
+
+/*
+ * Size of each driver's submission ring,  rounded up to a power of two.
+ * A full ring fails new requests with ENOMEM just like crypto_q_max.
+ */
+static int crypto_drv_qlen = 1024;
+module_param(crypto_drv_qlen, int, 0444);
+MODULE_PARM_DESC(crypto_drv_qlen,
+		"Size of the per-driver crypto request ring");
+
+/*
+ * Asymmetric (e.g. MOD) operations are rare enough that they still share
+ * a single queue protected by CRYPTO_Q_LOCK().
  */
-static LIST_HEAD(crp_q);		/* crypto request queue */
 static LIST_HEAD(crp_kq);		/* asym request queue */
 
 static spinlock_t crypto_q_lock;
 
-int crypto_all_qblocked = 0;  /* protect with Q_LOCK */
-module_param(crypto_all_qblocked, int, 0444);
-MODULE_PARM_DESC(crypto_all_qblocked, "Are all crypto queues blocked");
-
 int crypto_all_kqblocked = 0; /* protect with Q_LOCK */
 module_param(crypto_all_kqblocked, int, 0444);
 MODULE_PARM_DESC(crypto_all_kqblocked, "Are all asym crypto queues blocked");
@@ -212,6 +285,36 @@ static struct kmem_cache *cryptop_zone;
 static struct kmem_cache *cryptodesc_zone;
 #endif
 
+/*
+ * Freed requests are kept,  with their descriptors still attached,  in a
+ * small per-CPU magazine for each descriptor count.  crypto_getreq() can
+ * then hand one straight back with only the fields a caller may have
+ * changed reset,  rather than going to the slab for the request and each
+ * of its descriptors.
+ */
+#define CRYPTO_MAG_NDESC	4	/* bundles of 0 to 3 descriptors */
+#define CRYPTO_MAG_MAX		64
+
+static int crypto_mag_size = 32;
+module_param(crypto_mag_size, int, 0644);
+MODULE_PARM_DESC(crypto_mag_size,
+		"Requests cached per CPU for each descriptor count (0 disables)");
+
+struct crypto_mag {
+	struct cryptop	*cm_req[CRYPTO_MAG_NDESC][CRYPTO_MAG_MAX];
+	int		cm_cnt[CRYPTO_MAG_NDESC];
+	unsigned long	cm_hits;	/* getreq served from the magazine */
+	unsigned long	cm_allocs;	/* getreq that went to the slab */
+	unsigned long	cm_frees;	/* freereq kept in the magazine */
+	unsigned long	cm_drops;	/* freereq given back to the slab */
+};
+
+static DEFINE_PER_CPU(struct crypto_mag, crypto_mags);
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *crypto_debugfs;
+#endif
+
 #define debug crypto_debug
 int crypto_debug = 0;
 module_param(crypto_debug, int, 0644);
@@ -229,8 +332,8 @@ EXPORT_SYMBOL(crypto_debug);
  * slow,  printing anything will just kill us
  */
 
-static int crypto_q_cnt = 0;
-module_param(crypto_q_cnt, int, 0444);
+static atomic_t crypto_q_cnt = ATOMIC_INIT(0);
+module_param_named(crypto_q_cnt, crypto_q_cnt.counter, int, 0444);
 MODULE_PARM_DESC(crypto_q_cnt,
 		"Current number of outstanding crypto requests");
 
@@ -272,6 +375,16 @@ module_param(crypto_max_loopcount, int, 0644);
 MODULE_PARM_DESC(crypto_max_loopcount,
 	   "Maximum number of crypto ops to do before yielding to other processes");
 
+/*
+ * Time each stage of every request for the per-driver statistics.  This
+ * costs a clock read per stage so it is off by default,  the ocf trace
+ * events are there regardless.
+ */
+static int crypto_timing = 0;
+module_param(crypto_timing, int, 0644);
+MODULE_PARM_DESC(crypto_timing,
+	   "Collect per-driver queue/service/callback times (ocf/drivers)");
+
 #ifndef CONFIG_NR_CPUS
 #define CONFIG_NR_CPUS 1
 #endif
@@ -293,9 +406,228 @@ static	struct cryptostats cryptostats;
 static struct cryptocap *
 crypto_checkdriver(u_int32_t hid)
 {
-	if (crypto_drivers == NULL)
+	struct crypto_drvtab *tab;
+	struct cryptocap *cap = NULL;
+
+	rcu_read_lock();
+	tab = rcu_dereference(crypto_drvtab);
+	if (tab != NULL && hid < tab->dt_num)
+		cap = tab->dt_cap[hid];
+	rcu_read_unlock();
+	return cap;
+}
+
+/*
+ * Number of driver slots,  for walking them without the driver lock.
+ */
+static int
+crypto_drivers_count(void)
+{
+	struct crypto_drvtab *tab;
+	int n;
+
+	rcu_read_lock();
+	tab = rcu_dereference(crypto_drvtab);
+	n = tab != NULL ? tab->dt_num : 0;
+	rcu_read_unlock();
+	return n;
+}
+
+/*
+ * Driver id of a cap,  called with CRYPTO_DRIVER_LOCK() held.
+ */
+static u_int32_t
+crypto_cap_hid(const struct cryptocap *cap)
+{
+	u_int32_t hid;
+
+	for (hid = 0; hid < crypto_drivers_num; hid++)
+		if (crypto_drivers[hid] == cap)
+			break;
+	return hid;
+}
+
+/*
+ * Allocate a driver table of num slots.  The caps of an old table are
+ * carried over and the new slots get one zero'd block of caps,  which is
+ * what crypto_exit() expects when it frees them.
+ */
+static struct crypto_drvtab *
+crypto_drvtab_alloc(struct crypto_drvtab *old, int num, gfp_t gfp)
+{
+	struct crypto_drvtab *tab;
+	struct cryptocap *caps;
+	int i, old_num = old != NULL ? old->dt_num : 0;
+
+	tab = kmalloc(sizeof(*tab) + num * sizeof(tab->dt_cap[0]), gfp);
+	caps = kmalloc((num - old_num) * sizeof(struct cryptocap), gfp);
+	if (tab == NULL || caps == NULL) {
+		kfree(tab);
+		kfree(caps);
 		return NULL;
-	return (hid >= crypto_drivers_num ? NULL : &crypto_drivers[hid]);
+	}
+	memset(caps, 0, (num - old_num) * sizeof(struct cryptocap));
+
+	tab->dt_num = num;
+	for (i = 0; i < old_num; i++)
+		tab->dt_cap[i] = old->dt_cap[i];
+	for (; i < num; i++)
+		tab->dt_cap[i] = &caps[i - old_num];
+	return tab;
+}
+
+static void
+crypto_drvtab_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct crypto_drvtab, dt_rcu));
+}
+
+static __inline u_int64_t
+crypto_tnow(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/*
+ * Account the time from "then" to "now" to one of a driver's stages.
+ */
+static void
+crypto_tstat(struct crypto_drvq *dq, int stage, u_int64_t then, u_int64_t now)
+{
+	struct crypto_tstat *ts;
+	unsigned long flags;
+	u_int64_t delta;
+
+	if (dq == NULL || then == 0)
+		return;
+	delta = now > then ? now - then : 0;
+	spin_lock_irqsave(&dq->dq_tlock, flags);
+	ts = &dq->dq_tstat[stage];
+	ts->ts_acc += delta;
+	if (delta > ts->ts_max)
+		ts->ts_max = delta;
+	ts->ts_count++;
+	spin_unlock_irqrestore(&dq->dq_tlock, flags);
+}
+
+static struct crypto_drvq *
+crypto_tdq(struct cryptop *crp)
+{
+	struct cryptocap *cap;
+
+	cap = crypto_checkdriver(CRYPTO_SESID2HID(crp->crp_sid));
+	return cap ? cap->cc_q : NULL;
+}
+
+static struct crypto_drvq *
+crypto_dq_alloc(void)
+{
+	struct crypto_drvq *dq;
+	unsigned int size, i;
+
+	for (size = 1; size < crypto_drv_qlen && size < 0x10000; size <<= 1)
+		;
+	dq = kmalloc(sizeof(*dq) + size * sizeof(dq->dq_slot[0]), GFP_KERNEL);
+	if (dq == NULL)
+		return NULL;
+	memset(dq, 0, sizeof(*dq));
+	spin_lock_init(&dq->dq_tlock);
+	dq->dq_mask = size - 1;
+	atomic_set(&dq->dq_head, 0);
+	atomic_set(&dq->dq_unblocks, 0);
+	for (i = 0; i < size; i++) {
+		atomic_set(&dq->dq_slot[i].ds_seq, i);
+		dq->dq_slot[i].ds_crp = NULL;
+	}
+	return dq;
+}
+
+/*
+ * Add a request to the tail of a driver ring,  safe against any number
+ * of concurrent submitters.  Returns ENOMEM if the ring is full.
+ */
+static int
+crypto_dq_put(struct crypto_drvq *dq, struct cryptop *crp)
+{
+	struct crypto_dq_slot *slot;
+	unsigned int pos, prev;
+	int diff;
+
+	pos = atomic_read(&dq->dq_head);
+	for (;;) {
+		slot = &dq->dq_slot[pos & dq->dq_mask];
+		diff = (int) (atomic_read(&slot->ds_seq) - pos);
+		if (diff == 0) {
+			prev = atomic_cmpxchg(&dq->dq_head, pos, pos + 1);
+			if (prev == pos)
+				break;
+			pos = prev;
+		} else if (diff < 0)
+			return ENOMEM;
+		else
+			pos = atomic_read(&dq->dq_head);
+	}
+	slot->ds_crp = crp;
+	smp_wmb();
+	atomic_set(&slot->ds_seq, pos + 1);
+	return 0;
+}
+
+/*
+ * Return non-zero if the next slot of the ring has been published.
+ */
+static __inline int
+crypto_dq_peek(struct crypto_drvq *dq)
+{
+	struct crypto_dq_slot *slot = &dq->dq_slot[dq->dq_tail & dq->dq_mask];
+
+	return (int) (atomic_read(&slot->ds_seq) - (dq->dq_tail + 1)) >= 0;
+}
+
+/*
+ * Remove the request at the head of a driver ring.  Only the owner of
+ * CRYPTO_DQ_RUNNING may call this.
+ */
+static struct cryptop *
+crypto_dq_get(struct crypto_drvq *dq)
+{
+	struct crypto_dq_slot *slot = &dq->dq_slot[dq->dq_tail & dq->dq_mask];
+	struct cryptop *crp;
+
+	if (!crypto_dq_peek(dq))
+		return NULL;
+	smp_rmb();
+	crp = slot->ds_crp;
+	slot->ds_crp = NULL;
+	smp_mb();
+	atomic_set(&slot->ds_seq, dq->dq_tail + dq->dq_mask + 1);
+	dq->dq_tail++;
+	return crp;
+}
+
+/*
+ * Is there work on this ring that a dispatch thread could pick up now ?
+ */
+static __inline int
+crypto_dq_runnable(struct crypto_drvq *dq)
+{
+	return dq != NULL && !dq->dq_blocked &&
+			!test_bit(CRYPTO_DQ_RUNNING, &dq->dq_state) &&
+			(dq->dq_retry != NULL || crypto_dq_peek(dq));
+}
+
+static __inline int
+crypto_dq_trylock(struct crypto_drvq *dq)
+{
+	return !test_and_set_bit(CRYPTO_DQ_RUNNING, &dq->dq_state);
+}
+
+static __inline void
+crypto_dq_unlock(struct crypto_drvq *dq)
+{
+	smp_mb();
+	clear_bit(CRYPTO_DQ_RUNNING, &dq->dq_state);
+	smp_mb();
 }
 
 /*
@@ -344,7 +676,7 @@ crypto_select_driver(const struct cryptoini *cri, int flags)
 	best = NULL;
 again:
 	for (hid = 0; hid < crypto_drivers_num; hid++) {
-		cap = &crypto_drivers[hid];
+		cap = crypto_drivers[hid];
 		/*
 		 * If it's not initialized, is in the process of
 		 * going away, or is not appropriate (hardware
@@ -407,7 +739,7 @@ crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int crid)
 	}
 	if (cap != NULL) {
 		/* Call the driver initialization routine. */
-		hid = cap - crypto_drivers;
+		hid = crypto_cap_hid(cap);
 		lid = hid;		/* Pass the driver ID. */
 		cap->cc_sessions++;
 		CRYPTO_DRIVER_UNLOCK();
@@ -429,9 +761,15 @@ crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int crid)
 static void
 crypto_remove(struct cryptocap *cap)
 {
+	struct crypto_drvq *dq;
+
 	CRYPTO_DRIVER_ASSERT();
-	if (cap->cc_sessions == 0 && cap->cc_koperations == 0)
+	if (cap->cc_sessions == 0 && cap->cc_koperations == 0) {
+		/* the ring stays with the slot for the next driver */
+		dq = cap->cc_q;
 		bzero(cap, sizeof(*cap));
+		cap->cc_q = dq;
+	}
 }
 
 /*
@@ -462,7 +800,7 @@ crypto_freesession(u_int64_t sid)
 		err = ENOENT;
 		goto done;
 	}
-	cap = &crypto_drivers[hid];
+	cap = crypto_drivers[hid];
 
 	if (cap->cc_dev) {
 		CRYPTO_DRIVER_UNLOCK();
@@ -489,7 +827,8 @@ done:
 int32_t
 crypto_get_driverid(device_t dev, int flags)
 {
-	struct cryptocap *newdrv;
+	struct crypto_drvtab *newtab, *oldtab;
+	struct crypto_drvq *dq;
 	int i;
 	unsigned long d_flags;
 
@@ -499,11 +838,18 @@ crypto_get_driverid(device_t dev, int flags)
 		return -1;
 	}
 
+	/* allocate a ring up front,  we may not need it if the slot has one */
+	dq = crypto_dq_alloc();
+	if (dq == NULL) {
+		printk("crypto: no space for driver request ring!\n");
+		return -1;
+	}
+
 	CRYPTO_DRIVER_LOCK();
 
 	for (i = 0; i < crypto_drivers_num; i++) {
-		if (crypto_drivers[i].cc_dev == NULL &&
-		    (crypto_drivers[i].cc_flags & CRYPTOCAP_F_CLEANUP) == 0) {
+		if (crypto_drivers[i]->cc_dev == NULL &&
+		    (crypto_drivers[i]->cc_flags & CRYPTOCAP_F_CLEANUP) == 0) {
 			break;
 		}
 	}
@@ -513,39 +859,48 @@ crypto_get_driverid(device_t dev, int flags)
 		/* Be careful about wrap-around. */
 		if (2 * crypto_drivers_num <= crypto_drivers_num) {
 			CRYPTO_DRIVER_UNLOCK();
+			kfree(dq);
 			printk("crypto: driver count wraparound!\n");
 			return -1;
 		}
 
-		newdrv = kmalloc(2 * crypto_drivers_num * sizeof(struct cryptocap),
-				GFP_KERNEL);
-		if (newdrv == NULL) {
+		newtab = crypto_drvtab_alloc(crypto_drvtab,
+				2 * crypto_drivers_num, GFP_ATOMIC);
+		if (newtab == NULL) {
 			CRYPTO_DRIVER_UNLOCK();
+			kfree(dq);
 			printk("crypto: no space to expand driver table!\n");
 			return -1;
 		}
 
-		memcpy(newdrv, crypto_drivers,
-				crypto_drivers_num * sizeof(struct cryptocap));
-		memset(&newdrv[crypto_drivers_num], 0,
-				crypto_drivers_num * sizeof(struct cryptocap));
-
-		crypto_drivers_num *= 2;
-
-		kfree(crypto_drivers);
-		crypto_drivers = newdrv;
+		/* the crypto threads may still be walking the old array */
+		oldtab = crypto_drvtab;
+		rcu_assign_pointer(crypto_drvtab, newtab);
+		crypto_drivers = newtab->dt_cap;
+		crypto_drivers_num = newtab->dt_num;
+		call_rcu(&oldtab->dt_rcu, crypto_drvtab_free_rcu);
 	}
 
 	/* NB: state is zero'd on free */
-	crypto_drivers[i].cc_sessions = 1;	/* Mark */
-	crypto_drivers[i].cc_dev = dev;
-	crypto_drivers[i].cc_flags = flags;
+	crypto_drivers[i]->cc_sessions = 1;	/* Mark */
+	crypto_drivers[i]->cc_dev = dev;
+	crypto_drivers[i]->cc_flags = flags;
+	if (crypto_drivers[i]->cc_q == NULL) {
+		crypto_drivers[i]->cc_q = dq;
+		dq = NULL;
+	} else {
+		crypto_drivers[i]->cc_q->dq_blocked = 0;
+		memset(crypto_drivers[i]->cc_q->dq_tstat, 0,
+				sizeof(crypto_drivers[i]->cc_q->dq_tstat));
+	}
 	if (bootverbose)
 		printf("crypto: assign %s driver id %u, flags %u\n",
 		    device_get_nameunit(dev), i, flags);
 
 	CRYPTO_DRIVER_UNLOCK();
 
+	if (dq != NULL)
+		kfree(dq);
 	return i;
 }
 
@@ -563,9 +918,9 @@ crypto_find_driver(const char *match)
 
 	CRYPTO_DRIVER_LOCK();
 	for (i = 0; i < crypto_drivers_num; i++) {
-		device_t dev = crypto_drivers[i].cc_dev;
+		device_t dev = crypto_drivers[i]->cc_dev;
 		if (dev == NULL ||
-		    (crypto_drivers[i].cc_flags & CRYPTOCAP_F_CLEANUP))
+		    (crypto_drivers[i]->cc_flags & CRYPTOCAP_F_CLEANUP))
 			continue;
 		if (strncmp(match, device_get_nameunit(dev), len) == 0 ||
 		    strncmp(match, device_get_name(dev), len) == 0)
@@ -683,12 +1038,20 @@ static void
 driver_finis(struct cryptocap *cap)
 {
 	u_int32_t ses, kops;
+	struct crypto_drvq *dq;
 
 	CRYPTO_DRIVER_ASSERT();
 
 	ses = cap->cc_sessions;
 	kops = cap->cc_koperations;
+	dq = cap->cc_q;
 	bzero(cap, sizeof(*cap));
+	cap->cc_q = dq;
+	/* let anything still queued through so it can be migrated */
+	if (dq != NULL) {
+		dq->dq_blocked = 0;
+		wake_up_interruptible(&cryptoproc_wait);
+	}
 	if (ses != 0 || kops != 0) {
 		/*
 		 * If there are pending sessions,
@@ -778,10 +1141,11 @@ crypto_unblock(u_int32_t driverid, int what)
 	CRYPTO_Q_LOCK();
 	cap = crypto_checkdriver(driverid);
 	if (cap != NULL) {
-		if (what & CRYPTO_SYMQ) {
-			cap->cc_qblocked = 0;
-			cap->cc_unqblocked = 0;
-			crypto_all_qblocked = 0;
+		if ((what & CRYPTO_SYMQ) && cap->cc_q != NULL) {
+			/* tell a dispatch racing with us not to block the ring */
+			atomic_inc(&cap->cc_q->dq_unblocks);
+			smp_mb();
+			cap->cc_q->dq_blocked = 0;
 		}
 		if (what & CRYPTO_ASYMQ) {
 			cap->cc_kqblocked = 0;
@@ -797,6 +1161,55 @@ crypto_unblock(u_int32_t driverid, int what)
 	return err;
 }
 
+/*
+ * Hand a request to the driver on behalf of the owner of its ring.  If
+ * the driver runs out of resources the request is parked as the ring's
+ * retry op and the ring is marked blocked,  unless the driver managed to
+ * call crypto_unblock() while we were in it.
+ */
+static int
+crypto_dq_invoke(struct cryptocap *cap, struct crypto_drvq *dq,
+		struct cryptop *crp, int hint)
+{
+	int result, unblocks;
+
+	unblocks = atomic_read(&dq->dq_unblocks);
+	result = crypto_invoke(cap, crp, hint);
+	if (result == ERESTART) {
+		dq->dq_retry = crp;
+		dq->dq_blocked = 1;
+		smp_mb();
+		if (atomic_read(&dq->dq_unblocks) != unblocks)
+			dq->dq_blocked = 0;
+		cryptostats.cs_blocks++;
+	}
+	return result;
+}
+
+/*
+ * Feed queued requests to a driver until its ring is empty,  the driver
+ * blocks or we have done budget ops.  Caller owns the ring.
+ */
+static int
+crypto_dq_run(struct cryptocap *cap, struct crypto_drvq *dq, int budget)
+{
+	struct cryptop *crp;
+	int done = 0;
+
+	while (done < budget && !dq->dq_blocked) {
+		crp = dq->dq_retry;
+		if (crp != NULL)
+			dq->dq_retry = NULL;
+		else if ((crp = crypto_dq_get(dq)) == NULL)
+			break;
+		/* the ring tells us exactly if this driver has more to come */
+		crypto_dq_invoke(cap, dq, crp,
+				crypto_dq_peek(dq) ? CRYPTO_HINT_MORE : 0);
+		done++;
+	}
+	return done;
+}
+
 /*
  * Add a crypto request to a queue, to be processed by the kernel thread.
  */
@@ -804,66 +1217,60 @@ int
 crypto_dispatch(struct cryptop *crp)
 {
 	struct cryptocap *cap;
-	int result = -1;
-	unsigned long q_flags;
+	struct crypto_drvq *dq;
+	int hid, result;
 
 	dprintk("%s()\n", __FUNCTION__);
 
 	cryptostats.cs_ops++;
 
-	CRYPTO_Q_LOCK();
-	if (crypto_q_cnt >= crypto_q_max) {
+	if (atomic_inc_return(&crypto_q_cnt) > crypto_q_max) {
+		atomic_dec(&crypto_q_cnt);
 		cryptostats.cs_drops++;
-		CRYPTO_Q_UNLOCK();
 		return ENOMEM;
 	}
-	crypto_q_cnt++;
 
 	/* make sure we are starting a fresh run on this crp. */
 	crp->crp_flags &= ~CRYPTO_F_DONE;
 	crp->crp_etype = 0;
+	crp->crp_tstamp = crypto_timing ? crypto_tnow() : 0;
+	trace_ocf_dispatch(crp, crp->crp_flags);
+
+	hid = CRYPTO_SESID2HID(crp->crp_sid);
+	cap = crypto_checkdriver(hid);
+	/* Driver cannot disappear when there is an active session. */
+	KASSERT(cap != NULL && cap->cc_q != NULL,
+			("%s: Driver disappeared.", __func__));
+	dq = cap->cc_q;
 
 	/*
 	 * Caller marked the request to be processed immediately; dispatch
-	 * it directly to the driver unless the driver is currently blocked.
+	 * it directly to the driver unless the driver is currently blocked,
+	 * has requests queued ahead of this one or is being fed by another
+	 * thread.
 	 */
-	if ((crp->crp_flags & CRYPTO_F_BATCH) == 0) {
-		int hid = CRYPTO_SESID2HID(crp->crp_sid);
-		cap = crypto_checkdriver(hid);
-		/* Driver cannot disappear when there is an active session. */
-		KASSERT(cap != NULL, ("%s: Driver disappeared.", __func__));
-		if (!cap->cc_qblocked) {
-			crypto_all_qblocked = 0;
-			crypto_drivers[hid].cc_unqblocked = 1;
-			CRYPTO_Q_UNLOCK();
-			result = crypto_invoke(cap, crp, 0);
-			CRYPTO_Q_LOCK();
-			if (result == ERESTART)
-				if (crypto_drivers[hid].cc_unqblocked)
-					crypto_drivers[hid].cc_qblocked = 1;
-			crypto_drivers[hid].cc_unqblocked = 0;
+	if ((crp->crp_flags & CRYPTO_F_BATCH) == 0 && !dq->dq_blocked &&
+			crypto_dq_trylock(dq)) {
+		if (dq->dq_retry == NULL && !crypto_dq_peek(dq)) {
+			result = crypto_dq_invoke(cap, dq, crp, 0);
+			crypto_dq_unlock(dq);
+			if (crypto_dq_runnable(dq))
+				wake_up_interruptible(&cryptoproc_wait);
+			/* ERESTART means it was queued for a retry */
+			return result == ERESTART ? 0 : result;
 		}
+		crypto_dq_unlock(dq);
 	}
-	if (result == ERESTART) {
-		/*
-		 * The driver ran out of resources, mark the
-		 * driver ``blocked'' for cryptop's and put
-		 * the request back in the queue.  It would
-		 * best to put the request back where we got
-		 * it but that's hard so for now we put it
-		 * at the front.  This should be ok; putting
-		 * it at the end does not work.
-		 */
-		list_add(&crp->crp_next, &crp_q);
-		cryptostats.cs_blocks++;
-		result = 0;
-	} else if (result == -1) {
-		TAILQ_INSERT_TAIL(&crp_q, crp, crp_next);
-		result = 0;
+
+	result = crypto_dq_put(dq, crp);
+	if (result) {
+		atomic_dec(&crypto_q_cnt);
+		cryptostats.cs_drops++;
+		return result;
 	}
+	trace_ocf_queue(crp, atomic_read(&dq->dq_head) - dq->dq_tail);
 	wake_up_interruptible(&cryptoproc_wait);
-	CRYPTO_Q_UNLOCK();
-	return result;
+	return 0;
 }
 
 /*
@@ -927,7 +1334,7 @@ crypto_select_kdriver(const struct cryptkop *krp, int flags)
 	blocked = NULL;
 again:
 	for (hid = 0; hid < crypto_drivers_num; hid++) {
-		cap = &crypto_drivers[hid];
+		cap = crypto_drivers[hid];
 		/*
 		 * If it's not initialized, is in the process of
 		 * going away, or is not appropriate (hardware
@@ -992,7 +1399,7 @@ crypto_kinvoke(struct cryptkop *krp, int crid)
 		cap = crypto_select_kdriver(krp, crid);
 	}
 	if (cap != NULL && !cap->cc_kqblocked) {
-		krp->krp_hid = cap - crypto_drivers;
+		krp->krp_hid = crypto_cap_hid(cap);
 		cap->cc_koperations++;
 		CRYPTO_DRIVER_UNLOCK();
 		error = CRYPTODEV_KPROCESS(cap->cc_dev, krp, 0);
@@ -1035,10 +1442,13 @@ crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint)
 
 	dprintk("%s()\n", __FUNCTION__);
 
-#ifdef CRYPTO_TIMING
-	if (crypto_timing)
-		crypto_tstat(&cryptostats.cs_invoke, &crp->crp_tstamp);
-#endif
+	trace_ocf_process(crp, hint);
+	if (crp->crp_tstamp) {
+		u_int64_t now = crypto_tnow();
+
+		crypto_tstat(cap->cc_q, CRYPTO_TSTAT_QUEUE, crp->crp_tstamp, now);
+		crp->crp_tstamp = now;
+	}
 	if (cap->cc_flags & CRYPTOCAP_F_CLEANUP) {
 		struct cryptodesc *crd;
 		u_int64_t nid;
@@ -1071,6 +1481,18 @@ crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint)
 	}
 }
 
+static void
+crypto_freereq_slab(struct cryptop *crp)
+{
+	struct cryptodesc *crd;
+
+	while ((crd = crp->crp_desc) != NULL) {
+		crp->crp_desc = crd->crd_next;
+		kmem_cache_free(cryptodesc_zone, crd);
+	}
+	kmem_cache_free(cryptop_zone, crp);
+}
+
 /*
  * Release a set of crypto descriptors.
  */
@@ -1078,6 +1500,9 @@ void
 crypto_freereq(struct cryptop *crp)
 {
 	struct cryptodesc *crd;
+	struct crypto_mag *m;
+	unsigned long flags;
+	int n;
 
 	if (crp == NULL)
 		return;
@@ -1085,15 +1510,8 @@ crypto_freereq(struct cryptop *crp)
 #ifdef DIAGNOSTIC
 	{
 		struct cryptop *crp2;
-		unsigned long q_flags;
+		unsigned long r_flags;
 
-		CRYPTO_Q_LOCK();
-		TAILQ_FOREACH(crp2, &crp_q, crp_next) {
-			KASSERT(crp2 != crp,
-			    ("Freeing cryptop from the crypto queue (%p).",
-			    crp));
-		}
-		CRYPTO_Q_UNLOCK();
 		CRYPTO_RETQ_LOCK();
 		TAILQ_FOREACH(crp2, &crp_ret_q, crp_next) {
 			KASSERT(crp2 != crp,
@@ -1104,11 +1522,42 @@ crypto_freereq(struct cryptop *crp)
 	}
 #endif
 
-	while ((crd = crp->crp_desc) != NULL) {
-		crp->crp_desc = crd->crd_next;
-		kmem_cache_free(cryptodesc_zone, crd);
+	n = 0;
+	for (crd = crp->crp_desc; crd && n < CRYPTO_MAG_NDESC; crd = crd->crd_next)
+		n++;
+
+	if (n < CRYPTO_MAG_NDESC) {
+		local_irq_save(flags);
+		m = &per_cpu(crypto_mags, smp_processor_id());
+		if (m->cm_cnt[n] < min(crypto_mag_size, CRYPTO_MAG_MAX)) {
+			m->cm_req[n][m->cm_cnt[n]++] = crp;
+			m->cm_frees++;
+			local_irq_restore(flags);
+			return;
+		}
+		m->cm_drops++;
+		local_irq_restore(flags);
+	}
+	crypto_freereq_slab(crp);
+}
+
+/*
+ * Make a cached request look freshly allocated.  crp_waitq has no
+ * waiters once a request is freed so it is left alone,  as are the
+ * descriptor IVs which are only read when a flag says they were set.
+ */
+static inline void
+crypto_req_reset(struct cryptop *crp)
+{
+	struct cryptodesc *crd, *desc = crp->crp_desc;
+
+	INIT_LIST_HEAD(&crp->crp_next);
+	memset(&crp->crp_sid, 0, sizeof(*crp) - offsetof(struct cryptop, crp_sid));
+	crp->crp_desc = desc;
+	for (crd = desc; crd; crd = crd->crd_next) {
+		memset(crd, 0, offsetof(struct cryptodesc, crd_iv));
+		crd->CRD_INI.cri_next = NULL;
 	}
-	kmem_cache_free(cryptop_zone, crp);
 }
 
 /*
@@ -1119,6 +1568,24 @@ crypto_getreq(int num)
 {
 	struct cryptodesc *crd;
 	struct cryptop *crp;
+	struct crypto_mag *m;
+	unsigned long flags;
+
+	if (num >= 0 && num < CRYPTO_MAG_NDESC) {
+		crp = NULL;
+		local_irq_save(flags);
+		m = &per_cpu(crypto_mags, smp_processor_id());
+		if (m->cm_cnt[num] > 0) {
+			crp = m->cm_req[num][--m->cm_cnt[num]];
+			m->cm_hits++;
+		} else
+			m->cm_allocs++;
+		local_irq_restore(flags);
+		if (crp) {
+			crypto_req_reset(crp);
+			return crp;
+		}
+	}
 
 	crp = kmem_cache_alloc(cryptop_zone, SLAB_ATOMIC);
 	if (crp != NULL) {
@@ -1128,7 +1595,7 @@ crypto_getreq(int num)
 		while (num--) {
 			crd = kmem_cache_alloc(cryptodesc_zone, SLAB_ATOMIC);
 			if (crd == NULL) {
-				crypto_freereq(crp);
+				crypto_freereq_slab(crp);
 				return NULL;
 			}
 			memset(crd, 0, sizeof(*crd));
@@ -1139,20 +1606,44 @@ crypto_getreq(int num)
 	return crp;
 }
 
+/*
+ * Run a request's callback,  the request may be gone once it returns.
+ */
+static void
+crypto_callback(struct cryptop *crp, int deferred)
+{
+	struct crypto_drvq *dq = NULL;
+	u_int64_t start = 0;
+
+	trace_ocf_callback(crp, deferred);
+	if (crp->crp_tstamp) {
+		dq = crypto_tdq(crp);
+		start = crypto_tnow();
+		crypto_tstat(dq, CRYPTO_TSTAT_CBWAIT, crp->crp_tstamp, start);
+	}
+	crp->crp_callback(crp);
+	if (start)
+		crypto_tstat(dq, CRYPTO_TSTAT_CALLBACK, start, crypto_tnow());
+}
+
 /*
  * Invoke the callback on behalf of the driver.
  */
 void
 crypto_done(struct cryptop *crp)
 {
-	unsigned long q_flags;
-
 	dprintk("%s()\n", __FUNCTION__);
+	trace_ocf_done(crp, crp->crp_etype);
+	if (crp->crp_tstamp) {
+		u_int64_t now = crypto_tnow();
+
+		crypto_tstat(crypto_tdq(crp), CRYPTO_TSTAT_SERVICE,
+				crp->crp_tstamp, now);
+		crp->crp_tstamp = now;
+	}
 	if ((crp->crp_flags & CRYPTO_F_DONE) == 0) {
 		crp->crp_flags |= CRYPTO_F_DONE;
-		CRYPTO_Q_LOCK();
-		crypto_q_cnt--;
-		CRYPTO_Q_UNLOCK();
+		atomic_dec(&crypto_q_cnt);
 	} else
 		printk("crypto: crypto_done op already done, flags 0x%x",
 				crp->crp_flags);
@@ -1173,7 +1664,7 @@ crypto_done(struct cryptop *crp)
 		 * callback routine does very little (e.g. the
 		 * /dev/crypto callback method just does a wakeup).
 		 */
-		crp->crp_callback(crp);
+		crypto_callback(crp, 0);
 	} else {
 		unsigned long r_flags;
 		/*
@@ -1205,7 +1696,7 @@ crypto_kdone(struct cryptkop *krp)
 	CRYPTO_DRIVER_LOCK();
 	/* XXX: What if driver is loaded in the meantime? */
 	if (krp->krp_hid < crypto_drivers_num) {
-		cap = &crypto_drivers[krp->krp_hid];
+		cap = crypto_drivers[krp->krp_hid];
 		cap->cc_koperations--;
 		KASSERT(cap->cc_koperations >= 0, ("cc_koperations < 0"));
 		if (cap->cc_flags & CRYPTOCAP_F_CLEANUP)
@@ -1244,7 +1735,7 @@ crypto_getfeat(int *featp)
 
 	CRYPTO_DRIVER_LOCK();
 	for (hid = 0; hid < crypto_drivers_num; hid++) {
-		const struct cryptocap *cap = &crypto_drivers[hid];
+		const struct cryptocap *cap = crypto_drivers[hid];
 
 		if ((cap->cc_flags & CRYPTOCAP_F_SOFTWARE) &&
 		    !crypto_devallowsoft) {
@@ -1259,106 +1750,75 @@ crypto_getfeat(int *featp)
 	return (0);
 }
 
+/*
+ * Return non-zero if any driver ring has work that no thread is feeding.
+ */
+static int
+crypto_q_runnable(void)
+{
+	struct crypto_drvtab *tab;
+	int hid, runnable = 0;
+
+	rcu_read_lock();
+	tab = rcu_dereference(crypto_drvtab);
+	for (hid = 0; tab != NULL && hid < tab->dt_num; hid++)
+		if (crypto_dq_runnable(tab->dt_cap[hid]->cc_q)) {
+			runnable = 1;
+			break;
+		}
+	rcu_read_unlock();
+	return runnable;
+}
+
+/*
+ * Walk the driver rings once,  starting at a per-thread offset so the
+ * per-cpu threads tend to pick different drivers,  and feed each ring
+ * that we can take ownership of.  Returns the number of ops dispatched.
+ */
+static int
+crypto_q_run(int start)
+{
+	struct cryptocap *cap;
+	struct crypto_drvq *dq;
+	int i, hid, done = 0, n = crypto_drivers_count();
+
+	for (i = 0; i < n; i++) {
+		hid = (start + i) % n;
+		cap = crypto_checkdriver(hid);
+		if (cap == NULL)
+			break;
+		dq = cap->cc_q;
+		if (!crypto_dq_runnable(dq) || !crypto_dq_trylock(dq))
+			continue;
+		done += crypto_dq_run(cap, dq, crypto_max_loopcount);
+		crypto_dq_unlock(dq);
+	}
+	return done;
+}
+
 /*
  * Crypto thread, dispatches crypto requests.
  */
 static int
 crypto_proc(void *arg)
 {
-	struct cryptop *crp, *submit;
 	struct cryptkop *krp, *krpp;
 	struct cryptocap *cap;
-	u_int32_t hid;
-	int result, hint;
+	int result, submitted;
 	unsigned long q_flags;
 	int loopcount = 0;
 
 	set_current_state(TASK_INTERRUPTIBLE);
 
-	CRYPTO_Q_LOCK();
 	for (;;) {
 		/*
-		 * we need to make sure we don't get into a busy loop with nothing
-		 * to do,  the two crypto_all_*blocked vars help us find out when
-		 * we are all full and can do nothing on any driver or Q.  If so we
-		 * wait for an unblock.
+		 * Symmetric ops run without the queue lock,  each driver ring
+		 * is fed by at most one thread at a time.
 		 */
-		crypto_all_qblocked  = !list_empty(&crp_q);
-
-		/*
-		 * Find the first element in the queue that can be
-		 * processed and look-ahead to see if multiple ops
-		 * are ready for the same driver.
-		 */
-		submit = NULL;
-		hint = 0;
-		list_for_each_entry(crp, &crp_q, crp_next) {
-			hid = CRYPTO_SESID2HID(crp->crp_sid);
-			cap = crypto_checkdriver(hid);
-			/*
-			 * Driver cannot disappear when there is an active
-			 * session.
-			 */
-			KASSERT(cap != NULL, ("%s:%u Driver disappeared.",
-			    __func__, __LINE__));
-			if (cap == NULL || cap->cc_dev == NULL) {
-				/* Op needs to be migrated, process it. */
-				if (submit == NULL)
-					submit = crp;
-				break;
-			}
-			if (!cap->cc_qblocked) {
-				if (submit != NULL) {
-					/*
-					 * We stop on finding another op,
-					 * regardless whether its for the same
-					 * driver or not.  We could keep
-					 * searching the queue but it might be
-					 * better to just use a per-driver
-					 * queue instead.
-					 */
-					if (CRYPTO_SESID2HID(submit->crp_sid) == hid)
-						hint = CRYPTO_HINT_MORE;
-					break;
-				} else {
-					submit = crp;
-					if ((submit->crp_flags & CRYPTO_F_BATCH) == 0)
-						break;
-					/* keep scanning for more are q'd */
-				}
-			}
-		}
-		if (submit != NULL) {
-			hid = CRYPTO_SESID2HID(submit->crp_sid);
-			crypto_all_qblocked = 0;
-			list_del(&submit->crp_next);
-			crypto_drivers[hid].cc_unqblocked = 1;
-			cap = crypto_checkdriver(hid);
-			CRYPTO_Q_UNLOCK();
-			KASSERT(cap != NULL, ("%s:%u Driver disappeared.",
-			    __func__, __LINE__));
-			result = crypto_invoke(cap, submit, hint);
-			CRYPTO_Q_LOCK();
-			if (result == ERESTART) {
-				/*
-				 * The driver ran out of resources, mark the
-				 * driver ``blocked'' for cryptop's and put
-				 * the request back in the queue.  It would
-				 * best to put the request back where we got
-				 * it but that's hard so for now we put it
-				 * at the front.  This should be ok; putting
-				 * it at the end does not work.
-				 */
-				/* XXX validate sid again? */
-				list_add(&submit->crp_next, &crp_q);
-				cryptostats.cs_blocks++;
-				if (crypto_drivers[hid].cc_unqblocked)
-					crypto_drivers[hid].cc_qblocked=0;
-				crypto_drivers[hid].cc_unqblocked=0;
-			}
-			crypto_drivers[hid].cc_unqblocked = 0;
-		}
+		submitted = crypto_q_run((int) (unsigned long) arg);
+		loopcount += submitted;
 
+		CRYPTO_Q_LOCK();
 		crypto_all_kqblocked = !list_empty(&crp_kq);
 
 		/* As above, but for key ops */
@@ -1387,7 +1847,7 @@ crypto_proc(void *arg)
 		if (krp != NULL) {
 			crypto_all_kqblocked = 0;
 			list_del(&krp->krp_next);
-			crypto_drivers[krp->krp_hid].cc_kqblocked = 1;
+			crypto_checkdriver(krp->krp_hid)->cc_kqblocked = 1;
 			CRYPTO_Q_UNLOCK();
 			result = crypto_kinvoke(krp, krp->krp_hid);
 			CRYPTO_Q_LOCK();
@@ -1405,30 +1865,27 @@ crypto_proc(void *arg)
 				list_add(&krp->krp_next, &crp_kq);
 				cryptostats.cs_kblocks++;
 			} else
-				crypto_drivers[krp->krp_hid].cc_kqblocked = 0;
+				crypto_checkdriver(krp->krp_hid)->cc_kqblocked = 0;
 		}
 
-		if (submit == NULL && krp == NULL) {
+		CRYPTO_Q_UNLOCK();
+
+		if (submitted == 0 && krp == NULL) {
 			/*
 			 * Nothing more to be processed.  Sleep until we're
 			 * woken because there are more ops to process.
 			 * This happens either by submission or by a driver
 			 * becoming unblocked and notifying us through
-			 * crypto_unblock.  Note that when we wakeup we
-			 * start processing each queue again from the
-			 * front. It's not clear that it's important to
-			 * preserve this ordering since ops may finish
-			 * out of order if dispatched to different devices
-			 * and some become blocked while others do not.
+			 * crypto_unblock.  Only one thread is woken per
+			 * event,  it will look at every ring before it
+			 * sleeps again.
 			 */
-			dprintk("%s - sleeping (qe=%d qb=%d kqe=%d kqb=%d)\n",
-					__FUNCTION__,
-					list_empty(&crp_q), crypto_all_qblocked,
+			dprintk("%s - sleeping (qr=%d kqe=%d kqb=%d)\n",
+					__FUNCTION__, crypto_q_runnable(),
 					list_empty(&crp_kq), crypto_all_kqblocked);
 			loopcount = 0;
-			CRYPTO_Q_UNLOCK();
-			wait_event_interruptible(cryptoproc_wait,
-					!(list_empty(&crp_q) || crypto_all_qblocked) ||
+			wait_event_interruptible_exclusive(cryptoproc_wait,
+					crypto_q_runnable() ||
 					!(list_empty(&crp_kq) || crypto_all_kqblocked) ||
 					kthread_should_stop());
 			if (signal_pending (current)) {
@@ -1440,7 +1897,6 @@ crypto_proc(void *arg)
 				spin_unlock_irq(&current->sigmask_lock);
 #endif
 			}
-			CRYPTO_Q_LOCK();
 			dprintk("%s - awake\n", __FUNCTION__);
 			if (kthread_should_stop())
 				break;
@@ -1451,13 +1907,10 @@ crypto_proc(void *arg)
 			 * been using the CPU exclusively for a while.
 			 */
 			loopcount = 0;
-			CRYPTO_Q_UNLOCK();
 			schedule();
-			CRYPTO_Q_LOCK();
 		}
 		loopcount++;
 	}
-	CRYPTO_Q_UNLOCK();
 	return 0;
 }
 
@@ -1496,7 +1949,7 @@ crypto_ret_proc(void *arg)
 			 * Run callbacks unlocked.
 			 */
 			if (crpt != NULL)
-				crpt->crp_callback(crpt);
+				crypto_callback(crpt, 1);
 			if (krpt != NULL)
 				krpt->krp_callback(krpt);
 			CRYPTO_RETQ_LOCK();
@@ -1549,7 +2002,7 @@ db_show_drivers(void)
 		, "KB"
 	);
 	for (hid = 0; hid < crypto_drivers_num; hid++) {
-		const struct cryptocap *cap = &crypto_drivers[hid];
+		const struct cryptocap *cap = crypto_drivers[hid];
 		if (cap->cc_dev == NULL)
 			continue;
 		db_printf("%-12s %4u %4u %08x %2u %2u\n"
@@ -1557,7 +2010,7 @@ db_show_drivers(void)
 		    , cap->cc_sessions
 		    , cap->cc_koperations
 		    , cap->cc_flags
-		    , cap->cc_qblocked
+		    , cap->cc_q ? cap->cc_q->dq_blocked : 0
 		    , cap->cc_kqblocked
 		);
 	}
@@ -1570,20 +2023,6 @@ DB_SHOW_COMMAND(crypto, db_show_crypto)
 	db_show_drivers();
 	db_printf("\n");
 
-	db_printf("%4s %8s %4s %4s %4s %4s %8s %8s\n",
-	    "HID", "Caps", "Ilen", "Olen", "Etype", "Flags",
-	    "Desc", "Callback");
-	TAILQ_FOREACH(crp, &crp_q, crp_next) {
-		db_printf("%4u %08x %4u %4u %4u %04x %8p %8p\n"
-		    , (int) CRYPTO_SESID2HID(crp->crp_sid)
-		    , (int) CRYPTO_SESID2CAPS(crp->crp_sid)
-		    , crp->crp_ilen, crp->crp_olen
-		    , crp->crp_etype
-		    , crp->crp_flags
-		    , crp->crp_desc
-		    , crp->crp_callback
-		);
-	}
 	if (!TAILQ_EMPTY(&crp_ret_q)) {
 		db_printf("\n%4s %4s %4s %8s\n",
 		    "HID", "Etype", "Flags", "Callback");
@@ -1631,6 +2070,133 @@ DB_SHOW_COMMAND(kcrypto, db_show_kcrypto)
 }
 #endif
 
+#ifdef CONFIG_DEBUG_FS
+static int
+crypto_mag_show(struct seq_file *m, void *v)
+{
+	struct crypto_mag *cm;
+	int cpu, i;
+
+	seq_printf(m, "cpu       hits     allocs      frees      drops  cached\n");
+	for_each_online_cpu(cpu) {
+		cm = &per_cpu(crypto_mags, cpu);
+		seq_printf(m, "%3d %10lu %10lu %10lu %10lu ", cpu, cm->cm_hits,
+				cm->cm_allocs, cm->cm_frees, cm->cm_drops);
+		for (i = 0; i < CRYPTO_MAG_NDESC; i++)
+			seq_printf(m, " %d", cm->cm_cnt[i]);
+		seq_printf(m, "\n");
+	}
+	return 0;
+}
+
+static int
+crypto_mag_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, crypto_mag_show, NULL);
+}
+
+static const struct file_operations crypto_mag_fops = {
+	.owner = THIS_MODULE,
+	.open = crypto_mag_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const char *crypto_tstat_names[CRYPTO_TSTAT_MAX] = {
+	"queue", "service", "cbwait", "callback"
+};
+
+/*
+ * Per-driver stage times,  one line per driver and stage.  Writing
+ * anything to the file clears them.
+ */
+static int
+crypto_tstat_show(struct seq_file *m, void *v)
+{
+	struct crypto_tstat ts[CRYPTO_TSTAT_MAX];
+	struct cryptocap *cap;
+	unsigned long d_flags, flags;
+	u_int64_t avg;
+	int hid, i;
+
+	seq_printf(m, "hid driver       stage         count     avg_ns     max_ns\n");
+	CRYPTO_DRIVER_LOCK();
+	for (hid = 0; hid < crypto_drivers_num; hid++) {
+		cap = crypto_drivers[hid];
+		if (cap->cc_dev == NULL || cap->cc_q == NULL)
+			continue;
+		spin_lock_irqsave(&cap->cc_q->dq_tlock, flags);
+		memcpy(ts, cap->cc_q->dq_tstat, sizeof(ts));
+		spin_unlock_irqrestore(&cap->cc_q->dq_tlock, flags);
+		for (i = 0; i < CRYPTO_TSTAT_MAX; i++) {
+			avg = ts[i].ts_acc;
+			if (ts[i].ts_count)
+				do_div(avg, ts[i].ts_count);
+			seq_printf(m, "%3d %-12s %-8s %10u %10llu %10llu\n", hid,
+					device_get_nameunit(cap->cc_dev),
+					crypto_tstat_names[i], ts[i].ts_count,
+					(unsigned long long) avg,
+					(unsigned long long) ts[i].ts_max);
+		}
+	}
+	CRYPTO_DRIVER_UNLOCK();
+	return 0;
+}
+
+static int
+crypto_tstat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, crypto_tstat_show, NULL);
+}
+
+static ssize_t
+crypto_tstat_write(struct file *file, const char __user *buf, size_t count,
+		loff_t *ppos)
+{
+	struct crypto_drvq *dq;
+	unsigned long d_flags, flags;
+	int hid;
+
+	CRYPTO_DRIVER_LOCK();
+	for (hid = 0; hid < crypto_drivers_num; hid++) {
+		dq = crypto_drivers[hid]->cc_q;
+		if (dq == NULL)
+			continue;
+		spin_lock_irqsave(&dq->dq_tlock, flags);
+		memset(dq->dq_tstat, 0, sizeof(dq->dq_tstat));
+		spin_unlock_irqrestore(&dq->dq_tlock, flags);
+	}
+	CRYPTO_DRIVER_UNLOCK();
+	return count;
+}
+
+static const struct file_operations crypto_tstat_fops = {
+	.owner = THIS_MODULE,
+	.open = crypto_tstat_open,
+	.read = seq_read,
+	.write = crypto_tstat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+/*
+ * Give everything cached in the magazines back to the slabs.
+ */
+static void
+crypto_mag_drain(void)
+{
+	struct crypto_mag *m;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		m = &per_cpu(crypto_mags, cpu);
+		for (i = 0; i < CRYPTO_MAG_NDESC; i++)
+			while (m->cm_cnt[i] > 0)
+				crypto_freereq_slab(m->cm_req[i][--m->cm_cnt[i]]);
+	}
+}
 
 static int
 crypto_init(void)
@@ -1668,16 +2234,26 @@ crypto_init(void)
 		goto bad;
 	}
 
-	crypto_drivers_num = CRYPTO_DRIVERS_INITIAL;
-	crypto_drivers = kmalloc(crypto_drivers_num * sizeof(struct cryptocap),
+	crypto_drvtab = crypto_drvtab_alloc(NULL, CRYPTO_DRIVERS_INITIAL,
 			GFP_KERNEL);
-	if (crypto_drivers == NULL) {
+	if (crypto_drvtab == NULL) {
 		printk("crypto: crypto_init cannot setup crypto drivers\n");
 		error = ENOMEM;
 		goto bad;
 	}
-
-	memset(crypto_drivers, 0, crypto_drivers_num * sizeof(struct cryptocap));
+	crypto_drivers = crypto_drvtab->dt_cap;
+	crypto_drivers_num = crypto_drvtab->dt_num;
+
+#ifdef CONFIG_DEBUG_FS
+	/* statistics only,  carry on without them if this fails */
+	crypto_debugfs = debugfs_create_dir("ocf", NULL);
+	if (!IS_ERR_OR_NULL(crypto_debugfs)) {
+		debugfs_create_file("reqcache", 0444, crypto_debugfs, NULL,
+				&crypto_mag_fops);
+		debugfs_create_file("drivers", 0644, crypto_debugfs, NULL,
+				&crypto_tstat_fops);
+	}
+#endif
 
 	ocf_for_each_cpu(cpu) {
 		cryptoproc[cpu] = kthread_create(crypto_proc, (void *) cpu,
@@ -1728,9 +2304,30 @@ crypto_exit(void)
 	/* 
 	 * Reclaim dynamically allocated resources.
 	 */
-	if (crypto_drivers != NULL)
-		kfree(crypto_drivers);
+	rcu_barrier();		/* old driver tables */
+	if (crypto_drvtab != NULL) {
+		int hid;
+
+		for (hid = 0; hid < crypto_drivers_num; hid++)
+			if (crypto_drivers[hid]->cc_q != NULL)
+				kfree(crypto_drivers[hid]->cc_q);
+		/* a block of caps for each size the table had */
+		kfree(crypto_drivers[0]);
+		for (hid = CRYPTO_DRIVERS_INITIAL; hid < crypto_drivers_num; hid *= 2)
+			kfree(crypto_drivers[hid]);
+		kfree(crypto_drvtab);
+		crypto_drvtab = NULL;
+		crypto_drivers = NULL;
+	}
+
+#ifdef CONFIG_DEBUG_FS
+	if (!IS_ERR_OR_NULL(crypto_debugfs))
+		debugfs_remove_recursive(crypto_debugfs);
+	crypto_debugfs = NULL;
+#endif
 
+	if (cryptodesc_zone != NULL && cryptop_zone != NULL)
+		crypto_mag_drain();
 	if (cryptodesc_zone != NULL)
 		kmem_cache_destroy(cryptodesc_zone);
 	if (cryptop_zone != NULL)
@@ -58,6 +58,10 @@ __FBSDID("$FreeBSD: src/sys/opencrypto/cryptodev.c,v 1.34 2007/05/09 19:37:02 gn
 #include <linux/file.h>
 #include <linux/mount.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
 #include <asm/uaccess.h>
 
 #include <cryptodev.h>
@@ -70,6 +74,30 @@ int cryptodev_debug = 0;
 module_param(cryptodev_debug, int, 0644);
 MODULE_PARM_DESC(cryptodev_debug, "Enable cryptodev debug");
 
+/*
+ * Zero-copy sessions (SES_F_ZEROCOPY) only pin the user buffer when it is
+ * big enough for that to beat a copy,  and aligned well enough for the
+ * drivers to use it directly.  Everything else goes through a bounce
+ * buffer as before.
+ */
+static int cryptodev_zc_min = 4096;
+module_param(cryptodev_zc_min, int, 0644);
+MODULE_PARM_DESC(cryptodev_zc_min,
+		"Smallest op that zero-copy sessions run on pinned user pages");
+
+static int cryptodev_zc_align = 4;
+module_param(cryptodev_zc_align, int, 0644);
+MODULE_PARM_DESC(cryptodev_zc_align,
+		"Required alignment (power of 2) of zero-copy user buffers");
+
+static int cryptodev_max_inflight = 256;
+module_param(cryptodev_max_inflight, int, 0644);
+MODULE_PARM_DESC(cryptodev_max_inflight,
+		"Maximum async CIOCCRYPTMULTI ops outstanding per descriptor");
+
+/* enough pages for an unaligned CRYPTO_MAX_DATA_LEN buffer */
+#define CRYPTODEV_ZC_PAGES	((CRYPTO_MAX_DATA_LEN) / PAGE_SIZE + 2)
+
 struct csession_info {
 	u_int16_t	blocksize;
 	u_int16_t	minkey, maxkey;
@@ -83,6 +111,7 @@ struct csession_info {
 
 struct csession {
 	struct list_head	list;
+	struct csession	*hnext;		/* fcrypt cse_hash chain */
 	u_int64_t	sid;
 	u_int32_t	ses;
 
@@ -104,11 +133,54 @@ struct csession {
 	struct iovec	iovec;
 	struct uio	uio;
 	int		error;
+
+	u_int32_t	flags;		/* SES_F_* from session2_op */
+	int		zc_npages;	/* user pages pinned for this op */
+	int		zc_dirty;	/* pages were written to */
+	struct page	*zc_pages[CRYPTODEV_ZC_PAGES];
+	struct iovec	zc_iov[CRYPTODEV_ZC_PAGES + 1];
+	u_char		zc_mac[HASH_MAX_LEN];	/* MAC lands here, not in user pages */
+
+	int		nops;		/* CIOCCRYPTMULTI ops using the session */
+
+	atomic_t	refcnt;		/* the hash table's and each user's */
+	struct rcu_head	rcu;
 };
 
+/*
+ * Session numbers are handed out sequentially per descriptor,  so the low
+ * bits index a hash table with at most one entry per bucket until there
+ * are more than CSE_HASH_SIZE sessions open.  Lookups are done under RCU,
+ * additions and removals under fcr->lock.  A session found by csefind() is
+ * pinned by a reference until the caller's cseput().
+ */
+#define CSE_HASH_SIZE	256
+#define CSE_HASH(ses)	((ses) & (CSE_HASH_SIZE - 1))
+
 struct fcrypt {
 	struct list_head	csessions;
 	int		sesn;
+	struct csession	*cse_hash[CSE_HASH_SIZE];
+
+	spinlock_t	lock;		/* protects the CIOCCRYPTMULTI state below */
+	wait_queue_head_t waitq;	/* woken as each op completes */
+	struct list_head	done;	/* completed async ops waiting for read() */
+	int		inflight;	/* async ops submitted but not yet read */
+	int		pending;	/* async ops the drivers still have */
+};
+
+struct cryptodev_aop {
+	struct list_head	list;
+	struct fcrypt	*fcr;
+	struct csession	*cse;
+	struct cryptop	*crp;
+	struct crypt_op	cop;		/* copy of the caller's op */
+	struct crypt_op	*uop;		/* the op in user space */
+	struct iovec	iovec;
+	struct uio	uio;
+	int		async;
+	int		done;
+	int		error;
 };
 
 static struct csession *csefind(struct fcrypt *, u_int);
@@ -116,13 +188,14 @@ static int csedelete(struct fcrypt *, struct csession *);
 static struct csession *cseadd(struct fcrypt *, struct csession *);
 static struct csession *csecreate(struct fcrypt *, u_int64_t,
 		struct cryptoini *crie, struct cryptoini *cria, struct csession_info *);
-static int csefree(struct csession *);
+static int cseput(struct csession *);
 
 static	int cryptodev_op(struct csession *, struct crypt_op *);
 static	int cryptodev_key(struct crypt_kop *);
 static	int cryptodev_find(struct crypt_find_op *);
 
 static int cryptodev_cb(void *);
+static int cryptodev_multi(struct fcrypt *, struct crypt_mop *);
 static int cryptodev_open(struct inode *inode, struct file *filp);
 
 /*
@@ -162,14 +235,103 @@ checkcrid(int crid)
 	return 0;
 }
 
+/*
+ * Release the user pages pinned by cryptodev_zc_map().
+ */
+static void
+cryptodev_zc_unmap(struct csession *cse)
+{
+	int i;
+
+	for (i = 0; i < cse->zc_npages; i++) {
+		if (cse->zc_dirty) {
+			flush_dcache_page(cse->zc_pages[i]);
+			set_page_dirty_lock(cse->zc_pages[i]);
+		}
+		page_cache_release(cse->zc_pages[i]);
+	}
+	cse->zc_npages = 0;
+	cse->uio.uio_iov = &cse->iovec;
+	cse->uio.uio_iovcnt = 1;
+}
+
+/*
+ * Try to build the session uio directly over the caller's buffer.  The
+ * op is done in place,  so this only works if the result is meant to go
+ * back into src (or nothing is written,  ie. a hash only session).  The
+ * MAC is placed in a trailing kernel iovec as the user buffer has no room
+ * for it.  Returns 0 if the pages are pinned,  non-zero if the caller
+ * should fall back to a bounce buffer.
+ */
 static int
-cryptodev_op(struct csession *cse, struct crypt_op *cop)
+cryptodev_zc_map(struct csession *cse, struct crypt_op *cop)
 {
-	struct cryptop *crp = NULL;
-	struct cryptodesc *crde = NULL, *crda = NULL;
-	int error = 0;
+	unsigned long start = (unsigned long) cop->src;
+	int npages, n, i, off, len, seg;
+	caddr_t base;
+
+	if (cop->len < cryptodev_zc_min ||
+			(start & (cryptodev_zc_align - 1)) != 0)
+		return -1;
+	if (cop->dst != cop->src && (cop->dst != NULL || cse->info.blocksize))
+		return -1;
+
+	off = offset_in_page(start);
+	npages = (off + cop->len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (npages > CRYPTODEV_ZC_PAGES)
+		return -1;
+
+	cse->zc_dirty = (cse->info.blocksize != 0);
+	n = get_user_pages_fast(start & PAGE_MASK, npages, cse->zc_dirty,
+			cse->zc_pages);
+	if (n > 0)
+		cse->zc_npages = n;
+	if (n != npages)
+		goto fallback;
+
+	/* drivers address the buffer through the kernel mapping */
+	for (i = 0; i < npages; i++)
+		if (PageHighMem(cse->zc_pages[i]))
+			goto fallback;
+
+	/* one iovec per run of physically contiguous pages */
+	seg = -1;
+	len = cop->len;
+	for (i = 0; i < npages; i++) {
+		base = (caddr_t) page_address(cse->zc_pages[i]) + off;
+		n = min_t(int, PAGE_SIZE - off, len);
+		if (seg >= 0 && (caddr_t) cse->zc_iov[seg].iov_base +
+				cse->zc_iov[seg].iov_len == base)
+			cse->zc_iov[seg].iov_len += n;
+		else {
+			seg++;
+			cse->zc_iov[seg].iov_base = base;
+			cse->zc_iov[seg].iov_len = n;
+		}
+		len -= n;
+		off = 0;
+	}
+	if (cse->info.authsize) {
+		seg++;
+		cse->zc_iov[seg].iov_base = cse->zc_mac;
+		cse->zc_iov[seg].iov_len = cse->info.authsize;
+	}
 
-	dprintk("%s()\n", __FUNCTION__);
+	cse->uio.uio_iov = cse->zc_iov;
+	cse->uio.uio_iovcnt = seg + 1;
+	return 0;
+
+fallback:
+	dprintk("%s: falling back to bounce buffer (%d/%d pages)\n",
+			__FUNCTION__, n, npages);
+	cse->zc_dirty = 0;
+	cryptodev_zc_unmap(cse);
+	return -1;
+}
+
+static int
+cryptodev_opcheck(struct csession *cse, struct crypt_op *cop)
+{
 	if (cop->len > CRYPTO_MAX_DATA_LEN) {
 		dprintk("%s: %d > %d\n", __FUNCTION__, cop->len, CRYPTO_MAX_DATA_LEN);
 		return (E2BIG);
@@ -180,33 +342,25 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 				cop->len);
 		return (EINVAL);
 	}
+	return (0);
+}
 
-	cse->uio.uio_iov = &cse->iovec;
-	cse->uio.uio_iovcnt = 1;
-	cse->uio.uio_offset = 0;
-#if 0
-	cse->uio.uio_resid = cop->len;
-	cse->uio.uio_segflg = UIO_SYSSPACE;
-	cse->uio.uio_rw = UIO_WRITE;
-	cse->uio.uio_td = td;
-#endif
-	cse->uio.uio_iov[0].iov_len = cop->len;
-	if (cse->info.authsize)
-		cse->uio.uio_iov[0].iov_len += cse->info.authsize;
-	cse->uio.uio_iov[0].iov_base = kmalloc(cse->uio.uio_iov[0].iov_len,
-			GFP_KERNEL);
-
-	if (cse->uio.uio_iov[0].iov_base == NULL) {
-		dprintk("%s: iov_base kmalloc(%d) failed\n", __FUNCTION__,
-				(int)cse->uio.uio_iov[0].iov_len);
-		return (ENOMEM);
-	}
+/*
+ * Build a request for "cop" over "uio",  which must already hold the
+ * data.  The caller fills in the callback and opaque pointer.
+ */
+static int
+cryptodev_prep(struct csession *cse, struct crypt_op *cop, struct uio *uio,
+		struct cryptop **crpp)
+{
+	struct cryptop *crp;
+	struct cryptodesc *crde = NULL, *crda = NULL;
+	int error = 0;
 
 	crp = crypto_getreq((cse->info.blocksize != 0) + (cse->info.authsize != 0));
 	if (crp == NULL) {
 		dprintk("%s: ENOMEM\n", __FUNCTION__);
-		error = ENOMEM;
-		goto bail;
+		return (ENOMEM);
 	}
 
 	if (cse->info.authsize && cse->info.blocksize) {
@@ -227,12 +381,6 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		goto bail;
 	}
 
-	if ((error = copy_from_user(cse->uio.uio_iov[0].iov_base, cop->src,
-					cop->len))) {
-		dprintk("%s: bad copy\n", __FUNCTION__);
-		goto bail;
-	}
-
 	if (crda) {
 		crda->crd_skip = 0;
 		crda->crd_len = cop->len;
@@ -256,13 +404,11 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		crde->crd_klen = cse->keylen * 8;
 	}
 
-	crp->crp_ilen = cse->uio.uio_iov[0].iov_len;
+	crp->crp_ilen = cop->len + cse->info.authsize;
 	crp->crp_flags = CRYPTO_F_IOV | CRYPTO_F_CBIMM
 		       | (cop->flags & COP_F_BATCH);
-	crp->crp_buf = (caddr_t)&cse->uio;
-	crp->crp_callback = (int (*) (struct cryptop *)) cryptodev_cb;
+	crp->crp_buf = (caddr_t)uio;
 	crp->crp_sid = cse->sid;
-	crp->crp_opaque = (void *)cse;
 
 	if (cop->iv) {
 		if (crde == NULL) {
@@ -275,12 +421,11 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 			dprintk("%s arc4 with IV\n", __FUNCTION__);
 			goto bail;
 		}
-		if ((error = copy_from_user(cse->tmp_iv, cop->iv,
+		if ((error = copy_from_user(crde->crd_iv, cop->iv,
 						cse->info.blocksize))) {
 			dprintk("%s bad iv copy\n", __FUNCTION__);
 			goto bail;
 		}
-		memcpy(crde->crd_iv, cse->tmp_iv, cse->info.blocksize);
 		crde->crd_flags |= CRD_F_IV_EXPLICIT | CRD_F_IV_PRESENT;
 		crde->crd_skip = 0;
 	} else if (cse->cipher == CRYPTO_ARC4) { /* XXX use flag? */
@@ -297,6 +442,61 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		goto bail;
 	}
 
+	*crpp = crp;
+	return (0);
+
+bail:
+	crypto_freereq(crp);
+	return (error);
+}
+
+static int
+cryptodev_op(struct csession *cse, struct crypt_op *cop)
+{
+	struct cryptop *crp = NULL;
+	int error = 0;
+
+	dprintk("%s()\n", __FUNCTION__);
+	if ((error = cryptodev_opcheck(cse, cop)))
+		return (error);
+
+	cse->uio.uio_iov = &cse->iovec;
+	cse->uio.uio_iovcnt = 1;
+	cse->uio.uio_offset = 0;
+#if 0
+	cse->uio.uio_resid = cop->len;
+	cse->uio.uio_segflg = UIO_SYSSPACE;
+	cse->uio.uio_rw = UIO_WRITE;
+	cse->uio.uio_td = td;
+#endif
+	cse->uio.uio_iov[0].iov_len = cop->len;
+	if (cse->info.authsize)
+		cse->uio.uio_iov[0].iov_len += cse->info.authsize;
+	cse->uio.uio_iov[0].iov_base = NULL;
+
+	if ((cse->flags & SES_F_ZEROCOPY) == 0 ||
+			cryptodev_zc_map(cse, cop) != 0) {
+		cse->uio.uio_iov[0].iov_base =
+				kmalloc(cse->uio.uio_iov[0].iov_len, GFP_KERNEL);
+		if (cse->uio.uio_iov[0].iov_base == NULL) {
+			dprintk("%s: iov_base kmalloc(%d) failed\n", __FUNCTION__,
+					(int)cse->uio.uio_iov[0].iov_len);
+			return (ENOMEM);
+		}
+	}
+
+	if (cse->zc_npages == 0 &&
+			(error = copy_from_user(cse->uio.uio_iov[0].iov_base, cop->src,
+					cop->len))) {
+		dprintk("%s: bad copy\n", __FUNCTION__);
+		goto bail;
+	}
+
+	if ((error = cryptodev_prep(cse, cop, &cse->uio, &crp)))
+		goto bail;
+	crp->crp_callback = (int (*) (struct cryptop *)) cryptodev_cb;
+	crp->crp_opaque = (void *)cse;
+
 	/*
 	 * Let the dispatch run unlocked, then, interlock against the
 	 * callback before checking if the operation completed and going
@@ -343,6 +543,16 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		goto bail;
 	}
 
+	if (cse->zc_npages) {
+		/* the data is already in place,  only the MAC is ours */
+		if (cop->mac && (error = copy_to_user(cop->mac, cse->zc_mac,
+						cse->info.authsize))) {
+			dprintk("%s bad mac copy\n", __FUNCTION__);
+			goto bail;
+		}
+		goto bail;
+	}
+
 	if (cop->dst && (error = copy_to_user(cop->dst,
 					cse->uio.uio_iov[0].iov_base, cop->len))) {
 		dprintk("%s bad dst copy\n", __FUNCTION__);
@@ -360,7 +570,9 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 bail:
 	if (crp)
 		crypto_freereq(crp);
-	if (cse->uio.uio_iov[0].iov_base)
+	if (cse->zc_npages)
+		cryptodev_zc_unmap(cse);
+	else if (cse->uio.uio_iov[0].iov_base)
 		kfree(cse->uio.uio_iov[0].iov_base);
 
 	return (error);
@@ -393,6 +605,252 @@ cryptodev_cb(void *op)
 	return (0);
 }
 
+/*
+ * Ops submitted through CIOCCRYPTMULTI each carry their own buffer and
+ * request so any number of them can be in flight on one descriptor.
+ * Synchronous batches wait for their own ops,  MOP_F_ASYNC ones are
+ * queued on fcr->done when they complete and handed back by read().
+ * An op keeps the session reference its caller got from csefind(),  an
+ * async one also the fcr->inflight slot cryptodev_multi reserved for it.
+ */
+static struct cryptodev_aop *
+cryptodev_aop_alloc(struct fcrypt *fcr, struct csession *cse,
+		struct crypt_op *cop, struct crypt_op *uop, int async)
+{
+	struct cryptodev_aop *aop;
+	unsigned long flags;
+
+	aop = (struct cryptodev_aop *) kmalloc(sizeof(*aop), GFP_KERNEL);
+	if (aop == NULL)
+		return (NULL);
+	memset(aop, 0, sizeof(*aop));
+
+	INIT_LIST_HEAD(&aop->list);
+	aop->fcr = fcr;
+	aop->cse = cse;
+	aop->cop = *cop;
+	aop->uop = uop;
+	aop->async = async;
+	aop->uio.uio_iov = &aop->iovec;
+	aop->uio.uio_iovcnt = 1;
+
+	spin_lock_irqsave(&fcr->lock, flags);
+	cse->nops++;
+	if (async)
+		fcr->pending++;
+	spin_unlock_irqrestore(&fcr->lock, flags);
+	return (aop);
+}
+
+static void
+cryptodev_aop_free(struct cryptodev_aop *aop)
+{
+	struct fcrypt *fcr = aop->fcr;
+	unsigned long flags;
+
+	if (aop->crp)
+		crypto_freereq(aop->crp);
+	if (aop->iovec.iov_base)
+		kfree(aop->iovec.iov_base);
+
+	spin_lock_irqsave(&fcr->lock, flags);
+	aop->cse->nops--;
+	if (aop->async)
+		fcr->inflight--;
+	spin_unlock_irqrestore(&fcr->lock, flags);
+	cseput(aop->cse);
+	kfree(aop);
+}
+
+/*
+ * Mark an op finished and,  for async ops,  make it visible to read().
+ */
+static void
+cryptodev_aop_done(struct cryptodev_aop *aop, int error)
+{
+	struct fcrypt *fcr = aop->fcr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fcr->lock, flags);
+	aop->error = error;
+	aop->done = 1;
+	if (aop->async) {
+		list_add_tail(&aop->list, &fcr->done);
+		fcr->pending--;
+	}
+	/* under the lock,  cryptodev_release may free fcr once we drop it */
+	wake_up_interruptible(&fcr->waitq);
+	spin_unlock_irqrestore(&fcr->lock, flags);
+}
+
+static int
+cryptodev_acb(void *op)
+{
+	struct cryptop *crp = (struct cryptop *) op;
+	struct cryptodev_aop *aop = (struct cryptodev_aop *) crp->crp_opaque;
+
+	dprintk("%s()\n", __FUNCTION__);
+	if (crp->crp_etype == EAGAIN) {
+		crp->crp_flags &= ~CRYPTO_F_DONE;
+		return crypto_dispatch(crp);
+	}
+	if (crp->crp_etype != 0 || (crp->crp_flags & CRYPTO_F_DONE))
+		cryptodev_aop_done(aop, crp->crp_etype);
+	return (0);
+}
+
+/*
+ * Copy in and dispatch one op.  Any failure is reported as the result of
+ * the op,  so every op submitted gets exactly one completion.
+ */
+static void
+cryptodev_aop_start(struct cryptodev_aop *aop)
+{
+	struct csession *cse = aop->cse;
+	struct crypt_op *cop = &aop->cop;
+	int error;
+
+	if ((error = cryptodev_opcheck(cse, cop)))
+		goto bail;
+
+	aop->iovec.iov_len = cop->len + cse->info.authsize;
+	aop->iovec.iov_base = kmalloc(aop->iovec.iov_len, GFP_KERNEL);
+	if (aop->iovec.iov_base == NULL) {
+		error = ENOMEM;
+		goto bail;
+	}
+	if (copy_from_user(aop->iovec.iov_base, cop->src, cop->len)) {
+		dprintk("%s: bad copy\n", __FUNCTION__);
+		error = EFAULT;
+		goto bail;
+	}
+
+	cop->flags |= COP_F_BATCH;
+	if ((error = cryptodev_prep(cse, cop, &aop->uio, &aop->crp)))
+		goto bail;
+	aop->crp->crp_callback = (int (*) (struct cryptop *)) cryptodev_acb;
+	aop->crp->crp_opaque = (void *)aop;
+
+	if ((error = crypto_dispatch(aop->crp)) == 0)
+		return;
+	dprintk("%s error in crypto_dispatch\n", __FUNCTION__);
+bail:
+	cryptodev_aop_done(aop, error);
+}
+
+/*
+ * Hand the results of a finished op back to the user and free it.
+ */
+static int
+cryptodev_aop_finish(struct cryptodev_aop *aop)
+{
+	struct crypt_op *cop = &aop->cop;
+	int error = aop->error;
+
+	if (error == 0 && cop->dst &&
+			copy_to_user(cop->dst, aop->iovec.iov_base, cop->len)) {
+		dprintk("%s bad dst copy\n", __FUNCTION__);
+		error = EFAULT;
+	}
+	if (error == 0 && cop->mac &&
+			copy_to_user(cop->mac,
+				(caddr_t)aop->iovec.iov_base + cop->len,
+				aop->cse->info.authsize)) {
+		dprintk("%s bad mac copy\n", __FUNCTION__);
+		error = EFAULT;
+	}
+	cryptodev_aop_free(aop);
+	return (error);
+}
+
+static int
+cryptodev_multi(struct fcrypt *fcr, struct crypt_mop *mop)
+{
+	struct cryptodev_aop **aops = NULL;
+	struct csession *cse;
+	struct crypt_op cop;
+	unsigned long flags;
+	int async = (mop->mop_flags & MOP_F_ASYNC) != 0;
+	int i, n, error = 0, ret = 0;
+
+	dprintk("%s(count=%u flags=%x)\n", __FUNCTION__, mop->mop_count,
+			mop->mop_flags);
+	if (mop->mop_count == 0 || mop->mop_count > CRYPTO_MOP_MAX)
+		return (EINVAL);
+	if (!async && mop->mop_errors == NULL)
+		return (EINVAL);
+
+	if (async) {
+		/* reserve the slots up front,  so racing batches cannot overshoot */
+		spin_lock_irqsave(&fcr->lock, flags);
+		if (fcr->inflight + mop->mop_count > cryptodev_max_inflight)
+			error = EBUSY;
+		else
+			fcr->inflight += mop->mop_count;
+		spin_unlock_irqrestore(&fcr->lock, flags);
+		if (error)
+			return (error);
+	} else {
+		aops = kmalloc(mop->mop_count * sizeof(*aops), GFP_KERNEL);
+		if (aops == NULL)
+			return (ENOMEM);
+		memset(aops, 0, mop->mop_count * sizeof(*aops));
+	}
+
+	for (n = 0; n < mop->mop_count; n++) {
+		struct cryptodev_aop *aop;
+
+		if (copy_from_user(&cop, &mop->mop_ops[n], sizeof(cop))) {
+			error = EFAULT;
+			break;
+		}
+		cse = csefind(fcr, cop.ses);
+		if (cse == NULL) {
+			error = EINVAL;
+			break;
+		}
+		aop = cryptodev_aop_alloc(fcr, cse, &cop, &mop->mop_ops[n], async);
+		if (aop == NULL) {
+			cseput(cse);
+			error = ENOMEM;
+			break;
+		}
+		if (aops)
+			aops[n] = aop;
+		cryptodev_aop_start(aop);
+	}
+	dprintk("%s submitted %d/%u error=%d\n", __FUNCTION__, n,
+			mop->mop_count, error);
+
+	if (async) {
+		/* give back the slots of the ops that never made it in */
+		if (n < mop->mop_count) {
+			spin_lock_irqsave(&fcr->lock, flags);
+			fcr->inflight -= mop->mop_count - n;
+			wake_up_interruptible(&fcr->waitq);
+			spin_unlock_irqrestore(&fcr->lock, flags);
+		}
+		/* tell the caller how many made it in,  they will be read() */
+		mop->mop_count = n;
+		return (n ? 0 : error);
+	}
+
+	for (i = 0; i < mop->mop_count; i++) {
+		int err = error;
+
+		if (i < n) {
+			/* same reasoning as in cryptodev_op,  we cannot bail out */
+			while (wait_event_interruptible(fcr->waitq, aops[i]->done))
+				schedule();
+			err = cryptodev_aop_finish(aops[i]);
+		}
+		if (put_user(err, &mop->mop_errors[i]))
+			ret = EFAULT;
+	}
+	kfree(aops);
+	return (ret);
+}
+
 static int
 cryptodevkey_cb(void *op)
 {
@@ -545,33 +1003,56 @@ csefind(struct fcrypt *fcr, u_int ses)
 	struct csession *cse;
 
 	dprintk("%s()\n", __FUNCTION__);
-	list_for_each_entry(cse, &fcr->csessions, list)
-		if (cse->ses == ses)
-			return (cse);
-	return (NULL);
+	rcu_read_lock();
+	for (cse = rcu_dereference(fcr->cse_hash[CSE_HASH(ses)]); cse;
+			cse = rcu_dereference(cse->hnext))
+		/* a session on its way out has no references left */
+		if (cse->ses == ses && atomic_inc_not_zero(&cse->refcnt))
+			break;
+	rcu_read_unlock();
+	return (cse);
 }
 
+/*
+ * Unhook a session.  Once this returns 1 no new lookup can find it,  and
+ * the caller owns the reference the hash table held.
+ */
 static int
 csedelete(struct fcrypt *fcr, struct csession *cse_del)
 {
-	struct csession *cse;
+	struct csession **pp;
+	unsigned long flags;
+	int found = 0;
 
 	dprintk("%s()\n", __FUNCTION__);
-	list_for_each_entry(cse, &fcr->csessions, list) {
-		if (cse == cse_del) {
-			list_del(&cse->list);
-			return (1);
+	spin_lock_irqsave(&fcr->lock, flags);
+	for (pp = &fcr->cse_hash[CSE_HASH(cse_del->ses)]; *pp; pp = &(*pp)->hnext) {
+		if (*pp == cse_del) {
+			rcu_assign_pointer(*pp, cse_del->hnext);
+			list_del(&cse_del->list);
+			found = 1;
+			break;
 		}
 	}
-	return (0);
+	spin_unlock_irqrestore(&fcr->lock, flags);
+	return (found);
 }
 	
 static struct csession *
 cseadd(struct fcrypt *fcr, struct csession *cse)
 {
+	struct csession **head;
+	unsigned long flags;
+
 	dprintk("%s()\n", __FUNCTION__);
+	spin_lock_irqsave(&fcr->lock, flags);
 	list_add_tail(&cse->list, &fcr->csessions);
 	cse->ses = fcr->sesn++;
+	atomic_set(&cse->refcnt, 1);
+	head = &fcr->cse_hash[CSE_HASH(cse->ses)];
+	cse->hnext = *head;
+	rcu_assign_pointer(*head, cse);
+	spin_unlock_irqrestore(&fcr->lock, flags);
 	return (cse);
 }
 
@@ -602,18 +1083,32 @@ csecreate(struct fcrypt *fcr, u_int64_t sid, struct cryptoini *crie,
 	return (cse);
 }
 
-static int
-csefree(struct csession *cse)
+static void
+csefree_rcu(struct rcu_head *head)
 {
-	int error;
+	struct csession *cse = container_of(head, struct csession, rcu);
 
-	dprintk("%s()\n", __FUNCTION__);
-	error = crypto_freesession(cse->sid);
 	if (cse->key)
 		kfree(cse->key);
 	if (cse->mackey)
 		kfree(cse->mackey);
 	kfree(cse);
+}
+
+/*
+ * Drop a reference.  The last one frees the driver session,  the memory
+ * goes after a grace period as csefind() may still be looking at it.
+ */
+static int
+cseput(struct csession *cse)
+{
+	int error;
+
+	if (!atomic_dec_and_test(&cse->refcnt))
+		return (0);
+	dprintk("%s()\n", __FUNCTION__);
+	error = crypto_freesession(cse->sid);
+	call_rcu(&cse->rcu, csefree_rcu);
 	return(error);
 }
 
@@ -632,6 +1127,8 @@ cryptodev_ioctl(
 	struct crypt_op cop;
 	struct crypt_kop kop;
 	struct crypt_find_op fop;
+	struct crypt_mop mop;
+	unsigned long flags;
 	u_int64_t sid;
 	u_int32_t ses = 0;
 	int feat, fd, error = 0, crid;
@@ -849,6 +1346,7 @@ cryptodev_ioctl(
 			goto bail;
 		}
 		sop.ses = cse->ses;
+		cse->flags = sop.flags;
 
 		if (cmd == CIOCGSESSION2) {
 			/* return hardware/driver id */
@@ -878,8 +1376,23 @@ bail:
 			dprintk("%s(CIOCFSESSION) - Fail %d\n", __FUNCTION__, error);
 			break;
 		}
-		csedelete(fcr, cse);
-		error = csefree(cse);
+		spin_lock_irqsave(&fcr->lock, flags);
+		if (cse->nops)
+			error = EBUSY;
+		spin_unlock_irqrestore(&fcr->lock, flags);
+		if (error) {
+			dprintk("%s(CIOCFSESSION) - %d ops outstanding\n", __FUNCTION__,
+					cse->nops);
+			cseput(cse);
+			break;
+		}
+		if (!csedelete(fcr, cse)) {
+			cseput(cse);
+			error = EINVAL;
+			break;
+		}
+		cseput(cse);
+		error = cseput(cse);
 		break;
 	case CIOCCRYPT:
 		dprintk("%s(CIOCCRYPT)\n", __FUNCTION__);
@@ -895,12 +1408,26 @@ bail:
 			break;
 		}
 		error = cryptodev_op(cse, &cop);
+		cseput(cse);
 		if(copy_to_user((void*)arg, &cop, sizeof(cop))) {
 			dprintk("%s(CIOCCRYPT) - bad return copy\n", __FUNCTION__);
 			error = EFAULT;
 			goto bail;
 		}
 		break;
+	case CIOCCRYPTMULTI:
+		dprintk("%s(CIOCCRYPTMULTI)\n", __FUNCTION__);
+		if (copy_from_user(&mop, (void*)arg, sizeof(mop))) {
+			dprintk("%s(CIOCCRYPTMULTI) - bad copy\n", __FUNCTION__);
+			error = EFAULT;
+			break;
+		}
+		error = cryptodev_multi(fcr, &mop);
+		if (copy_to_user((void*)arg, &mop, sizeof(mop))) {
+			dprintk("%s(CIOCCRYPTMULTI) - bad return copy\n", __FUNCTION__);
+			error = EFAULT;
+		}
+		break;
 	case CIOCKEY:
 	case CIOCKEY2:
 		dprintk("%s(CIOCKEY)\n", __FUNCTION__);
@@ -960,6 +1487,71 @@ bail:
 	return(-error);
 }
 
+/*
+ * Reap completed MOP_F_ASYNC ops,  one struct crypt_result each.  The
+ * results are copied out here rather than in the callback as only now are
+ * we running in the context of the process that owns the buffers.
+ */
+static ssize_t
+cryptodev_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct fcrypt *fcr = filp->private_data;
+	struct cryptodev_aop *aop;
+	struct crypt_result res;
+	unsigned long flags;
+	ssize_t n = 0;
+	int error;
+
+	dprintk("%s(%zu)\n", __FUNCTION__, count);
+	if (count < sizeof(res))
+		return(-EINVAL);
+
+	while (n + sizeof(res) <= count) {
+		spin_lock_irqsave(&fcr->lock, flags);
+		if (list_empty(&fcr->done)) {
+			error = fcr->inflight;
+			spin_unlock_irqrestore(&fcr->lock, flags);
+			if (n || error == 0)
+				break;
+			if (filp->f_flags & O_NONBLOCK)
+				return(-EAGAIN);
+			/* slots of a batch that stopped early go back unused */
+			if (wait_event_interruptible(fcr->waitq,
+					!list_empty(&fcr->done) ||
+					fcr->inflight == 0))
+				return(-ERESTARTSYS);
+			continue;
+		}
+		aop = list_entry(fcr->done.next, struct cryptodev_aop, list);
+		list_del(&aop->list);
+		spin_unlock_irqrestore(&fcr->lock, flags);
+
+		res.cr_op = (caddr_t) aop->uop;
+		res.cr_error = cryptodev_aop_finish(aop);
+		if (copy_to_user(buf + n, &res, sizeof(res)))
+			return(n ? n : -EFAULT);
+		n += sizeof(res);
+	}
+	return(n);
+}
+
+static unsigned int
+cryptodev_poll(struct file *filp, poll_table *wait)
+{
+	struct fcrypt *fcr = filp->private_data;
+	unsigned long flags;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &fcr->waitq, wait);
+	spin_lock_irqsave(&fcr->lock, flags);
+	if (!list_empty(&fcr->done))
+		mask |= POLLIN | POLLRDNORM;
+	if (fcr->inflight < cryptodev_max_inflight)
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock_irqrestore(&fcr->lock, flags);
+	return(mask);
+}
+
 #ifdef HAVE_UNLOCKED_IOCTL
 static long
 cryptodev_unlocked_ioctl(
@@ -996,6 +1588,9 @@ cryptodev_open(struct inode *inode, struct file *filp)
 	memset(fcr, 0, sizeof(*fcr));
 
 	INIT_LIST_HEAD(&fcr->csessions);
+	spin_lock_init(&fcr->lock);
+	init_waitqueue_head(&fcr->waitq);
+	INIT_LIST_HEAD(&fcr->done);
 	filp->private_data = fcr;
 	return(0);
 }
@@ -1005,6 +1600,8 @@ cryptodev_release(struct inode *inode, struct file *filp)
 {
 	struct fcrypt *fcr = filp->private_data;
 	struct csession *cse, *tmp;
+	struct cryptodev_aop *aop, *atmp;
+	unsigned long flags;
 
 	dprintk("%s()\n", __FUNCTION__);
 	if (!filp) {
@@ -1012,9 +1609,18 @@ cryptodev_release(struct inode *inode, struct file *filp)
 		return(0);
 	}
 
+	/* the drivers must be done with our async ops before they go */
+	wait_event(fcr->waitq, fcr->pending == 0);
+	spin_lock_irqsave(&fcr->lock, flags);
+	spin_unlock_irqrestore(&fcr->lock, flags);
+	list_for_each_entry_safe(aop, atmp, &fcr->done, list) {
+		list_del(&aop->list);
+		cryptodev_aop_free(aop);
+	}
+
 	list_for_each_entry_safe(cse, tmp, &fcr->csessions, list) {
 		list_del(&cse->list);
-		(void)csefree(cse);
+		(void)cseput(cse);
 	}
 	filp->private_data = NULL;
 	kfree(fcr);
@@ -1025,6 +1631,8 @@ static struct file_operations cryptodev_fops = {
 	.owner = THIS_MODULE,
 	.open = cryptodev_open,
 	.release = cryptodev_release,
+	.read = cryptodev_read,
+	.poll = cryptodev_poll,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
 	.ioctl = cryptodev_ioctl,
 #endif
@@ -1059,6 +1667,7 @@ cryptodev_exit(void)
 {
 	dprintk("%s()\n", __FUNCTION__);
 	misc_deregister(&cryptodev);
+	rcu_barrier();		/* sessions still waiting to be freed */
 }
 
 module_init(cryptodev_init);
@@ -199,7 +199,9 @@ struct session2_op {
 
   	u_int32_t	ses;		/* returns: session # */ 
 	int		crid;		/* driver id + flags (rw) */
-	int		pad[4];		/* for future expansion */
+	u_int32_t	flags;		/* session flags */
+#define SES_F_ZEROCOPY	0x0001		/* operate directly on user pages */
+	int		pad[3];		/* for future expansion */
 };
 
 struct crypt_op {
@@ -216,6 +218,29 @@ struct crypt_op {
 	caddr_t		iv;
 };
 
+/*
+ * Submit several ops with one CIOCCRYPTMULTI.  Without MOP_F_ASYNC the
+ * call returns once all of them are done,  with each op's errno in
+ * mop_errors.  With MOP_F_ASYNC it returns as soon as the ops are queued
+ * (mop_count is updated to the number accepted) and the results are
+ * collected as struct crypt_result's with read() on the descriptor,
+ * which poll()s readable while any are waiting.  The ops and their
+ * buffers must stay valid until then.
+ */
+struct crypt_mop {
+	u_int32_t	mop_count;	/* number of ops,  CRYPTO_MOP_MAX max */
+	u_int32_t	mop_flags;
+#define	MOP_F_ASYNC	0x0001		/* complete through read()/poll() */
+	struct crypt_op	*mop_ops;
+	int		*mop_errors;	/* per op errno (sync only) */
+};
+#define	CRYPTO_MOP_MAX	64
+
+struct crypt_result {
+	caddr_t		cr_op;		/* the op,  as passed in mop_ops */
+	int		cr_error;	/* its errno,  0 on success */
+};
+
 /*
  * Parameters for looking up a crypto driver/device by
  * device name or by id.  The latter are returned for
@@ -273,6 +298,7 @@ struct crypt_kop {
 #define CIOCGSESSION2	_IOWR('c', 106, struct session2_op)
 #define CIOCKEY2	_IOWR('c', 107, struct crypt_kop)
 #define CIOCFINDDEV	_IOWR('c', 108, struct crypt_find_op)
+#define CIOCCRYPTMULTI	_IOWR('c', 109, struct crypt_mop)
 
 struct cryptotstat {
 	struct timespec	acc;		/* total accumulated time */
@@ -376,6 +402,9 @@ struct cryptop {
 	struct cryptodesc *crp_desc;	/* Linked list of processing descriptors */
 
 	int (*crp_callback)(struct cryptop *); /* Callback function */
+
+	u_int64_t	crp_tstamp;	/* start of the current stage (ns),
+					 * only kept with crypto_timing */
 };
 
 #define CRYPTO_BUF_CONTIG	0x0
@@ -0,0 +1,142 @@
+/*
+ * Multi-buffer SHA1/SHA256 compression functions for cryptosoft,  one
+ * lane per vector element,  written with the GCC vector extensions.
+ *
+ * cryptosoft.c includes this once for each instruction set,  with
+ *
+ *	SWCR_VEC_NAME(x)	the name of function x for this instruction set
+ *	SWCR_VEC_TARGET		the target attribute its functions are built with
+ *	SWCR_VEC_LANES		u32 elements per vector
+ *
+ * defined.  The functions take the same arguments as the portable ones
+ * and handle up to SWCR_VEC_LANES lanes,  the unused ones hash lane 0
+ * again and are thrown away.  They must only be called between
+ * kernel_fpu_begin() and kernel_fpu_end().
+ */
+
+typedef u32 SWCR_VEC_NAME(swcr_vec)
+		__attribute__((vector_size(SWCR_VEC_LANES * 4)));
+#define SWCR_VEC SWCR_VEC_NAME(swcr_vec)
+
+#define SWCR_VROL(x, r)	(((x) << (r)) | ((x) >> (32 - (r))))
+#define SWCR_VROR(x, r)	(((x) >> (r)) | ((x) << (32 - (r))))
+
+/* the first "words" words of each lane's state,  word by word */
+#define SWCR_VEC_GET(v, words) \
+	for (i = 0; i < (words); i++) \
+		for (l = 0; l < SWCR_VEC_LANES; l++) \
+			(v)[i][l] = st[l < n ? l : 0][i];
+
+/* the 16 message words of each lane's block */
+#define SWCR_VEC_MSG(w) \
+	for (i = 0; i < 16; i++) \
+		for (l = 0; l < SWCR_VEC_LANES; l++) \
+			(w)[i][l] = get_unaligned_be32(blk[l < n ? l : 0] + 4 * i);
+
+#define SWCR_VEC_ADD(v, words) \
+	for (i = 0; i < (words); i++) \
+		for (l = 0; l < n; l++) \
+			st[l][i] += (v)[i][l];
+
+#define SWCR_VEC_F1(b, c, d)	((d) ^ ((b) & ((c) ^ (d))))
+#define SWCR_VEC_F2(b, c, d)	((b) ^ (c) ^ (d))
+#define SWCR_VEC_F3(b, c, d)	(((b) & (c)) | ((d) & ((b) | (c))))
+
+#define SWCR_VEC_R1(a, b, c, d, e, f, k) do { \
+	if (i >= 16) \
+		w[i & 15] = SWCR_VROL(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ \
+				w[(i + 2) & 15] ^ w[i & 15], 1); \
+	e += SWCR_VROL(a, 5) + f(b, c, d) + (u32) (k) + w[i & 15]; \
+	b = SWCR_VROL(b, 30); \
+	i++; \
+} while (0)
+
+/* five rounds,  the variables back where they started */
+#define SWCR_VEC_R5(f, k) do { \
+	SWCR_VEC_R1(a, b, c, d, e, f, k); \
+	SWCR_VEC_R1(e, a, b, c, d, f, k); \
+	SWCR_VEC_R1(d, e, a, b, c, f, k); \
+	SWCR_VEC_R1(c, d, e, a, b, f, k); \
+	SWCR_VEC_R1(b, c, d, e, a, f, k); \
+} while (0)
+
+static SWCR_VEC_TARGET void
+SWCR_VEC_NAME(swcr_sha1)(u32 **st, const u8 **blk, int n)
+{
+	SWCR_VEC w[16], v[5], a, b, c, d, e;
+	int i, l;
+
+	SWCR_VEC_MSG(w);
+	SWCR_VEC_GET(v, 5);
+	a = v[0]; b = v[1]; c = v[2]; d = v[3]; e = v[4];
+
+	i = 0;
+	while (i < 20)
+		SWCR_VEC_R5(SWCR_VEC_F1, 0x5a827999);
+	while (i < 40)
+		SWCR_VEC_R5(SWCR_VEC_F2, 0x6ed9eba1);
+	while (i < 60)
+		SWCR_VEC_R5(SWCR_VEC_F3, 0x8f1bbcdc);
+	while (i < 80)
+		SWCR_VEC_R5(SWCR_VEC_F2, 0xca62c1d6);
+
+	v[0] = a; v[1] = b; v[2] = c; v[3] = d; v[4] = e;
+	SWCR_VEC_ADD(v, 5);
+}
+
+#define SWCR_VEC_R256(a, b, c, d, e, f, g, h) do { \
+	if (i >= 16) { \
+		s0 = w[(i + 1) & 15]; \
+		s1 = w[(i + 14) & 15]; \
+		w[i & 15] += (SWCR_VROR(s0, 7) ^ SWCR_VROR(s0, 18) ^ (s0 >> 3)) + \
+			w[(i + 9) & 15] + \
+			(SWCR_VROR(s1, 17) ^ SWCR_VROR(s1, 19) ^ (s1 >> 10)); \
+	} \
+	t1 = h + (SWCR_VROR(e, 6) ^ SWCR_VROR(e, 11) ^ SWCR_VROR(e, 25)) + \
+		(g ^ (e & (f ^ g))) + swcr_sha256_k[i] + w[i & 15]; \
+	t2 = (SWCR_VROR(a, 2) ^ SWCR_VROR(a, 13) ^ SWCR_VROR(a, 22)) + \
+		((a & b) | (c & (a | b))); \
+	d += t1; \
+	h = t1 + t2; \
+	i++; \
+} while (0)
+
+static SWCR_VEC_TARGET void
+SWCR_VEC_NAME(swcr_sha256)(u32 **st, const u8 **blk, int n)
+{
+	SWCR_VEC w[16], v[8], a, b, c, d, e, f, g, h, t1, t2, s0, s1;
+	int i, l;
+
+	SWCR_VEC_MSG(w);
+	SWCR_VEC_GET(v, 8);
+	a = v[0]; b = v[1]; c = v[2]; d = v[3];
+	e = v[4]; f = v[5]; g = v[6]; h = v[7];
+
+	for (i = 0; i < 64; ) {
+		SWCR_VEC_R256(a, b, c, d, e, f, g, h);
+		SWCR_VEC_R256(h, a, b, c, d, e, f, g);
+		SWCR_VEC_R256(g, h, a, b, c, d, e, f);
+		SWCR_VEC_R256(f, g, h, a, b, c, d, e);
+		SWCR_VEC_R256(e, f, g, h, a, b, c, d);
+		SWCR_VEC_R256(d, e, f, g, h, a, b, c);
+		SWCR_VEC_R256(c, d, e, f, g, h, a, b);
+		SWCR_VEC_R256(b, c, d, e, f, g, h, a);
+	}
+
+	v[0] = a; v[1] = b; v[2] = c; v[3] = d;
+	v[4] = e; v[5] = f; v[6] = g; v[7] = h;
+	SWCR_VEC_ADD(v, 8);
+}
+
+#undef SWCR_VEC_R256
+#undef SWCR_VEC_R5
+#undef SWCR_VEC_R1
+#undef SWCR_VEC_F3
+#undef SWCR_VEC_F2
+#undef SWCR_VEC_F1
+#undef SWCR_VEC_ADD
+#undef SWCR_VEC_MSG
+#undef SWCR_VEC_GET
+#undef SWCR_VROR
+#undef SWCR_VROL
+#undef SWCR_VEC
@@ -50,12 +50,23 @@
 #include <linux/random.h>
 #include <linux/interrupt.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/bitops.h>
+#include <asm/unaligned.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,10)
 #include <linux/scatterlist.h>
 #endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
 #include <crypto/hash.h>
 #endif
+/* SIMD multi-buffer HMACs,  built with GCC's per-function target attribute */
+#if defined(CONFIG_X86_64) && LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0) && \
+		(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SWCR_MB_SIMD	1
+#include <asm/i387.h>
+#include <asm/xcr.h>
+#include <asm/xsave.h>
+#endif
 
 #include <cryptodev.h>
 #include <uio.h>
@@ -85,10 +96,12 @@ struct {
 #define SW_TYPE_AHASH		(SW_TYPE_HASH | SW_TYPE_ASYNC)
 #define SW_TYPE_AHMAC		(SW_TYPE_HMAC | SW_TYPE_ASYNC)
 
-#define SCATTERLIST_MAX 16
+#define SCATTERLIST_MAX 20	/* a pinned 64K user buffer + MAC */
 
 struct swcr_data {
-	struct work_struct  workq;
+	struct work_struct  workq;		/* session teardown,  head only */
+	struct rcu_head		sw_rcu;
+	atomic_t			sw_refcnt;		/* the table's and each request's */
 	int					sw_type;
 	int					sw_alg;
 	struct crypto_tfm	*sw_tfm;
@@ -102,6 +115,23 @@ struct swcr_data {
 		void *sw_comp_buf;
 	} u;
 	struct swcr_data	*sw_next;
+	const struct swcr_mb_alg *sw_mb;	/* multi-buffer HMAC,  if possible */
+	u32					sw_mb_ist[8];	/* HMAC inner/outer states */
+	u32					sw_mb_ost[8];
+};
+
+/* one multi-buffer HMAC in progress */
+struct swcr_mb_lane {
+	struct scatterlist	*ml_sg;		/* next segment */
+	int			ml_nsg;		/* segments left after the current one */
+	const u8	*ml_p;		/* position in current segment */
+	unsigned int	ml_seg;		/* bytes left in current segment */
+	unsigned int	ml_left;	/* data bytes left */
+	u64			ml_bits;	/* total message length */
+	int			ml_npad;	/* padding blocks,  -1 until built */
+	int			ml_pad;		/* padding blocks handed out */
+	u32			ml_st[8];
+	u8			ml_blk[128];
 };
 
 struct swcr_req {
@@ -113,6 +143,10 @@ struct swcr_req {
 	unsigned char		 iv[EALG_MAX_BLOCK_LEN];
 	char				 result[HASH_MAX_LEN];
 	void				*crypto_req;
+	int					 hint;		/* CRYPTO_HINT_* we were given */
+	int					 mb_nsg;	/* waiting in a swcr_mb_batch */
+	int					 mb_len;
+	struct swcr_mb_lane	 mb_lane;
 };
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
@@ -258,13 +292,47 @@ module_param(swcr_no_ahash, int, 0644);
 MODULE_PARM_DESC(swcr_no_ahash,
                 "Do not use async hash/hmac even if available");
 
+int swcr_mb = 1;
+module_param(swcr_mb, int, 0644);
+MODULE_PARM_DESC(swcr_mb,
+                "Batch HMAC-SHA1/SHA256 requests through the multi-buffer engine");
+
+#ifdef SWCR_MB_SIMD
+int swcr_mb_simd = 2;
+module_param(swcr_mb_simd, int, 0444);
+MODULE_PARM_DESC(swcr_mb_simd,
+                "Widest vectors the multi-buffer engine may use (0 none, 1 SSE2, 2 AVX2)");
+#endif
+
 int swcr_no_ablk = 0;
 module_param(swcr_no_ablk, int, 0644);
 MODULE_PARM_DESC(swcr_no_ablk,
                 "Do not use async blk ciphers even if available");
 
-static struct swcr_data **swcr_sessions = NULL;
-static u_int32_t swcr_sesnum = 0;
+/*
+ * Sessions live in fixed size chunks hung off a directory,  so a lookup
+ * is two loads and the table never has to be copied to grow.  Chunks are
+ * never freed before module exit,  which lets swcr_process() look up a
+ * session under rcu_read_lock() alone.  Each request pins the session it
+ * found with a reference on the head of its swcr_data chain,  and the
+ * chain is torn down after the last one is dropped and a grace period
+ * has passed.  Free lids are kept on a list threaded through sc_free so
+ * newsession doesn't scan for a slot.
+ */
+#define SWCR_SES_CHUNK		256
+#define SWCR_SES_CHUNKS		1024
+#define SWCR_SES_MAX		(SWCR_SES_CHUNK * SWCR_SES_CHUNKS)
+#define SWCR_SES_INUSE		0xffffffff
+
+struct swcr_ses_chunk {
+	struct swcr_data	*sc_ses[SWCR_SES_CHUNK];
+	u_int32_t			 sc_free[SWCR_SES_CHUNK];	/* next free lid */
+};
+
+static struct swcr_ses_chunk *swcr_ses_dir[SWCR_SES_CHUNKS];
+static u_int32_t swcr_sesnum = 0;		/* lids backed by a chunk */
+static u_int32_t swcr_ses_free = 0;		/* free list head,  0 is empty */
+static DEFINE_SPINLOCK(swcr_ses_lock);
 
 static	int swcr_process(device_t, struct cryptop *, int);
 static	int swcr_newsession(device_t, u_int32_t *, struct cryptoini *);
@@ -332,6 +400,490 @@ execute_later(void (fn)(void *), void *arg)
 	}
 }
 
+static inline struct swcr_ses_chunk *
+swcr_ses_chunk(u_int32_t lid)
+{
+	if (lid == 0 || lid >= SWCR_SES_MAX)
+		return NULL;
+	return rcu_dereference(swcr_ses_dir[lid / SWCR_SES_CHUNK]);
+}
+
+/*
+ * Reserve a lid,  adding a chunk if none are free.  We leave lid 0 unused.
+ */
+static u_int32_t
+swcr_ses_alloc(void)
+{
+	struct swcr_ses_chunk *c;
+	unsigned long flags;
+	u_int32_t lid, i;
+
+	spin_lock_irqsave(&swcr_ses_lock, flags);
+	if (swcr_ses_free == 0 && swcr_sesnum < SWCR_SES_MAX) {
+		c = (struct swcr_ses_chunk *) kmalloc(sizeof(*c), SLAB_ATOMIC);
+		if (c) {
+			memset(c, 0, sizeof(*c));
+			for (i = SWCR_SES_CHUNK - 1; i > 0; i--) {
+				c->sc_free[i] = swcr_ses_free;
+				swcr_ses_free = swcr_sesnum + i;
+			}
+			if (swcr_sesnum) {
+				c->sc_free[0] = swcr_ses_free;
+				swcr_ses_free = swcr_sesnum;
+			}
+			rcu_assign_pointer(swcr_ses_dir[swcr_sesnum / SWCR_SES_CHUNK], c);
+			swcr_sesnum += SWCR_SES_CHUNK;
+		}
+	}
+	lid = swcr_ses_free;
+	if (lid) {
+		c = swcr_ses_dir[lid / SWCR_SES_CHUNK];
+		swcr_ses_free = c->sc_free[lid % SWCR_SES_CHUNK];
+		c->sc_free[lid % SWCR_SES_CHUNK] = SWCR_SES_INUSE;
+	}
+	spin_unlock_irqrestore(&swcr_ses_lock, flags);
+	return lid;
+}
+
+/*
+ * Multi-buffer HMAC-SHA1/SHA256.
+ *
+ * Small packets spend most of their time in the hash compression
+ * function,  one block at a time,  with every round depending on the one
+ * before.  When the OCF core tells us more requests are coming
+ * (CRYPTO_HINT_MORE) we hold HMAC requests back until we have up to
+ * SWCR_MB_LANES of them and then run their compression functions side by
+ * side,  round by round,  so the CPU always has independent work to issue.
+ * On x86_64 the lanes go in SSE2 or AVX2 vectors,  four or eight to a
+ * vector,  when the FPU can be had (not from every interrupt context),
+ * otherwise in portable C.
+ * The ipad/opad states are computed once per session,  which also saves
+ * the two extra compressions the hmac tfm does per request.  Ciphers,
+ * AES included,  still go through the blkcipher tfm one request at a time.
+ */
+#ifdef SWCR_MB_SIMD
+#define SWCR_MB_LANES	8
+#else
+#define SWCR_MB_LANES	4
+#endif
+
+/* requests a batch waits for,  4 in portable C,  SWCR_MB_LANES in vectors */
+static int swcr_mb_lanes = 4;
+
+/* the vectors in use,  0 none,  1 SSE2,  2 AVX2 */
+static int swcr_mb_isa = 0;
+
+struct swcr_mb_batch {
+	spinlock_t		mb_lock;
+	int				mb_n;
+	struct swcr_req	*mb_req[SWCR_MB_LANES];
+};
+
+struct swcr_mb_alg {
+	int		ma_words;	/* state words */
+	int		ma_dsize;	/* digest size in bytes */
+	const u32	*ma_iv;
+	void	(*ma_compress)(u32 **st, const u8 **blk, int n);
+	struct swcr_mb_batch *ma_batch;	/* requests waiting for a lane */
+#ifdef SWCR_MB_SIMD
+	void	(*ma_sse2)(u32 **st, const u8 **blk, int n);	/* up to 4 lanes */
+	void	(*ma_avx2)(u32 **st, const u8 **blk, int n);	/* up to 8 lanes */
+#endif
+};
+
+static const u32 swcr_sha1_iv[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static const u32 swcr_sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const u32 swcr_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/*
+ * One block for each of n lanes.  The lane loop is innermost so the
+ * rounds of different lanes are independent of each other.
+ */
+static void
+swcr_sha1_mb(u32 **st, const u8 **blk, int n)
+{
+	u32 w[SWCR_MB_LANES][16], v[SWCR_MB_LANES][5], t;
+	int i, l;
+
+	for (l = 0; l < n; l++) {
+		for (i = 0; i < 16; i++)
+			w[l][i] = get_unaligned_be32(blk[l] + 4 * i);
+		for (i = 0; i < 5; i++)
+			v[l][i] = st[l][i];
+	}
+
+#define SHA1_W(l, i) ((i) < 16 ? w[l][i] : (w[l][(i) & 15] = rol32( \
+		w[l][((i) + 13) & 15] ^ w[l][((i) + 8) & 15] ^ \
+		w[l][((i) + 2) & 15] ^ w[l][(i) & 15], 1)))
+#define SHA1_ROUND(f, k) \
+	for (l = 0; l < n; l++) { \
+		u32 *x = v[l]; \
+		t = rol32(x[0], 5) + (f) + x[4] + (k) + SHA1_W(l, i); \
+		x[4] = x[3]; x[3] = x[2]; x[2] = rol32(x[1], 30); \
+		x[1] = x[0]; x[0] = t; \
+	}
+
+	for (i = 0; i < 20; i++)
+		SHA1_ROUND((x[1] & x[2]) | (~x[1] & x[3]), 0x5a827999)
+	for (; i < 40; i++)
+		SHA1_ROUND(x[1] ^ x[2] ^ x[3], 0x6ed9eba1)
+	for (; i < 60; i++)
+		SHA1_ROUND((x[1] & x[2]) | (x[3] & (x[1] | x[2])), 0x8f1bbcdc)
+	for (; i < 80; i++)
+		SHA1_ROUND(x[1] ^ x[2] ^ x[3], 0xca62c1d6)
+#undef SHA1_ROUND
+#undef SHA1_W
+
+	for (l = 0; l < n; l++)
+		for (i = 0; i < 5; i++)
+			st[l][i] += v[l][i];
+}
+
+static void
+swcr_sha256_mb(u32 **st, const u8 **blk, int n)
+{
+	u32 w[SWCR_MB_LANES][16], v[SWCR_MB_LANES][8], t1, t2;
+	int i, l;
+
+	for (l = 0; l < n; l++) {
+		for (i = 0; i < 16; i++)
+			w[l][i] = get_unaligned_be32(blk[l] + 4 * i);
+		for (i = 0; i < 8; i++)
+			v[l][i] = st[l][i];
+	}
+
+	for (i = 0; i < 64; i++) {
+		for (l = 0; l < n; l++) {
+			u32 *x = v[l], *wl = w[l];
+
+			if (i >= 16) {
+				u32 s0 = wl[(i + 1) & 15], s1 = wl[(i + 14) & 15];
+
+				s0 = ror32(s0, 7) ^ ror32(s0, 18) ^ (s0 >> 3);
+				s1 = ror32(s1, 17) ^ ror32(s1, 19) ^ (s1 >> 10);
+				wl[i & 15] += s0 + wl[(i + 9) & 15] + s1;
+			}
+			t1 = x[7] + (ror32(x[4], 6) ^ ror32(x[4], 11) ^ ror32(x[4], 25)) +
+				((x[4] & x[5]) ^ (~x[4] & x[6])) + swcr_sha256_k[i] +
+				wl[i & 15];
+			t2 = (ror32(x[0], 2) ^ ror32(x[0], 13) ^ ror32(x[0], 22)) +
+				((x[0] & x[1]) ^ (x[0] & x[2]) ^ (x[1] & x[2]));
+			x[7] = x[6]; x[6] = x[5]; x[5] = x[4]; x[4] = x[3] + t1;
+			x[3] = x[2]; x[2] = x[1]; x[1] = x[0]; x[0] = t1 + t2;
+		}
+	}
+
+	for (l = 0; l < n; l++)
+		for (i = 0; i < 8; i++)
+			st[l][i] += v[l][i];
+}
+
+#ifdef SWCR_MB_SIMD
+#define SWCR_VEC_NAME(x)	x##_sse2
+#define SWCR_VEC_TARGET		__attribute__((target("sse2")))
+#define SWCR_VEC_LANES		4
+#include "cryptosoft-mb.h"
+#undef SWCR_VEC_LANES
+#undef SWCR_VEC_TARGET
+#undef SWCR_VEC_NAME
+
+#define SWCR_VEC_NAME(x)	x##_avx2
+#define SWCR_VEC_TARGET		__attribute__((target("avx2")))
+#define SWCR_VEC_LANES		8
+#include "cryptosoft-mb.h"
+#undef SWCR_VEC_LANES
+#undef SWCR_VEC_TARGET
+#undef SWCR_VEC_NAME
+#endif
+
+static struct swcr_mb_batch swcr_mb_batch[2];
+
+/* 0 until swcr_mb_selftest() has passed,  sessions stay on the tfm */
+static int swcr_mb_ok = 0;
+
+static const struct swcr_mb_alg swcr_mb_sha1 = {
+	5, SHA1_HASH_LEN, swcr_sha1_iv, swcr_sha1_mb, &swcr_mb_batch[0],
+#ifdef SWCR_MB_SIMD
+	swcr_sha1_sse2, swcr_sha1_avx2,
+#endif
+};
+
+static const struct swcr_mb_alg swcr_mb_sha256 = {
+	8, SHA2_256_HASH_LEN, swcr_sha256_iv, swcr_sha256_mb, &swcr_mb_batch[1],
+#ifdef SWCR_MB_SIMD
+	swcr_sha256_sse2, swcr_sha256_avx2,
+#endif
+};
+
+#ifdef SWCR_MB_SIMD
+/*
+ * The widest vectors both the CPU and swcr_mb_simd allow.  AVX2 also
+ * needs the kernel to be saving the YMM registers.
+ */
+static int
+swcr_mb_simd_isa(void)
+{
+	int isa = 0;
+
+	if (swcr_mb_simd >= 1 && boot_cpu_has(X86_FEATURE_XMM2))
+		isa = 1;
+#ifdef X86_FEATURE_AVX2
+	if (swcr_mb_simd >= 2 && boot_cpu_has(X86_FEATURE_AVX2) &&
+			boot_cpu_has(X86_FEATURE_OSXSAVE) &&
+			(xgetbv(XCR_XFEATURE_ENABLED_MASK) & (XSTATE_SSE | XSTATE_YMM)) ==
+				(XSTATE_SSE | XSTATE_YMM))
+		isa = 2;
+#endif
+	return isa;
+}
+#endif
+
+/*
+ * One block for each of n lanes,  in the narrowest vectors that hold them
+ * when "simd" says we have the FPU,  else in portable C.
+ */
+static void
+swcr_mb_compress(const struct swcr_mb_alg *alg, int simd, u32 **st,
+		const u8 **blk, int n)
+{
+#ifdef SWCR_MB_SIMD
+	if (simd && n > 1) {
+		if (n <= 4)
+			alg->ma_sse2(st, blk, n);
+		else if (swcr_mb_isa >= 2)
+			alg->ma_avx2(st, blk, n);
+		else {
+			alg->ma_sse2(st, blk, 4);
+			alg->ma_sse2(st + 4, blk + 4, n - 4);
+		}
+		return;
+	}
+#endif
+	alg->ma_compress(st, blk, n);
+}
+
+/*
+ * Point a lane at "len" bytes of "sg",  with "prefix" bytes of message
+ * already folded into "st".
+ */
+static void
+swcr_mb_lane_init(struct swcr_mb_lane *l, const struct swcr_mb_alg *alg,
+		const u32 *st, struct scatterlist *sg, int nsg, unsigned int len,
+		unsigned int prefix)
+{
+	memcpy(l->ml_st, st, alg->ma_words * sizeof(u32));
+	l->ml_sg = sg;
+	l->ml_nsg = nsg;
+	l->ml_p = NULL;
+	l->ml_seg = 0;
+	l->ml_left = len;
+	l->ml_bits = ((u64) prefix + len) << 3;
+	l->ml_npad = -1;
+	l->ml_pad = 0;
+}
+
+/*
+ * Step over exhausted (or empty,  the IOV path can leave some) segments.
+ */
+static inline void
+swcr_mb_advance(struct swcr_mb_lane *l)
+{
+	while (l->ml_seg == 0 && l->ml_nsg > 0) {
+		l->ml_seg = l->ml_sg->length;
+		l->ml_p = l->ml_seg ? sg_virt(l->ml_sg) : NULL;
+		l->ml_sg++;
+		l->ml_nsg--;
+	}
+}
+
+static void
+swcr_mb_gather(struct swcr_mb_lane *l, u8 *dst, unsigned int n)
+{
+	unsigned int c;
+
+	l->ml_left -= n;
+	while (n) {
+		swcr_mb_advance(l);
+		c = min(n, l->ml_seg);
+		memcpy(dst, l->ml_p, c);
+		dst += c;
+		l->ml_p += c;
+		l->ml_seg -= c;
+		n -= c;
+	}
+}
+
+/*
+ * The lane's next 64 byte block,  straight from the buffer when it is
+ * contiguous,  or NULL once the padding has been handed out.
+ */
+static const u8 *
+swcr_mb_next(struct swcr_mb_lane *l)
+{
+	const u8 *p;
+	int n;
+
+	if (l->ml_left >= 64) {
+		swcr_mb_advance(l);
+		if (l->ml_seg >= 64) {
+			p = l->ml_p;
+			l->ml_p += 64;
+			l->ml_seg -= 64;
+			l->ml_left -= 64;
+			return p;
+		}
+		swcr_mb_gather(l, l->ml_blk, 64);
+		return l->ml_blk;
+	}
+
+	if (l->ml_npad < 0) {
+		n = l->ml_left;
+		swcr_mb_gather(l, l->ml_blk, n);
+		l->ml_blk[n] = 0x80;
+		l->ml_npad = (n + 9 > 64) ? 2 : 1;
+		memset(l->ml_blk + n + 1, 0, l->ml_npad * 64 - n - 9);
+		put_unaligned_be64(l->ml_bits, l->ml_blk + l->ml_npad * 64 - 8);
+	}
+	if (l->ml_pad < l->ml_npad)
+		return l->ml_blk + 64 * l->ml_pad++;
+	return NULL;
+}
+
+/*
+ * Run up to SWCR_MB_LANES lanes to completion.
+ */
+static void
+swcr_mb_hash(const struct swcr_mb_alg *alg, int simd,
+		struct swcr_mb_lane **lanes, int n)
+{
+	const u8 *blk[SWCR_MB_LANES];
+	u32 *st[SWCR_MB_LANES];
+	int active, i;
+
+	do {
+		active = 0;
+		for (i = 0; i < n; i++) {
+			if ((blk[active] = swcr_mb_next(lanes[i])) != NULL)
+				st[active++] = lanes[i]->ml_st;
+		}
+		if (active)
+			swcr_mb_compress(alg, simd, st, blk, active);
+	} while (active);
+}
+
+static void
+swcr_mb_digest(const struct swcr_mb_alg *alg, const u32 *st, u8 *out)
+{
+	int i;
+
+	for (i = 0; i < alg->ma_words; i++)
+		put_unaligned_be32(st[i], out + 4 * i);
+}
+
+/*
+ * Run the inner hashes of n lanes to completion and then the outer ones
+ * from the states in ost,  leaving each MAC at the start of its ml_blk.
+ */
+static void
+swcr_mb_finish(const struct swcr_mb_alg *alg, struct swcr_mb_lane **lanes,
+		const u32 **ost, int n)
+{
+	const u8 *bp[SWCR_MB_LANES];
+	u32 *sp[SWCR_MB_LANES];
+	u8 *blk;
+	int i, simd = 0;
+
+#ifdef SWCR_MB_SIMD
+	if (swcr_mb_isa && n > 1 && irq_fpu_usable()) {
+		kernel_fpu_begin();
+		simd = 1;
+	}
+#endif
+	swcr_mb_hash(alg, simd, lanes, n);
+
+	/* the outer hash is always a single block */
+	for (i = 0; i < n; i++) {
+		blk = lanes[i]->ml_blk;
+		memset(blk, 0, 64);
+		swcr_mb_digest(alg, lanes[i]->ml_st, blk);
+		blk[alg->ma_dsize] = 0x80;
+		put_unaligned_be64((u64) (64 + alg->ma_dsize) << 3, blk + 56);
+		memcpy(lanes[i]->ml_st, ost[i], alg->ma_words * sizeof(u32));
+		sp[i] = lanes[i]->ml_st;
+		bp[i] = blk;
+	}
+	swcr_mb_compress(alg, simd, sp, bp, n);
+#ifdef SWCR_MB_SIMD
+	if (simd)
+		kernel_fpu_end();
+#endif
+
+	for (i = 0; i < n; i++)
+		swcr_mb_digest(alg, lanes[i]->ml_st, lanes[i]->ml_blk);
+}
+
+/*
+ * Work out the inner and outer HMAC states for a key.
+ */
+static void
+swcr_mb_setkey(const struct swcr_mb_alg *alg, const u8 *key, int klen,
+		u32 *ist, u32 *ost)
+{
+	struct swcr_mb_lane l, *lp = &l;
+	struct scatterlist sg;
+	u8 k0[64];
+	const u8 *blk;
+	u32 *st;
+	int i;
+
+	memset(k0, 0, sizeof(k0));
+	if (klen > 64) {
+		sg_init_one(&sg, key, klen);
+		swcr_mb_lane_init(&l, alg, alg->ma_iv, &sg, 1, klen, 0);
+		swcr_mb_hash(alg, 0, &lp, 1);
+		swcr_mb_digest(alg, l.ml_st, k0);
+	} else
+		memcpy(k0, key, klen);
+
+	blk = k0;
+	for (i = 0; i < 64; i++)
+		k0[i] ^= 0x36;
+	memcpy(ist, alg->ma_iv, alg->ma_words * sizeof(u32));
+	st = ist;
+	alg->ma_compress(&st, &blk, 1);
+
+	for (i = 0; i < 64; i++)
+		k0[i] ^= 0x36 ^ 0x5c;
+	memcpy(ost, alg->ma_iv, alg->ma_words * sizeof(u32));
+	st = ost;
+	alg->ma_compress(&st, &blk, 1);
+	memset(k0, 0, sizeof(k0));
+}
+
 /*
  * Generate a new software session.
  */
@@ -350,43 +902,17 @@ swcr_newsession(device_t dev, u_int32_t *sid, struct cryptoini *cri)
 		return EINVAL;
 	}
 
-	if (swcr_sessions) {
-		for (i = 1; i < swcr_sesnum; i++)
-			if (swcr_sessions[i] == NULL)
-				break;
-	} else
-		i = 1;		/* NB: to silence compiler warning */
-
-	if (swcr_sessions == NULL || i == swcr_sesnum) {
-		if (swcr_sessions == NULL) {
-			i = 1; /* We leave swcr_sessions[0] empty */
-			swcr_sesnum = CRYPTO_SW_SESSIONS;
-		} else
-			swcr_sesnum *= 2;
-
-		swd = kmalloc(swcr_sesnum * sizeof(struct swcr_data *), SLAB_ATOMIC);
-		if (swd == NULL) {
-			/* Reset session number */
-			if (swcr_sesnum == CRYPTO_SW_SESSIONS)
-				swcr_sesnum = 0;
-			else
-				swcr_sesnum /= 2;
-			dprintk("%s,%d: ENOBUFS\n", __FILE__, __LINE__);
-			return ENOBUFS;
-		}
-		memset(swd, 0, swcr_sesnum * sizeof(struct swcr_data *));
-
-		/* Copy existing sessions */
-		if (swcr_sessions) {
-			memcpy(swd, swcr_sessions,
-			    (swcr_sesnum / 2) * sizeof(struct swcr_data *));
-			kfree(swcr_sessions);
-		}
-
-		swcr_sessions = swd;
+	i = swcr_ses_alloc();
+	if (i == 0) {
+		dprintk("%s,%d: ENOBUFS\n", __FILE__, __LINE__);
+		return ENOBUFS;
 	}
 
-	swd = &swcr_sessions[i];
+	/*
+	 * NB: the chain is built in place,  nobody can look at it until the
+	 * caller has been handed the sid.
+	 */
+	swd = &swcr_ses_dir[i / SWCR_SES_CHUNK]->sc_ses[i % SWCR_SES_CHUNK];
 	*sid = i;
 
 	while (cri) {
@@ -398,6 +924,7 @@ swcr_newsession(device_t dev, u_int32_t *sid, struct cryptoini *cri)
 			return ENOBUFS;
 		}
 		memset(*swd, 0, sizeof(struct swcr_data));
+		atomic_set(&(*swd)->sw_refcnt, 1);
 
 		if (cri->cri_alg < 0 ||
 				cri->cri_alg>=sizeof(crypto_details)/sizeof(crypto_details[0])){
@@ -526,6 +1053,20 @@ swcr_newsession(device_t dev, u_int32_t *sid, struct cryptoini *cri)
 				(*swd)->u.hmac.sw_mlen = crypto_hash_digestsize(
 						crypto_hash_cast((*swd)->sw_tfm));
 			}
+
+			if (!swcr_mb_ok)
+				(*swd)->sw_mb = NULL;
+			else if (cri->cri_alg == CRYPTO_SHA1_HMAC)
+				(*swd)->sw_mb = &swcr_mb_sha1;
+			else if (cri->cri_alg == CRYPTO_SHA2_256_HMAC)
+				(*swd)->sw_mb = &swcr_mb_sha256;
+			if ((*swd)->sw_mb &&
+					(*swd)->u.hmac.sw_mlen <= (*swd)->sw_mb->ma_dsize)
+				swcr_mb_setkey((*swd)->sw_mb, (*swd)->u.hmac.sw_key,
+						(*swd)->u.hmac.sw_klen, (*swd)->sw_mb_ist,
+						(*swd)->sw_mb_ost);
+			else
+				(*swd)->sw_mb = NULL;
 		} else if ((*swd)->sw_type & SW_TYPE_COMP) {
 			(*swd)->sw_tfm = crypto_comp_tfm(
 					crypto_alloc_comp(algo, 0, CRYPTO_ALG_ASYNC));
@@ -554,27 +1095,14 @@ swcr_newsession(device_t dev, u_int32_t *sid, struct cryptoini *cri)
 }
 
 /*
- * Free a session.
+ * Tear down a session's swcr_data chain,  in process context.
  */
-static int
-swcr_freesession(device_t dev, u_int64_t tid)
+static void
+swcr_freechain(struct swcr_data *swd)
 {
-	struct swcr_data *swd;
-	u_int32_t sid = CRYPTO_SESID2LID(tid);
+	while (swd != NULL) {
+		struct swcr_data *next = swd->sw_next;
 
-	dprintk("%s()\n", __FUNCTION__);
-	if (sid > swcr_sesnum || swcr_sessions == NULL ||
-			swcr_sessions[sid] == NULL) {
-		dprintk("%s,%d: EINVAL\n", __FILE__, __LINE__);
-		return(EINVAL);
-	}
-
-	/* Silently accept and return */
-	if (sid == 0)
-		return(0);
-
-	while ((swd = swcr_sessions[sid]) != NULL) {
-		swcr_sessions[sid] = swd->sw_next;
 		if (swd->sw_tfm) {
 			switch (swd->sw_type & SW_TYPE_ALG_AMASK) {
 #ifdef HAVE_AHASH
@@ -615,7 +1143,81 @@ swcr_freesession(device_t dev, u_int64_t tid)
 				kfree(swd->u.hmac.sw_key);
 		}
 		kfree(swd);
+		swd = next;
 	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+static void
+swcr_ses_free_work(struct work_struct *wq)
+{
+	swcr_freechain(container_of(wq, struct swcr_data, workq));
+}
+#else
+static void
+swcr_ses_free_work(void *arg)
+{
+	swcr_freechain((struct swcr_data *) arg);
+}
+#endif
+
+static void
+swcr_ses_free_rcu(struct rcu_head *head)
+{
+	struct swcr_data *swd = container_of(head, struct swcr_data, sw_rcu);
+
+	/* the tfm frees may sleep,  and we are in softirq context here */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	INIT_WORK(&swd->workq, swcr_ses_free_work);
+#else
+	INIT_WORK(&swd->workq, swcr_ses_free_work, swd);
+#endif
+	schedule_work(&swd->workq);
+}
+
+/*
+ * Drop a reference to a session's chain.
+ */
+static inline void
+swcr_ses_put(struct swcr_data *swd)
+{
+	if (atomic_dec_and_test(&swd->sw_refcnt))
+		call_rcu(&swd->sw_rcu, swcr_ses_free_rcu);
+}
+
+/*
+ * Free a session.
+ */
+static int
+swcr_freesession(device_t dev, u_int64_t tid)
+{
+	struct swcr_data *swd, **head;
+	struct swcr_ses_chunk *c;
+	unsigned long flags;
+	u_int32_t sid = CRYPTO_SESID2LID(tid);
+
+	dprintk("%s()\n", __FUNCTION__);
+	/* Silently accept and return */
+	if (sid == 0)
+		return(0);
+
+	c = swcr_ses_chunk(sid);
+	if (c == NULL || c->sc_free[sid % SWCR_SES_CHUNK] != SWCR_SES_INUSE) {
+		dprintk("%s,%d: EINVAL\n", __FILE__, __LINE__);
+		return(EINVAL);
+	}
+
+	/* unhook the chain and recycle the lid,  requests may still hold it */
+	head = &c->sc_ses[sid % SWCR_SES_CHUNK];
+	swd = *head;
+	rcu_assign_pointer(*head, NULL);
+	spin_lock_irqsave(&swcr_ses_lock, flags);
+	c->sc_free[sid % SWCR_SES_CHUNK] = swcr_ses_free;
+	swcr_ses_free = sid;
+	spin_unlock_irqrestore(&swcr_ses_lock, flags);
+
+	if (swd != NULL)
+		swcr_ses_put(swd);
 	return 0;
 }
 
@@ -637,6 +1239,8 @@ static void swcr_process_req_complete(struct swcr_req *req)
 #if defined(HAVE_AHASH)
 	case SW_TYPE_AHMAC:
 	case SW_TYPE_AHASH:
+		if (req->crypto_req == NULL)	/* done by the multi-buffer engine */
+			break;
 		crypto_copyback(req->crp->crp_flags, req->crp->crp_buf,
 				req->crd->crd_inject, req->sw->u.hmac.sw_mlen, req->result);
 		ahash_request_free(req->crypto_req);
@@ -667,6 +1271,7 @@ static void swcr_process_req_complete(struct swcr_req *req)
 done:
 	dprintk("%s crypto_done %p\n", __FUNCTION__, req);
 	crypto_done(req->crp);
+	swcr_ses_put(req->sw_head);
 	kmem_cache_free(swcr_req_cache, req);
 }
 
@@ -683,10 +1288,271 @@ static void swcr_process_callback(struct crypto_async_request *creq, int err)
 		req->crp->crp_etype = -err;
 	}
 
+	/* nothing is coming along behind us to flush a batch */
+	req->hint = 0;
 	swcr_process_req_complete(req);
 }
 #endif /* defined(HAVE_ABLKCIPHER) || defined(HAVE_AHASH) */
 
+/*
+ * Finish the HMACs for a batch of requests and complete them.
+ */
+static void
+swcr_mb_run(const struct swcr_mb_alg *alg, struct swcr_req **reqs, int n)
+{
+	struct swcr_mb_lane *lanes[SWCR_MB_LANES];
+	const u32 *ost[SWCR_MB_LANES];
+	struct swcr_req *req;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		req = reqs[i];
+		lanes[i] = &req->mb_lane;
+		swcr_mb_lane_init(lanes[i], alg, req->sw->sw_mb_ist, req->sg,
+				req->mb_nsg, req->mb_len, 64);
+		ost[i] = req->sw->sw_mb_ost;
+	}
+	swcr_mb_finish(alg, lanes, ost, n);
+
+	for (i = 0; i < n; i++) {
+		req = reqs[i];
+		memcpy(req->result, lanes[i]->ml_blk, alg->ma_dsize);
+		crypto_copyback(req->crp->crp_flags, req->crp->crp_buf,
+				req->crd->crd_inject, req->sw->u.hmac.sw_mlen, req->result);
+		swcr_process_req_complete(req);
+	}
+}
+
+static void
+swcr_mb_take(const struct swcr_mb_alg *alg, struct swcr_req *req)
+{
+	struct swcr_mb_batch *b = alg->ma_batch;
+	struct swcr_req *run[SWCR_MB_LANES];
+	unsigned long flags;
+	int n = 0;
+
+	spin_lock_irqsave(&b->mb_lock, flags);
+	if (req)
+		b->mb_req[b->mb_n++] = req;
+	if (b->mb_n >= swcr_mb_lanes || !req || !(req->hint & CRYPTO_HINT_MORE)) {
+		n = b->mb_n;
+		memcpy(run, b->mb_req, n * sizeof(run[0]));
+		b->mb_n = 0;
+	}
+	spin_unlock_irqrestore(&b->mb_lock, flags);
+
+	if (n)
+		swcr_mb_run(alg, run, n);
+}
+
+/*
+ * Run whatever is waiting,  called once the core has nothing more for us.
+ */
+static void
+swcr_mb_flush(void)
+{
+	swcr_mb_take(&swcr_mb_sha1, NULL);
+	swcr_mb_take(&swcr_mb_sha256, NULL);
+}
+
+/*
+ * Checked at load,  before any session can use the engine:  the RFC 2202
+ * and RFC 4231 HMAC test cases with a short key and with a key longer
+ * than a block,  then a range of message lengths around the padding
+ * boundaries,  split over several (some empty) segments and run
+ * SWCR_MB_LANES at a time,  against the hmac tfm the scalar path uses.
+ */
+static const char swcr_mb_kat_jefe[] = "what do ya want for nothing?";
+static const char swcr_mb_kat_long[] =
+		"Test Using Larger Than Block-Size Key - Hash Key First";
+
+static const struct {
+	const struct swcr_mb_alg *alg;
+	const char *key;		/* NULL for klen bytes of 0xaa */
+	int klen;
+	const char *msg;
+	const char *mac;
+} swcr_mb_kat[] = {
+	{ &swcr_mb_sha1, "Jefe", 4, swcr_mb_kat_jefe,
+			"\xef\xfc\xdf\x6a\xe5\xeb\x2f\xa2"
+			"\xd2\x74\x16\xd5\xf1\x84\xdf\x9c"
+			"\x25\x9a\x7c\x79" },
+	{ &swcr_mb_sha1, NULL, 80, swcr_mb_kat_long,
+			"\xaa\x4a\xe5\xe1\x52\x72\xd0\x0e"
+			"\x95\x70\x56\x37\xce\x8a\x3b\x55"
+			"\xed\x40\x21\x12" },
+	{ &swcr_mb_sha256, "Jefe", 4, swcr_mb_kat_jefe,
+			"\x5b\xdc\xc1\x46\xbf\x60\x75\x4e"
+			"\x6a\x04\x24\x26\x08\x95\x75\xc7"
+			"\x5a\x00\x3f\x08\x9d\x27\x39\x83"
+			"\x9d\xec\x58\xb9\x64\xec\x38\x43" },
+	{ &swcr_mb_sha256, NULL, 131, swcr_mb_kat_long,
+			"\x60\xe4\x31\x59\x1e\xe0\xb6\x7f"
+			"\x0d\x8a\x26\xaa\xcb\xf5\xb7\x7f"
+			"\x8e\x0b\xc6\x21\x37\x28\xc5\x14"
+			"\x05\x46\x04\x0f\x0e\xe3\x7f\x54" },
+};
+
+static const int swcr_mb_check_len[] = {
+	0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 256, 1500,
+};
+
+#define SWCR_MB_CHECK_MAX	1500
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19)
+/* a full batch of check lanes,  too big for the stack */
+struct swcr_mb_check {
+	struct scatterlist	sg[SWCR_MB_LANES][3];
+	struct swcr_mb_lane	lanes[SWCR_MB_LANES];
+	u8			mac[SWCR_MB_LANES][HASH_MAX_LEN];
+};
+
+/*
+ * HMAC each of swcr_mb_check_len[] bytes of buf with the tfm and with
+ * the engine,  returning the number of lengths that disagree.
+ */
+static int
+swcr_mb_check_tfm(const struct swcr_mb_alg *alg, const char *name,
+		const u8 *buf, const u8 *key, int klen)
+{
+	struct swcr_mb_check *c;
+	struct swcr_mb_lane *lanes[SWCR_MB_LANES];
+	struct scatterlist one;
+	const u32 *ost[SWCR_MB_LANES];
+	u32 ist[8], st[8];
+	struct hash_desc desc;
+	int i, j, n, len, a, b, bad = 0;
+
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (c == NULL)
+		return 1;
+	memset(&desc, 0, sizeof(desc));
+	desc.tfm = crypto_alloc_hash(name, 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(desc.tfm)) {
+		kfree(c);
+		return 0;	/* nothing to compare with */
+	}
+	if (crypto_hash_setkey(desc.tfm, key, klen))
+		goto out;
+
+	swcr_mb_setkey(alg, key, klen, ist, st);
+	for (i = 0; i < sizeof(swcr_mb_check_len) / sizeof(int); i += n) {
+		n = sizeof(swcr_mb_check_len) / sizeof(int) - i;
+		if (n > SWCR_MB_LANES)
+			n = SWCR_MB_LANES;
+		for (j = 0; j < n; j++) {
+			/* three segments,  cut differently in each lane */
+			len = swcr_mb_check_len[i + j];
+			a = len * j / 7;
+			b = a + (len - a) / (j + 2);
+			sg_init_table(c->sg[j], 3);
+			sg_set_buf(&c->sg[j][0], buf, a);
+			sg_set_buf(&c->sg[j][1], buf + a, b - a);
+			sg_set_buf(&c->sg[j][2], buf + b, len - b);
+			lanes[j] = &c->lanes[j];
+			swcr_mb_lane_init(lanes[j], alg, ist, c->sg[j], 3, len, 64);
+			ost[j] = st;
+
+			sg_init_one(&one, buf, len);
+			crypto_hash_digest(&desc, &one, len, c->mac[j]);
+		}
+		swcr_mb_finish(alg, lanes, ost, n);
+		for (j = 0; j < n; j++)
+			if (memcmp(c->lanes[j].ml_blk, c->mac[j], alg->ma_dsize))
+				bad++;
+	}
+out:
+	crypto_free_hash(desc.tfm);
+	kfree(c);
+	return bad;
+}
+#endif
+
+/*
+ * Check the engine against known answers and,  where it exists,  the
+ * kernel's own hmac tfm.  Returns the number of mismatches.
+ */
+static int
+swcr_mb_test(void)
+{
+	struct swcr_mb_lane lane, *lp = &lane;
+	struct scatterlist sg;
+	u32 ist[8], st[8];
+	const u32 *ost = st;
+	u8 key[131];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19)
+	u8 *buf;
+#endif
+	int i, bad = 0;
+
+	for (i = 0; i < sizeof(swcr_mb_kat) / sizeof(swcr_mb_kat[0]); i++) {
+		const struct swcr_mb_alg *alg = swcr_mb_kat[i].alg;
+		const char *msg = swcr_mb_kat[i].msg;
+
+		if (swcr_mb_kat[i].key)
+			memcpy(key, swcr_mb_kat[i].key, swcr_mb_kat[i].klen);
+		else
+			memset(key, 0xaa, swcr_mb_kat[i].klen);
+		swcr_mb_setkey(alg, key, swcr_mb_kat[i].klen, ist, st);
+		sg_init_one(&sg, msg, strlen(msg));
+		swcr_mb_lane_init(&lane, alg, ist, &sg, 1, strlen(msg), 64);
+		swcr_mb_finish(alg, &lp, &ost, 1);
+		if (memcmp(lane.ml_blk, swcr_mb_kat[i].mac, alg->ma_dsize))
+			bad++;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19)
+	buf = kmalloc(SWCR_MB_CHECK_MAX, GFP_KERNEL);
+	if (buf == NULL) {
+		printk("cryptosoft: no memory to check the multi-buffer HMACs\n");
+		return 1;
+	}
+	for (i = 0; i < SWCR_MB_CHECK_MAX; i++)
+		buf[i] = i * 7 + (i >> 8);
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = 0x80 + i;
+	bad += swcr_mb_check_tfm(&swcr_mb_sha1, "hmac(sha1)", buf, key, 20);
+	bad += swcr_mb_check_tfm(&swcr_mb_sha1, "hmac(sha1)", buf, key, 100);
+	bad += swcr_mb_check_tfm(&swcr_mb_sha256, "hmac(sha256)", buf, key, 32);
+	bad += swcr_mb_check_tfm(&swcr_mb_sha256, "hmac(sha256)", buf, key, 100);
+	kfree(buf);
+#endif
+	return bad;
+}
+
+/*
+ * Pick the widest vectors we have and enable the engine if it passes
+ * swcr_mb_test(),  retrying in portable C if the vectors do not.
+ */
+static void
+swcr_mb_selftest(void)
+{
+	int bad;
+
+#ifdef SWCR_MB_SIMD
+	swcr_mb_isa = swcr_mb_simd_isa();
+	if (swcr_mb_isa)
+		swcr_mb_lanes = SWCR_MB_LANES;
+	bad = swcr_mb_test();
+	if (bad && swcr_mb_isa) {
+		printk(KERN_ERR "cryptosoft: %s multi-buffer HMAC self-test failed "
+				"(%d mismatches),  trying without\n",
+				swcr_mb_isa >= 2 ? "AVX2" : "SSE2", bad);
+		swcr_mb_isa = 0;
+		swcr_mb_lanes = 4;
+		bad = swcr_mb_test();
+	}
+#else
+	bad = swcr_mb_test();
+#endif
+	if (bad) {
+		printk(KERN_ERR "cryptosoft: multi-buffer HMAC self-test failed "
+				"(%d mismatches),  using the hash tfm\n", bad);
+		return;
+	}
+	swcr_mb_ok = 1;
+}
+
 
 static void swcr_process_req(struct swcr_req *req)
 {
@@ -695,7 +1561,7 @@ static void swcr_process_req(struct swcr_req *req)
 	struct cryptodesc *crd = req->crd;
 	struct sk_buff *skb = (struct sk_buff *) crp->crp_buf;
 	struct uio *uiop = (struct uio *) crp->crp_buf;
-	int sg_num, sg_len, skip;
+	int sg_num, sg_len, skip, mb;
 
 	dprintk("%s()\n", __FUNCTION__);
 
@@ -719,6 +1585,10 @@ static void swcr_process_req(struct swcr_req *req)
 		goto done;
 	}
 
+	/* paged skbs may be in highmem,  leave those to the tfm */
+	mb = swcr_mb && sw->sw_mb && ((crp->crp_flags & CRYPTO_F_SKBUF) == 0 ||
+			skb_shinfo(skb)->nr_frags == 0);
+
 	/*
 	 * for some types we need to ensure only one user as info is stored in
 	 * the tfm during an operation that can get corrupted
@@ -731,9 +1601,12 @@ static void swcr_process_req(struct swcr_req *req)
 	case SW_TYPE_HMAC:
 	case SW_TYPE_HASH: {
 		unsigned long flags;
+		if (mb)		/* the multi-buffer engine doesn't touch the tfm */
+			break;
 		spin_lock_irqsave(&sw->sw_tfm_lock, flags);
 		if (sw->sw_type & SW_TYPE_INUSE) {
 			spin_unlock_irqrestore(&sw->sw_tfm_lock, flags);
+			req->hint = 0;
 			execute_later((void (*)(void *))swcr_process_req, (void *)req);
 			return;
 		}
@@ -817,6 +1690,21 @@ static void swcr_process_req(struct swcr_req *req)
 	if (sg_num > 0)
 		sg_mark_end(&req->sg[sg_num-1]);
 
+	if (mb) {
+		/* check we have room for the result */
+		if (crp->crp_ilen - crd->crd_inject < sw->u.hmac.sw_mlen) {
+			dprintk("cryptosoft: EINVAL crp_ilen=%d, inject=%d mlen=%d\n",
+					crp->crp_ilen, crd->crd_inject, sw->u.hmac.sw_mlen);
+			crp->crp_etype = EINVAL;
+			goto done;
+		}
+		req->crypto_req = NULL;
+		req->mb_nsg = sg_num;
+		req->mb_len = sg_len;
+		swcr_mb_take(sw->sw_mb, req);
+		return;
+	}
+
 	switch (sw->sw_type & SW_TYPE_ALG_AMASK) {
 
 #ifdef HAVE_AHASH
@@ -1161,6 +2049,8 @@ static int
 swcr_process(device_t dev, struct cryptop *crp, int hint)
 {
 	struct swcr_req *req = NULL;
+	struct swcr_ses_chunk *c;
+	struct swcr_data *sw_head = NULL;
 	u_int32_t lid;
 
 	dprintk("%s()\n", __FUNCTION__);
@@ -1179,8 +2069,14 @@ swcr_process(device_t dev, struct cryptop *crp, int hint)
 	}
 
 	lid = crp->crp_sid & 0xffffffff;
-	if (lid >= swcr_sesnum || lid == 0 || swcr_sessions == NULL ||
-			swcr_sessions[lid] == NULL) {
+	rcu_read_lock();
+	if ((c = swcr_ses_chunk(lid)) != NULL)
+		sw_head = rcu_dereference(c->sc_ses[lid % SWCR_SES_CHUNK]);
+	/* hold the session until the request completes */
+	if (sw_head != NULL && !atomic_inc_not_zero(&sw_head->sw_refcnt))
+		sw_head = NULL;
+	rcu_read_unlock();
+	if (sw_head == NULL) {
 		crp->crp_etype = ENOENT;
 		dprintk("%s,%d: ENOENT\n", __FILE__, __LINE__);
 		goto done;
@@ -1217,17 +2113,24 @@ swcr_process(device_t dev, struct cryptop *crp, int hint)
 	}
 	memset(req, 0, sizeof(*req));
 
-	req->sw_head = swcr_sessions[lid];
+	req->sw_head = sw_head;
 	req->crp = crp;
 	req->crd = crp->crp_desc;
+	req->hint = hint;
 
 	swcr_process_req(req);
+	if ((hint & CRYPTO_HINT_MORE) == 0)
+		swcr_mb_flush();
 	return 0;
 
 done:
 	crypto_done(crp);
+	if (sw_head)
+		swcr_ses_put(sw_head);
 	if (req)
 		kmem_cache_free(swcr_req_cache, req);
+	if ((hint & CRYPTO_HINT_MORE) == 0)
+		swcr_mb_flush();
 	return 0;
 }
 
@@ -1240,6 +2143,10 @@ cryptosoft_init(void)
 
 	dprintk("%s(%p)\n", __FUNCTION__, cryptosoft_init);
 
+	for (i = 0; i < sizeof(swcr_mb_batch) / sizeof(swcr_mb_batch[0]); i++)
+		spin_lock_init(&swcr_mb_batch[i].mb_lock);
+	swcr_mb_selftest();
+
 	swcr_req_cache = kmem_cache_create("cryptosoft_req",
 				sizeof(struct swcr_req), 0, SLAB_HWCACHE_ALIGN, NULL
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
@@ -1308,10 +2215,18 @@ cryptosoft_init(void)
 static void
 cryptosoft_exit(void)
 {
+	int i;
+
 	dprintk("%s()\n", __FUNCTION__);
 	crypto_unregister_all(swcr_id);
 	swcr_id = -1;
+	/* let any session teardown still queued finish */
+	rcu_barrier();
+	flush_scheduled_work();
 	kmem_cache_destroy(swcr_req_cache);
+	for (i = 0; i < SWCR_SES_CHUNKS; i++)
+		if (swcr_ses_dir[i])
+			kfree(swcr_ses_dir[i]);
 }
 
 late_initcall(cryptosoft_init);
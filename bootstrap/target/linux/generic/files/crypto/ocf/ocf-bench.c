@@ -42,6 +42,15 @@
 #include <linux/sched.h>
 #include <linux/spinlock.h>
 #include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/ctype.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/div64.h>
 #include <cryptodev.h>
 
 #ifdef I_HAVE_AN_XSCALE_WITH_INTEL_SDK
@@ -99,6 +108,116 @@ static int request_cbimm = 1;
 module_param(request_cbimm, int, 0);
 MODULE_PARM_DESC(request_cbimm, "enable OCF immediate callback on completion");
 
+/*
+ * number of submitting threads to scale up to,  0 disables the test
+ */
+static int request_threads = 0;
+module_param(request_threads, int, 0);
+MODULE_PARM_DESC(request_threads,
+		"run the dispatch scaling test with 1 to this many producer threads");
+
+/*
+ * how long to run each step of the scaling test
+ */
+static int request_msecs = 2000;
+module_param(request_msecs, int, 0);
+MODULE_PARM_DESC(request_msecs,
+		"milliseconds to run each scaling step or matrix point for");
+
+/*
+ * matrix mode,  sweep algorithm x size x queue depth x driver and keep
+ * the results in debugfs (ocf-bench/matrix and ocf-bench/histogram).
+ * The module stays loaded in this mode so the results can be collected,
+ * rmmod and insmod again to re-run.
+ */
+#define BENCH_MATRIX_MAX	16
+
+static int request_matrix = 0;
+module_param(request_matrix, int, 0);
+MODULE_PARM_DESC(request_matrix, "run the throughput/latency matrix");
+
+static char *matrix_algs[BENCH_MATRIX_MAX] = { "aes-sha1" };
+static int matrix_nalgs = 1;
+module_param_array(matrix_algs, charp, &matrix_nalgs, 0);
+MODULE_PARM_DESC(matrix_algs,
+		"matrix algorithms (aes-sha1,aes-sha256,3des-sha1,aes,3des,"
+		"sha1-hmac,sha256-hmac,md5-hmac)");
+
+static int matrix_sizes[BENCH_MATRIX_MAX] = { 64, 256, 1488, 4096 };
+static int matrix_nsizes = 4;
+module_param_array(matrix_sizes, int, &matrix_nsizes, 0);
+MODULE_PARM_DESC(matrix_sizes,
+		"matrix request sizes (rounded down to the cipher block size)");
+
+static int matrix_qdepths[BENCH_MATRIX_MAX] = { 1, 8, 32, 128 };
+static int matrix_nqdepths = 4;
+module_param_array(matrix_qdepths, int, &matrix_nqdepths, 0);
+MODULE_PARM_DESC(matrix_qdepths, "matrix numbers of outstanding requests");
+
+static char *matrix_drivers[BENCH_MATRIX_MAX] = { "any" };
+static int matrix_ndrivers = 1;
+module_param_array(matrix_drivers, charp, &matrix_ndrivers, 0);
+MODULE_PARM_DESC(matrix_drivers,
+		"matrix drivers (any,hw,sw,a driver name or a crid)");
+
+/*
+ * the algorithm combinations we know how to drive,  the first one is
+ * what the plain and scaling tests have always used
+ */
+struct bench_alg {
+	const char *name;
+	int cipher;
+	int cklen;			/* bytes */
+	int mac;
+	int mklen;			/* bytes */
+	int blksize;
+};
+
+static struct bench_alg bench_algs[] = {
+	{ "aes-sha1",    CRYPTO_AES_CBC,  24, CRYPTO_SHA1_HMAC,     20, 16 },
+	{ "aes-sha256",  CRYPTO_AES_CBC,  16, CRYPTO_SHA2_256_HMAC, 32, 16 },
+	{ "3des-sha1",   CRYPTO_3DES_CBC, 24, CRYPTO_SHA1_HMAC,     20,  8 },
+	{ "aes",         CRYPTO_AES_CBC,  16, 0,                     0, 16 },
+	{ "3des",        CRYPTO_3DES_CBC, 24, 0,                     0,  8 },
+	{ "sha1-hmac",   0,                0, CRYPTO_SHA1_HMAC,     20,  1 },
+	{ "sha256-hmac", 0,                0, CRYPTO_SHA2_256_HMAC, 32,  1 },
+	{ "md5-hmac",    0,                0, CRYPTO_MD5_HMAC,      16,  1 },
+};
+
+/* keys are a prefix of this */
+static char bench_key[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+/*
+ * completion latency histogram,  2^BENCH_HIST_SUB buckets per power of
+ * two nanoseconds so percentiles are good to within 25%
+ */
+#define BENCH_HIST_SUB		2
+#define BENCH_HIST_BUCKETS	(64 << BENCH_HIST_SUB)
+
+/*
+ * one point of the matrix
+ */
+struct bench_point {
+	const struct bench_alg *alg;
+	int size;
+	int qdepth;
+	const char *driver;		/* as requested */
+	char drvname[32];		/* what the session ended up on */
+	int status;			/* 0 or why the point could not run */
+	unsigned long ops;
+	unsigned long errors;
+	unsigned long msecs;
+	u32 hist[BENCH_HIST_BUCKETS];
+};
+
+static struct bench_point *bench_points;
+static int bench_npoints;
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *bench_debugfs;
+#endif
+
+struct producer;
+
 /*
  * a structure for each request
  */
@@ -108,8 +227,31 @@ typedef struct  {
 	IX_MBUF mbuf;
 #endif
 	unsigned char *buffer;
+	struct list_head list;		/* producer free list */
+	struct producer *prod;
+	ktime_t start;			/* when it was dispatched */
 } request_t;
 
+/*
+ * a submitting thread for the scaling test,  it owns request_q_len
+ * requests and dispatches each one again as soon as it completes
+ */
+struct producer {
+	struct task_struct *task;
+	wait_queue_head_t wait;
+	spinlock_t lock;
+	struct list_head free;		/* requests ready to be submitted */
+	int nfree;
+	uint64_t sid;
+	unsigned long ops;		/* completed requests */
+	unsigned long errors;		/* of which failed */
+	const struct bench_alg *alg;
+	int size;
+	int qlen;
+	struct bench_point *pt;		/* latency histogram,  matrix only */
+	request_t *requests;
+};
+
 static request_t *requests;
 
 static spinlock_t ocfbench_counter_lock;
@@ -124,7 +266,7 @@ static int total;
 static uint64_t ocf_cryptoid;
 static unsigned long jstart, jstop;
 
-static int ocf_init(void);
+static int ocf_init(uint64_t *sid, const struct bench_alg *a, int crid);
 static int ocf_cb(struct cryptop *crp);
 static void ocf_request(void *arg);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
@@ -132,37 +274,40 @@ static void ocf_request_wq(struct work_struct *work);
 #endif
 
 static int
-ocf_init(void)
+ocf_init(uint64_t *sid, const struct bench_alg *a, int crid)
 {
 	int error;
 	struct cryptoini crie, cria;
-	struct cryptodesc crda, crde;
 
 	memset(&crie, 0, sizeof(crie));
 	memset(&cria, 0, sizeof(cria));
-	memset(&crde, 0, sizeof(crde));
-	memset(&crda, 0, sizeof(crda));
 
-	cria.cri_alg  = CRYPTO_SHA1_HMAC;
-	cria.cri_klen = 20 * 8;
-	cria.cri_key  = "0123456789abcdefghij";
+	cria.cri_alg  = a->mac;
+	cria.cri_klen = a->mklen * 8;
+	cria.cri_key  = bench_key;
 
-	//crie.cri_alg  = CRYPTO_3DES_CBC;
-	crie.cri_alg  = CRYPTO_AES_CBC;
-	crie.cri_klen = 24 * 8;
-	crie.cri_key  = "0123456789abcdefghijklmn";
+	crie.cri_alg  = a->cipher;
+	crie.cri_klen = a->cklen * 8;
+	crie.cri_key  = bench_key;
 
-	crie.cri_next = &cria;
+	if (a->mac)
+		crie.cri_next = &cria;
 
-	error = crypto_newsession(&ocf_cryptoid, &crie,
-				CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE);
+	error = crypto_newsession(sid, a->cipher ? &crie : &cria, crid);
 	if (error) {
-		printk("crypto_newsession failed %d\n", error);
+		if (!request_matrix)
+			printk("crypto_newsession failed %d\n", error);
 		return -1;
 	}
 	return 0;
 }
 
+static int
+ocf_ndesc(const struct bench_alg *a)
+{
+	return (a->cipher ? 1 : 0) + (a->mac ? 1 : 0);
+}
+
 static int
 ocf_cb(struct cryptop *crp)
 {
@@ -189,12 +334,50 @@ ocf_cb(struct cryptop *crp)
 }
 
 
+static void
+ocf_setup(struct cryptop *crp, request_t *r, uint64_t sid,
+		const struct bench_alg *a, int size, int (*cb)(struct cryptop *))
+{
+	struct cryptodesc *crd = crp->crp_desc;
+
+	if (a->cipher) {
+		crd->crd_skip = 0;
+		crd->crd_flags = CRD_F_IV_EXPLICIT | CRD_F_ENCRYPT;
+		crd->crd_len = size;
+		crd->crd_inject = size;
+		crd->crd_alg = a->cipher;
+		crd->crd_key = bench_key;
+		crd->crd_klen = a->cklen * 8;
+		crd = crd->crd_next;
+	}
+
+	if (a->mac) {
+		crd->crd_skip = 0;
+		crd->crd_flags = 0;
+		crd->crd_len = size;
+		crd->crd_inject = size;
+		crd->crd_alg = a->mac;
+		crd->crd_key = bench_key;
+		crd->crd_klen = a->mklen * 8;
+	}
+
+	crp->crp_ilen = size + 64;
+	crp->crp_flags = 0;
+	if (request_batch)
+		crp->crp_flags |= CRYPTO_F_BATCH;
+	if (request_cbimm)
+		crp->crp_flags |= CRYPTO_F_CBIMM;
+	crp->crp_buf = (caddr_t) r->buffer;
+	crp->crp_callback = cb;
+	crp->crp_sid = sid;
+	crp->crp_opaque = (caddr_t) r;
+}
+
 static void
 ocf_request(void *arg)
 {
 	request_t *r = arg;
-	struct cryptop *crp = crypto_getreq(2);
-	struct cryptodesc *crde, *crda;
+	struct cryptop *crp = crypto_getreq(ocf_ndesc(&bench_algs[0]));
 	unsigned long flags;
 
 	if (!crp) {
@@ -204,36 +387,7 @@ ocf_request(void *arg)
 		return;
 	}
 
-	crde = crp->crp_desc;
-	crda = crde->crd_next;
-
-	crda->crd_skip = 0;
-	crda->crd_flags = 0;
-	crda->crd_len = request_size;
-	crda->crd_inject = request_size;
-	crda->crd_alg = CRYPTO_SHA1_HMAC;
-	crda->crd_key = "0123456789abcdefghij";
-	crda->crd_klen = 20 * 8;
-
-	crde->crd_skip = 0;
-	crde->crd_flags = CRD_F_IV_EXPLICIT | CRD_F_ENCRYPT;
-	crde->crd_len = request_size;
-	crde->crd_inject = request_size;
-	//crde->crd_alg = CRYPTO_3DES_CBC;
-	crde->crd_alg = CRYPTO_AES_CBC;
-	crde->crd_key = "0123456789abcdefghijklmn";
-	crde->crd_klen = 24 * 8;
-
-	crp->crp_ilen = request_size + 64;
-	crp->crp_flags = 0;
-	if (request_batch)
-		crp->crp_flags |= CRYPTO_F_BATCH;
-	if (request_cbimm)
-		crp->crp_flags |= CRYPTO_F_CBIMM;
-	crp->crp_buf = (caddr_t) r->buffer;
-	crp->crp_callback = ocf_cb;
-	crp->crp_sid = ocf_cryptoid;
-	crp->crp_opaque = (caddr_t) r;
+	ocf_setup(crp, r, ocf_cryptoid, &bench_algs[0], request_size, ocf_cb);
 	crypto_dispatch(crp);
 }
 
@@ -252,6 +406,500 @@ ocf_done(void)
 	crypto_freesession(ocf_cryptoid);
 }
 
+/*************************************************************************/
+/*
+ * matrix mode latency histograms,  log-linear buckets with
+ * 1 << BENCH_HIST_SUB steps per power of two, and the percentiles the
+ * matrix reports from them
+ */
+
+static int
+bench_hist_bucket(u64 ns)
+{
+	int o;
+
+	if (ns < (1 << BENCH_HIST_SUB))
+		return (int) ns;
+	o = fls64(ns) - 1;
+	return ((o - BENCH_HIST_SUB + 1) << BENCH_HIST_SUB) +
+		((ns >> (o - BENCH_HIST_SUB)) & ((1 << BENCH_HIST_SUB) - 1));
+}
+
+/*
+ * the smallest latency that lands in bucket b
+ */
+static u64
+bench_hist_value(int b)
+{
+	int o;
+
+	if (b < (1 << BENCH_HIST_SUB))
+		return b;
+	o = (b >> BENCH_HIST_SUB) + BENCH_HIST_SUB - 1;
+	return (u64) ((1 << BENCH_HIST_SUB) + (b & ((1 << BENCH_HIST_SUB) - 1)))
+			<< (o - BENCH_HIST_SUB);
+}
+
+/*
+ * latency (upper bucket bound) below which "per10k" of the ops finished
+ */
+static u64
+bench_percentile(struct bench_point *pt, int per10k)
+{
+	u64 want, sum = 0;
+	int b;
+
+	if (pt->ops == 0)
+		return 0;
+	want = (u64) pt->ops * per10k + 9999;
+	do_div(want, 10000);
+	for (b = 0; b < BENCH_HIST_BUCKETS - 1; b++) {
+		sum += pt->hist[b];
+		if (sum >= want)
+			break;
+	}
+	return bench_hist_value(b + 1) - 1;
+}
+
+/*************************************************************************/
+/*
+ * dispatch scaling test,  N threads each keeping request_q_len requests
+ * in flight against their own session
+ */
+
+static void
+producer_put(struct producer *p, request_t *r, int completed, int error)
+{
+	unsigned long flags;
+	u64 ns = 0;
+
+	if (completed && p->pt)
+		ns = ktime_to_ns(ktime_sub(ktime_get(), r->start));
+
+	spin_lock_irqsave(&p->lock, flags);
+	list_add_tail(&r->list, &p->free);
+	p->nfree++;
+	p->ops += completed;
+	if (error)
+		p->errors++;
+	if (completed && p->pt)
+		p->pt->hist[bench_hist_bucket(ns)]++;
+	spin_unlock_irqrestore(&p->lock, flags);
+	wake_up(&p->wait);
+}
+
+static int
+producer_cb(struct cryptop *crp)
+{
+	request_t *r = (request_t *) crp->crp_opaque;
+	int error = crp->crp_etype;
+
+	if (error && r->prod->pt == NULL)
+		printk("Error in OCF processing: %d\n", error);
+	crypto_freereq(crp);
+	producer_put(r->prod, r, 1, error);
+	return 0;
+}
+
+static int
+producer_proc(void *arg)
+{
+	struct producer *p = arg;
+	struct cryptop *crp;
+	request_t *r;
+	unsigned long flags;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(p->wait,
+				p->nfree > 0 || kthread_should_stop());
+		spin_lock_irqsave(&p->lock, flags);
+		if (list_empty(&p->free)) {
+			spin_unlock_irqrestore(&p->lock, flags);
+			continue;
+		}
+		r = list_entry(p->free.next, request_t, list);
+		list_del(&r->list);
+		p->nfree--;
+		spin_unlock_irqrestore(&p->lock, flags);
+
+		crp = crypto_getreq(ocf_ndesc(p->alg));
+		if (crp == NULL) {
+			producer_put(p, r, 0, 0);
+			schedule();
+			continue;
+		}
+		ocf_setup(crp, r, p->sid, p->alg, p->size, producer_cb);
+		r->start = ktime_get();
+		if (crypto_dispatch(crp) != 0) {
+			/* queues are full,  back off and try again */
+			crypto_freereq(crp);
+			producer_put(p, r, 0, 0);
+			schedule();
+		}
+	}
+	return 0;
+}
+
+/*
+ * give a producer qlen requests of size bytes and a session for alg,
+ * returns the crypto_newsession error or -1 if we ran out of memory
+ */
+static int
+producer_setup(struct producer *p, const struct bench_alg *a, int size,
+		int qlen, int crid)
+{
+	int i;
+
+	init_waitqueue_head(&p->wait);
+	spin_lock_init(&p->lock);
+	INIT_LIST_HEAD(&p->free);
+	p->alg = a;
+	p->size = size;
+	p->qlen = qlen;
+	p->requests = kmalloc(sizeof(request_t) * qlen, GFP_KERNEL);
+	if (!p->requests)
+		return -1;
+	memset(p->requests, 0, sizeof(request_t) * qlen);
+	for (i = 0; i < qlen; i++) {
+		request_t *r = &p->requests[i];
+
+		r->prod = p;
+		r->buffer = kmalloc(size + 128, GFP_DMA);
+		if (!r->buffer)
+			return -1;
+		memset(r->buffer, '0' + i, size + 128);
+		list_add_tail(&r->list, &p->free);
+		p->nfree++;
+	}
+	return ocf_init(&p->sid, a, crid) == -1 ? EINVAL : 0;
+}
+
+static void
+producer_free(struct producer *p)
+{
+	int i;
+
+	if (p->sid)
+		crypto_freesession(p->sid);
+	p->sid = 0;
+	if (p->requests == NULL)
+		return;
+	for (i = 0; i < p->qlen; i++)
+		if (p->requests[i].buffer)
+			kfree(p->requests[i].buffer);
+	kfree(p->requests);
+	p->requests = NULL;
+}
+
+/*
+ * run nthreads producers for request_msecs,  returns how many actually
+ * ran and the total ops they completed in *ops over *elapsed msecs
+ */
+static int
+producer_run(struct producer *prods, int nthreads, unsigned long *ops,
+		unsigned long *elapsed)
+{
+	int i, j;
+
+	*ops = 0;
+	for (i = 0; i < nthreads; i++) {
+		struct producer *p = &prods[i];
+
+		p->ops = 0;
+		p->errors = 0;
+		p->task = kthread_create(producer_proc, p, "ocf-bench/%d", i);
+		if (IS_ERR(p->task)) {
+			printk("OCF: cannot start producer %d\n", i);
+			p->task = NULL;
+			nthreads = i;
+			break;
+		}
+		if (cpu_online(i % NR_CPUS))
+			kthread_bind(p->task, i % NR_CPUS);
+	}
+	if (nthreads == 0)
+		return 0;
+
+	jstart = jiffies;
+	for (i = 0; i < nthreads; i++)
+		wake_up_process(prods[i].task);
+	msleep(request_msecs);
+	for (i = 0; i < nthreads; i++) {
+		kthread_stop(prods[i].task);
+		prods[i].task = NULL;
+	}
+	jstop = jiffies;
+
+	/* wait for everything in flight to drain before the next step */
+	for (i = 0; i < nthreads; i++) {
+		for (j = 0; prods[i].nfree < prods[i].qlen && j < 5 * HZ; j++)
+			schedule_timeout_uninterruptible(1);
+		*ops += prods[i].ops;
+	}
+
+	*elapsed = jiffies_to_msecs(jstop - jstart);
+	if (*elapsed == 0)
+		*elapsed = 1;
+	return nthreads;
+}
+
+static int
+producer_step(struct producer *prods, int nthreads)
+{
+	unsigned long ops, elapsed, opsps, mbps;
+
+	nthreads = producer_run(prods, nthreads, &ops, &elapsed);
+	if (nthreads == 0)
+		return -1;
+
+	opsps = ops * 1000 / elapsed;
+	mbps = (unsigned long) ((uint64_t) opsps * prods[0].size * 8 / 1000);
+	printk("OCF: %2d producers: %8lu ops in %5lu ms %8lu ops/sec (%lu.%03lu Mbps)\n",
+			nthreads, ops, elapsed, opsps, mbps / 1000, mbps % 1000);
+	return 0;
+}
+
+static void
+producer_test(void)
+{
+	struct producer *prods;
+	int i, n;
+
+	prods = kmalloc(sizeof(*prods) * request_threads, GFP_KERNEL);
+	if (!prods) {
+		printk("malloc failed\n");
+		return;
+	}
+	memset(prods, 0, sizeof(*prods) * request_threads);
+
+	for (n = 0; n < request_threads; n++)
+		if (producer_setup(&prods[n], &bench_algs[0], request_size,
+				request_q_len,
+				CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE) != 0)
+			break;
+	if (n < request_threads)
+		printk("OCF: only %d producers could be set up\n", n);
+
+	printk("OCF: dispatch scaling, %d outstanding requests per producer\n",
+			request_q_len);
+	for (i = 1; i <= n; i++)
+		if (producer_step(prods, i) < 0)
+			break;
+
+	for (i = 0; i < request_threads; i++)
+		producer_free(&prods[i]);
+	kfree(prods);
+}
+
+/*************************************************************************/
+/*
+ * throughput/latency matrix,  one producer per point so the queue depth
+ * is exactly what was asked for
+ */
+
+static const struct bench_alg *
+bench_find_alg(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(bench_algs) / sizeof(bench_algs[0]); i++)
+		if (strcmp(bench_algs[i].name, name) == 0)
+			return &bench_algs[i];
+	return NULL;
+}
+
+static int
+bench_find_crid(const char *name)
+{
+	if (strcmp(name, "any") == 0)
+		return CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE;
+	if (strcmp(name, "hw") == 0)
+		return CRYPTOCAP_F_HARDWARE;
+	if (strcmp(name, "sw") == 0)
+		return CRYPTOCAP_F_SOFTWARE;
+	if (isdigit(*name))
+		return simple_strtol(name, NULL, 0);
+	return crypto_find_driver(name);
+}
+
+static void
+bench_point_run(struct bench_point *pt)
+{
+	struct producer p;
+	device_t dev;
+	int crid;
+
+	memset(&p, 0, sizeof(p));
+	strlcpy(pt->drvname, pt->driver, sizeof(pt->drvname));
+	crid = bench_find_crid(pt->driver);
+	if (crid == -1) {
+		pt->status = ENOENT;
+		return;
+	}
+
+	pt->status = producer_setup(&p, pt->alg, pt->size, pt->qdepth, crid);
+	if (pt->status == -1)
+		pt->status = ENOMEM;
+	if (pt->status == 0) {
+		dev = crypto_find_device_byhid(CRYPTO_SESID2HID(p.sid));
+		if (dev)
+			strlcpy(pt->drvname, device_get_nameunit(dev),
+					sizeof(pt->drvname));
+		p.pt = pt;
+		if (producer_run(&p, 1, &pt->ops, &pt->msecs) == 0)
+			pt->status = ECHILD;
+		pt->errors = p.errors;
+	}
+	producer_free(&p);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static void
+bench_point_show(struct seq_file *m, struct bench_point *pt)
+{
+	u64 opsps, mbps;
+	unsigned long rem;
+
+	/* bytes per msec is KB/s */
+	opsps = (u64) pt->ops * 1000;
+	mbps = (u64) pt->ops * pt->size;
+	if (pt->msecs) {
+		do_div(opsps, pt->msecs);
+		do_div(mbps, pt->msecs);
+	}
+	rem = do_div(mbps, 1000);
+	seq_printf(m, "%s %d %d %s %d %lu %lu %lu %llu %llu.%03lu %llu %llu %llu\n",
+			pt->alg->name, pt->size, pt->qdepth, pt->drvname, pt->status,
+			pt->ops, pt->errors, pt->msecs, opsps, mbps, rem,
+			bench_percentile(pt, 5000), bench_percentile(pt, 9900),
+			bench_percentile(pt, 9990));
+}
+
+static int
+bench_matrix_show(struct seq_file *m, void *v)
+{
+	int i;
+
+	seq_printf(m, "# alg size qdepth driver status ops errors msecs "
+			"ops_per_sec mb_per_sec p50_ns p99_ns p999_ns\n");
+	for (i = 0; i < bench_npoints; i++)
+		bench_point_show(m, &bench_points[i]);
+	return 0;
+}
+
+static int
+bench_matrix_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_matrix_show, NULL);
+}
+
+static struct file_operations bench_matrix_fops = {
+	.owner = THIS_MODULE,
+	.open = bench_matrix_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * one line per point,  "lowest_ns:count" for each non-empty bucket
+ */
+static int
+bench_hist_show(struct seq_file *m, void *v)
+{
+	struct bench_point *pt;
+	int i, b;
+
+	seq_printf(m, "# alg size qdepth driver bucket_ns:count ...\n");
+	for (i = 0; i < bench_npoints; i++) {
+		pt = &bench_points[i];
+		seq_printf(m, "%s %d %d %s", pt->alg->name, pt->size,
+				pt->qdepth, pt->drvname);
+		for (b = 0; b < BENCH_HIST_BUCKETS; b++)
+			if (pt->hist[b])
+				seq_printf(m, " %llu:%u", bench_hist_value(b),
+						pt->hist[b]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int
+bench_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_hist_show, NULL);
+}
+
+static struct file_operations bench_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = bench_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+static int
+bench_matrix(void)
+{
+	struct bench_point *pt;
+	const struct bench_alg *a;
+	int ia, is, iq, id, size;
+
+	bench_npoints = matrix_nalgs * matrix_nsizes * matrix_nqdepths *
+			matrix_ndrivers;
+	bench_points = vmalloc(sizeof(*bench_points) * bench_npoints);
+	if (!bench_points) {
+		printk("malloc failed\n");
+		return -ENOMEM;
+	}
+	memset(bench_points, 0, sizeof(*bench_points) * bench_npoints);
+
+	printk("OCF: matrix of %d points, %d ms each\n", bench_npoints,
+			request_msecs);
+	pt = bench_points;
+	for (ia = 0; ia < matrix_nalgs; ia++) {
+		a = bench_find_alg(matrix_algs[ia]);
+		if (a == NULL) {
+			printk("OCF: unknown algorithm '%s'\n", matrix_algs[ia]);
+			vfree(bench_points);
+			bench_points = NULL;
+			return -EINVAL;
+		}
+		for (is = 0; is < matrix_nsizes; is++) {
+			size = matrix_sizes[is] & ~(a->blksize - 1);
+			if (size <= 0)
+				size = a->blksize;
+			for (iq = 0; iq < matrix_nqdepths; iq++) {
+				for (id = 0; id < matrix_ndrivers; id++, pt++) {
+					pt->alg = a;
+					pt->size = size;
+					pt->qdepth = matrix_qdepths[iq] > 0 ?
+							matrix_qdepths[iq] : 1;
+					pt->driver = matrix_drivers[id];
+					bench_point_run(pt);
+					printk("OCF: %s %d bytes qdepth %d on %s: %lu ops "
+							"in %lu ms (status %d, p99 %llu ns)\n",
+							a->name, pt->size, pt->qdepth, pt->drvname,
+							pt->ops, pt->msecs, pt->status,
+							bench_percentile(pt, 9900));
+				}
+			}
+		}
+	}
+
+#ifdef CONFIG_DEBUG_FS
+	bench_debugfs = debugfs_create_dir("ocf-bench", NULL);
+	if (!IS_ERR_OR_NULL(bench_debugfs)) {
+		debugfs_create_file("matrix", 0444, bench_debugfs, NULL,
+				&bench_matrix_fops);
+		debugfs_create_file("histogram", 0444, bench_debugfs, NULL,
+				&bench_hist_fops);
+	}
+#endif
+	return 0;
+}
+
 /*************************************************************************/
 #ifdef BENCH_IXP_ACCESS_LIB
 /*************************************************************************/
@@ -411,6 +1059,9 @@ ocfbench_init(void)
 
 	printk("Crypto Speed tests\n");
 
+	if (request_matrix)
+		return bench_matrix();
+
 	requests = kmalloc(sizeof(request_t) * request_q_len, GFP_KERNEL);
 	if (!requests) {
 		printk("malloc failed\n");
@@ -436,7 +1087,8 @@ ocfbench_init(void)
 	 * OCF benchmark
 	 */
 	printk("OCF: testing ...\n");
-	if (ocf_init() == -1)
+	if (ocf_init(&ocf_cryptoid, &bench_algs[0],
+			CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE) == -1)
 		return -EINVAL;
 
 	spin_lock_init(&ocfbench_counter_lock);
@@ -462,6 +1114,9 @@ ocfbench_init(void)
 			((int)mbps) / 1000, ((int)mbps) % 1000);
 	ocf_done();
 
+	if (request_threads > 0)
+		producer_test();
+
 #ifdef BENCH_IXP_ACCESS_LIB
 	/*
 	 * IXP benchmark
@@ -504,6 +1159,14 @@ ocfbench_init(void)
 
 static void __exit ocfbench_exit(void)
 {
+#ifdef CONFIG_DEBUG_FS
+	if (!IS_ERR_OR_NULL(bench_debugfs))
+		debugfs_remove_recursive(bench_debugfs);
+	bench_debugfs = NULL;
+#endif
+	if (bench_points)
+		vfree(bench_points);
+	bench_points = NULL;
 }
 
 module_init(ocfbench_init);
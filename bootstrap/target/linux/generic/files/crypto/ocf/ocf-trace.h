@@ -0,0 +1,85 @@
+/*
+ * Trace events for the stages an OCF request goes through.
+ *
+ *   ocf_dispatch   crypto_dispatch() accepted the request
+ *   ocf_queue      it was put on the driver's ring rather than run directly
+ *   ocf_process    it is being handed to the driver's process method
+ *   ocf_done       the driver called crypto_done()
+ *   ocf_callback   the callback is about to run,  deferred=1 if it went
+ *                  through crypto_ret_proc
+ *
+ * "trace-cmd record -e ocf" records them all.  Without CONFIG_EVENT_TRACING
+ * they compile away to nothing.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ocf
+
+#include <linux/version.h>
+#if defined(CONFIG_EVENT_TRACING) && \
+		LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+#define OCF_TRACE_EVENTS 1
+#endif
+
+#if !defined(_OCF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _OCF_TRACE_H
+
+#include <cryptodev.h>
+
+#ifdef OCF_TRACE_EVENTS
+#include <linux/tracepoint.h>
+
+/*
+ * every event carries the session,  the driver it belongs to and the
+ * request length,  plus one stage specific value
+ */
+#undef OCF_TRACE_EVENT
+#define OCF_TRACE_EVENT(name, val, fmt)					\
+TRACE_EVENT(name,							\
+	TP_PROTO(struct cryptop *crp, int val),				\
+	TP_ARGS(crp, val),						\
+	TP_STRUCT__entry(						\
+		__field(u64, sid)					\
+		__field(u32, hid)					\
+		__field(int, bytes)					\
+		__field(int, val)					\
+	),								\
+	TP_fast_assign(							\
+		__entry->sid = crp->crp_sid;				\
+		__entry->hid = CRYPTO_SESID2HID(crp->crp_sid);		\
+		__entry->bytes = crp->crp_ilen;				\
+		__entry->val = val;					\
+	),								\
+	TP_printk(fmt, (unsigned long long) __entry->sid, __entry->hid,	\
+		__entry->bytes, __entry->val)				\
+)
+
+OCF_TRACE_EVENT(ocf_dispatch, flags,
+		"sid=%llx hid=%u bytes=%d flags=0x%x");
+OCF_TRACE_EVENT(ocf_queue, depth,
+		"sid=%llx hid=%u bytes=%d depth=%d");
+OCF_TRACE_EVENT(ocf_process, hint,
+		"sid=%llx hid=%u bytes=%d hint=0x%x");
+OCF_TRACE_EVENT(ocf_done, error,
+		"sid=%llx hid=%u bytes=%d error=%d");
+OCF_TRACE_EVENT(ocf_callback, deferred,
+		"sid=%llx hid=%u bytes=%d deferred=%d");
+
+#else
+
+static inline void trace_ocf_dispatch(struct cryptop *crp, int flags) {}
+static inline void trace_ocf_queue(struct cryptop *crp, int depth) {}
+static inline void trace_ocf_process(struct cryptop *crp, int hint) {}
+static inline void trace_ocf_done(struct cryptop *crp, int error) {}
+static inline void trace_ocf_callback(struct cryptop *crp, int deferred) {}
+
+#endif /* OCF_TRACE_EVENTS */
+#endif /* _OCF_TRACE_H */
+
+#ifdef OCF_TRACE_EVENTS
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ocf-trace
+#include <trace/define_trace.h>
+#endif
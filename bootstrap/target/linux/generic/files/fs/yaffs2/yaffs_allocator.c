@@ -17,330 +17,272 @@
 #include "yportenv.h"
 
 /*
- * Each entry in yaffs_tnode_list and yaffs_obj_list hold blocks
- * of approx 100 objects that are themn allocated singly.
- * This is basically a simplified slab allocator.
+ * Tnodes and objects are carved out of whole pages, a simplified slab
+ * allocator. Each page starts with a yaffs_alloc_page header holding that
+ * page's own free list and a count of what has been handed out, and the
+ * header for an item is found by masking the item's address. A page goes
+ * back to the system as soon as the last thing on it is freed, so RAM
+ * used for tnodes shrinks again once a big file is deleted or its tree is
+ * evicted. One empty page of each kind is held back so that a file growing
+ * and shrinking across a page boundary does not bounce pages in and out
+ * of the page allocator.
  *
  * We don't use the Linux slab allocator because slab does not allow
  * us to dump all the objects in one hit when we do a umount and tear
  * down  all the tnodes and objects. slab requires that we first free
  * the individual objects.
- *
- * Once yaffs has been mainlined I shall try to motivate for a change
- * to slab to provide the extra features we need here.
  */
 
-struct yaffs_tnode_list {
-	struct yaffs_tnode_list *next;
-	struct yaffs_tnode *tnodes;
+struct yaffs_alloc_page {
+	struct list_head list;	/* on the pool's partial or full list */
+	void *free;		/* free items, linked through their first word */
+	int n_used;
 };
 
-struct yaffs_obj_list {
-	struct yaffs_obj_list *next;
-	struct yaffs_obj *objects;
+struct yaffs_alloc_pool {
+	struct list_head partial;	/* pages with free items */
+	struct list_head full;
+	struct yaffs_alloc_page *spare;	/* an empty page held back */
+	int item_size;
+	int first_item;		/* offset of the first item in a page */
+	int items_per_page;
+	int n_pages;
 };
 
 struct yaffs_allocator {
-	int n_tnodes_created;
-	struct yaffs_tnode *free_tnodes;
-	int n_free_tnodes;
-	struct yaffs_tnode_list *alloc_tnode_list;
-
-	int n_obj_created;
-	struct list_head free_objs;
-	int n_free_objects;
-
-	struct yaffs_obj_list *allocated_obj_list;
+	struct yaffs_alloc_pool tnodes;
+	struct yaffs_alloc_pool objs;
 };
 
-static void yaffs_deinit_raw_tnodes(struct yaffs_dev *dev)
+static struct yaffs_alloc_page *yaffs_item_page(void *item)
 {
-	struct yaffs_allocator *allocator =
-	    (struct yaffs_allocator *)dev->allocator;
-	struct yaffs_tnode_list *tmp;
-
-	if (!allocator) {
-		BUG();
-		return;
-	}
-
-	while (allocator->alloc_tnode_list) {
-		tmp = allocator->alloc_tnode_list->next;
+	return (struct yaffs_alloc_page *)((unsigned long)item & PAGE_MASK);
+}
 
-		kfree(allocator->alloc_tnode_list->tnodes);
-		kfree(allocator->alloc_tnode_list);
-		allocator->alloc_tnode_list = tmp;
-	}
+static void yaffs_pool_init(struct yaffs_alloc_pool *pool, int item_size,
+			    int align)
+{
+	INIT_LIST_HEAD(&pool->partial);
+	INIT_LIST_HEAD(&pool->full);
+	pool->spare = NULL;
+	pool->item_size = item_size;
+	pool->first_item = ALIGN(sizeof(struct yaffs_alloc_page), align);
+	pool->items_per_page = (PAGE_SIZE - pool->first_item) / item_size;
+	pool->n_pages = 0;
+}
 
-	allocator->free_tnodes = NULL;
-	allocator->n_free_tnodes = 0;
-	allocator->n_tnodes_created = 0;
+static void yaffs_pool_free_page(struct yaffs_alloc_pool *pool,
+				 struct yaffs_alloc_page *page)
+{
+	free_page((unsigned long)page);
+	pool->n_pages--;
 }
 
-static void yaffs_init_raw_tnodes(struct yaffs_dev *dev)
+static void yaffs_pool_deinit(struct yaffs_alloc_pool *pool)
 {
-	struct yaffs_allocator *allocator = dev->allocator;
+	struct yaffs_alloc_page *page;
 
-	if (!allocator) {
-		BUG();
-		return;
+	while (!list_empty(&pool->partial)) {
+		page = list_entry(pool->partial.next,
+				  struct yaffs_alloc_page, list);
+		list_del(&page->list);
+		yaffs_pool_free_page(pool, page);
 	}
-
-	allocator->alloc_tnode_list = NULL;
-	allocator->free_tnodes = NULL;
-	allocator->n_free_tnodes = 0;
-	allocator->n_tnodes_created = 0;
+	while (!list_empty(&pool->full)) {
+		page = list_entry(pool->full.next,
+				  struct yaffs_alloc_page, list);
+		list_del(&page->list);
+		yaffs_pool_free_page(pool, page);
+	}
+	if (pool->spare)
+		yaffs_pool_free_page(pool, pool->spare);
+	pool->spare = NULL;
 }
 
-static int yaffs_create_tnodes(struct yaffs_dev *dev, int n_tnodes)
+/* Gets an empty page, the spare if there is one, onto the partial list */
+static struct yaffs_alloc_page *yaffs_pool_grow(struct yaffs_alloc_pool *pool)
 {
-	struct yaffs_allocator *allocator =
-	    (struct yaffs_allocator *)dev->allocator;
+	struct yaffs_alloc_page *page = pool->spare;
+	u8 *item;
 	int i;
-	struct yaffs_tnode *new_tnodes;
-	u8 *mem;
-	struct yaffs_tnode *curr;
-	struct yaffs_tnode *next;
-	struct yaffs_tnode_list *tnl;
-
-	if (!allocator) {
-		BUG();
-		return YAFFS_FAIL;
-	}
 
-	if (n_tnodes < 1)
-		return YAFFS_OK;
-
-	/* make these things */
-	new_tnodes = kmalloc(n_tnodes * dev->tnode_size, GFP_NOFS);
-	mem = (u8 *) new_tnodes;
-
-	if (!new_tnodes) {
-		yaffs_trace(YAFFS_TRACE_ERROR,
-			"yaffs: Could not allocate Tnodes");
-		return YAFFS_FAIL;
-	}
-
-	/* New hookup for wide tnodes */
-	for (i = 0; i < n_tnodes - 1; i++) {
-		curr = (struct yaffs_tnode *)&mem[i * dev->tnode_size];
-		next = (struct yaffs_tnode *)&mem[(i + 1) * dev->tnode_size];
-		curr->internal[0] = next;
+	if (page) {
+		pool->spare = NULL;
+	} else {
+		page = (struct yaffs_alloc_page *)__get_free_page(GFP_NOFS);
+		if (!page)
+			return NULL;
+		pool->n_pages++;
+
+		page->free = NULL;
+		page->n_used = 0;
+		item = (u8 *)page + pool->first_item +
+		    (pool->items_per_page - 1) * pool->item_size;
+		for (i = 0; i < pool->items_per_page; i++) {
+			*(void **)item = page->free;
+			page->free = item;
+			item -= pool->item_size;
+		}
 	}
 
-	curr = (struct yaffs_tnode *)&mem[(n_tnodes - 1) * dev->tnode_size];
-	curr->internal[0] = allocator->free_tnodes;
-	allocator->free_tnodes = (struct yaffs_tnode *)mem;
+	list_add(&page->list, &pool->partial);
+	return page;
+}
 
-	allocator->n_free_tnodes += n_tnodes;
-	allocator->n_tnodes_created += n_tnodes;
+static void *yaffs_pool_alloc(struct yaffs_alloc_pool *pool)
+{
+	struct yaffs_alloc_page *page;
+	void *item;
 
-	/* Now add this bunch of tnodes to a list for freeing up.
-	 * NB If we can't add this to the management list it isn't fatal
-	 * but it just means we can't free this bunch of tnodes later.
-	 */
-	tnl = kmalloc(sizeof(struct yaffs_tnode_list), GFP_NOFS);
-	if (!tnl) {
-		yaffs_trace(YAFFS_TRACE_ERROR,
-			"Could not add tnodes to management list");
-		return YAFFS_FAIL;
+	if (list_empty(&pool->partial)) {
+		page = yaffs_pool_grow(pool);
+		if (!page)
+			return NULL;
 	} else {
-		tnl->tnodes = new_tnodes;
-		tnl->next = allocator->alloc_tnode_list;
-		allocator->alloc_tnode_list = tnl;
+		page = list_entry(pool->partial.next,
+				  struct yaffs_alloc_page, list);
 	}
 
-	yaffs_trace(YAFFS_TRACE_ALLOCATE, "Tnodes added");
+	item = page->free;
+	page->free = *(void **)item;
+	page->n_used++;
+	if (!page->free)
+		list_move(&page->list, &pool->full);
 
-	return YAFFS_OK;
+	return item;
 }
 
-struct yaffs_tnode *yaffs_alloc_raw_tnode(struct yaffs_dev *dev)
+static void yaffs_pool_free(struct yaffs_alloc_pool *pool, void *item)
 {
-	struct yaffs_allocator *allocator =
-	    (struct yaffs_allocator *)dev->allocator;
-	struct yaffs_tnode *tn = NULL;
+	struct yaffs_alloc_page *page = yaffs_item_page(item);
 
-	if (!allocator) {
-		BUG();
-		return NULL;
-	}
+	if (!page->free)
+		list_move(&page->list, &pool->partial);
+	*(void **)item = page->free;
+	page->free = item;
+	page->n_used--;
 
-	/* If there are none left make more */
-	if (!allocator->free_tnodes)
-		yaffs_create_tnodes(dev, YAFFS_ALLOCATION_NTNODES);
-
-	if (allocator->free_tnodes) {
-		tn = allocator->free_tnodes;
-		allocator->free_tnodes = allocator->free_tnodes->internal[0];
-		allocator->n_free_tnodes--;
-	}
+	if (page->n_used)
+		return;
 
-	return tn;
+	list_del(&page->list);
+	if (pool->spare)
+		yaffs_pool_free_page(pool, page);
+	else
+		pool->spare = page;
 }
 
-/* FreeTnode frees up a tnode and puts it back on the free list */
-void yaffs_free_raw_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
+/*
+ * Wide tnodes are not a power of two bytes long. Space them out so that
+ * none straddles a cache line: a power of two up to the line size, whole
+ * lines above that. dev->tnode_size itself stays as it is, since it is
+ * also the size tnodes are stored with in the checkpoint.
+ */
+static int yaffs_tnode_stride(struct yaffs_dev *dev)
 {
-	struct yaffs_allocator *allocator = dev->allocator;
+	int stride = sizeof(void *);
 
-	if (!allocator) {
-		BUG();
-		return;
-	}
+	if (dev->tnode_size > L1_CACHE_BYTES)
+		return ALIGN(dev->tnode_size, L1_CACHE_BYTES);
 
-	if (tn) {
-		tn->internal[0] = allocator->free_tnodes;
-		allocator->free_tnodes = tn;
-		allocator->n_free_tnodes++;
-	}
-	dev->checkpoint_blocks_required = 0;	/* force recalculation */
+	while (stride < dev->tnode_size)
+		stride <<= 1;
+	return stride;
 }
 
-/*--------------- yaffs_obj alloaction ------------------------
- *
- * Free yaffs_objs are stored in a list using obj->siblings.
- * The blocks of allocated objects are stored in a linked list.
- */
-
-static void yaffs_init_raw_objs(struct yaffs_dev *dev)
+struct yaffs_tnode *yaffs_alloc_raw_tnode(struct yaffs_dev *dev)
 {
 	struct yaffs_allocator *allocator = dev->allocator;
+	struct yaffs_tnode *tn;
 
 	if (!allocator) {
 		BUG();
-		return;
+		return NULL;
 	}
 
-	allocator->allocated_obj_list = NULL;
-	INIT_LIST_HEAD(&allocator->free_objs);
-	allocator->n_free_objects = 0;
+	tn = yaffs_pool_alloc(&allocator->tnodes);
+	if (!tn)
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"yaffs: Could not allocate Tnodes");
+	return tn;
 }
 
-static void yaffs_deinit_raw_objs(struct yaffs_dev *dev)
+/* FreeTnode frees up a tnode and puts it back on the free list */
+void yaffs_free_raw_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 {
 	struct yaffs_allocator *allocator = dev->allocator;
-	struct yaffs_obj_list *tmp;
 
 	if (!allocator) {
 		BUG();
 		return;
 	}
 
-	while (allocator->allocated_obj_list) {
-		tmp = allocator->allocated_obj_list->next;
-		kfree(allocator->allocated_obj_list->objects);
-		kfree(allocator->allocated_obj_list);
-		allocator->allocated_obj_list = tmp;
-	}
-
-	INIT_LIST_HEAD(&allocator->free_objs);
-	allocator->n_free_objects = 0;
-	allocator->n_obj_created = 0;
+	if (tn)
+		yaffs_pool_free(&allocator->tnodes, tn);
+	dev->checkpoint_blocks_required = 0;	/* force recalculation */
 }
 
-static int yaffs_create_free_objs(struct yaffs_dev *dev, int n_obj)
+struct yaffs_obj *yaffs_alloc_raw_obj(struct yaffs_dev *dev)
 {
 	struct yaffs_allocator *allocator = dev->allocator;
-	int i;
-	struct yaffs_obj *new_objs;
-	struct yaffs_obj_list *list;
+	struct yaffs_obj *obj;
 
 	if (!allocator) {
 		BUG();
-		return YAFFS_FAIL;
+		return NULL;
 	}
 
-	if (n_obj < 1)
-		return YAFFS_OK;
-
-	/* make these things */
-	new_objs = kmalloc(n_obj * sizeof(struct yaffs_obj), GFP_NOFS);
-	list = kmalloc(sizeof(struct yaffs_obj_list), GFP_NOFS);
-
-	if (!new_objs || !list) {
-		kfree(new_objs);
-		new_objs = NULL;
-		kfree(list);
-		list = NULL;
+	obj = yaffs_pool_alloc(&allocator->objs);
+	if (!obj)
 		yaffs_trace(YAFFS_TRACE_ALLOCATE,
 			"Could not allocate more objects");
-		return YAFFS_FAIL;
-	}
-
-	/* Hook them into the free list */
-	for (i = 0; i < n_obj; i++)
-		list_add(&new_objs[i].siblings, &allocator->free_objs);
-
-	allocator->n_free_objects += n_obj;
-	allocator->n_obj_created += n_obj;
-
-	/* Now add this bunch of Objects to a list for freeing up. */
-
-	list->objects = new_objs;
-	list->next = allocator->allocated_obj_list;
-	allocator->allocated_obj_list = list;
-
-	return YAFFS_OK;
+	return obj;
 }
 
-struct yaffs_obj *yaffs_alloc_raw_obj(struct yaffs_dev *dev)
+void yaffs_free_raw_obj(struct yaffs_dev *dev, struct yaffs_obj *obj)
 {
-	struct yaffs_obj *obj = NULL;
-	struct list_head *lh;
 	struct yaffs_allocator *allocator = dev->allocator;
 
 	if (!allocator) {
 		BUG();
-		return obj;
-	}
-
-	/* If there are none left make more */
-	if (list_empty(&allocator->free_objs))
-		yaffs_create_free_objs(dev, YAFFS_ALLOCATION_NOBJECTS);
-
-	if (!list_empty(&allocator->free_objs)) {
-		lh = allocator->free_objs.next;
-		obj = list_entry(lh, struct yaffs_obj, siblings);
-		list_del_init(lh);
-		allocator->n_free_objects--;
+		return;
 	}
 
-	return obj;
+	yaffs_pool_free(&allocator->objs, obj);
 }
 
-void yaffs_free_raw_obj(struct yaffs_dev *dev, struct yaffs_obj *obj)
+int yaffs_raw_pages(struct yaffs_dev *dev, int *tnode_pages)
 {
-
 	struct yaffs_allocator *allocator = dev->allocator;
 
 	if (!allocator) {
-		BUG();
-		return;
+		*tnode_pages = 0;
+		return 0;
 	}
 
-	/* Link into the free list. */
-	list_add(&obj->siblings, &allocator->free_objs);
-	allocator->n_free_objects++;
+	*tnode_pages = allocator->tnodes.n_pages;
+	return allocator->tnodes.n_pages + allocator->objs.n_pages;
 }
 
 void yaffs_deinit_raw_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	struct yaffs_allocator *allocator = dev->allocator;
 
-	if (!dev->allocator) {
+	if (!allocator) {
 		BUG();
 		return;
 	}
 
-	yaffs_deinit_raw_tnodes(dev);
-	yaffs_deinit_raw_objs(dev);
-	kfree(dev->allocator);
+	yaffs_pool_deinit(&allocator->tnodes);
+	yaffs_pool_deinit(&allocator->objs);
+	kfree(allocator);
 	dev->allocator = NULL;
 }
 
 void yaffs_init_raw_tnodes_and_objs(struct yaffs_dev *dev)
 {
 	struct yaffs_allocator *allocator;
+	int stride;
 
 	if (dev->allocator) {
 		BUG();
@@ -350,8 +292,10 @@ void yaffs_init_raw_tnodes_and_objs(struct yaffs_dev *dev)
 	allocator = kmalloc(sizeof(struct yaffs_allocator), GFP_NOFS);
 	if (allocator) {
 		dev->allocator = allocator;
-		yaffs_init_raw_tnodes(dev);
-		yaffs_init_raw_objs(dev);
+		stride = yaffs_tnode_stride(dev);
+		yaffs_pool_init(&allocator->tnodes, stride,
+				min(stride, L1_CACHE_BYTES));
+		yaffs_pool_init(&allocator->objs, sizeof(struct yaffs_obj),
+				__alignof__(struct yaffs_obj));
 	}
 }
-
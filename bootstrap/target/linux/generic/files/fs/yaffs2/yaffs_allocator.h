@@ -27,4 +27,7 @@ void yaffs_free_raw_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn);
 struct yaffs_obj *yaffs_alloc_raw_obj(struct yaffs_dev *dev);
 void yaffs_free_raw_obj(struct yaffs_dev *dev, struct yaffs_obj *obj);
 
+/* Pages held for tnodes and objects, and of those for tnodes alone */
+int yaffs_raw_pages(struct yaffs_dev *dev, int *tnode_pages);
+
 #endif
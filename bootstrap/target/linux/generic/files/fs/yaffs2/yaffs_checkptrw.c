@@ -121,6 +121,7 @@ static void yaffs2_checkpt_find_erased_block(struct yaffs_dev *dev)
 
 	if (dev->checkpt_next_block >= 0 &&
 	    dev->checkpt_next_block <= dev->internal_end_block &&
+	    dev->blocks_in_checkpt < dev->checkpt_max_blocks &&
 	    blocks_avail > 0) {
 
 		for (i = dev->checkpt_next_block; i <= dev->internal_end_block;
@@ -193,6 +194,23 @@ static void yaffs2_checkpt_find_block(struct yaffs_dev *dev)
 	dev->checkpt_cur_block = -1;
 }
 
+/* A checkpoint block list of 1 checkpoint block per 16 block is
+ * (hopefully) going to be way more than we need. Writes stay within it
+ * too, so that whatever is written can be read back.
+ */
+int yaffs2_checkpt_max_blocks(struct yaffs_dev *dev)
+{
+	return (dev->internal_end_block - dev->internal_start_block) / 16 + 2;
+}
+
+static int yaffs2_checkpt_fns_ok(struct yaffs_dev *dev)
+{
+	return dev->tagger.write_chunk_tags_fn &&
+	    dev->tagger.read_chunk_tags_fn &&
+	    dev->drv.drv_erase_fn &&
+	    dev->drv.drv_mark_bad_fn;
+}
+
 int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 {
 	int i;
@@ -200,10 +218,7 @@ int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 	dev->checkpt_open_write = writing;
 
 	/* Got the functions we need? */
-	if (!dev->tagger.write_chunk_tags_fn ||
-	    !dev->tagger.read_chunk_tags_fn ||
-	    !dev->drv.drv_erase_fn ||
-	    !dev->drv.drv_mark_bad_fn)
+	if (!yaffs2_checkpt_fns_ok(dev))
 		return 0;
 
 	if (writing && !yaffs2_checkpt_space_ok(dev))
@@ -222,6 +237,8 @@ int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 	dev->checkpt_cur_block = -1;
 	dev->checkpt_cur_chunk = -1;
 	dev->checkpt_next_block = dev->internal_start_block;
+	dev->checkpt_max_blocks = yaffs2_checkpt_max_blocks(dev);
+	dev->checkpt_prev_blocks = 0;
 
 	if (writing) {
 		memset(dev->checkpt_buffer, 0, dev->data_bytes_per_chunk);
@@ -232,11 +249,7 @@ int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 	/* Opening for a read */
 	/* Set to a value that will kick off a read */
 	dev->checkpt_byte_offs = dev->data_bytes_per_chunk;
-	/* A checkpoint block list of 1 checkpoint block per 16 block is
-	 * (hopefully) going to be way more than we need */
 	dev->blocks_in_checkpt = 0;
-	dev->checkpt_max_blocks =
-	    (dev->internal_end_block - dev->internal_start_block) / 16 + 2;
 	dev->checkpt_block_list =
 	    kmalloc(sizeof(int) * dev->checkpt_max_blocks, GFP_NOFS);
 
@@ -249,6 +262,34 @@ int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 	return 1;
 }
 
+/* Reopens the checkpoint for writing more onto its end, carrying on
+ * where the last write left off (or where yaffs2_checkpt_rd_end() found
+ * the end). At most max_blocks blocks may be used in all.
+ */
+int yaffs2_checkpt_open_append(struct yaffs_dev *dev, int max_blocks)
+{
+	if (!yaffs2_checkpt_fns_ok(dev))
+		return 0;
+
+	if (!dev->checkpt_buffer)
+		dev->checkpt_buffer =
+		    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
+	if (!dev->checkpt_buffer)
+		return 0;
+
+	dev->checkpt_open_write = 1;
+	dev->checkpt_byte_count = 0;
+	dev->checkpt_prev_blocks = dev->blocks_in_checkpt;
+	dev->checkpt_max_blocks = yaffs2_checkpt_max_blocks(dev);
+	if (max_blocks < dev->checkpt_max_blocks)
+		dev->checkpt_max_blocks = max_blocks;
+
+	memset(dev->checkpt_buffer, 0, dev->data_bytes_per_chunk);
+	yaffs2_checkpt_init_chunk_hdr(dev);
+
+	return 1;
+}
+
 int yaffs2_get_checkpt_sum(struct yaffs_dev *dev, u32 * sum)
 {
 	u32 composite_sum;
@@ -342,7 +383,8 @@ int yaffs2_checkpt_wr(struct yaffs_dev *dev, const void *data, int n_bytes)
 			ok = yaffs2_checkpt_flush_buffer(dev);
 	}
 
-	return i;
+	/* Bytes that did not make it to NAND were not written */
+	return ok ? i : 0;
 }
 
 int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes)
@@ -420,14 +462,60 @@ int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes)
 	return i;
 }
 
+/* Skips the rest of the current chunk: a record written after the
+ * stream was closed and reopened for appending starts in a new chunk.
+ */
+void yaffs2_checkpt_rd_align(struct yaffs_dev *dev)
+{
+	dev->checkpt_byte_offs = dev->data_bytes_per_chunk;
+}
+
+/* Called when a read found no more data. Leaves things set up for
+ * yaffs2_checkpt_open_append(), provided the chunk the read stopped at
+ * was never written. Returns 0 if that cannot be done.
+ */
+int yaffs2_checkpt_rd_end(struct yaffs_dev *dev)
+{
+	struct yaffs_ext_tags tags;
+	int chunk;
+
+	if (dev->blocks_in_checkpt < 1 || !dev->checkpt_block_list ||
+	    !dev->checkpt_buffer)
+		return 0;
+
+	if (dev->checkpt_cur_block < 0) {
+		/* Stopped at the end of a block, carry on in a new one */
+		dev->checkpt_next_block =
+		    dev->checkpt_block_list[dev->blocks_in_checkpt - 1] + 1;
+		return 1;
+	}
+
+	chunk = dev->checkpt_cur_block * dev->param.chunks_per_block +
+	    dev->checkpt_cur_chunk;
+
+	/* The chunk must look erased, data and all */
+	memset(&tags, 0, sizeof(tags));
+	dev->tagger.read_chunk_tags_fn(dev, apply_chunk_offset(dev, chunk),
+				       dev->checkpt_buffer, &tags);
+	if (tags.chunk_used ||
+	    tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR ||
+	    !yaffs_check_ff(dev->checkpt_buffer, dev->data_bytes_per_chunk))
+		return 0;
+
+	dev->checkpt_next_block = dev->checkpt_cur_block + 1;
+	return 1;
+}
+
 int yaffs_checkpt_close(struct yaffs_dev *dev)
 {
 	int i;
+	int n_new;
+	int ok = 1;
 
 	if (dev->checkpt_open_write) {
 		if (dev->checkpt_byte_offs !=
-			sizeof(sizeof(struct yaffs_checkpt_chunk_hdr)))
-			yaffs2_checkpt_flush_buffer(dev);
+			sizeof(struct yaffs_checkpt_chunk_hdr))
+			ok = yaffs2_checkpt_flush_buffer(dev);
 	} else if (dev->checkpt_block_list) {
 		for (i = 0;
 		     i < dev->blocks_in_checkpt &&
@@ -445,9 +533,10 @@ int yaffs_checkpt_close(struct yaffs_dev *dev)
 		dev->checkpt_block_list = NULL;
 	}
 
-	dev->n_free_chunks -=
-		dev->blocks_in_checkpt * dev->param.chunks_per_block;
-	dev->n_erased_blocks -= dev->blocks_in_checkpt;
+	n_new = dev->blocks_in_checkpt - dev->checkpt_prev_blocks;
+	dev->n_free_chunks -= n_new * dev->param.chunks_per_block;
+	dev->n_erased_blocks -= n_new;
+	dev->checkpt_prev_blocks = dev->blocks_in_checkpt;
 
 	yaffs_trace(YAFFS_TRACE_CHECKPOINT, "checkpoint byte count %d",
 		dev->checkpt_byte_count);
@@ -456,7 +545,7 @@ int yaffs_checkpt_close(struct yaffs_dev *dev)
 		/* free the buffer */
 		kfree(dev->checkpt_buffer);
 		dev->checkpt_buffer = NULL;
-		return 1;
+		return ok;
 	} else {
 		return 0;
 	}
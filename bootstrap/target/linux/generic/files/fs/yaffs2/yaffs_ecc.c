@@ -24,6 +24,7 @@
 #include "yportenv.h"
 
 #include "yaffs_ecc.h"
+#include "yaffs_trace.h"
 
 /* Table generated by gen-ecc.c
  * Using a table means we do not have to calculate p1..p4 and p1'..p4'
@@ -68,26 +69,128 @@ static const unsigned char column_parity_table[] = {
 };
 
 
-/* Calculate the ECC for a 256-byte block of data */
-void yaffs_ecc_calc(const unsigned char *data, unsigned char *ecc)
+/*
+ * The parities are all worked out from two things: col_parity, the xor of
+ * the table entries of all the bytes, and line_parity, the xor of the
+ * offsets of the bytes with an odd number of bits set. The primed line
+ * parity, the xor of the complemented offsets of the same bytes, is the
+ * line parity complemented when there is an odd number of such bytes,
+ * which is bit 0 of col_parity.
+ */
+typedef void (*yaffs_ecc_lines_fn) (const unsigned char *data,
+				    unsigned n_bytes,
+				    unsigned char *col_parity,
+				    unsigned *line_parity);
+
+/* A byte at a time through the table */
+void yaffs_ecc_lines_table(const unsigned char *data, unsigned n_bytes,
+				  unsigned char *col_parity_out,
+				  unsigned *line_parity_out)
 {
 	unsigned int i;
 	unsigned char col_parity = 0;
-	unsigned char line_parity = 0;
-	unsigned char line_parity_prime = 0;
-	unsigned char t;
+	unsigned line_parity = 0;
 	unsigned char b;
 
-	for (i = 0; i < 256; i++) {
+	for (i = 0; i < n_bytes; i++) {
 		b = column_parity_table[*data++];
 		col_parity ^= b;
 
-		if (b & 0x01) {	/* odd number of bits in the byte */
+		if (b & 0x01)	/* odd number of bits in the byte */
 			line_parity ^= i;
-			line_parity_prime ^= ~i;
-		}
 	}
 
+	*col_parity_out = col_parity;
+	*line_parity_out = line_parity;
+}
+
+#if BITS_PER_LONG == 64
+#define YAFFS_ECC_WORD_SHIFT 3
+#else
+#define YAFFS_ECC_WORD_SHIFT 2
+#endif
+
+/*
+ * A word at a time. The column parities are linear, so col_parity is the
+ * table entry for the xor of all the bytes, which is the xor of all the
+ * words folded down a byte lane at a time. A byte's offset is its word
+ * number shifted up plus its lane, so the line parity splits too: the
+ * high bits are the xor of the numbers of the words with odd parity and
+ * the low bits the xor of the lanes with odd parity in the folded word.
+ * Lanes are taken in memory order so endianness does not matter.
+ */
+void yaffs_ecc_lines_word(const unsigned char *data, unsigned n_bytes,
+			  unsigned char *col_parity_out,
+			  unsigned *line_parity_out)
+{
+	const unsigned long *words = (const unsigned long *)data;
+	unsigned n_words = n_bytes >> YAFFS_ECC_WORD_SHIFT;
+	unsigned char lanes[sizeof(unsigned long)];
+	unsigned long all = 0;
+	unsigned long x;
+	unsigned char col_parity = 0;
+	unsigned line_parity = 0;
+	unsigned char b;
+	unsigned i;
+
+	if ((unsigned long)data & (sizeof(unsigned long) - 1)) {
+		yaffs_ecc_lines_table(data, n_bytes,
+				      col_parity_out, line_parity_out);
+		return;
+	}
+
+	for (i = 0; i < n_words; i++) {
+		x = words[i];
+		all ^= x;
+#if BITS_PER_LONG == 64
+		x ^= x >> 32;
+#endif
+		x ^= x >> 16;
+		x ^= x >> 8;
+		line_parity ^= i & -(column_parity_table[x & 0xff] & 0x01);
+	}
+	line_parity <<= YAFFS_ECC_WORD_SHIFT;
+
+	memcpy(lanes, &all, sizeof(all));
+	for (i = 0; i < sizeof(unsigned long); i++) {
+		b = column_parity_table[lanes[i]];
+		col_parity ^= b;
+		if (b & 0x01)
+			line_parity ^= i;
+	}
+
+	for (i = n_words << YAFFS_ECC_WORD_SHIFT; i < n_bytes; i++) {
+		b = column_parity_table[data[i]];
+		col_parity ^= b;
+		if (b & 0x01)
+			line_parity ^= i;
+	}
+
+	*col_parity_out = col_parity;
+	*line_parity_out = line_parity;
+}
+
+#ifdef CONFIG_YAFFS_ECC_TABLE
+static yaffs_ecc_lines_fn yaffs_ecc_lines = yaffs_ecc_lines_table;
+#else
+static yaffs_ecc_lines_fn yaffs_ecc_lines = yaffs_ecc_lines_word;
+#endif
+
+/* Calculate the ECC for a 256-byte block of data */
+void yaffs_ecc_calc(const unsigned char *data, unsigned char *ecc)
+{
+	unsigned char col_parity;
+	unsigned char line_parity;
+	unsigned char line_parity_prime;
+	unsigned lines;
+	unsigned char t;
+
+	yaffs_ecc_lines(data, 256, &col_parity, &lines);
+	line_parity = lines;
+	line_parity_prime = line_parity;
+	if (col_parity & 0x01)
+		line_parity_prime = ~line_parity;
+
 	ecc[2] = (~col_parity) | 0x03;
 
 	t = 0;
@@ -205,27 +308,16 @@ int yaffs_ecc_correct(unsigned char *data, unsigned char *read_ecc,
 void yaffs_ecc_calc_other(const unsigned char *data, unsigned n_bytes,
 			  struct yaffs_ecc_other *ecc_other)
 {
-	unsigned int i;
-	unsigned char col_parity = 0;
-	unsigned line_parity = 0;
-	unsigned line_parity_prime = 0;
-	unsigned char b;
+	unsigned char col_parity;
+	unsigned line_parity;
 
-	for (i = 0; i < n_bytes; i++) {
-		b = column_parity_table[*data++];
-		col_parity ^= b;
-
-		if (b & 0x01) {
-			/* odd number of bits in the byte */
-			line_parity ^= i;
-			line_parity_prime ^= ~i;
-		}
-
-	}
+	yaffs_ecc_lines(data, n_bytes, &col_parity, &line_parity);
 
 	ecc_other->col_parity = (col_parity >> 2) & 0x3f;
 	ecc_other->line_parity = line_parity;
-	ecc_other->line_parity_prime = line_parity_prime;
+	ecc_other->line_parity_prime = line_parity;
+	if (col_parity & 0x01)
+		ecc_other->line_parity_prime = ~line_parity;
 }
 
 int yaffs_ecc_correct_other(unsigned char *data, unsigned n_bytes,
@@ -279,3 +371,95 @@ int yaffs_ecc_correct_other(unsigned char *data, unsigned n_bytes,
 
 	return -1;
 }
+
+/*
+ * The word version is used unless CONFIG_YAFFS_ECC_TABLE asks for the
+ * table. A wrong parity would only show when data got miscorrected, so
+ * at init it has to give a few known answers, else the table is used.
+ * yaffs2-sim compares the two over every length and alignment and times
+ * them. With YAFFS_TRACE_MOUNT set at load they are timed here as well.
+ */
+static const struct {
+	unsigned short len;
+	unsigned char col_parity;
+	unsigned line_parity;
+} yaffs_ecc_known[] = {
+	{ 512, 0x3c, 0x75 },
+	{ 256, 0xfc, 0x60 },
+	{ 255, 0x99, 0x9f },
+	{ 100, 0x99, 0x5d },
+	{ 13, 0xcc, 0x0e },
+};
+
+static void yaffs_ecc_known_data(unsigned char *buf, int len)
+{
+	unsigned seed = 1;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+}
+
+#define YAFFS_ECC_BENCH_JIFFIES ((HZ / 50) ? (HZ / 50) : 1)
+
+static unsigned yaffs_ecc_rate(yaffs_ecc_lines_fn fn, const unsigned char *data)
+{
+	unsigned long start;
+	unsigned long j;
+	unsigned char col_parity;
+	unsigned line_parity;
+	unsigned count = 0;
+
+	/* Start on a tick */
+	j = jiffies;
+	while ((start = jiffies) == j)
+		cpu_relax();
+
+	while (time_before(jiffies, start + YAFFS_ECC_BENCH_JIFFIES)) {
+		fn(data, 256, &col_parity, &line_parity);
+		count++;
+	}
+
+	/* kB/s */
+	return (count / 4) * HZ / YAFFS_ECC_BENCH_JIFFIES;
+}
+
+void yaffs_ecc_init(void)
+{
+	unsigned char *buf;
+	unsigned char col_parity;
+	unsigned line_parity;
+	int i;
+
+	buf = kmalloc(512, GFP_KERNEL);
+	if (!buf) {
+		yaffs_ecc_lines = yaffs_ecc_lines_table;
+		return;
+	}
+	yaffs_ecc_known_data(buf, 512);
+
+	for (i = 0; i < ARRAY_SIZE(yaffs_ecc_known); i++) {
+		yaffs_ecc_lines(buf, yaffs_ecc_known[i].len,
+				&col_parity, &line_parity);
+		if (col_parity != yaffs_ecc_known[i].col_parity ||
+		    line_parity != yaffs_ecc_known[i].line_parity) {
+			yaffs_trace(YAFFS_TRACE_ALWAYS,
+				"yaffs: ecc wrong for %d bytes, using the table",
+				yaffs_ecc_known[i].len);
+			yaffs_ecc_lines = yaffs_ecc_lines_table;
+			break;
+		}
+	}
+
+	if (yaffs_trace_mask & YAFFS_TRACE_MOUNT)
+		yaffs_trace(YAFFS_TRACE_ALWAYS,
+			"yaffs: ecc table %u kB/s, word %u kB/s, using %s",
+			yaffs_ecc_rate(yaffs_ecc_lines_table, buf),
+			yaffs_ecc_rate(yaffs_ecc_lines_word, buf),
+			(yaffs_ecc_lines == yaffs_ecc_lines_word) ?
+				"word" : "table");
+
+	kfree(buf);
+}
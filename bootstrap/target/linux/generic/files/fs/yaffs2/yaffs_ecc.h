@@ -32,6 +32,14 @@ struct yaffs_ecc_other {
 	unsigned line_parity_prime;
 };
 
+void yaffs_ecc_init(void);
+
+/* The two ways of working out the parities, for yaffs2-sim to compare */
+void yaffs_ecc_lines_table(const unsigned char *data, unsigned n_bytes,
+			   unsigned char *col_parity, unsigned *line_parity);
+void yaffs_ecc_lines_word(const unsigned char *data, unsigned n_bytes,
+			  unsigned char *col_parity, unsigned *line_parity);
+
 void yaffs_ecc_calc(const unsigned char *data, unsigned char *ecc);
 int yaffs_ecc_correct(unsigned char *data, unsigned char *read_ecc,
 		      const unsigned char *test_ecc);
@@ -44,6 +44,12 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 static void yaffs_fix_null_name(struct yaffs_obj *obj, YCHAR *name,
 				int buffer_size);
 
+static void yaffs_dir_index_add(struct yaffs_obj *dir, struct yaffs_obj *obj);
+static void yaffs_dir_index_del(struct yaffs_obj *dir, struct yaffs_obj *obj);
+static void yaffs_dir_index_free(struct yaffs_obj *dir);
+
+static void yaffs_gc_index_update(struct yaffs_dev *dev, int block);
+
 /* Function to calculate chunk and offset */
 
 void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
@@ -438,6 +444,7 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 		/* If the block is full set the state to full */
 		if (dev->alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 
@@ -478,6 +485,7 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 		bi = yaffs_get_block_info(dev, dev->alloc_block);
 		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 	}
@@ -625,6 +633,7 @@ static void yaffs_retire_block(struct yaffs_dev *dev, int flash_block)
 	bi->block_state = YAFFS_BLOCK_STATE_DEAD;
 	bi->gc_prioritise = 0;
 	bi->needs_retiring = 0;
+	yaffs_gc_index_update(dev, flash_block);
 
 	dev->n_retired_blocks++;
 }
@@ -649,9 +658,27 @@ static u16 yaffs_calc_name_sum(const YCHAR *name)
 	return sum;
 }
 
+/* FNV-1a over the part of the name that yaffs_find_by_name() compares */
+static u32 yaffs_calc_name_hash(const YCHAR *name)
+{
+	u32 hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < YAFFS_MAX_NAME_LENGTH && name[i]; i++) {
+		hash ^= (u32) name[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
 
 void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 {
+	struct yaffs_obj *parent = obj->parent;
+
+	/* Rehash it in the parent's index under the new name */
+	if (obj->name_indexed)
+		yaffs_dir_index_del(parent, obj);
+
 	memset(obj->short_name, 0, sizeof(obj->short_name));
 
 	if (name && !name[0]) {
@@ -665,6 +692,19 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 	}
 
 	obj->sum = yaffs_calc_name_sum(name);
+
+	/* Hash what yaffs_get_obj_name() will hand back */
+	obj->name_hashed = 0;
+	if (obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		name = YAFFS_LOSTNFOUND_NAME;
+	if (name) {
+		obj->name_hash = yaffs_calc_name_hash(name);
+		obj->name_hashed = 1;
+	}
+
+	/* This is also where a new object first gets into the index */
+	if (parent)
+		yaffs_dir_index_add(parent, obj);
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -720,6 +760,23 @@ static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	struct list_head *i;
+	struct yaffs_obj *obj;
+	int b;
+
+	/* Directory name indices and the block lists of evicted files are
+	 * the only per-object allocations */
+	for (b = 0; b < YAFFS_NOBJECT_BUCKETS; b++) {
+		list_for_each(i, &dev->obj_bucket[b].list) {
+			obj = list_entry(i, struct yaffs_obj, hash_link);
+			if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+				yaffs_dir_index_free(obj);
+			else if (obj->variant_type == YAFFS_OBJECT_TYPE_FILE)
+				kfree(obj->variant.file_variant.
+				      evicted_blocks);
+		}
+	}
+
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
@@ -797,12 +854,17 @@ struct yaffs_tnode *yaffs_find_tnode_0(struct yaffs_dev *dev,
 				       struct yaffs_file_var *file_struct,
 				       u32 chunk_id)
 {
-	struct yaffs_tnode *tn = file_struct->top;
+	struct yaffs_tnode *tn;
 	u32 i;
 	int required_depth;
-	int level = file_struct->top_level;
+	int level;
 
-	(void) dev;
+	if (file_struct->evicted_tnodes)
+		yaffs_reload_tnodes(dev, container_of(file_struct,
+			struct yaffs_obj, variant.file_variant));
+
+	tn = file_struct->top;
+	level = file_struct->top_level;
 
 	/* Check sane level and chunk Id */
 	if (level < 0 || level > YAFFS_TNODES_MAX_LEVEL)
@@ -1033,8 +1095,10 @@ static int yaffs_find_del_file_chunk(struct yaffs_obj *in, int inode_chunk,
 					      inode_chunk);
 
 	/* Delete the entry in the filestructure (if found) */
-	if (ret_val != -1)
+	if (ret_val != -1) {
+		yaffs2_checkpt_log_tnode(in, inode_chunk);
 		yaffs_load_tnode_0(dev, tn, inode_chunk, 0);
+	}
 
 	return ret_val;
 }
@@ -1072,6 +1136,10 @@ int yaffs_put_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 		return YAFFS_OK;
 	}
 
+	if (yaffs_reload_tnodes(dev, in) != YAFFS_OK)
+		return YAFFS_FAIL;
+	in->evict_refused = 0;	/* worth another look once it has moved */
+
 	tn = yaffs_add_find_tnode_0(dev,
 				    &in->variant.file_variant,
 				    inode_chunk, NULL);
@@ -1167,6 +1235,7 @@ int yaffs_put_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 	if (existing_cunk == 0)
 		in->n_data_chunks++;
 
+	yaffs2_checkpt_log_tnode(in, inode_chunk);
 	yaffs_load_tnode_0(dev, tn, inode_chunk, nand_chunk);
 
 	return YAFFS_OK;
@@ -1185,6 +1254,7 @@ static void yaffs_soft_del_chunk(struct yaffs_dev *dev, int chunk)
 		the_block->soft_del_pages++;
 		dev->n_free_chunks++;
 		yaffs2_update_oldest_dirty_seq(dev, block_no, the_block);
+		yaffs_gc_index_update(dev, block_no);
 	}
 }
 
@@ -1232,6 +1302,7 @@ static int yaffs_soft_del_worker(struct yaffs_obj *in, struct yaffs_tnode *tn,
 	}
 
 	/* level 0 */
+	yaffs2_checkpt_log_tnode(in, chunk_offset << YAFFS_TNODES_LEVEL0_BITS);
 	 for (i = YAFFS_NTNODES_LEVEL0 - 1; i >= 0; i--) {
 		the_chunk = yaffs_get_group_base(dev, tn, i);
 		if (the_chunk) {
@@ -1255,8 +1326,14 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 	if (dev && dev->param.remove_obj_fn)
 		dev->param.remove_obj_fn(obj);
 
+	if (parent) {
+		yaffs_dir_index_del(parent, obj);
+		parent->variant.dir_variant.n_children--;
+	}
+
 	list_del_init(&obj->siblings);
 	obj->parent = NULL;
+	obj->checkpt_dirty = 1;
 
 	yaffs_verify_dir(parent);
 }
@@ -1289,6 +1366,9 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	obj->checkpt_dirty = 1;
+	directory->variant.dir_variant.n_children++;
+	yaffs_dir_index_add(directory, obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1357,63 +1437,134 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache
  *   provides write buffering.
  *
- *   There are a small number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache chunks are found through a hash on (object, chunk_id) and kept on
+ *   a device LRU list, free ones at the head. Each object keeps its clean
+ *   chunks on one list and its dirty chunks on another, sorted by chunk_id,
+ *   so flushing a file only visits the chunks that need writing and writes
+ *   them in file order. None of this depends on the number of caches, so
+ *   n_caches can be in the hundreds.
  */
 
-static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+static inline u32 yaffs_cache_hash(struct yaffs_dev *dev,
+				   const struct yaffs_obj *obj, int chunk_id)
+{
+	return (obj->obj_id * 0x9e3779b1 + chunk_id) & dev->cache_hash_mask;
+}
+
+static void yaffs_unhash_chunk_cache(struct yaffs_dev *dev,
+				     struct yaffs_cache *cache)
+{
+	struct yaffs_cache **p;
+
+	p = &dev->cache_hash[yaffs_cache_hash(dev, cache->object,
+					      cache->chunk_id)];
+	while (*p && *p != cache)
+		p = &(*p)->hash_next;
+	if (*p)
+		*p = cache->hash_next;
+	cache->hash_next = NULL;
+}
+
+/* Hand a cache chunk to an object. The chunk starts out clean. */
+static void yaffs_attach_chunk_cache(struct yaffs_cache *cache,
+				     struct yaffs_obj *obj, int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
+	u32 h = yaffs_cache_hash(dev, obj, chunk_id);
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
-			return 1;
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	cache->hash_next = dev->cache_hash[h];
+	dev->cache_hash[h] = cache;
+	list_add_tail(&cache->obj_link, &obj->cache_clean);
+}
+
+/* Drop whatever a cache chunk holds and put it at the head of the LRU. */
+static void yaffs_release_chunk_cache(struct yaffs_dev *dev,
+				      struct yaffs_cache *cache)
+{
+	if (!cache->object)
+		return;
+
+	yaffs_unhash_chunk_cache(dev, cache);
+	list_del_init(&cache->obj_link);
+	if (cache->dirty)
+		dev->n_dirty_caches--;
+	cache->dirty = 0;
+	cache->object = NULL;
+	list_move(&cache->lru, &dev->cache_lru);
+}
+
+static void yaffs_clean_chunk_cache(struct yaffs_dev *dev,
+				    struct yaffs_cache *cache)
+{
+	if (!cache->dirty)
+		return;
+
+	cache->dirty = 0;
+	dev->n_dirty_caches--;
+	list_move_tail(&cache->obj_link, &cache->object->cache_clean);
+}
+
+static void yaffs_dirty_chunk_cache(struct yaffs_dev *dev,
+				    struct yaffs_cache *cache)
+{
+	struct list_head *pos;
+	struct yaffs_obj *obj = cache->object;
+
+	if (cache->dirty)
+		return;
+
+	cache->dirty = 1;
+	dev->n_dirty_caches++;
+	list_del(&cache->obj_link);
+
+	/* Keep the dirty list in chunk order. Writes are mostly sequential
+	 * so the right place is nearly always at the tail.
+	 */
+	for (pos = obj->cache_dirty.prev; pos != &obj->cache_dirty;
+	     pos = pos->prev) {
+		if (list_entry(pos, struct yaffs_cache, obj_link)->chunk_id <
+		    cache->chunk_id)
+			break;
 	}
+	list_add(&cache->obj_link, pos);
+}
 
-	return 0;
+static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+{
+	return !list_empty(&obj->cache_dirty);
 }
 
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
-	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
+	struct yaffs_cache *cache = NULL;
+	int chunk_written;
 
-	if (n_caches < 1)
+	if (dev->param.n_caches < 1)
 		return;
-	do {
-		cache = NULL;
 
-		/* Find the lowest dirty chunk for this object */
-		for (i = 0; i < n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].dirty) {
-				if (!cache ||
-				    dev->cache[i].chunk_id < lowest) {
-					cache = &dev->cache[i];
-					lowest = cache->chunk_id;
-				}
-			}
-		}
+	/* Write out the dirty chunks, lowest first, and free them up */
+	while (!list_empty(&obj->cache_dirty)) {
+		cache = list_entry(obj->cache_dirty.next,
+				   struct yaffs_cache, obj_link);
+		if (cache->locked)
+			break;
 
-		if (cache && !cache->locked) {
-			/* Write it out and free it up */
-			chunk_written =
-			    yaffs_wr_data_obj(cache->object,
-					      cache->chunk_id,
-					      cache->data,
-					      cache->n_bytes, 1);
-			cache->dirty = 0;
-			cache->object = NULL;
-		}
-	} while (cache && chunk_written > 0);
+		chunk_written =
+		    yaffs_wr_data_obj(cache->object,
+				      cache->chunk_id,
+				      cache->data,
+				      cache->n_bytes, 1);
+		yaffs_release_chunk_cache(dev, cache);
+		if (chunk_written <= 0)
+			break;
+		cache = NULL;
+	}
 
 	if (cache)
 		/* Hoosterman, disk full while writing cache out. */
@@ -1428,136 +1579,103 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
+	struct yaffs_cache *cache;
 	int i;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-		}
-		if (obj)
-			yaffs_flush_file_cache(obj);
-	} while (obj);
-
+	/* Flush each object that still has dirty chunks. */
+	for (i = 0; i < dev->param.n_caches && dev->n_dirty_caches > 0; i++) {
+		cache = &dev->cache[i];
+		if (cache->object && cache->dirty)
+			yaffs_flush_file_cache(cache->object);
+	}
 }
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+/* Grab us a cache chunk for obj:chunk_id.
+ * Take the least recently used chunk. Free chunks sit at the head of the
+ * LRU so they go first. If the LRU chunk is dirty, flush its object's
+ * dirty chunks, which frees them, and take the head again.
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_obj *obj,
+						  int chunk_id)
 {
-	int i;
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_cache *cache = NULL;
+	struct yaffs_cache *c;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
+	if (dev->param.n_caches < 1)
+		return NULL;
+
+	list_for_each_entry(c, &dev->cache_lru, lru) {
+		if (!c->locked) {
+			cache = c;
+			break;
 		}
 	}
-	return NULL;
+
+	if (!cache)
+		return NULL;
+
+	if (cache->dirty) {
+		yaffs_flush_file_cache(cache->object);
+		cache = list_entry(dev->cache_lru.next,
+				   struct yaffs_cache, lru);
+		if (cache->locked)
+			return NULL;
+	}
+
+	yaffs_release_chunk_cache(dev, cache);
+	yaffs_attach_chunk_cache(cache, obj, chunk_id);
+	return cache;
 }
 
-static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
+/* Look for a cached chunk without counting it as a hit */
+static struct yaffs_cache *yaffs_lookup_chunk_cache(const struct yaffs_obj *obj,
+						    int chunk_id)
 {
+	struct yaffs_dev *dev = obj->my_dev;
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	/* Try find a non-dirty one... */
-
-	cache = yaffs_grab_chunk_worker(dev);
-
-	if (!cache) {
-		/* They were all dirty, find the LRU object and flush
-		 * its cache, then  find again.
-		 * NB what's here is not very accurate,
-		 * we actually flush the object with the LRU chunk.
-		 */
-
-		/* With locking we can't assume we can use entry zero,
-		 * Set the_obj to a valid pointer for Coverity. */
-		the_obj = dev->cache[0].object;
-		usage = -1;
-		cache = NULL;
-		pushout = -1;
-
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object &&
-			    !dev->cache[i].locked &&
-			    (dev->cache[i].last_use < usage ||
-			    !cache)) {
-				usage = dev->cache[i].last_use;
-				the_obj = dev->cache[i].object;
-				cache = &dev->cache[i];
-				pushout = i;
-			}
-		}
-
-		if (!cache || cache->dirty) {
-			/* Flush and try again */
-			yaffs_flush_file_cache(the_obj);
-			cache = yaffs_grab_chunk_worker(dev);
-		}
+	cache = dev->cache_hash[yaffs_cache_hash(dev, obj, chunk_id)];
+	for (; cache; cache = cache->hash_next) {
+		if (cache->object == obj && cache->chunk_id == chunk_id)
+			return cache;
 	}
-	return cache;
+	return NULL;
 }
 
 /* Find a cached chunk */
 static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
-	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-
-	if (dev->param.n_caches < 1)
-		return NULL;
-
-	for (i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].object == obj &&
-		    dev->cache[i].chunk_id == chunk_id) {
-			dev->cache_hits++;
+	struct yaffs_cache *cache = yaffs_lookup_chunk_cache(obj, chunk_id);
 
-			return &dev->cache[i];
-		}
-	}
-	return NULL;
+	if (cache)
+		obj->my_dev->cache_hits++;
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
-	int i;
-
 	if (dev->param.n_caches < 1)
 		return;
 
-	if (dev->cache_last_use < 0 ||
-		dev->cache_last_use > 100000000) {
-		/* Reset the cache usages */
-		for (i = 1; i < dev->param.n_caches; i++)
-			dev->cache[i].last_use = 0;
-
-		dev->cache_last_use = 0;
-	}
-	dev->cache_last_use++;
-	cache->last_use = dev->cache_last_use;
+	list_move_tail(&cache->lru, &dev->cache_lru);
 
 	if (is_write)
-		cache->dirty = 1;
+		yaffs_dirty_chunk_cache(dev, cache);
+}
+
+/* Is there flash space for one more dirty cache chunk on top of the ones
+ * already promised?
+ */
+static int yaffs_cache_space_available(struct yaffs_dev *dev)
+{
+	return yaffs_check_alloc_available(dev, dev->n_dirty_caches + 1);
 }
 
 /* Invalidate a single cache page.
@@ -1572,7 +1690,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		cache = yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_release_chunk_cache(object->my_dev, cache);
 	}
 }
 
@@ -1581,15 +1699,18 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	struct yaffs_cache *next;
 
 	if (dev->param.n_caches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
-		}
+		list_for_each_entry_safe(cache, next, &in->cache_dirty,
+					 obj_link)
+			yaffs_release_chunk_cache(dev, cache);
+		list_for_each_entry_safe(cache, next, &in->cache_clean,
+					 obj_link)
+			yaffs_release_chunk_cache(dev, cache);
 	}
 }
 
@@ -1618,11 +1739,18 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 	dev = obj->my_dev;
 	yaffs_trace(YAFFS_TRACE_OS, "FreeObject %p inode %p",
 		obj, obj->my_inode);
+	yaffs2_checkpt_log_free(obj);
 	if (obj->parent)
 		BUG();
 	if (!list_empty(&obj->siblings))
 		BUG();
 
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_dir_index_free(obj);
+
+	/* Cache chunks must not outlive the object they point at */
+	yaffs_invalidate_whole_cache(obj);
+
 	if (obj->my_inode) {
 		/* We're still hooked up to a cached inode.
 		 * Don't delete now, but mark for later deletion
@@ -1633,6 +1761,12 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 
 	yaffs_unhash_obj(obj);
 
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_FILE) {
+		dev->n_evicted_tnodes -=
+		    obj->variant.file_variant.evicted_tnodes;
+		kfree(obj->variant.file_variant.evicted_blocks);
+	}
+
 	yaffs_free_raw_obj(dev, obj);
 	dev->n_obj--;
 	dev->checkpoint_blocks_required = 0;	/* force recalculation */
@@ -1644,6 +1778,394 @@ void yaffs_handle_defered_free(struct yaffs_obj *obj)
 		yaffs_free_obj(obj);
 }
 
+static void yaffs_free_tnode_tree(struct yaffs_dev *dev,
+				  struct yaffs_tnode *tn, u32 level)
+{
+	int i;
+
+	if (!tn)
+		return;
+
+	if (level > 0)
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_free_tnode_tree(dev, tn->internal[i], level - 1);
+
+	yaffs_free_tnode(dev, tn);
+}
+
+/*--------------------- Tnode eviction -----------------------
+ *
+ * The tnode tree of a file nobody has open can be dropped to give RAM back
+ * under memory pressure. The NAND still knows where the file's data is:
+ * every live chunk carries its object and chunk id in its tags, so the tree
+ * can be rebuilt by reading the tags of the live chunks, or the block
+ * summaries where there are any. Only the blocks the file's chunks were in
+ * when its tree went need reading, and the chunks of an evicted file do not
+ * move: whatever would move them needs the tree back first. So the list of
+ * those blocks is kept, a tree is only dropped if they are not many more
+ * than the file fills, and when a checkpoint needs every tree they are
+ * rebuilt in one pass over the device.
+ */
+
+/* How many times the blocks a file fills its chunks may be spread over */
+#define YAFFS_EVICT_MAX_SPREAD	4
+
+static int yaffs_can_evict(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_file_var *file_struct = &obj->variant.file_variant;
+
+	/* A file with changes waiting for a checkpoint delta would only be
+	 * rebuilt again for the delta */
+	if (obj->checkpt_dirty && dev->param.is_yaffs2 &&
+	    !dev->param.skip_checkpt_wr)
+		return 0;
+
+	return obj->variant_type == YAFFS_OBJECT_TYPE_FILE &&
+	    !obj->my_inode && !obj->evict_refused &&
+	    !obj->deleted && !obj->soft_del && !obj->unlinked &&
+	    !obj->defered_free && !yaffs_obj_cache_dirty(obj) &&
+	    obj->n_data_chunks > 0 &&
+	    !file_struct->evicted_tnodes &&
+	    file_struct->top && file_struct->top_level > 0;
+}
+
+/* Marks in map, one bit per block, the blocks the chunks of a tree are in.
+ * Returns how many were not marked yet.
+ */
+static int yaffs_tnode_blocks(struct yaffs_dev *dev, struct yaffs_tnode *tn,
+			      u32 level, u8 *map)
+{
+	u32 base;
+	int n = 0;
+	int blk;
+	int bit;
+	int i;
+
+	if (!tn)
+		return 0;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			n += yaffs_tnode_blocks(dev, tn->internal[i],
+						level - 1, map);
+		return n;
+	}
+
+	for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+		base = yaffs_get_group_base(dev, tn, i);
+		if (!base)
+			continue;
+		for (blk = base / dev->param.chunks_per_block;
+		     blk <= (base + dev->chunk_grp_size - 1) /
+		     dev->param.chunks_per_block; blk++) {
+			bit = blk - dev->internal_start_block;
+			if (!(map[bit / 8] & (1 << (bit & 7)))) {
+				map[bit / 8] |= 1 << (bit & 7);
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+/* Drops the trees of about n_wanted tnodes. Returns how many went. */
+int yaffs_evict_tnodes(struct yaffs_dev *dev, int n_wanted)
+{
+	struct yaffs_file_var *file_struct;
+	struct yaffs_obj *obj;
+	struct list_head *i;
+	int n_freed = 0;
+	int n_before;
+	int n_blocks;
+	int map_bytes;
+	u8 *map;
+	int *blocks;
+	int blk;
+	int b;
+
+	map_bytes = (dev->internal_end_block - dev->internal_start_block) /
+	    8 + 1;
+	map = kmalloc(map_bytes, GFP_NOFS);
+	if (!map)
+		return 0;
+
+	for (b = 0; n_freed < n_wanted && b < YAFFS_NOBJECT_BUCKETS; b++) {
+		dev->evict_bucket = (dev->evict_bucket + 1) %
+		    YAFFS_NOBJECT_BUCKETS;
+		list_for_each(i, &dev->obj_bucket[dev->evict_bucket].list) {
+			obj = list_entry(i, struct yaffs_obj, hash_link);
+			if (!yaffs_can_evict(obj))
+				continue;
+
+			file_struct = &obj->variant.file_variant;
+			memset(map, 0, map_bytes);
+			n_blocks = yaffs_tnode_blocks(dev, file_struct->top,
+						      file_struct->top_level,
+						      map);
+			if (n_blocks > YAFFS_EVICT_MAX_SPREAD *
+			    (obj->n_data_chunks /
+			     dev->param.chunks_per_block + 1)) {
+				obj->evict_refused = 1;
+				continue;
+			}
+
+			blocks = kmalloc(n_blocks * sizeof(int), GFP_NOFS);
+			if (!blocks)
+				break;
+			file_struct->evicted_blocks = blocks;
+			file_struct->n_evicted_blocks = n_blocks;
+			for (blk = 0; n_blocks; blk++) {
+				if (map[blk / 8] & (1 << (blk & 7))) {
+					*blocks++ = blk +
+					    dev->internal_start_block;
+					n_blocks--;
+				}
+			}
+
+			n_before = dev->n_tnodes;
+			yaffs_free_tnode_tree(dev, file_struct->top,
+					      file_struct->top_level);
+			file_struct->top = NULL;
+			file_struct->top_level = 0;
+			file_struct->evicted_tnodes = n_before - dev->n_tnodes;
+			dev->n_evicted_tnodes += file_struct->evicted_tnodes;
+			n_freed += file_struct->evicted_tnodes;
+			dev->tnode_evictions++;
+		}
+	}
+	kfree(map);
+
+	if (n_freed)
+		yaffs_trace(YAFFS_TRACE_ALLOCATE,
+			"evicted %d tnodes", n_freed);
+	return n_freed;
+}
+
+/* About how many tnodes yaffs_evict_tnodes() could free, for a shrinker.
+ * Trees are sized from the number of chunks rather than walked, and those
+ * yaffs_evict_tnodes() would find too spread out are counted until it has
+ * looked at them.
+ */
+int yaffs_evictable_tnodes(struct yaffs_dev *dev)
+{
+	struct yaffs_obj *obj;
+	struct list_head *i;
+	int n = 0;
+	int n0;
+	int b;
+
+	for (b = 0; b < YAFFS_NOBJECT_BUCKETS; b++) {
+		list_for_each(i, &dev->obj_bucket[b].list) {
+			obj = list_entry(i, struct yaffs_obj, hash_link);
+			if (!yaffs_can_evict(obj))
+				continue;
+			n0 = (obj->n_data_chunks >> YAFFS_TNODES_LEVEL0_BITS) +
+			    1;
+			n += n0 + n0 / (YAFFS_NTNODES_INTERNAL - 1) +
+			    obj->variant.file_variant.top_level;
+		}
+	}
+	return n;
+}
+
+/* Works out which evicted file, if any, a live chunk belongs to */
+static struct yaffs_obj *yaffs_reload_target(struct yaffs_dev *dev,
+					     struct yaffs_obj *only,
+					     struct yaffs_ext_tags *tags)
+{
+	struct yaffs_obj *obj;
+
+	if (!tags->chunk_used || tags->chunk_id < 1 ||
+	    tags->ecc_result > YAFFS_ECC_RESULT_FIXED)
+		return NULL;
+
+	if (only)
+		obj = (tags->obj_id == only->obj_id) ? only : NULL;
+	else
+		obj = yaffs_find_by_number(dev, tags->obj_id);
+
+	if (!obj || obj->variant_type != YAFFS_OBJECT_TYPE_FILE ||
+	    !obj->variant.file_variant.evicted_tnodes)
+		return NULL;
+	return obj;
+}
+
+static int yaffs_reload_scan(struct yaffs_dev *dev, struct yaffs_obj *only)
+{
+	struct yaffs_summary_tags *st = NULL;
+	struct yaffs_block_info *bi;
+	struct yaffs_ext_tags tags;
+	struct yaffs_obj *obj;
+	struct yaffs_tnode *tn;
+	int have_summary;
+	int n_blocks;
+	int chunk;
+	int blk;
+	int c;
+	int k;
+
+	if (dev->sum_tags)
+		st = kmalloc(yaffs_summary_tags_bytes(dev), GFP_NOFS);
+
+	n_blocks = only ? only->variant.file_variant.n_evicted_blocks :
+	    dev->internal_end_block - dev->internal_start_block + 1;
+
+	for (k = 0; k < n_blocks; k++) {
+		blk = only ? only->variant.file_variant.evicted_blocks[k] :
+		    dev->internal_start_block + k;
+		bi = yaffs_get_block_info(dev, blk);
+		if (bi->pages_in_use < 1 ||
+		    (bi->block_state != YAFFS_BLOCK_STATE_FULL &&
+		     bi->block_state != YAFFS_BLOCK_STATE_ALLOCATING &&
+		     bi->block_state != YAFFS_BLOCK_STATE_COLLECTING))
+			continue;
+
+		have_summary = st && bi->has_summary &&
+		    yaffs_summary_read(dev, st, blk) == YAFFS_OK;
+
+		for (c = 0; c < dev->param.chunks_per_block; c++) {
+			if (!yaffs_check_chunk_bit(dev, blk, c))
+				continue;
+
+			chunk = blk * dev->param.chunks_per_block + c;
+			if (have_summary && c < dev->chunks_per_summary)
+				yaffs_summary_unpack(dev, st, &tags, c);
+			else
+				yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
+							 &tags);
+
+			obj = yaffs_reload_target(dev, only, &tags);
+			if (!obj)
+				continue;
+
+			tn = yaffs_add_find_tnode_0(dev,
+						    &obj->variant.file_variant,
+						    tags.chunk_id, NULL);
+			if (!tn) {
+				kfree(st);
+				return YAFFS_FAIL;
+			}
+			yaffs_load_tnode_0(dev, tn, tags.chunk_id, chunk);
+		}
+	}
+
+	kfree(st);
+	return YAFFS_OK;
+}
+
+/* Starts (or, if done is set, finishes) the rebuild of one file's tree */
+static int yaffs_reload_file(struct yaffs_obj *obj, int done, int result)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_file_var *file_struct = &obj->variant.file_variant;
+
+	if (!done) {
+		file_struct->top = yaffs_get_tnode(dev);
+		file_struct->top_level = 0;
+		return file_struct->top ? YAFFS_OK : YAFFS_FAIL;
+	}
+
+	if (result != YAFFS_OK) {
+		yaffs_free_tnode_tree(dev, file_struct->top,
+				      file_struct->top_level);
+		file_struct->top = NULL;
+		file_struct->top_level = 0;
+		return YAFFS_FAIL;
+	}
+
+	dev->n_evicted_tnodes -= file_struct->evicted_tnodes;
+	file_struct->evicted_tnodes = 0;
+	kfree(file_struct->evicted_blocks);
+	file_struct->evicted_blocks = NULL;
+	file_struct->n_evicted_blocks = 0;
+	dev->tnode_reloads++;
+	return YAFFS_OK;
+}
+
+/*
+ * Rebuilds the tree of obj if it was evicted, reading only the blocks its
+ * chunks are in, or, if obj is NULL, the trees of every evicted file in one
+ * pass over the NAND.
+ */
+int yaffs_reload_tnodes(struct yaffs_dev *dev, struct yaffs_obj *obj)
+{
+	struct list_head *i;
+	struct yaffs_obj *l;
+	int result = YAFFS_OK;
+	int done;
+	int b;
+
+	if (obj && !obj->variant.file_variant.evicted_tnodes)
+		return YAFFS_OK;
+	if (!obj && !dev->n_evicted_tnodes)
+		return YAFFS_OK;
+
+	yaffs_trace(YAFFS_TRACE_ALLOCATE,
+		"reloading tnodes of %d", obj ? obj->obj_id : 0);
+
+	for (done = 0; done < 2; done++) {
+		if (obj) {
+			if (yaffs_reload_file(obj, done, result) != YAFFS_OK)
+				result = YAFFS_FAIL;
+		} else {
+			for (b = 0; b < YAFFS_NOBJECT_BUCKETS; b++) {
+				list_for_each(i, &dev->obj_bucket[b].list) {
+					l = list_entry(i, struct yaffs_obj,
+						       hash_link);
+					if (l->variant_type ==
+					    YAFFS_OBJECT_TYPE_FILE &&
+					    l->variant.file_variant.
+					    evicted_tnodes &&
+					    yaffs_reload_file(l, done, result)
+					    != YAFFS_OK)
+						result = YAFFS_FAIL;
+				}
+			}
+		}
+		if (!done && result == YAFFS_OK)
+			result = yaffs_reload_scan(dev, obj);
+	}
+
+	if (result != YAFFS_OK)
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"yaffs: could not reload tnodes");
+	return result;
+}
+
+/* Drops an object from RAM without touching NAND. Used when a checkpoint
+ * says the object has gone since an earlier part of the checkpoint was
+ * read in.
+ */
+void yaffs_forget_obj(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct list_head *children = &obj->variant.dir_variant.children;
+	struct yaffs_obj *child;
+
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY) {
+		/* Anything still in here gets sorted out by a later
+		 * record, or else stays in lost+found */
+		while (!list_empty(children)) {
+			child = list_entry(children->next,
+					   struct yaffs_obj, siblings);
+			if (dev->lost_n_found && dev->lost_n_found != obj)
+				yaffs_add_obj_to_dir(dev->lost_n_found, child);
+			else
+				yaffs_remove_obj_from_dir(child);
+		}
+	} else if (obj->variant_type == YAFFS_OBJECT_TYPE_FILE) {
+		yaffs_free_tnode_tree(dev, obj->variant.file_variant.top,
+				      obj->variant.file_variant.top_level);
+		obj->variant.file_variant.top = NULL;
+	}
+
+	list_del_init(&obj->hard_links);
+	if (obj->parent)
+		yaffs_remove_obj_from_dir(obj);
+	yaffs_free_obj(obj);
+}
+
 static int yaffs_generic_obj_del(struct yaffs_obj *in)
 {
 	/* Iinvalidate the file's data in the cache, without flushing. */
@@ -1681,11 +2203,13 @@ static void yaffs_soft_del_file(struct yaffs_obj *obj)
 			obj->obj_id);
 		yaffs_generic_obj_del(obj);
 	} else {
+		yaffs_reload_tnodes(obj->my_dev, obj);
 		yaffs_soft_del_worker(obj,
 				      obj->variant.file_variant.top,
 				      obj->variant.
 				      file_variant.top_level, 0);
 		obj->soft_del = 1;
+		obj->checkpt_dirty = 1;
 	}
 }
 
@@ -1812,12 +2336,16 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 	INIT_LIST_HEAD(&(obj->hard_links));
 	INIT_LIST_HEAD(&(obj->hash_link));
 	INIT_LIST_HEAD(&obj->siblings);
+	INIT_LIST_HEAD(&obj->cache_clean);
+	INIT_LIST_HEAD(&obj->cache_dirty);
 
 	/* Now make the directory sane */
 	if (dev->root_dir) {
 		obj->parent = dev->root_dir;
 		list_add(&(obj->siblings),
 			 &dev->root_dir->variant.dir_variant.children);
+		dev->root_dir->variant.dir_variant.n_children++;
+		/* It has no name yet, so it stays out of the index */
 	}
 
 	/* Add it to the lost and found directory.
@@ -1937,6 +2465,7 @@ static struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 	the_obj->fake = 0;
 	the_obj->rename_allowed = 1;
 	the_obj->unlink_allowed = 1;
+	the_obj->checkpt_dirty = 1;
 	the_obj->obj_id = number;
 	yaffs_hash_obj(the_obj);
 	the_obj->variant_type = type;
@@ -1954,6 +2483,8 @@ static struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 	case YAFFS_OBJECT_TYPE_DIRECTORY:
 		INIT_LIST_HEAD(&the_obj->variant.dir_variant.children);
 		INIT_LIST_HEAD(&the_obj->variant.dir_variant.dirty);
+		the_obj->variant.dir_variant.n_children = 0;
+		the_obj->variant.dir_variant.index = NULL;
 		break;
 	case YAFFS_OBJECT_TYPE_SYMLINK:
 	case YAFFS_OBJECT_TYPE_HARDLINK:
@@ -1996,6 +2527,7 @@ static void yaffs_init_tnodes_and_objs(struct yaffs_dev *dev)
 
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
+	dev->n_evicted_tnodes = 0;
 	yaffs_init_raw_tnodes_and_objs(dev);
 
 	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
@@ -2031,7 +2563,7 @@ YCHAR *yaffs_clone_str(const YCHAR *str)
 	len = strnlen(str, YAFFS_MAX_ALIAS_LENGTH);
 	new_str = kmalloc((len + 1) * sizeof(YCHAR), GFP_NOFS);
 	if (new_str) {
-		strncpy(new_str, str, len);
+		memcpy(new_str, str, len * sizeof(YCHAR));
 		new_str[len] = 0;
 	}
 	return new_str;
@@ -2237,6 +2769,247 @@ struct yaffs_obj *yaffs_link_obj(struct yaffs_obj *parent, const YCHAR * name,
 
 /*---------------------- Block Management and Page Allocation -------------*/
 
+/*
+ * GC victim index, see struct yaffs_gc_link.
+ */
+
+static inline struct yaffs_gc_link *yaffs_gc_link(struct yaffs_dev *dev,
+						  int block)
+{
+	return &dev->gc_links[block - dev->internal_start_block];
+}
+
+/* The bucket a block belongs in, -1 if it is not a gc candidate */
+static int yaffs_gc_bucket_of(struct yaffs_dev *dev,
+			      struct yaffs_block_info *bi)
+{
+	int live = bi->pages_in_use - bi->soft_del_pages;
+
+	if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+	    live < 0 || live >= dev->param.chunks_per_block)
+		return -1;
+	return live;
+}
+
+static void yaffs_gc_index_clear(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int i;
+
+	if (!dev->gc_links)
+		return;
+
+	for (i = 0; i < n_blocks; i++) {
+		dev->gc_links[i].next = 0;
+		dev->gc_links[i].prev = 0;
+		dev->gc_links[i].bucket = -1;
+	}
+	memset(dev->gc_buckets, 0,
+	       dev->param.chunks_per_block * sizeof(struct yaffs_gc_bucket));
+	dev->gc_min_bucket = dev->param.chunks_per_block;
+}
+
+static void yaffs_gc_index_del(struct yaffs_dev *dev, int block)
+{
+	struct yaffs_gc_link *l = yaffs_gc_link(dev, block);
+	struct yaffs_gc_bucket *b;
+
+	if (l->bucket < 0)
+		return;
+
+	b = &dev->gc_buckets[l->bucket];
+	if (l->prev)
+		yaffs_gc_link(dev, l->prev)->next = l->next;
+	else
+		b->head = l->next;
+	if (l->next)
+		yaffs_gc_link(dev, l->next)->prev = l->prev;
+	else
+		b->tail = l->prev;
+
+	l->next = 0;
+	l->prev = 0;
+	l->bucket = -1;
+}
+
+static void yaffs_gc_index_add(struct yaffs_dev *dev, int block, int bucket)
+{
+	struct yaffs_gc_link *l = yaffs_gc_link(dev, block);
+	struct yaffs_gc_bucket *b = &dev->gc_buckets[bucket];
+
+	l->bucket = bucket;
+	l->next = 0;
+	l->prev = b->tail;
+	if (b->tail)
+		yaffs_gc_link(dev, b->tail)->next = block;
+	else
+		b->head = block;
+	b->tail = block;
+
+	if (bucket < dev->gc_min_bucket)
+		dev->gc_min_bucket = bucket;
+}
+
+/* Called whenever a block's state or live page count may have changed. */
+static void yaffs_gc_index_update(struct yaffs_dev *dev, int block)
+{
+	int bucket;
+
+	if (!dev->gc_links)
+		return;
+
+	bucket = yaffs_gc_bucket_of(dev, yaffs_get_block_info(dev, block));
+	if (bucket == yaffs_gc_link(dev, block)->bucket)
+		return;
+
+	yaffs_gc_index_del(dev, block);
+	if (bucket >= 0)
+		yaffs_gc_index_add(dev, block, bucket);
+}
+
+struct yaffs_gc_rebuild {
+	u32 seq;
+	int block;
+};
+
+static int yaffs_gc_rebuild_cmp(const void *a, const void *b)
+{
+	const struct yaffs_gc_rebuild *ra = a;
+	const struct yaffs_gc_rebuild *rb = b;
+
+	if (ra->seq != rb->seq)
+		return (ra->seq < rb->seq) ? -1 : 1;
+	return ra->block - rb->block;
+}
+
+/* Builds the index from scratch after a scan or checkpoint restore. The
+ * blocks go in oldest first so that plain selection prefers old data
+ * when there is a choice.
+ */
+static void yaffs_gc_index_rebuild(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	struct yaffs_gc_rebuild *order;
+	struct yaffs_block_info *bi;
+	int alt = 0;
+	int n = 0;
+	int bucket;
+	int i;
+
+	if (!dev->gc_links)
+		return;
+
+	yaffs_gc_index_clear(dev);
+
+	order = kmalloc(n_blocks * sizeof(*order), GFP_NOFS);
+	if (!order) {
+		order = vmalloc(n_blocks * sizeof(*order));
+		alt = 1;
+	}
+
+	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++) {
+		bi = yaffs_get_block_info(dev, i);
+		bucket = yaffs_gc_bucket_of(dev, bi);
+		if (bucket < 0)
+			continue;
+		if (order) {
+			order[n].seq = bi->seq_number;
+			order[n].block = i;
+			n++;
+		} else {
+			/* No memory to sort, just lose the ordering */
+			yaffs_gc_index_add(dev, i, bucket);
+		}
+	}
+
+	if (!order)
+		return;
+
+	sort(order, n, sizeof(*order), yaffs_gc_rebuild_cmp, NULL);
+	for (i = 0; i < n; i++) {
+		bi = yaffs_get_block_info(dev, order[i].block);
+		yaffs_gc_index_add(dev, order[i].block,
+				   yaffs_gc_bucket_of(dev, bi));
+	}
+
+	if (alt)
+		vfree(order);
+	else
+		kfree(order);
+}
+
+/* Finds the block to collect among those with at most max_live live
+ * pages, giving up after looking at max_look blocks that cannot be used.
+ *
+ * Plain selection takes the dirtiest block, which is the head of the
+ * lowest list. Cost-benefit selection weighs the pages freed against the
+ * pages copied, free / (total + live), times the age of the block's data
+ * by sequence number: old data is likely to stay live, so its block is
+ * worth collecting before it is the dirtiest, which gets the data out of
+ * the way of blocks that are still being overwritten. That means looking
+ * at every block on the lists, so every block counts against max_look.
+ */
+static unsigned yaffs_gc_index_find(struct yaffs_dev *dev, int max_live,
+				    int max_look, unsigned *live_out)
+{
+	int cpb = dev->param.chunks_per_block;
+	struct yaffs_block_info *bi;
+	unsigned best = 0;
+	int best_live = 0;
+	u64 best_age = 0;
+	u64 age;
+	int block;
+	int next;
+	int k;
+
+	while (dev->gc_min_bucket < cpb &&
+	       !dev->gc_buckets[dev->gc_min_bucket].head)
+		dev->gc_min_bucket++;
+
+	if (max_live >= cpb)
+		max_live = cpb - 1;
+
+	for (k = dev->gc_min_bucket; k <= max_live && max_look > 0; k++) {
+		for (block = dev->gc_buckets[k].head;
+		     block && max_look > 0; block = next) {
+			next = yaffs_gc_link(dev, block)->next;
+			bi = yaffs_get_block_info(dev, block);
+
+			if (yaffs_gc_bucket_of(dev, bi) != k) {
+				/* Should not happen, but put it right */
+				yaffs_gc_index_update(dev, block);
+				continue;
+			}
+
+			if (!yaffs_block_ok_for_gc(dev, bi)) {
+				max_look--;
+				continue;
+			}
+
+			if (!dev->param.gc_cost_benefit) {
+				*live_out = k;
+				return block;
+			}
+
+			/* Compare age * (cpb - k) / (cpb + k) against the
+			 * best so far without dividing.
+			 */
+			max_look--;
+			age = dev->seq_number - bi->seq_number + 1;
+			if (!best ||
+			    age * (cpb - k) * (cpb + best_live) >
+			    best_age * (cpb - best_live) * (cpb + k)) {
+				best = block;
+				best_live = k;
+				best_age = age;
+			}
+		}
+	}
+
+	*live_out = best_live;
+	return best;
+}
+
 static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 {
 	if (dev->block_info_alt && dev->block_info)
@@ -2254,6 +3027,16 @@ static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 		kfree(dev->chunk_bits);
 	dev->chunk_bits_alt = 0;
 	dev->chunk_bits = NULL;
+
+	if (dev->gc_links_alt && dev->gc_links)
+		vfree(dev->gc_links);
+	else
+		kfree(dev->gc_links);
+	dev->gc_links_alt = 0;
+	dev->gc_links = NULL;
+
+	kfree(dev->gc_buckets);
+	dev->gc_buckets = NULL;
 }
 
 static int yaffs_init_blocks(struct yaffs_dev *dev)
@@ -2295,6 +3078,33 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 
 	memset(dev->block_info, 0, n_blocks * sizeof(struct yaffs_block_info));
 	memset(dev->chunk_bits, 0, dev->chunk_bit_stride * n_blocks);
+
+	/* The gc index is optional, without it gc searches the blocks */
+	dev->gc_links =
+		kmalloc(n_blocks * sizeof(struct yaffs_gc_link), GFP_NOFS);
+	if (!dev->gc_links) {
+		dev->gc_links =
+		    vmalloc(n_blocks * sizeof(struct yaffs_gc_link));
+		dev->gc_links_alt = 1;
+	} else {
+		dev->gc_links_alt = 0;
+	}
+	dev->gc_buckets = kmalloc(dev->param.chunks_per_block *
+				  sizeof(struct yaffs_gc_bucket), GFP_NOFS);
+	if (!dev->gc_links || !dev->gc_buckets) {
+		yaffs_trace(YAFFS_TRACE_ALWAYS,
+			"yaffs: no memory for the gc index, using a search");
+		if (dev->gc_links_alt && dev->gc_links)
+			vfree(dev->gc_links);
+		else
+			kfree(dev->gc_links);
+		kfree(dev->gc_buckets);
+		dev->gc_links = NULL;
+		dev->gc_buckets = NULL;
+		dev->gc_links_alt = 0;
+	}
+	yaffs_gc_index_clear(dev);
+
 	return YAFFS_OK;
 
 alloc_error:
@@ -2321,6 +3131,7 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	yaffs2_clear_oldest_dirty_seq(dev, bi);
 
 	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_gc_index_update(dev, block_no);
 
 	/* If this is the block being garbage collected then stop gc'ing */
 	if (block_no == dev->gc_block)
@@ -2454,6 +3265,7 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 		bi->soft_del_pages--;
 
 		object->n_data_chunks--;
+		object->checkpt_dirty = 1;
 		if (object->n_data_chunks <= 0) {
 			/* remeber to clean up obj */
 			dev->gc_cleanup_list[dev->n_clean_ups] = tags.obj_id;
@@ -2514,6 +3326,7 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 				/* It's a header */
 				object->hdr_chunk = new_chunk;
 				object->serial = tags.serial_number;
+				object->checkpt_dirty = 1;
 			} else {
 				/* It's a data chunk */
 				yaffs_put_chunk_in_file(object, tags.chunk_id,
@@ -2546,8 +3359,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 
 	/*yaffs_verify_free_chunks(dev); */
 
-	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
+	if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
+		yaffs_gc_index_update(dev, block);
+	}
 
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
@@ -2593,6 +3408,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		 * because checkpointing does not restore gc.
 		 */
 		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		yaffs_gc_index_update(dev, block);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2710,6 +3526,13 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				iterations = 100;
 		}
 
+		if (dev->gc_links) {
+			dev->gc_dirtiest = yaffs_gc_index_find(dev, threshold,
+						iterations,
+						&dev->gc_pages_in_use);
+			iterations = 0;
+		}
+
 		for (i = 0;
 		     i < iterations &&
 		     (dev->gc_dirtiest < 1 ||
@@ -2893,34 +3716,110 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
  * Garbage collects. Intended to be called from a background thread.
  * Returns non-zero if at least half the free chunks are erased.
  */
-int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
+int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
+{
+	int erased_chunks = dev->n_erased_blocks * dev->param.chunks_per_block;
+
+	yaffs_trace(YAFFS_TRACE_BACKGROUND, "Background gc %u", urgency);
+
+	yaffs_check_gc(dev, 1);
+	return erased_chunks > dev->n_free_chunks / 2;
+}
+
+/*-------------------- Data file manipulation -----------------*/
+
+static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
+{
+	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
+
+	if (nand_chunk >= 0)
+		return yaffs_rd_chunk_tags_nand(in->my_dev, nand_chunk,
+						buffer, NULL);
+	else {
+		yaffs_trace(YAFFS_TRACE_NANDACCESS,
+			"Chunk %d not found zero instead",
+			nand_chunk);
+		/* get sane (zero) data if you read a hole */
+		memset(buffer, 0, in->my_dev->data_bytes_per_chunk);
+		return 0;
+	}
+
+}
+
+/* Resolve the NAND chunks behind n_chunks consecutive file chunks, -1 for
+ * holes. Each level 0 tnode covers YAFFS_NTNODES_LEVEL0 file chunks so the
+ * tree is only walked when crossing into the next one.
+ */
+static void yaffs_find_chunk_run(struct yaffs_obj *in, int inode_chunk,
+				 int n_chunks, int *nand_chunks)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_tnode *tn = NULL;
+	struct yaffs_ext_tags tags;
+	int the_chunk;
+	int chunk;
+	int i;
+
+	for (i = 0; i < n_chunks; i++) {
+		chunk = inode_chunk + i;
+		if (i == 0 || (chunk & YAFFS_TNODES_LEVEL0_MASK) == 0)
+			tn = yaffs_find_tnode_0(dev, &in->variant.file_variant,
+						chunk);
+		if (!tn) {
+			nand_chunks[i] = -1;
+			continue;
+		}
+		the_chunk = yaffs_get_group_base(dev, tn, chunk);
+		nand_chunks[i] = yaffs_find_chunk_in_group(dev, the_chunk, &tags,
+							   in->obj_id, chunk);
+	}
+}
+
+/* Read n_chunks whole file chunks into buffer. Runs of physically
+ * consecutive chunks go to the driver as one read. If a batch fails or
+ * reports any ECC activity, its chunks are read again one at a time so
+ * that the usual per chunk error handling applies.
+ */
+static void yaffs_rd_data_run(struct yaffs_obj *in, int inode_chunk,
+			      int n_chunks, u8 *buffer)
 {
-	int erased_chunks = dev->n_erased_blocks * dev->param.chunks_per_block;
+	struct yaffs_dev *dev = in->my_dev;
+	int nand_chunks[YAFFS_MAX_RD_RUN];
+	enum yaffs_ecc_result ecc_result;
+	int bytes = dev->data_bytes_per_chunk;
+	int i;
+	int j;
+	int k;
 
-	yaffs_trace(YAFFS_TRACE_BACKGROUND, "Background gc %u", urgency);
+	yaffs_find_chunk_run(in, inode_chunk, n_chunks, nand_chunks);
 
-	yaffs_check_gc(dev, 1);
-	return erased_chunks > dev->n_free_chunks / 2;
-}
+	for (i = 0; i < n_chunks; i = j) {
+		if (nand_chunks[i] < 0) {
+			/* get sane (zero) data if you read a hole */
+			memset(buffer + i * bytes, 0, bytes);
+			j = i + 1;
+			continue;
+		}
 
-/*-------------------- Data file manipulation -----------------*/
+		for (j = i + 1; j < n_chunks; j++) {
+			if (nand_chunks[j] != nand_chunks[j - 1] + 1)
+				break;
+		}
 
-static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
-{
-	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
+		if (j - i > 1 &&
+		    yaffs_rd_chunks_nand(dev, nand_chunks[i], j - i,
+					 buffer + i * bytes,
+					 &ecc_result) == YAFFS_OK &&
+		    ecc_result == YAFFS_ECC_RESULT_NO_ERROR) {
+			dev->n_page_reads += j - i;
+			dev->n_multi_reads++;
+			continue;
+		}
 
-	if (nand_chunk >= 0)
-		return yaffs_rd_chunk_tags_nand(in->my_dev, nand_chunk,
-						buffer, NULL);
-	else {
-		yaffs_trace(YAFFS_TRACE_NANDACCESS,
-			"Chunk %d not found zero instead",
-			nand_chunk);
-		/* get sane (zero) data if you read a hole */
-		memset(buffer, 0, in->my_dev->data_bytes_per_chunk);
-		return 0;
+		for (k = i; k < j; k++)
+			yaffs_rd_chunk_tags_nand(dev, nand_chunks[k],
+						 buffer + k * bytes, NULL);
 	}
-
 }
 
 void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
@@ -2971,6 +3870,7 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		dev->n_free_chunks++;
 		yaffs_clear_chunk_bit(dev, block, page);
 		bi->pages_in_use--;
+		yaffs_gc_index_update(dev, block);
 
 		if (bi->pages_in_use == 0 &&
 		    !bi->has_shrink_hdr &&
@@ -3157,6 +4057,39 @@ int yaffs_list_xattrib(struct yaffs_obj *obj, char *buffer, int size)
 	return yaffs_do_xattrib_fetch(obj, NULL, buffer, size);
 }
 
+/* Where a header read ahead by the OS is kept, see struct
+ * yaffs_hdr_prefetch. NULL if it has none for the chunk, or if a block has
+ * been erased since and the chunk may hold something else now.
+ */
+static const u8 *yaffs_hdr_prefetched(struct yaffs_dev *dev, int chunk)
+{
+	struct yaffs_hdr_prefetch *pf = dev->hdr_prefetch;
+	int i;
+
+	if (!pf || pf->n_erasures != dev->n_erasures)
+		return NULL;
+
+	for (i = 0; i < pf->n; i++) {
+		if (pf->chunk[i] == chunk)
+			return pf->buffer + i * dev->data_bytes_per_chunk;
+	}
+	return NULL;
+}
+
+static int yaffs_rd_obj_hdr(struct yaffs_dev *dev, int chunk, u8 *buffer,
+			    struct yaffs_ext_tags *tags)
+{
+	const u8 *data = yaffs_hdr_prefetched(dev, chunk);
+
+	if (!data)
+		return yaffs_rd_chunk_tags_nand(dev, chunk, buffer, tags);
+
+	memcpy(buffer, data, dev->data_bytes_per_chunk);
+	if (tags)
+		memset(tags, 0, sizeof(*tags));
+	return YAFFS_OK;
+}
+
 static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 {
 	u8 *buf;
@@ -3173,7 +4106,7 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 	in->lazy_loaded = 0;
 	buf = yaffs_get_temp_buffer(dev);
 
-	result = yaffs_rd_chunk_tags_nand(dev, in->hdr_chunk, buf, &tags);
+	result = yaffs_rd_obj_hdr(dev, in->hdr_chunk, buf, &tags);
 	oh = (struct yaffs_obj_hdr *)buf;
 
 	in->yst_mode = oh->yst_mode;
@@ -3363,6 +4296,7 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 	/* Tags */
 	memset(&new_tags, 0, sizeof(new_tags));
 	in->serial++;
+	in->checkpt_dirty = 1;
 	new_tags.chunk_id = 0;
 	new_tags.obj_id = in->obj_id;
 	new_tags.serial_number = in->serial;
@@ -3458,14 +4392,11 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 
 				if (!cache) {
 					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					    yaffs_grab_chunk_cache(in, chunk);
+					if (!cache)
+						return n_done;
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
 
 				yaffs_use_cache(dev, cache, 0);
@@ -3486,6 +4417,20 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 
 				yaffs_release_temp_buffer(dev, local_buffer);
 			}
+		} else if (dev->drv.drv_read_chunks_fn &&
+			   n >= 2 * dev->data_bytes_per_chunk) {
+			/* Several full chunks. Take as many as follow that
+			 * are not cached and read them as a batch.
+			 */
+			int n_run = 1;
+
+			while (n_run < YAFFS_MAX_RD_RUN &&
+			       n >= (n_run + 1) * dev->data_bytes_per_chunk &&
+			       !yaffs_lookup_chunk_cache(in, chunk + n_run))
+				n_run++;
+
+			yaffs_rd_data_run(in, chunk, n_run, buffer);
+			n_copy = n_run * dev->data_bytes_per_chunk;
 		} else {
 			/* A full chunk. Read directly into the buffer. */
 			yaffs_rd_data_obj(in, chunk, buffer);
@@ -3498,6 +4443,91 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	return n_done;
 }
 
+/* Map the whole chunks of a file read for yaffs_rd_mapped_chunks().
+ * Up to max_chunks of the chunks that lie completely within
+ * offset..offset + n_bytes and are not in the short op cache are
+ * resolved into nand_chunks, -1 for holes. Returns how many were mapped.
+ * Returns 0 if the read has to go through yaffs_file_rd(): the offset is
+ * not chunk aligned, the first chunk is cached, or the device uses inband
+ * tags or cannot read chunks in batches.
+ *
+ * The mapping is only good while the device lock is held. A caller that
+ * wants to drop the lock for the read must first keep the blocks behind
+ * the chunks from being erased, see param.erase_wait_fn.
+ */
+int yaffs_file_map_chunks(struct yaffs_obj *in, loff_t offset, int n_bytes,
+			  int *nand_chunks, int max_chunks)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int bytes = dev->data_bytes_per_chunk;
+	int chunk;
+	u32 start;
+	int n = 0;
+	int i;
+
+	if (dev->param.inband_tags || !dev->drv.drv_read_chunks_fn ||
+	    in->variant_type != YAFFS_OBJECT_TYPE_FILE)
+		return 0;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	if (start)
+		return 0;
+	chunk++;
+
+	while (n < max_chunks && n_bytes >= (n + 1) * bytes &&
+	       !yaffs_lookup_chunk_cache(in, chunk + n))
+		n++;
+
+	if (n == 0)
+		return 0;
+
+	yaffs_find_chunk_run(in, chunk, n, nand_chunks);
+
+	/* Account for the reads now, while we have the lock */
+	for (i = 0; i < n; i++) {
+		if (nand_chunks[i] < 0)
+			continue;
+		dev->n_page_reads++;
+		if (i == 0 || nand_chunks[i] != nand_chunks[i - 1] + 1)
+			dev->n_multi_reads++;
+	}
+	return n;
+}
+
+/* Read chunks mapped by yaffs_file_map_chunks() into buffer. This needs
+ * no lock as long as the blocks stay unerased. Returns YAFFS_FAIL if a
+ * read failed or needed ECC; the caller should then read the range again
+ * with yaffs_file_rd() under the lock so that the error is handled.
+ */
+int yaffs_rd_mapped_chunks(struct yaffs_dev *dev, const int *nand_chunks,
+			   int n_chunks, u8 *buffer)
+{
+	enum yaffs_ecc_result ecc_result;
+	int bytes = dev->data_bytes_per_chunk;
+	int i;
+	int j;
+
+	for (i = 0; i < n_chunks; i = j) {
+		if (nand_chunks[i] < 0) {
+			memset(buffer + i * bytes, 0, bytes);
+			j = i + 1;
+			continue;
+		}
+
+		for (j = i + 1; j < n_chunks; j++) {
+			if (nand_chunks[j] != nand_chunks[j - 1] + 1)
+				break;
+		}
+
+		if (yaffs_rd_chunks_nand(dev, nand_chunks[i], j - i,
+					 buffer + i * bytes,
+					 &ecc_result) != YAFFS_OK ||
+		    ecc_result != YAFFS_ECC_RESULT_NO_ERROR)
+			return YAFFS_FAIL;
+	}
+	return YAFFS_OK;
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 		     int n_bytes, int write_through)
 {
@@ -3524,7 +4554,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 		    start >= dev->data_bytes_per_chunk) {
 			yaffs_trace(YAFFS_TRACE_ERROR,
 				"AddrToChunk of offset %lld gives chunk %d start %d",
-				offset, chunk, start);
+				(long long)offset, chunk, start);
 		}
 		chunk++;	/* File pos to chunk in file offset */
 
@@ -3583,18 +4613,14 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 				cache = yaffs_find_chunk_cache(in, chunk);
 
 				if (!cache &&
-				    yaffs_check_alloc_available(dev, 1)) {
-					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+				    yaffs_cache_space_available(dev)) {
+					cache = yaffs_grab_chunk_cache(in, chunk);
+					if (cache)
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
 				} else if (cache &&
 					   !cache->dirty &&
-					   !yaffs_check_alloc_available(dev,
-									1)) {
+					   !yaffs_cache_space_available(dev)) {
 					/* Drop the cache if it was a read cache
 					 * item and no space check has been made
 					 * for it.
@@ -3619,7 +4645,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_clean_chunk_cache(dev,
+									cache);
 					}
 				} else {
 					chunk_written = -1;	/* fail write */
@@ -3667,6 +4694,10 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 	if ((start_write + n_done) > in->variant.file_variant.file_size)
 		in->variant.file_variant.file_size = (start_write + n_done);
 
+	/* Any write moves chunks, and only dirty objects get their tnode
+	 * groups into the next checkpoint delta */
+	in->checkpt_dirty = 1;
+
 	in->dirty = 1;
 	return n_done;
 }
@@ -3756,6 +4787,7 @@ void yaffs_resize_file_down(struct yaffs_obj *obj, loff_t new_size)
 	}
 
 	obj->variant.file_variant.file_size = new_size;
+	obj->checkpt_dirty = 1;
 
 	yaffs_prune_tree(dev, &obj->variant.file_variant);
 }
@@ -3779,6 +4811,7 @@ int yaffs_resize_file(struct yaffs_obj *in, loff_t new_size)
 	if (new_size > old_size) {
 		yaffs2_handle_hole(in, new_size);
 		in->variant.file_variant.file_size = new_size;
+		in->checkpt_dirty = 1;
 	} else {
 		/* new_size < old_size */
 		yaffs_resize_file_down(in, new_size);
@@ -3837,6 +4870,7 @@ static int yaffs_unlink_file_if_needed(struct yaffs_obj *in)
 			"yaffs: immediate deletion of file %d",
 			in->obj_id);
 		in->deleted = 1;
+		in->checkpt_dirty = 1;
 		in->my_dev->n_deleted_files++;
 		if (dev->param.disable_soft_del || dev->param.is_yaffs2)
 			yaffs_resize_file(in, 0);
@@ -3869,6 +4903,7 @@ static int yaffs_del_file(struct yaffs_obj *in)
 
 		if (ret_val == YAFFS_OK && in->unlinked && !in->deleted) {
 			in->deleted = 1;
+			in->checkpt_dirty = 1;
 			deleted = 1;
 			in->my_dev->n_deleted_files++;
 			yaffs_soft_del_file(in);
@@ -4318,6 +5353,228 @@ static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 }
 
 
+/*---------------- Directory name index ------------*/
+
+/* Objects are allocated nameless and named later. They are left out of
+ * a directory's index until then, as hashing the made up objNNN name
+ * would leave them in the wrong bucket.
+ */
+static int yaffs_obj_has_name(struct yaffs_obj *obj)
+{
+	return obj->name_hashed || obj->short_name[0] || obj->hdr_chunk > 0 ||
+		obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND;
+}
+
+/*
+ * The hash of an object's name. Objects that were lazy loaded or found
+ * by a scan before their header do not know their name yet and have to
+ * look it up, which is done once and then kept in name_hash.
+ */
+static u32 yaffs_obj_name_hash(struct yaffs_obj *obj)
+{
+	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+
+	if (!obj->name_hashed) {
+		yaffs_get_obj_name(obj, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		if (!obj->name_hashed) {
+			obj->name_hash = yaffs_calc_name_hash(buffer);
+			obj->name_hashed = 1;
+		}
+	}
+	return obj->name_hash;
+}
+
+static struct yaffs_dir_index *yaffs_dir_index_alloc(u32 n_buckets)
+{
+	struct yaffs_dir_index *index;
+
+	index = kmalloc(sizeof(struct yaffs_dir_index) +
+			(n_buckets - 1) * sizeof(struct yaffs_obj *), GFP_NOFS);
+	if (!index)
+		return NULL;
+	memset(index->bucket, 0, n_buckets * sizeof(struct yaffs_obj *));
+	index->n_buckets = n_buckets;
+	index->n_entries = 0;
+	return index;
+}
+
+static void yaffs_dir_index_link(struct yaffs_dir_index *index,
+				 struct yaffs_obj *obj)
+{
+	struct yaffs_obj **b;
+
+	b = &index->bucket[obj->name_hash & (index->n_buckets - 1)];
+	obj->name_next = *b;
+	*b = obj;
+	obj->name_indexed = 1;
+	index->n_entries++;
+}
+
+/* Double the number of buckets, leaving the index alone if we can't */
+static void yaffs_dir_index_grow(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_index *old = dir->variant.dir_variant.index;
+	struct yaffs_dir_index *index;
+	struct yaffs_obj *obj;
+	u32 b;
+
+	index = yaffs_dir_index_alloc(old->n_buckets * 2);
+	if (!index)
+		return;
+
+	for (b = 0; b < old->n_buckets; b++) {
+		while (old->bucket[b]) {
+			obj = old->bucket[b];
+			old->bucket[b] = obj->name_next;
+			yaffs_dir_index_link(index, obj);
+		}
+	}
+	kfree(old);
+	dir->variant.dir_variant.index = index;
+}
+
+static void yaffs_dir_index_add(struct yaffs_obj *dir, struct yaffs_obj *obj)
+{
+	struct yaffs_dir_index *index = dir->variant.dir_variant.index;
+
+	if (!index || obj->name_indexed || !yaffs_obj_has_name(obj))
+		return;
+
+	/* This may have to load the name, it can't recurse as we're
+	 * not indexed yet.
+	 */
+	yaffs_obj_name_hash(obj);
+
+	if (index->n_entries >= 2 * index->n_buckets &&
+	    index->n_buckets < YAFFS_DIR_INDEX_MAX_BUCKETS) {
+		yaffs_dir_index_grow(dir);
+		index = dir->variant.dir_variant.index;
+	}
+	yaffs_dir_index_link(index, obj);
+}
+
+static void yaffs_dir_index_del(struct yaffs_obj *dir, struct yaffs_obj *obj)
+{
+	struct yaffs_dir_index *index = dir->variant.dir_variant.index;
+	struct yaffs_obj **p;
+
+	if (!obj->name_indexed)
+		return;
+
+	if (index) {
+		p = &index->bucket[obj->name_hash & (index->n_buckets - 1)];
+		for (; *p; p = &(*p)->name_next) {
+			if (*p == obj) {
+				*p = obj->name_next;
+				index->n_entries--;
+				break;
+			}
+		}
+	}
+	obj->name_indexed = 0;
+	obj->name_next = NULL;
+}
+
+static void yaffs_dir_index_free(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_index *index = dir->variant.dir_variant.index;
+	struct yaffs_obj *obj;
+	u32 b;
+
+	if (!index)
+		return;
+
+	for (b = 0; b < index->n_buckets; b++) {
+		while (index->bucket[b]) {
+			obj = index->bucket[b];
+			index->bucket[b] = obj->name_next;
+			obj->name_indexed = 0;
+			obj->name_next = NULL;
+		}
+	}
+	kfree(index);
+	dir->variant.dir_variant.index = NULL;
+}
+
+static void yaffs_dir_index_build(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_index *index;
+	struct list_head *i;
+	struct yaffs_obj *l;
+	u32 n_buckets = 16;
+
+	while (n_buckets < dir->variant.dir_variant.n_children &&
+	       n_buckets < YAFFS_DIR_INDEX_MAX_BUCKETS)
+		n_buckets <<= 1;
+
+	index = yaffs_dir_index_alloc(n_buckets);
+	if (!index)
+		return;		/* Just carry on searching the list */
+
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		l = list_entry(i, struct yaffs_obj, siblings);
+		if (!yaffs_obj_has_name(l))
+			continue;
+		yaffs_obj_name_hash(l);
+		yaffs_dir_index_link(index, l);
+	}
+	dir->variant.dir_variant.index = index;
+
+	yaffs_trace(YAFFS_TRACE_OS, "built name index for dir %d, %d entries",
+		dir->obj_id, index->n_entries);
+}
+
+/* Index a directory once it has grown big enough */
+static void yaffs_dir_index_check(struct yaffs_obj *dir)
+{
+	/* The unlinked and deleted directories are full of duplicate
+	 * names, they don't get an index.
+	 */
+	if (!dir->variant.dir_variant.index &&
+	    dir->variant.dir_variant.n_children >= YAFFS_DIR_INDEX_MIN &&
+	    dir != dir->my_dev->unlinked_dir &&
+	    dir != dir->my_dev->del_dir)
+		yaffs_dir_index_build(dir);
+}
+
+static struct yaffs_obj *yaffs_find_by_name_indexed(struct yaffs_obj *dir,
+						    const YCHAR *name)
+{
+	struct yaffs_dir_index *index = dir->variant.dir_variant.index;
+	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+	struct yaffs_obj *l;
+	struct yaffs_obj *next;
+	u32 hash;
+
+	hash = yaffs_calc_name_hash(name);
+	next = index->bucket[hash & (index->n_buckets - 1)];
+
+	/* Loading l's details rehashes it, so step on before that */
+	while (next) {
+		l = next;
+		next = l->name_next;
+		if (l->name_hash != hash)
+			continue;
+		if (l->parent != dir)
+			BUG();
+
+		/* Only a long name on a hash match costs a NAND read */
+		if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
+			if (!strcmp(name, YAFFS_LOSTNFOUND_NAME))
+				return l;
+		} else if (l->short_name[0]) {
+			if (!strncmp(name, l->short_name, YAFFS_MAX_NAME_LENGTH))
+				return l;
+		} else {
+			yaffs_get_obj_name(l, buffer,
+				YAFFS_MAX_NAME_LENGTH + 1);
+			if (!strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH))
+				return l;
+		}
+	}
+	return NULL;
+}
+
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR *name)
 {
@@ -4343,6 +5600,10 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 		BUG();
 	}
 
+	yaffs_dir_index_check(directory);
+	if (directory->variant.dir_variant.index)
+		return yaffs_find_by_name_indexed(directory, name);
+
 	sum = yaffs_calc_name_sum(name);
 
 	list_for_each(i, &directory->variant.dir_variant.children) {
@@ -4370,6 +5631,134 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 	return NULL;
 }
 
+/*
+ * Header read-ahead for lookup and readdir, see struct yaffs_hdr_prefetch.
+ * These tell the OS which header chunks the calls it is about to make
+ * would read, mirroring the searches above, and count the reads as
+ * yaffs_file_map_chunks() does. They return nothing where the batched
+ * reads the OS would use are not available.
+ */
+static int yaffs_hdr_prefetch_ok(struct yaffs_dev *dev)
+{
+	return !dev->param.inband_tags && dev->drv.drv_read_chunks_fn;
+}
+
+/* Adds the header chunks that naming obj or telling its type would read */
+static int yaffs_add_obj_hdrs(struct yaffs_obj *obj, int *chunks, int n,
+			      int max)
+{
+	struct yaffs_obj *equiv;
+
+	if (n < max && obj->hdr_chunk > 0 &&
+	    obj->obj_id != YAFFS_OBJECTID_LOSTNFOUND &&
+	    (obj->lazy_loaded || !obj->short_name[0])) {
+		chunks[n++] = obj->hdr_chunk;
+		obj->my_dev->n_page_reads++;
+	}
+
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_HARDLINK) {
+		equiv = obj->variant.hardlink_variant.equiv_obj;
+		if (n < max && equiv && equiv->lazy_loaded &&
+		    equiv->hdr_chunk > 0) {
+			chunks[n++] = equiv->hdr_chunk;
+			obj->my_dev->n_page_reads++;
+		}
+	}
+	return n;
+}
+
+/* Loads the children of dir that are still lazy loaded and whose headers
+ * are in dev->hdr_prefetch, and returns the header chunks of up to max of
+ * those left. A lookup in dir loads them all first.
+ */
+int yaffs_dir_lazy_hdrs(struct yaffs_obj *dir, int *chunks, int max)
+{
+	struct yaffs_dev *dev = dir->my_dev;
+	struct list_head *i;
+	struct yaffs_obj *l;
+	int n = 0;
+
+	if (!yaffs_hdr_prefetch_ok(dev) || dir->variant.dir_variant.index)
+		return 0;
+
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		l = list_entry(i, struct yaffs_obj, siblings);
+		if (!l->lazy_loaded || l->hdr_chunk < 1)
+			continue;
+		if (yaffs_hdr_prefetched(dev, l->hdr_chunk)) {
+			yaffs_check_obj_details_loaded(l);
+		} else if (n < max) {
+			chunks[n++] = l->hdr_chunk;
+			dev->n_page_reads++;
+		}
+	}
+	return n;
+}
+
+/* The header chunks, up to max, that yaffs_find_by_name() would read to
+ * compare long names once the children are loaded. Builds the name index
+ * if the directory is due one.
+ */
+int yaffs_find_by_name_hdrs(struct yaffs_obj *dir, const YCHAR *name,
+			    int *chunks, int max)
+{
+	struct yaffs_dir_index *index;
+	struct list_head *i;
+	struct yaffs_obj *l;
+	int n = 0;
+	u32 hash;
+	int sum;
+
+	if (!name || !yaffs_hdr_prefetch_ok(dir->my_dev))
+		return 0;
+
+	yaffs_dir_index_check(dir);
+	index = dir->variant.dir_variant.index;
+	if (index) {
+		hash = yaffs_calc_name_hash(name);
+		l = index->bucket[hash & (index->n_buckets - 1)];
+		for (; l && n < max; l = l->name_next) {
+			if (l->name_hash == hash)
+				n = yaffs_add_obj_hdrs(l, chunks, n, max);
+		}
+		return n;
+	}
+
+	sum = yaffs_calc_name_sum(name);
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		l = list_entry(i, struct yaffs_obj, siblings);
+		if (n >= max)
+			break;
+		if (l->lazy_loaded || l->sum == sum)
+			n = yaffs_add_obj_hdrs(l, chunks, n, max);
+	}
+	return n;
+}
+
+/* The header chunks that a readdir would read for the children of a
+ * directory from 'from' on, up to max of them. *n_objs is set to how many
+ * children that covers.
+ */
+int yaffs_dir_name_hdrs(struct yaffs_obj *from, int *chunks, int max,
+			int *n_objs)
+{
+	struct list_head *head = &from->parent->variant.dir_variant.children;
+	struct list_head *i;
+	int n = 0;
+
+	*n_objs = from->parent->variant.dir_variant.n_children;
+	if (!yaffs_hdr_prefetch_ok(from->my_dev))
+		return 0;
+
+	*n_objs = 0;
+	for (i = &from->siblings; i != head && n < max; i = i->next) {
+		n = yaffs_add_obj_hdrs(list_entry(i, struct yaffs_obj, siblings),
+				       chunks, n, max);
+		(*n_objs)++;
+	}
+	return n;
+}
+
 /* GetEquivalentObject dereferences any hard links to get to the
  * actual object.
  */
@@ -4406,7 +5795,7 @@ static void yaffs_fix_null_name(struct yaffs_obj *obj, YCHAR *name,
 				int buffer_size)
 {
 	/* Create an object name if we could not find one. */
-	if (strnlen(name, YAFFS_MAX_NAME_LENGTH) == 0) {
+	if (!name[0]) {
 		YCHAR local_name[20];
 		YCHAR num_string[20];
 		YCHAR *x = &num_string[19];
@@ -4441,9 +5830,9 @@ int yaffs_get_obj_name(struct yaffs_obj *obj, YCHAR *name, int buffer_size)
 		memset(buffer, 0, obj->my_dev->data_bytes_per_chunk);
 
 		if (obj->hdr_chunk > 0) {
-			result = yaffs_rd_chunk_tags_nand(obj->my_dev,
-							  obj->hdr_chunk,
-							  buffer, NULL);
+			result = yaffs_rd_obj_hdr(obj->my_dev,
+						  obj->hdr_chunk,
+						  buffer, NULL);
 		}
 		yaffs_load_name_from_oh(obj->my_dev, name, oh->name,
 					buffer_size);
@@ -4813,33 +6202,49 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->cache = NULL;
 	dev->gc_cleanup_list = NULL;
 
+	dev->cache_hash = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
+	dev->n_dirty_caches = 0;
+
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		u32 n_hash;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
+		n_hash = 1;
+		while (n_hash < dev->param.n_caches)
+			n_hash <<= 1;
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_hash =
+		    kmalloc(n_hash * sizeof(struct yaffs_cache *), GFP_NOFS);
+		dev->cache_hash_mask = n_hash - 1;
 
 		buf = (u8 *) dev->cache;
+		if (!dev->cache_hash)
+			buf = NULL;
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
+		if (dev->cache_hash)
+			memset(dev->cache_hash, 0,
+			       n_hash * sizeof(struct yaffs_cache *));
 
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].obj_link);
+			list_add_tail(&dev->cache[i].lru, &dev->cache_lru);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
@@ -4910,6 +6315,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 			init_failed = 1;
 		}
 
+		yaffs_gc_index_rebuild(dev);
+
 		yaffs_strip_deleted_objs(dev);
 		yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
@@ -4951,6 +6358,7 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 	if (dev->is_mounted) {
 		int i;
 
+		yaffs2_checkpt_deinit(dev);
 		yaffs_deinit_blocks(dev);
 		yaffs_deinit_tnodes_and_objs(dev);
 		yaffs_summary_deinit(dev);
@@ -4965,6 +6373,8 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			kfree(dev->cache);
 			dev->cache = NULL;
 		}
+		kfree(dev->cache_hash);
+		dev->cache_hash = NULL;
 
 		kfree(dev->gc_cleanup_list);
 
@@ -5006,21 +6416,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 {
 	/* This is what we report to the outside world */
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count and subtract the number of dirty chunks in the cache. */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Now subtract the number of dirty chunks in the cache. */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
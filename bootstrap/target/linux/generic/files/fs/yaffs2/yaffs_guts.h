@@ -68,8 +68,6 @@
 
 
 
-#define YAFFS_ALLOCATION_NOBJECTS	100
-#define YAFFS_ALLOCATION_NTNODES	100
 #define YAFFS_ALLOCATION_NLINKS		100
 
 #define YAFFS_NOBJECT_BUCKETS		256
@@ -79,7 +77,7 @@
 
 /* Binary data version stamps */
 #define YAFFS_SUMMARY_VERSION		1
-#define YAFFS_CHECKPOINT_VERSION	7
+#define YAFFS_CHECKPOINT_VERSION	8
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -104,10 +102,13 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA	0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Most chunks yaffs_file_rd() resolves and reads as one batch */
+#define YAFFS_MAX_RD_RUN		32
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -131,11 +132,13 @@
 struct yaffs_cache {
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
 	u8 *data;
+	struct yaffs_cache *hash_next;	/* chain in dev->cache_hash */
+	struct list_head lru;		/* position in dev->cache_lru */
+	struct list_head obj_link;	/* on the object's clean or dirty list */
 };
 
 /* yaffs1 tags structures in RAM
@@ -306,6 +309,22 @@ struct yaffs_block_info {
 
 };
 
+/* GC victim index. Every FULL block with a free page is on the list for
+ * its number of live pages (pages_in_use - soft_del_pages), so the
+ * dirtiest one is found without looking at all the blocks. Lists are in
+ * the order blocks joined them, oldest first after a mount.
+ */
+struct yaffs_gc_link {
+	int next;
+	int prev;
+	int bucket;		/* -1 if not listed */
+};
+
+struct yaffs_gc_bucket {
+	int head;
+	int tail;
+};
+
 /* -------------------------- Object structure -------------------------------*/
 /* This is the object structure as stored on NAND */
 
@@ -374,11 +393,50 @@ struct yaffs_file_var {
 	loff_t shrink_size;
 	int top_level;
 	struct yaffs_tnode *top;
+	int evicted_tnodes;	/* tree dropped to save RAM, this many tnodes
+				 * to rebuild from NAND when next needed */
+	int n_evicted_blocks;	/* the blocks its chunks are in, all the */
+	int *evicted_blocks;	/* rebuild has to read */
+};
+
+/*
+ * Name index for big directories, a hash table of the children chained
+ * through obj->name_next. Built by yaffs_find_by_name() once a directory
+ * has YAFFS_DIR_INDEX_MIN children and kept up to date from then on.
+ */
+#define YAFFS_DIR_INDEX_MIN		32
+#define YAFFS_DIR_INDEX_MAX_BUCKETS	8192
+
+struct yaffs_dir_index {
+	u32 n_buckets;		/* power of 2 */
+	u32 n_entries;
+	struct yaffs_obj *bucket[1];
+};
+
+/*
+ * Object headers an OS flavour read ahead without its lock, so that lookup
+ * and readdir do not hold it across NAND reads. It asks which header chunks
+ * it is about to need (yaffs_dir_lazy_hdrs(), yaffs_find_by_name_hdrs(),
+ * yaffs_dir_name_hdrs()), pins and reads them the way it does mapped file
+ * chunks and hangs them on dev->hdr_prefetch while it calls back in. yaffs
+ * takes headers from there instead of the NAND as long as no block has
+ * been erased since they were asked for, chunks are never rewritten in
+ * place.
+ */
+#define YAFFS_HDR_PREFETCH_MAX		8
+
+struct yaffs_hdr_prefetch {
+	int n;
+	u32 n_erasures;		/* dev->n_erasures when they were asked for */
+	int chunk[YAFFS_HDR_PREFETCH_MAX];	/* -1 where the read failed */
+	u8 *buffer;		/* YAFFS_HDR_PREFETCH_MAX chunks of data */
 };
 
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	int n_children;
+	struct yaffs_dir_index *index;	/* NULL until the directory is big */
 };
 
 struct yaffs_symlink_var {
@@ -429,8 +487,20 @@ struct yaffs_obj {
 	u8 has_xattr:1;		/* This object has xattribs.
 				 * Only valid if xattr_known. */
 
+	u8 name_hashed:1;	/* name_hash is valid */
+	u8 name_indexed:1;	/* In the parent's name index */
+
+	u8 checkpt_dirty:1;	/* Changed since the last checkpoint */
+	u8 checkpt_saved:1;	/* Present in the checkpoint */
+
+	u8 evict_refused:1;	/* Its chunks are too spread out for the tree
+				 * to be rebuilt cheaply, see
+				 * yaffs_evict_tnodes() */
+
 	u8 serial;		/* serial number of chunk in NAND.*/
 	u16 sum;		/* sum of the name to speed searching */
+	u32 name_hash;		/* hash of the full name */
+	struct yaffs_obj *name_next;	/* chain in the parent's name index */
 
 	struct yaffs_dev *my_dev;	/* The device I'm on */
 
@@ -443,6 +513,10 @@ struct yaffs_obj {
 	struct yaffs_obj *parent;
 	struct list_head siblings;
 
+	/* Short op cache chunks held for this object (files only) */
+	struct list_head cache_clean;
+	struct list_head cache_dirty;	/* sorted by chunk_id */
+
 	/* Where's my object header in NAND? */
 	int hdr_chunk;
 
@@ -512,6 +586,55 @@ struct yaffs_buffer {
 	int in_use;
 };
 
+/*----------------- Mount scan read-ahead ------------------*/
+
+/* yaffs2_scan_backwards() reads the flash in two passes, block states
+ * first and then the tags of the blocks in use, and either pass can have
+ * its reads done ahead of it by helper threads. The scan hands the pass to
+ * the OS layer as a yaffs_scan_ahead: an ordered list of n_items blocks and
+ * a ring of window slots. Helpers fill item i into slot i % window with
+ * yaffs2_scan_fill() once the scan has finished with item i - window, and
+ * the scan then consumes the items strictly in order. Filling only reads
+ * the flash, so all changes to the device are still made by the scan.
+ */
+enum yaffs_scan_pass {
+	YAFFS_SCAN_PASS_STATE,
+	YAFFS_SCAN_PASS_TAGS
+};
+
+struct yaffs_scan_block {
+	int item;
+	int block;
+
+	/* YAFFS_SCAN_PASS_STATE */
+	enum yaffs_block_state state;
+	u32 seq_number;
+
+	/* YAFFS_SCAN_PASS_TAGS */
+	int summary_available;
+	int n_summary_chunks;	/* Summary chunks with good tags */
+	int sum_bytes;		/* Bytes of sum_tags they filled */
+	u32 n_reads;		/* Chunk reads done */
+	u32 n_ecc_errors;	/* Reads that reported an ECC result */
+	u32 n_tags_read;
+	u32 n_summary_used;
+	struct yaffs_ext_tags *tags;	/* One per chunk in the block */
+	struct yaffs_summary_tags *sum_tags;
+	u8 *buffer;
+};
+
+struct yaffs_scan_ahead {
+	struct yaffs_dev *dev;
+	enum yaffs_scan_pass pass;
+	int n_items;
+	int first_block;	/* YAFFS_SCAN_PASS_STATE: item i is this + i */
+	const int *order;	/* YAFFS_SCAN_PASS_TAGS: item i is order[i] */
+	int window;
+	struct yaffs_scan_block *slots;
+	int n_threads;		/* Helpers running, 0 if reading inline */
+	void *os_context;	/* For the scan_ahead_..._fn callbacks */
+};
+
 /*----------------- Device ---------------------------------*/
 
 struct yaffs_param {
@@ -552,9 +675,15 @@ struct yaffs_param {
 
 	int refresh_period;	/* How often to check for a block refresh */
 
+	int gc_cost_benefit;	/* Pick gc victims by free space times age
+				 * rather than just free space */
+
 	/* Checkpoint control. Can be set before or after initialisation */
 	u8 skip_checkpt_rd;
 	u8 skip_checkpt_wr;
+	int checkpt_max_deltas;	/* Saves appended as deltas before the
+				 * checkpoint is rewritten in full.
+				 * 0 = always rewrite. */
 
 	int enable_xattr;	/* Enable xattribs */
 
@@ -576,6 +705,26 @@ struct yaffs_param {
 	/*  Callback to control garbage collection. */
 	unsigned (*gc_control_fn) (struct yaffs_dev *dev);
 
+	/* Called before a block is erased. OS flavours that read mapped
+	 * chunks without holding their lock (see yaffs_file_map_chunks())
+	 * use it to wait until nobody is still reading the block.
+	 */
+	void (*erase_wait_fn) (struct yaffs_dev *dev, int block_no);
+
+	/* Optional mount scan read-ahead (see struct yaffs_scan_ahead).
+	 * scan_ahead_start_fn starts up to n_scan_threads helpers and
+	 * returns how many it started; with none the scan does its own
+	 * reads. scan_ahead_get_fn waits for an item to be filled,
+	 * scan_ahead_put_fn gives its slot back and scan_ahead_stop_fn
+	 * stops the helpers, whether or not all items were consumed.
+	 */
+	int n_scan_threads;
+	int (*scan_ahead_start_fn) (struct yaffs_scan_ahead *sa);
+	struct yaffs_scan_block *(*scan_ahead_get_fn) (
+				struct yaffs_scan_ahead *sa, int item);
+	void (*scan_ahead_put_fn) (struct yaffs_scan_ahead *sa, int item);
+	void (*scan_ahead_stop_fn) (struct yaffs_scan_ahead *sa);
+
 	/* Debug control flags. Don't use unless you know what you're doing */
 	int use_header_file_size;	/* Flag to determine if we should use
 					 * file sizes from the header */
@@ -604,6 +753,12 @@ struct yaffs_driver {
 				   u8 *data, int data_len,
 				   u8 *oob, int oob_len,
 				   enum yaffs_ecc_result *ecc_result);
+	/* Optional. Read the data of n_chunks physically consecutive
+	 * chunks in one go, no spare. ecc_result is the worst seen.
+	 */
+	int (*drv_read_chunks_fn) (struct yaffs_dev *dev, int nand_chunk,
+				   int n_chunks, u8 *data,
+				   enum yaffs_ecc_result *ecc_result);
 	int (*drv_erase_fn) (struct yaffs_dev *dev, int block_no);
 	int (*drv_mark_bad_fn) (struct yaffs_dev *dev, int block_no);
 	int (*drv_check_bad_fn) (struct yaffs_dev *dev, int block_no);
@@ -685,6 +840,22 @@ struct yaffs_dev {
 	int checkpoint_blocks_required;	/* Number of blocks needed to store
 					 * current checkpoint set */
 
+	/* Incremental checkpointing. A full checkpoint can be followed by
+	 * deltas holding only what changed since the previous save.
+	 */
+	int checkpt_prev_blocks;	/* checkpt blocks already accounted for
+					 * when the stream was opened */
+	int checkpt_can_append;	/* deltas can be appended to the checkpt */
+	int checkpt_chain_open;	/* open marker written, checkpt is stale
+				 * until the next delta */
+	int checkpt_n_deltas;	/* deltas since the last full checkpoint */
+	u8 *checkpt_shadow;	/* block info and chunk bits as saved */
+	unsigned checkpt_shadow_alt:1;	/* allocated using alternative alloc */
+	struct yaffs_checkpt_log *checkpt_log;	/* what changed since */
+	int checkpt_n_log;
+	int checkpt_max_log;
+	int checkpt_log_overflow;	/* log full, next save rewrites all */
+
 	/* Block Info */
 	struct yaffs_block_info *block_info;
 	u8 *chunk_bits;		/* bitmap of chunks in use */
@@ -703,6 +874,8 @@ struct yaffs_dev {
 	void *allocator;
 	int n_obj;
 	int n_tnodes;
+	int n_evicted_tnodes;	/* tnodes of evicted trees, see file_var */
+	u32 evict_bucket;	/* where the next eviction pass starts */
 
 	int n_hardlinks;
 
@@ -727,6 +900,12 @@ struct yaffs_dev {
 	unsigned gc_skip;
 	struct yaffs_summary_tags *gc_sum_tags;
 
+	/* Full blocks that can be collected, bucketed by live pages */
+	struct yaffs_gc_link *gc_links;	/* one per block */
+	struct yaffs_gc_bucket *gc_buckets;	/* one per live page count */
+	unsigned gc_links_alt:1;	/* allocated using alternative alloc */
+	int gc_min_bucket;	/* no blocks in lower buckets */
+
 	/* Special directories */
 	struct yaffs_obj *root_dir;
 	struct yaffs_obj *lost_n_found;
@@ -735,7 +914,10 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct yaffs_cache **cache_hash;	/* keyed on (object, chunk_id) */
+	u32 cache_hash_mask;
+	struct list_head cache_lru;	/* least recently used first */
+	int n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted
@@ -768,6 +950,9 @@ struct yaffs_dev {
 	/* Dirty directory handling */
 	struct list_head dirty_dirs;	/* List of dirty directories */
 
+	/* Headers read ahead by the OS, only set while it holds its lock */
+	struct yaffs_hdr_prefetch *hdr_prefetch;
+
 	/* Summary */
 	int chunks_per_summary;
 	struct yaffs_summary_tags *sum_tags;
@@ -775,6 +960,7 @@ struct yaffs_dev {
 	/* Statistics */
 	u32 n_page_writes;
 	u32 n_page_reads;
+	u32 n_multi_reads;	/* batched reads, each counted once */
 	u32 n_erasures;
 	u32 n_bad_markings;
 	u32 n_erase_failures;
@@ -797,6 +983,24 @@ struct yaffs_dev {
 	u32 tags_used;
 	u32 summary_used;
 
+	/* Last mount scan, zero if the mount used a checkpoint */
+	u32 scan_blocks;	/* Blocks whose tags were scanned */
+	u32 scan_summaries;	/* ... of which had a good summary */
+	u32 scan_threads;	/* Read-ahead helpers used */
+	u32 scan_state_ms;	/* Time spent reading block states */
+	u32 scan_sort_ms;	/* ... sorting blocks by sequence */
+	u32 scan_tags_ms;	/* ... scanning tags */
+	u32 scan_fixup_ms;	/* ... fixing up hard links */
+
+	/* Checkpoint saves */
+	u32 checkpt_full_saves;
+	u32 checkpt_delta_saves;
+	u32 checkpt_last_bytes;	/* Bytes written by the last save */
+
+	/* Tnode trees dropped under memory pressure and rebuilt */
+	u32 tnode_evictions;
+	u32 tnode_reloads;
+
 };
 
 /* The CheckpointDevice structure holds the device information that changes
@@ -826,6 +1030,17 @@ struct yaffs_checkpt_validity {
 	u32 head;
 };
 
+/* Entry in the log of changes since the last checkpoint: a level 0
+ * tnode group of a checkpointed file was modified or, if group is
+ * YAFFS_CHECKPT_LOG_FREED, a checkpointed object was freed.
+ */
+#define YAFFS_CHECKPT_LOG_FREED		0xffffffff
+
+struct yaffs_checkpt_log {
+	u32 obj_id;
+	u32 group;
+};
+
 struct yaffs_shadow_fixer {
 	int obj_id;
 	int shadowed_id;
@@ -864,6 +1079,10 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_map_chunks(struct yaffs_obj *obj, loff_t offset, int n_bytes,
+			  int *nand_chunks, int max_chunks);
+int yaffs_rd_mapped_chunks(struct yaffs_dev *dev, const int *nand_chunks,
+			   int n_chunks, u8 *buffer);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
@@ -887,6 +1106,13 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *the_dir,
 				     const YCHAR *name);
 struct yaffs_obj *yaffs_find_by_number(struct yaffs_dev *dev, u32 number);
 
+/* Header read-ahead, see struct yaffs_hdr_prefetch */
+int yaffs_dir_lazy_hdrs(struct yaffs_obj *dir, int *chunks, int max);
+int yaffs_find_by_name_hdrs(struct yaffs_obj *dir, const YCHAR *name,
+			    int *chunks, int max);
+int yaffs_dir_name_hdrs(struct yaffs_obj *from, int *chunks, int max,
+			int *n_objs);
+
 /* Link operations */
 struct yaffs_obj *yaffs_link_obj(struct yaffs_obj *parent, const YCHAR *name,
 				 struct yaffs_obj *equiv_obj);
@@ -916,6 +1142,11 @@ struct yaffs_obj *yaffs_root(struct yaffs_dev *dev);
 struct yaffs_obj *yaffs_lost_n_found(struct yaffs_dev *dev);
 
 void yaffs_handle_defered_free(struct yaffs_obj *obj);
+void yaffs_forget_obj(struct yaffs_obj *obj);
+
+int yaffs_evict_tnodes(struct yaffs_dev *dev, int n_wanted);
+int yaffs_evictable_tnodes(struct yaffs_dev *dev);
+int yaffs_reload_tnodes(struct yaffs_dev *dev, struct yaffs_obj *obj);
 
 void yaffs_update_dirty_dirs(struct yaffs_dev *dev);
 
@@ -18,6 +18,9 @@
 
 #include "yportenv.h"
 
+/* Size of the hashed table of per block reader counts */
+#define YAFFS_N_BLOCK_PINS	64
+
 struct yaffs_linux_context {
 	struct list_head context_list;	/* List of these we have mounted */
 	struct yaffs_dev *dev;
@@ -25,6 +28,9 @@ struct yaffs_linux_context {
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
 	struct mutex gross_lock;	/* Gross locking mutex*/
+	atomic_t block_pins[YAFFS_N_BLOCK_PINS]; /* Unlocked readers per block,
+						  * hashed on block number */
+	wait_queue_head_t pin_wait;	/* Erases waiting for readers */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the buffer size
 				 * at compile time so we have to allocate it.
 				 */
@@ -32,6 +38,8 @@ struct yaffs_linux_context {
 	struct task_struct *readdir_process;
 	unsigned mount_id;
 	int dirty;
+	int evictable;		/* Tnodes the shrinker can have, */
+	unsigned long evictable_at;	/* counted at this jiffy */
 };
 
 #define yaffs_dev_to_lc(dev) ((struct yaffs_linux_context *)((dev)->os_context))
@@ -37,6 +37,7 @@
 #define mtd_erase(m, ei) (m)->erase(m, ei)
 #define mtd_write_oob(m, addr, pops) (m)->write_oob(m, addr, pops)
 #define mtd_read_oob(m, addr, pops) (m)->read_oob(m, addr, pops)
+#define mtd_read(m, from, len, retlen, buf) (m)->read(m, from, len, retlen, buf)
 #define mtd_block_isbad(m, offs) (m)->block_isbad(m, offs)
 #define mtd_block_markbad(m, offs) (m)->block_markbad(m, offs)
 #endif
@@ -168,6 +169,49 @@ static int yaffs_mtd_read(struct yaffs_dev *dev, int nand_chunk,
 	return YAFFS_OK;
 }
 
+/* Read the main area of several consecutive pages as one MTD operation,
+ * letting the NAND driver stream them rather than setting up each page.
+ */
+static int yaffs_mtd_read_chunks(struct yaffs_dev *dev, int nand_chunk,
+				 int n_chunks, u8 *data,
+				 enum yaffs_ecc_result *ecc_result)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	loff_t addr;
+	size_t len;
+	size_t retlen = 0;
+	int retval;
+
+	addr = ((loff_t) nand_chunk) * dev->param.total_bytes_per_chunk;
+	len = n_chunks * dev->param.total_bytes_per_chunk;
+
+	retval = mtd_read(mtd, addr, len, &retlen, data);
+	if (retval)
+		yaffs_trace(YAFFS_TRACE_MTD,
+			"read failed, chunks %d..%d, mtd error %d",
+			nand_chunk, nand_chunk + n_chunks - 1, retval);
+
+	switch (retval) {
+	case 0:
+		*ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
+		break;
+
+	case -EUCLEAN:
+		/* Fixed, but let the caller re-read chunk by chunk so the
+		 * block gets the usual error handling.
+		 */
+		*ecc_result = YAFFS_ECC_RESULT_FIXED;
+		break;
+
+	case -EBADMSG:
+	default:
+		*ecc_result = YAFFS_ECC_RESULT_UNFIXED;
+		return YAFFS_FAIL;
+	}
+
+	return (retlen == len) ? YAFFS_OK : YAFFS_FAIL;
+}
+
 static 	int yaffs_mtd_erase(struct yaffs_dev *dev, int block_no)
 {
 	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
@@ -238,6 +282,7 @@ void yaffs_mtd_drv_install(struct yaffs_dev *dev)
 
 	drv->drv_write_chunk_fn = yaffs_mtd_write;
 	drv->drv_read_chunk_fn = yaffs_mtd_read;
+	drv->drv_read_chunks_fn = yaffs_mtd_read_chunks;
 	drv->drv_erase_fn = yaffs_mtd_erase;
 	drv->drv_mark_bad_fn = yaffs_mtd_mark_bad;
 	drv->drv_check_bad_fn = yaffs_mtd_check_bad;
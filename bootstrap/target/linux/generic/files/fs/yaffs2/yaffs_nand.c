@@ -47,6 +47,39 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/* As yaffs_rd_chunk_tags_nand(), but with no statistics and no handling of
+ * chunk errors, so that mount scan helpers can call it while the scan
+ * itself is changing the device. The caller accounts for the read and acts
+ * on tags->ecc_result later.
+ */
+int yaffs_rd_chunk_tags_raw(struct yaffs_dev *dev, int nand_chunk,
+			    u8 *buffer, struct yaffs_ext_tags *tags)
+{
+	int flash_chunk = apply_chunk_offset(dev, nand_chunk);
+
+	return dev->tagger.read_chunk_tags_fn(dev, flash_chunk, buffer, tags);
+}
+
+/* Read the data of a run of physically consecutive chunks with one driver
+ * call. Tags are not read and chunk errors are not handled here; callers
+ * that see an ECC result other than NO_ERROR should fall back to
+ * yaffs_rd_chunk_tags_nand() for each chunk.
+ * This touches no device state, statistics included, so it may be called
+ * without the device lock.
+ */
+int yaffs_rd_chunks_nand(struct yaffs_dev *dev, int nand_chunk, int n_chunks,
+			 u8 *buffer, enum yaffs_ecc_result *ecc_result)
+{
+	int flash_chunk = apply_chunk_offset(dev, nand_chunk);
+
+	if (!dev->drv.drv_read_chunks_fn)
+		return YAFFS_FAIL;
+
+	*ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
+	return dev->drv.drv_read_chunks_fn(dev, flash_chunk, n_chunks,
+					   buffer, ecc_result);
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 				int nand_chunk,
 				const u8 *buffer, struct yaffs_ext_tags *tags)
@@ -101,6 +134,9 @@ int yaffs_erase_block(struct yaffs_dev *dev, int block_no)
 {
 	int result;
 
+	if (dev->param.erase_wait_fn)
+		dev->param.erase_wait_fn(dev, block_no);
+
 	block_no -= dev->block_offset;
 	dev->n_erasures++;
 	result = dev->drv.drv_erase_fn(dev, block_no);
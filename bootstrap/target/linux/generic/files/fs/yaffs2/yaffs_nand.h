@@ -20,6 +20,12 @@
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 *buffer, struct yaffs_ext_tags *tags);
 
+int yaffs_rd_chunk_tags_raw(struct yaffs_dev *dev, int nand_chunk,
+			    u8 *buffer, struct yaffs_ext_tags *tags);
+
+int yaffs_rd_chunks_nand(struct yaffs_dev *dev, int nand_chunk, int n_chunks,
+			 u8 *buffer, enum yaffs_ecc_result *ecc_result);
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 *buffer, struct yaffs_ext_tags *tags);
@@ -98,9 +98,10 @@ int yaffs_summary_init(struct yaffs_dev *dev)
 	return YAFFS_OK;
 }
 
-static unsigned yaffs_summary_sum(struct yaffs_dev *dev)
+static unsigned yaffs_summary_sum(struct yaffs_dev *dev,
+				  struct yaffs_summary_tags *st)
 {
-	u8 *sum_buffer = (u8 *)dev->sum_tags;
+	u8 *sum_buffer = (u8 *)st;
 	int i;
 	unsigned sum = 0;
 
@@ -141,7 +142,7 @@ static int yaffs_summary_write(struct yaffs_dev *dev, int blk)
 	hdr.version = YAFFS_SUMMARY_VERSION;
 	hdr.block = blk;
 	hdr.seq = bi->seq_number;
-	hdr.sum = yaffs_summary_sum(dev);
+	hdr.sum = yaffs_summary_sum(dev, dev->sum_tags);
 
 	do {
 		this_tx = n_bytes;
@@ -237,7 +238,7 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 		if (hdr.version != YAFFS_SUMMARY_VERSION ||
 		    hdr.block != blk ||
 		    hdr.seq != bi->seq_number ||
-		    hdr.sum != yaffs_summary_sum(dev))
+		    hdr.sum != yaffs_summary_sum(dev, st))
 			result = YAFFS_FAIL;
 	}
 
@@ -276,14 +277,101 @@ int yaffs_summary_add(struct yaffs_dev *dev,
 	return YAFFS_OK;
 }
 
-int yaffs_summary_fetch(struct yaffs_dev *dev,
-			struct yaffs_ext_tags *tags,
-			int chunk_in_block)
+/* Read the summary of a block into sb->sum_tags for the mount scan. This
+ * changes nothing in the device or its block info, so it can run on a scan
+ * helper thread; what yaffs_summary_read() would have recorded is left in
+ * sb for the scan to apply.
+ */
+int yaffs_summary_peek(struct yaffs_dev *dev, struct yaffs_scan_block *sb)
+{
+	struct yaffs_ext_tags tags;
+	u8 *buffer = sb->buffer;
+	u8 *sum_buffer = (u8 *)sb->sum_tags;
+	u8 *sum_end;
+	int n_bytes;
+	int chunk_id;
+	int chunk_in_nand;
+	int result;
+	int this_tx;
+	struct yaffs_summary_header hdr;
+	int sum_bytes_per_chunk = dev->data_bytes_per_chunk - sizeof(hdr);
+	unsigned sum = 0;
+
+	sb->n_summary_chunks = 0;
+	sb->sum_bytes = 0;
+	n_bytes = sizeof(struct yaffs_summary_tags) * dev->chunks_per_summary;
+	chunk_in_nand = sb->block * dev->param.chunks_per_block +
+							dev->chunks_per_summary;
+	chunk_id = 1;
+	do {
+		this_tx = n_bytes;
+		if (this_tx > sum_bytes_per_chunk)
+			this_tx = sum_bytes_per_chunk;
+		result = yaffs_rd_chunk_tags_raw(dev, chunk_in_nand,
+						buffer, &tags);
+		sb->n_reads++;
+		if (tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+			sb->n_ecc_errors++;
+
+		if (tags.chunk_id != chunk_id ||
+			tags.obj_id != YAFFS_OBJECTID_SUMMARY ||
+			tags.chunk_used == 0 ||
+			tags.ecc_result > YAFFS_ECC_RESULT_FIXED ||
+			tags.n_bytes != (this_tx + sizeof(hdr)))
+				result = YAFFS_FAIL;
+		if (result != YAFFS_OK)
+			break;
+
+		sb->n_summary_chunks++;
+		memcpy(&hdr, buffer, sizeof(hdr));
+		memcpy(sum_buffer, buffer + sizeof(hdr), this_tx);
+		n_bytes -= this_tx;
+		sum_buffer += this_tx;
+		sb->sum_bytes += this_tx;
+		chunk_in_nand++;
+		chunk_id++;
+	} while (result == YAFFS_OK && n_bytes > 0);
+
+	if (result == YAFFS_OK) {
+		sum_end = sum_buffer;
+		for (sum_buffer = (u8 *)sb->sum_tags; sum_buffer < sum_end;
+		     sum_buffer++)
+			sum += *sum_buffer;
+
+		if (hdr.version != YAFFS_SUMMARY_VERSION ||
+		    hdr.block != sb->block ||
+		    hdr.seq != sb->seq_number ||
+		    hdr.sum != sum)
+			result = YAFFS_FAIL;
+	}
+
+	return result;
+}
+
+/* Copy what yaffs_summary_peek() read into the device's summary, as
+ * yaffs_summary_read() leaves it.
+ */
+void yaffs_summary_load(struct yaffs_dev *dev, struct yaffs_scan_block *sb)
+{
+	if (dev->sum_tags && sb->sum_bytes)
+		memcpy(dev->sum_tags, sb->sum_tags, sb->sum_bytes);
+}
+
+int yaffs_summary_tags_bytes(struct yaffs_dev *dev)
+{
+	return sizeof(struct yaffs_summary_tags) * dev->chunks_per_summary;
+}
+
+int yaffs_summary_unpack(struct yaffs_dev *dev,
+			 struct yaffs_summary_tags *st,
+			 struct yaffs_ext_tags *tags,
+			 int chunk_in_block)
 {
 	struct yaffs_packed_tags2_tags_only tags_only;
 	struct yaffs_summary_tags *sum_tags;
 	if (chunk_in_block >= 0 && chunk_in_block < dev->chunks_per_summary) {
-		sum_tags = &dev->sum_tags[chunk_in_block];
+		sum_tags = &st[chunk_in_block];
+		tags_only.seq_number = 0;	/* not in the summary */
 		tags_only.chunk_id = sum_tags->chunk_id;
 		tags_only.n_bytes = sum_tags->n_bytes;
 		tags_only.obj_id = sum_tags->obj_id;
@@ -293,6 +381,13 @@ int yaffs_summary_fetch(struct yaffs_dev *dev,
 	return YAFFS_FAIL;
 }
 
+int yaffs_summary_fetch(struct yaffs_dev *dev,
+			struct yaffs_ext_tags *tags,
+			int chunk_in_block)
+{
+	return yaffs_summary_unpack(dev, dev->sum_tags, tags, chunk_in_block);
+}
+
 void yaffs_summary_gc(struct yaffs_dev *dev, int blk)
 {
 	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
@@ -33,5 +33,13 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 			int blk);
 void yaffs_summary_gc(struct yaffs_dev *dev, int blk);
 
+int yaffs_summary_peek(struct yaffs_dev *dev, struct yaffs_scan_block *sb);
+void yaffs_summary_load(struct yaffs_dev *dev, struct yaffs_scan_block *sb);
+int yaffs_summary_tags_bytes(struct yaffs_dev *dev);
+int yaffs_summary_unpack(struct yaffs_dev *dev,
+			 struct yaffs_summary_tags *st,
+			 struct yaffs_ext_tags *tags,
+			 int chunk_in_block);
+
 
 #endif
@@ -258,6 +258,10 @@ void yaffs_verify_file(struct yaffs_obj *obj)
 
 	actual_depth = obj->variant.file_variant.top_level;
 
+	/* An evicted tree is not worth rebuilding just to check it */
+	if (obj->variant.file_variant.evicted_tnodes)
+		return;
+
 	/* Check that the chunks in the tnode tree are all correct.
 	 * We do this by scanning through the tnode tree and
 	 * checking the tags for every chunk match.
@@ -149,6 +149,12 @@
 #define YAFFS_SUPER_HAS_DIRTY
 #endif
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27))
+#define YAFFS_USE_READPAGES 1
+#else
+#define YAFFS_USE_READPAGES 0
+#endif
+
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 2, 0))
 #define set_nlink(inode, count)  do { (inode)->i_nlink = (count); } while(0)
@@ -177,7 +183,10 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 
 #include "yaffs_mtdif.h"
 #include "yaffs_packedtags2.h"
+#include "yaffs_ecc.h"
 #include "yaffs_getblockinfo.h"
+#include "yaffs_yaffs2.h"
+#include "yaffs_allocator.h"
 
 unsigned int yaffs_trace_mask =
 		YAFFS_TRACE_BAD_BLOCKS |
@@ -258,6 +267,141 @@ static void yaffs_gross_unlock(struct yaffs_dev *dev)
 	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
+/*
+ * Page reads map their chunks under gross_lock and then do the NAND I/O
+ * without it, so that they do not queue up behind writes, GC or each
+ * other. While the lock is dropped the blocks being read are pinned.
+ * yaffs calls yaffs_erase_wait() before it erases a block, and that waits
+ * for the block's pins to drop, which is what keeps GC from recycling a
+ * block under a reader. Pins are counted in a small table hashed on the
+ * block number, so now and then an erase waits on a read of some other
+ * block.
+ */
+static atomic_t *yaffs_block_pin(struct yaffs_dev *dev, int block_no)
+{
+	return &yaffs_dev_to_lc(dev)->block_pins[block_no % YAFFS_N_BLOCK_PINS];
+}
+
+static void yaffs_pin_chunks(struct yaffs_dev *dev, const int *nand_chunks,
+			     int n_chunks, int pin)
+{
+	int wake = 0;
+	int i;
+
+	for (i = 0; i < n_chunks; i++) {
+		atomic_t *pins;
+
+		if (nand_chunks[i] < 0)
+			continue;
+		pins = yaffs_block_pin(dev,
+				nand_chunks[i] / dev->param.chunks_per_block);
+		if (pin)
+			atomic_inc(pins);
+		else if (atomic_dec_and_test(pins))
+			wake = 1;
+	}
+
+	if (wake)
+		wake_up(&yaffs_dev_to_lc(dev)->pin_wait);
+}
+
+static void yaffs_erase_wait(struct yaffs_dev *dev, int block_no)
+{
+	atomic_t *pins = yaffs_block_pin(dev, block_no);
+
+	if (atomic_read(pins) == 0)
+		return;
+
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs erase of %d waits for readers",
+		block_no);
+	wait_event(yaffs_dev_to_lc(dev)->pin_wait, atomic_read(pins) == 0);
+}
+
+/* Object headers for lookup and readdir, read like page cache data: the
+ * chunks are asked for under gross_lock, pinned and read without it.
+ * Called and returns with gross_lock held. The headers stay on
+ * dev->hdr_prefetch for yaffs to use until that is cleared, which must
+ * happen before gross_lock is next dropped. Failed reads are left for
+ * yaffs to redo locked.
+ */
+static void yaffs_hdr_prefetch(struct yaffs_dev *dev,
+			       struct yaffs_hdr_prefetch *pf,
+			       const int *nand_chunks, int n)
+{
+	int bytes = dev->data_bytes_per_chunk;
+	u32 failed = 0;
+	int i;
+
+	dev->hdr_prefetch = NULL;
+	pf->n = 0;
+	if (!pf->buffer)
+		pf->buffer = kmalloc(YAFFS_HDR_PREFETCH_MAX * bytes, GFP_NOFS);
+	if (!pf->buffer)
+		return;
+
+	memcpy(pf->chunk, nand_chunks, n * sizeof(int));
+	pf->n_erasures = dev->n_erasures;
+	yaffs_pin_chunks(dev, pf->chunk, n, 1);
+	yaffs_gross_unlock(dev);
+
+	for (i = 0; i < n; i++) {
+		if (yaffs_rd_mapped_chunks(dev, &pf->chunk[i], 1,
+					   pf->buffer + i * bytes) != YAFFS_OK)
+			failed |= 1 << i;
+	}
+	yaffs_pin_chunks(dev, pf->chunk, n, 0);
+
+	yaffs_gross_lock(dev);
+	for (i = 0; i < n; i++) {
+		if (failed & (1 << i))
+			pf->chunk[i] = -1;
+	}
+	pf->n = n;
+	dev->hdr_prefetch = pf;
+}
+
+/* yaffs_file_rd() for the page cache, with the NAND reads done unlocked
+ * wherever the range allows it. Must be called without gross_lock.
+ */
+static int yaffs_file_rd_unlocked(struct yaffs_obj *obj, u8 *buf,
+				  loff_t pos, int n_bytes)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	int nand_chunks[YAFFS_MAX_RD_RUN];
+	int n_done = 0;
+	int len;
+	int ret;
+	int n;
+
+	while (n_done < n_bytes) {
+		yaffs_gross_lock(dev);
+		n = yaffs_file_map_chunks(obj, pos + n_done, n_bytes - n_done,
+					  nand_chunks, YAFFS_MAX_RD_RUN);
+		if (n == 0) {
+			/* Cached, unaligned or part of a chunk. Read the rest
+			 * the ordinary way. */
+			ret = yaffs_file_rd(obj, buf + n_done, pos + n_done,
+					    n_bytes - n_done);
+			yaffs_gross_unlock(dev);
+			return (ret < 0) ? ret : n_done + ret;
+		}
+		yaffs_pin_chunks(dev, nand_chunks, n, 1);
+		yaffs_gross_unlock(dev);
+
+		len = n * dev->data_bytes_per_chunk;
+		ret = yaffs_rd_mapped_chunks(dev, nand_chunks, n, buf + n_done);
+		yaffs_pin_chunks(dev, nand_chunks, n, 0);
+
+		if (ret != YAFFS_OK) {
+			/* Read it again locked so the error gets handled */
+			yaffs_gross_lock(dev);
+			yaffs_file_rd(obj, buf + n_done, pos + n_done, len);
+			yaffs_gross_unlock(dev);
+		}
+		n_done += len;
+	}
+	return n_done;
+}
 
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 {
@@ -267,7 +411,6 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	unsigned char *pg_buf;
 	int ret;
 	loff_t pos = ((loff_t) pg->index) << PAGE_CACHE_SHIFT;
-	struct yaffs_dev *dev;
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_readpage_nolock at %lld, size %08x",
@@ -276,8 +419,6 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 
-	dev = obj->my_dev;
-
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 	BUG_ON(!PageLocked(pg));
 #else
@@ -288,11 +429,7 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
-
-	ret = yaffs_file_rd(obj, pg_buf, pos, PAGE_CACHE_SIZE);
-
-	yaffs_gross_unlock(dev);
+	ret = yaffs_file_rd_unlocked(obj, pg_buf, pos, PAGE_CACHE_SIZE);
 
 	if (ret >= 0)
 		ret = 0;
@@ -329,6 +466,93 @@ static int yaffs_readpage(struct file *f, struct page *pg)
 	return ret;
 }
 
+#if (YAFFS_USE_READPAGES > 0)
+/* Most pages read ahead with one yaffs_file_rd() call */
+#define YAFFS_READPAGES_MAX	32
+
+/*
+ * Fill a run of locked, consecutive page cache pages with one
+ * yaffs_file_rd() so that yaffs can resolve the chunks behind them in one
+ * pass and read physically contiguous ones as a single NAND operation.
+ * The pages are mapped side by side with vmap(); if that fails they are
+ * read one at a time.
+ */
+static void yaffs_readpage_run(struct file *f, struct page **pages, int n)
+{
+	struct yaffs_obj *obj = yaffs_dentry_to_obj(f->f_dentry);
+	loff_t pos = ((loff_t) pages[0]->index) << PAGE_CACHE_SHIFT;
+	unsigned char *buf;
+	int ret;
+	int i;
+
+	buf = (n > 1) ? vmap(pages, n, VM_MAP, PAGE_KERNEL) : NULL;
+	if (!buf) {
+		for (i = 0; i < n; i++) {
+			yaffs_readpage_unlock(f, pages[i]);
+			page_cache_release(pages[i]);
+		}
+		return;
+	}
+
+	yaffs_trace(YAFFS_TRACE_OS,
+		"yaffs_readpage_run at %lld, %d pages", (long long)pos, n);
+
+	ret = yaffs_file_rd_unlocked(obj, buf, pos, n * PAGE_CACHE_SIZE);
+
+	vunmap(buf);
+
+	for (i = 0; i < n; i++) {
+		struct page *pg = pages[i];
+
+		if (ret >= 0) {
+			SetPageUptodate(pg);
+			ClearPageError(pg);
+		} else {
+			ClearPageUptodate(pg);
+			SetPageError(pg);
+		}
+		flush_dcache_page(pg);
+		UnlockPage(pg);
+		page_cache_release(pg);
+	}
+}
+
+static int yaffs_readpages(struct file *f, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages)
+{
+	struct page *run[YAFFS_READPAGES_MAX];
+	struct page *pg;
+	int n_run = 0;
+	unsigned i;
+
+	yaffs_trace(YAFFS_TRACE_OS, "yaffs_readpages %u pages", nr_pages);
+
+	for (i = 0; i < nr_pages; i++) {
+		/* The read-ahead list is in reverse index order */
+		pg = list_entry(pages->prev, struct page, lru);
+		list_del(&pg->lru);
+
+		if (add_to_page_cache_lru(pg, mapping, pg->index,
+					  GFP_KERNEL)) {
+			page_cache_release(pg);
+			continue;
+		}
+
+		if (n_run > 0 && (n_run == YAFFS_READPAGES_MAX ||
+				  run[n_run - 1]->index + 1 != pg->index)) {
+			yaffs_readpage_run(f, run, n_run);
+			n_run = 0;
+		}
+		run[n_run++] = pg;
+	}
+
+	if (n_run > 0)
+		yaffs_readpage_run(f, run, n_run);
+
+	yaffs_trace(YAFFS_TRACE_OS, "yaffs_readpages done");
+	return 0;
+}
+#endif
 
 static void yaffs_set_super_dirty_val(struct yaffs_dev *dev, int val)
 {
@@ -701,6 +925,9 @@ static int yaffs_commit_write(struct file *f, struct page *pg, unsigned offset,
 
 static struct address_space_operations yaffs_file_address_operations = {
 	.readpage = yaffs_readpage,
+#if (YAFFS_USE_READPAGES > 0)
+	.readpages = yaffs_readpages,
+#endif
 	.writepage = yaffs_writepage,
 #if (YAFFS_USE_WRITE_BEGIN_END > 0)
 	.write_begin = yaffs_write_begin,
@@ -1343,21 +1570,51 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	struct yaffs_obj *obj;
 	struct inode *inode = NULL;	/* NCB 2.5/2.6 needs NULL here */
 
-	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
+	struct yaffs_obj *dir_obj = yaffs_inode_to_obj(dir);
+	struct yaffs_dev *dev = dir_obj->my_dev;
+	int locked = (current != yaffs_dev_to_lc(dev)->readdir_process);
+	struct yaffs_hdr_prefetch pf;
+	int nand_chunks[YAFFS_HDR_PREFETCH_MAX];
+	int rounds;
+	int n;
 
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
+	pf.buffer = NULL;
+
+	if (locked)
 		yaffs_gross_lock(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_lookup for %d:%s",
-		yaffs_inode_to_obj(dir)->obj_id, dentry->d_name.name);
+		dir_obj->obj_id, dentry->d_name.name);
+
+	if (locked) {
+		/* Read the headers the search needs without the lock: those
+		 * of children not loaded since a checkpointed mount, then
+		 * the long names to compare. Give up on a busy device and
+		 * let the search read what is left. */
+		rounds = dir_obj->variant.dir_variant.n_children /
+			 YAFFS_HDR_PREFETCH_MAX + 2;
+		while ((n = yaffs_dir_lazy_hdrs(dir_obj, nand_chunks,
+					YAFFS_HDR_PREFETCH_MAX)) > 0 &&
+		       rounds-- > 0)
+			yaffs_hdr_prefetch(dev, &pf, nand_chunks, n);
+
+		n = yaffs_find_by_name_hdrs(dir_obj, dentry->d_name.name,
+					    nand_chunks,
+					    YAFFS_HDR_PREFETCH_MAX);
+		if (n > 0)
+			yaffs_hdr_prefetch(dev, &pf, nand_chunks, n);
+	}
 
-	obj = yaffs_find_by_name(yaffs_inode_to_obj(dir), dentry->d_name.name);
+	obj = yaffs_find_by_name(dir_obj, dentry->d_name.name);
 
 	obj = yaffs_get_equivalent_obj(obj);	/* in case it was a hardlink */
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
+	if (locked) {
+		dev->hdr_prefetch = NULL;
 		yaffs_gross_unlock(dev);
+	}
+	kfree(pf.buffer);
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -1683,11 +1940,17 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	unsigned long offset, curoffs;
 	struct yaffs_obj *l;
 	int ret_val = 0;
+	struct yaffs_hdr_prefetch pf;
+	int nand_chunks[YAFFS_HDR_PREFETCH_MAX];
+	int n_ahead = 0;
+	int n;
 
 	char name[YAFFS_MAX_NAME_LENGTH + 1];
 
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 	dev = obj->my_dev;
+	pf.n = 0;
+	pf.buffer = NULL;
 
 	yaffs_gross_lock(dev);
 
@@ -1744,6 +2007,17 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	}
 
 	while (sc->next_return) {
+		if (n_ahead == 0 && curoffs + 1 >= offset) {
+			/* Read the headers the next entries need without
+			 * the lock. The search may move on meanwhile. */
+			n = yaffs_dir_name_hdrs(sc->next_return, nand_chunks,
+						YAFFS_HDR_PREFETCH_MAX,
+						&n_ahead);
+			if (n > 0) {
+				yaffs_hdr_prefetch(dev, &pf, nand_chunks, n);
+				continue;
+			}
+		}
 		curoffs++;
 		l = sc->next_return;
 		if (curoffs >= offset) {
@@ -1755,6 +2029,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 				"yaffs_readdir: %s inode %d",
 				name, yaffs_get_obj_inode(l));
 
+			dev->hdr_prefetch = NULL;
 			yaffs_gross_unlock(dev);
 
 			if (filldir(dirent,
@@ -1766,6 +2041,10 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			}
 
 			yaffs_gross_lock(dev);
+			if (pf.n)
+				dev->hdr_prefetch = &pf;
+			if (n_ahead > 0)
+				n_ahead--;
 
 			offset++;
 			f->f_pos++;
@@ -1776,7 +2055,9 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 out:
 	yaffs_search_end(sc);
 	yaffs_dev_to_lc(dev)->readdir_process = NULL;
+	dev->hdr_prefetch = NULL;
 	yaffs_gross_unlock(dev);
+	kfree(pf.buffer);
 
 	return ret_val;
 }
@@ -2068,6 +2349,172 @@ static void yaffs_bg_stop(struct yaffs_dev *dev)
 }
 #endif
 
+#ifdef YAFFS_COMPILE_BACKGROUND
+/*
+ * Mount scan read-ahead. yaffs2_scan_backwards() gives each of its passes
+ * to these helpers, which claim items in order, wait for the item's slot in
+ * the ring to come free and fill it with yaffs2_scan_fill(). That keeps
+ * the flash busy while the scan is building objects, and with more than
+ * one CPU the tag unpacking and checking is spread out as well.
+ * The MTD layer serialises access to the chip itself. The driver's ECC
+ * counters are bumped without a lock, so they can miss a count while the
+ * helpers run.
+ */
+#define YAFFS_MAX_SCAN_THREADS 4
+
+struct yaffs_scan_helpers {
+	struct yaffs_scan_ahead *sa;
+	struct task_struct *threads[YAFFS_MAX_SCAN_THREADS];
+	int n_threads;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	int next;		/* Next item to claim */
+	int consumed;		/* Items the scan has finished with */
+	int stop;
+	int *filled;		/* Item in each slot, -1 if none yet */
+};
+
+static int yaffs_scan_slot_free(struct yaffs_scan_helpers *sh, int item)
+{
+	int ret;
+
+	spin_lock(&sh->lock);
+	ret = sh->stop || item < sh->consumed + sh->sa->window;
+	spin_unlock(&sh->lock);
+	return ret;
+}
+
+static int yaffs_scan_item_filled(struct yaffs_scan_helpers *sh, int item)
+{
+	int ret;
+
+	spin_lock(&sh->lock);
+	ret = sh->filled[item % sh->sa->window] == item;
+	spin_unlock(&sh->lock);
+	return ret;
+}
+
+static int yaffs_scan_helper_fn(void *data)
+{
+	struct yaffs_scan_helpers *sh = data;
+	struct yaffs_scan_ahead *sa = sh->sa;
+	int item;
+
+	while (1) {
+		spin_lock(&sh->lock);
+		item = sh->next++;
+		spin_unlock(&sh->lock);
+
+		if (item >= sa->n_items)
+			break;
+
+		wait_event(sh->wait, yaffs_scan_slot_free(sh, item));
+		if (sh->stop)
+			break;
+
+		yaffs2_scan_fill(sa, item, &sa->slots[item % sa->window]);
+
+		spin_lock(&sh->lock);
+		sh->filled[item % sa->window] = item;
+		spin_unlock(&sh->lock);
+		wake_up_all(&sh->wait);
+	}
+
+	/* Hang about until yaffs_scan_ahead_stop() reaps us */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int yaffs_scan_ahead_start(struct yaffs_scan_ahead *sa)
+{
+	struct yaffs_dev *dev = sa->dev;
+	struct yaffs_scan_helpers *sh;
+	struct task_struct *t;
+	int n_threads = dev->param.n_scan_threads;
+	int i;
+
+	if (n_threads > YAFFS_MAX_SCAN_THREADS)
+		n_threads = YAFFS_MAX_SCAN_THREADS;
+
+	sh = kmalloc(sizeof(struct yaffs_scan_helpers), GFP_NOFS);
+	if (!sh)
+		return 0;
+	memset(sh, 0, sizeof(struct yaffs_scan_helpers));
+
+	sh->filled = kmalloc(sa->window * sizeof(int), GFP_NOFS);
+	if (!sh->filled) {
+		kfree(sh);
+		return 0;
+	}
+	for (i = 0; i < sa->window; i++)
+		sh->filled[i] = -1;
+
+	sh->sa = sa;
+	spin_lock_init(&sh->lock);
+	init_waitqueue_head(&sh->wait);
+
+	for (i = 0; i < n_threads; i++) {
+		t = kthread_run(yaffs_scan_helper_fn, sh, "yaffs-scan-%d.%d",
+				yaffs_dev_to_lc(dev)->mount_id, i);
+		if (IS_ERR(t))
+			break;
+		sh->threads[sh->n_threads++] = t;
+	}
+
+	if (!sh->n_threads) {
+		kfree(sh->filled);
+		kfree(sh);
+		return 0;
+	}
+
+	sa->os_context = sh;
+	return sh->n_threads;
+}
+
+static struct yaffs_scan_block *yaffs_scan_ahead_get(
+				struct yaffs_scan_ahead *sa, int item)
+{
+	struct yaffs_scan_helpers *sh = sa->os_context;
+
+	wait_event(sh->wait, yaffs_scan_item_filled(sh, item));
+	return &sa->slots[item % sa->window];
+}
+
+static void yaffs_scan_ahead_put(struct yaffs_scan_ahead *sa, int item)
+{
+	struct yaffs_scan_helpers *sh = sa->os_context;
+
+	spin_lock(&sh->lock);
+	sh->consumed = item + 1;
+	spin_unlock(&sh->lock);
+	wake_up_all(&sh->wait);
+}
+
+static void yaffs_scan_ahead_stop(struct yaffs_scan_ahead *sa)
+{
+	struct yaffs_scan_helpers *sh = sa->os_context;
+	int i;
+
+	spin_lock(&sh->lock);
+	sh->stop = 1;
+	spin_unlock(&sh->lock);
+	wake_up_all(&sh->wait);
+
+	for (i = 0; i < sh->n_threads; i++)
+		kthread_stop(sh->threads[i]);
+
+	kfree(sh->filled);
+	kfree(sh);
+	sa->os_context = NULL;
+}
+#endif
+
 
 static void yaffs_flush_inodes(struct super_block *sb)
 {
@@ -2101,6 +2548,114 @@ static void yaffs_flush_super(struct super_block *sb, int do_checkpoint)
 static LIST_HEAD(yaffs_context_list);
 struct mutex yaffs_context_lock;
 
+/*
+ * Memory shrinker. Under pressure the tnode trees of files nobody has open
+ * are dropped (see yaffs_evict_tnodes()) and the pages they were on go back
+ * to the system. Rebuilding a tree means reading tags off the NAND, so the
+ * shrinker asks to be called less often than for a plain cache. Nothing
+ * here waits on a lock, reclaim may be running inside yaffs already. Only
+ * the trees that could go are counted, and as that walks every object the
+ * count is redone at most once a second.
+ */
+static unsigned long yaffs_shrink_count(void)
+{
+	struct list_head *item;
+	unsigned long count = 0;
+
+	if (!mutex_trylock(&yaffs_context_lock))
+		return 0;
+
+	list_for_each(item, &yaffs_context_list) {
+		struct yaffs_linux_context *dc =
+		    list_entry(item, struct yaffs_linux_context,
+			       context_list);
+
+		if (!dc->dev->is_mounted)
+			continue;
+		if (time_after_eq(jiffies, dc->evictable_at + HZ) &&
+		    mutex_trylock(&dc->gross_lock)) {
+			if (dc->dev->is_mounted)
+				dc->evictable =
+				    yaffs_evictable_tnodes(dc->dev);
+			dc->evictable_at = jiffies;
+			mutex_unlock(&dc->gross_lock);
+		}
+		count += dc->evictable;
+	}
+
+	mutex_unlock(&yaffs_context_lock);
+	return count;
+}
+
+static unsigned long yaffs_shrink_scan(unsigned long nr_to_scan)
+{
+	struct list_head *item;
+	unsigned long freed = 0;
+	int n;
+
+	if (!mutex_trylock(&yaffs_context_lock))
+		return 0;
+
+	list_for_each(item, &yaffs_context_list) {
+		struct yaffs_linux_context *dc =
+		    list_entry(item, struct yaffs_linux_context,
+			       context_list);
+		struct yaffs_dev *dev = dc->dev;
+
+		if (freed >= nr_to_scan)
+			break;
+		if (!dev->is_mounted || !mutex_trylock(&dc->gross_lock))
+			continue;
+		if (dev->is_mounted) {
+			n = yaffs_evict_tnodes(dev, nr_to_scan - freed);
+			dc->evictable -= min(n, dc->evictable);
+			freed += n;
+		}
+		mutex_unlock(&dc->gross_lock);
+	}
+
+	mutex_unlock(&yaffs_context_lock);
+	return freed;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0))
+static unsigned long yaffs_shrinker_count(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	return yaffs_shrink_count();
+}
+
+static unsigned long yaffs_shrinker_scan(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+	return yaffs_shrink_scan(sc->nr_to_scan);
+}
+
+static struct shrinker yaffs_shrinker = {
+	.count_objects = yaffs_shrinker_count,
+	.scan_objects = yaffs_shrinker_scan,
+	.seeks = DEFAULT_SEEKS * 4,
+};
+#else
+static int yaffs_shrinker_shrink(struct shrinker *shrink,
+				 struct shrink_control *sc)
+{
+	if (sc->nr_to_scan) {
+		if (!(sc->gfp_mask & __GFP_FS))
+			return -1;
+		yaffs_shrink_scan(sc->nr_to_scan);
+	}
+	return min_t(unsigned long, yaffs_shrink_count(), INT_MAX);
+}
+
+static struct shrinker yaffs_shrinker = {
+	.shrink = yaffs_shrinker_shrink,
+	.seeks = DEFAULT_SEEKS * 4,
+};
+#endif
+
 static void yaffs_put_super(struct super_block *sb)
 {
 	struct yaffs_dev *dev = yaffs_super_to_dev(sb);
@@ -2501,6 +3056,12 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;
+	int n_caches_overridden;
+	int n_scan_threads;
+	int n_scan_threads_overridden;
+	int checkpoint_deltas;
+	int checkpoint_deltas_overridden;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -2508,6 +3069,7 @@ struct yaffs_options {
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
 	int disable_summary;
+	int gc_cost_benefit;
 };
 
 #define MAX_OPT_LEN 30
@@ -2557,8 +3119,21 @@ static int yaffs_parse_options(struct yaffs_options *options,
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-on")) {
 			options->empty_lost_and_found = 1;
 			options->empty_lost_and_found_overridden = 1;
+		} else if (!strcmp(cur_opt, "gc-cost-benefit")) {
+			options->gc_cost_benefit = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "n-caches=", 9)) {
+			options->n_caches = simple_strtoul(cur_opt + 9, NULL, 0);
+			options->n_caches_overridden = 1;
+		} else if (!strncmp(cur_opt, "scan-threads=", 13)) {
+			options->n_scan_threads =
+				simple_strtoul(cur_opt + 13, NULL, 0);
+			options->n_scan_threads_overridden = 1;
+		} else if (!strncmp(cur_opt, "checkpoint-deltas=", 18)) {
+			options->checkpoint_deltas =
+				simple_strtoul(cur_opt + 18, NULL, 0);
+			options->checkpoint_deltas_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -2754,6 +3329,8 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	param->n_reserved_blocks = 5;
 	param->n_caches = (options.no_cache) ? 0 : 10;
+	if (options.n_caches_overridden && !options.no_cache)
+		param->n_caches = options.n_caches;
 	param->inband_tags = inband_tags;
 
 	param->enable_xattr = 1;
@@ -2806,6 +3383,17 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	param->sb_dirty_fn = yaffs_set_super_dirty;
 	param->gc_control_fn = yaffs_gc_control_callback;
+	param->erase_wait_fn = yaffs_erase_wait;
+
+#ifdef YAFFS_COMPILE_BACKGROUND
+	param->n_scan_threads = num_online_cpus();
+	if (options.n_scan_threads_overridden)
+		param->n_scan_threads = options.n_scan_threads;
+	param->scan_ahead_start_fn = yaffs_scan_ahead_start;
+	param->scan_ahead_get_fn = yaffs_scan_ahead_get;
+	param->scan_ahead_put_fn = yaffs_scan_ahead_put;
+	param->scan_ahead_stop_fn = yaffs_scan_ahead_stop;
+#endif
 
 	yaffs_dev_to_lc(dev)->super = sb;
 
@@ -2813,6 +3401,10 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	param->skip_checkpt_rd = options.skip_checkpoint_read;
 	param->skip_checkpt_wr = options.skip_checkpoint_write;
+	param->checkpt_max_deltas = 16;
+	if (options.checkpoint_deltas_overridden)
+		param->checkpt_max_deltas = options.checkpoint_deltas;
+	param->gc_cost_benefit = options.gc_cost_benefit;
 
 	mutex_lock(&yaffs_context_lock);
 	/* Get a mount id */
@@ -2828,6 +3420,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		}
 	}
 	context->mount_id = mount_id;
+	context->evictable_at = jiffies - HZ;	/* counted at the first ask */
 
 	list_add_tail(&(yaffs_dev_to_lc(dev)->context_list),
 		      &yaffs_context_list);
@@ -2838,6 +3431,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
 	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_waitqueue_head(&(yaffs_dev_to_lc(dev)->pin_wait));
 
 	yaffs_gross_lock(dev);
 
@@ -3023,6 +3617,8 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 				param->disable_bad_block_marking);
 	buf += sprintf(buf, "refresh_period....... %d\n",
 				param->refresh_period);
+	buf += sprintf(buf, "gc_cost_benefit...... %d\n",
+				param->gc_cost_benefit);
 	buf += sprintf(buf, "n_caches............. %d\n", param->n_caches);
 	buf += sprintf(buf, "n_reserved_blocks.... %d\n",
 				param->n_reserved_blocks);
@@ -3040,6 +3636,9 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
+	int n_pages;
+	int n_tnode_pages;
+
 	buf += sprintf(buf, "max file size....... %lld\n",
 				(long long) yaffs_max_file_size(dev));
 	buf += sprintf(buf, "data_bytes_per_chunk. %d\n",
@@ -3051,11 +3650,17 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 				dev->blocks_in_checkpt);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "n_tnodes............. %d\n", dev->n_tnodes);
+	buf += sprintf(buf, "n_evicted_tnodes..... %d\n",
+				dev->n_evicted_tnodes);
 	buf += sprintf(buf, "n_obj................ %d\n", dev->n_obj);
+	n_pages = yaffs_raw_pages(dev, &n_tnode_pages);
+	buf += sprintf(buf, "alloc_pages.......... %d\n", n_pages);
+	buf += sprintf(buf, "tnode_pages.......... %d\n", n_tnode_pages);
 	buf += sprintf(buf, "n_free_chunks........ %d\n", dev->n_free_chunks);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "n_page_writes........ %u\n", dev->n_page_writes);
 	buf += sprintf(buf, "n_page_reads......... %u\n", dev->n_page_reads);
+	buf += sprintf(buf, "n_multi_reads........ %u\n", dev->n_multi_reads);
 	buf += sprintf(buf, "n_erasures........... %u\n", dev->n_erasures);
 	buf += sprintf(buf, "n_gc_copies.......... %u\n", dev->n_gc_copies);
 	buf += sprintf(buf, "all_gcs.............. %u\n", dev->all_gcs);
@@ -3083,6 +3688,29 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_bg_deletions....... %u\n", dev->n_bg_deletions);
 	buf += sprintf(buf, "tags_used............ %u\n", dev->tags_used);
 	buf += sprintf(buf, "summary_used......... %u\n", dev->summary_used);
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "scan_blocks.......... %u\n", dev->scan_blocks);
+	buf += sprintf(buf, "scan_summaries....... %u\n", dev->scan_summaries);
+	buf += sprintf(buf, "scan_threads......... %u\n", dev->scan_threads);
+	buf += sprintf(buf, "scan_state_ms........ %u\n", dev->scan_state_ms);
+	buf += sprintf(buf, "scan_sort_ms......... %u\n", dev->scan_sort_ms);
+	buf += sprintf(buf, "scan_tags_ms......... %u\n", dev->scan_tags_ms);
+	buf += sprintf(buf, "scan_fixup_ms........ %u\n", dev->scan_fixup_ms);
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "checkpt_max_deltas... %d\n",
+				dev->param.checkpt_max_deltas);
+	buf += sprintf(buf, "checkpt_n_deltas..... %d\n",
+				dev->checkpt_n_deltas);
+	buf += sprintf(buf, "checkpt_full_saves... %u\n",
+				dev->checkpt_full_saves);
+	buf += sprintf(buf, "checkpt_delta_saves.. %u\n",
+				dev->checkpt_delta_saves);
+	buf += sprintf(buf, "checkpt_last_bytes... %u\n",
+				dev->checkpt_last_bytes);
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "tnode_evictions...... %u\n",
+				dev->tnode_evictions);
+	buf += sprintf(buf, "tnode_reloads........ %u\n", dev->tnode_reloads);
 
 	return buf;
 }
@@ -3394,6 +4022,8 @@ static int __init init_yaffs_fs(void)
 
 	mutex_init(&yaffs_context_lock);
 
+	yaffs_ecc_init();
+
 	/* Install the proc_fs entries */
 	my_proc_entry = create_proc_entry("yaffs",
 					  S_IRUGO | S_IFREG, YPROC_ROOT);
@@ -3428,6 +4058,8 @@ static int __init init_yaffs_fs(void)
 			}
 			fsinst++;
 		}
+	} else {
+		register_shrinker(&yaffs_shrinker);
 	}
 
 	return error;
@@ -3443,6 +4075,8 @@ static void __exit exit_yaffs_fs(void)
 
 	remove_proc_entry("yaffs", YPROC_ROOT);
 
+	unregister_shrinker(&yaffs_shrinker);
+
 	fsinst = fs_to_install;
 
 	while (fsinst->fst) {
@@ -31,6 +31,22 @@
 #define YAFFS_CHECKPOINT_MIN_BLOCKS 60
 #define YAFFS_SMALL_HOLE_THRESHOLD 4
 
+/*
+ * Validity marker heads. A checkpoint is a full image bracketed by HEAD
+ * and TAIL markers, which may be followed by appended segments: an OPEN
+ * marker, written before the first NAND change after a save, and DELTA
+ * records holding what changed since the previous save. A checkpoint
+ * whose last segment is an OPEN marker is stale.
+ */
+#define YAFFS_CHECKPT_MARK_TAIL		0
+#define YAFFS_CHECKPT_MARK_HEAD		1
+#define YAFFS_CHECKPT_MARK_OPEN		2
+#define YAFFS_CHECKPT_MARK_DELTA	3
+
+/* Bounds on the change log, in entries */
+#define YAFFS_CHECKPT_LOG_MIN		64
+#define YAFFS_CHECKPT_LOG_MAX		8192
+
 /*
  * Oldest Dirty Sequence Number handling.
  */
@@ -225,7 +241,8 @@ int yaffs_calc_checkpt_blocks_required(struct yaffs_dev *dev)
 		n_bytes +=
 		    (sizeof(struct yaffs_checkpt_obj) + sizeof(u32)) *
 		    dev->n_obj;
-		n_bytes += (dev->tnode_size + sizeof(u32)) * dev->n_tnodes;
+		n_bytes += (dev->tnode_size + sizeof(u32)) *
+		    (dev->n_tnodes + dev->n_evicted_tnodes);
 		n_bytes += sizeof(struct yaffs_checkpt_validity);
 		n_bytes += sizeof(u32);	/* checksum */
 
@@ -248,7 +265,7 @@ int yaffs_calc_checkpt_blocks_required(struct yaffs_dev *dev)
 
 /*--------------------- Checkpointing --------------------*/
 
-static int yaffs2_wr_checkpt_validity_marker(struct yaffs_dev *dev, int head)
+static int yaffs2_wr_checkpt_validity_marker(struct yaffs_dev *dev, u32 head)
 {
 	struct yaffs_checkpt_validity cp;
 
@@ -257,12 +274,19 @@ static int yaffs2_wr_checkpt_validity_marker(struct yaffs_dev *dev, int head)
 	cp.struct_type = sizeof(cp);
 	cp.magic = YAFFS_MAGIC;
 	cp.version = YAFFS_CHECKPOINT_VERSION;
-	cp.head = (head) ? 1 : 0;
+	cp.head = head;
 
 	return (yaffs2_checkpt_wr(dev, &cp, sizeof(cp)) == sizeof(cp)) ? 1 : 0;
 }
 
-static int yaffs2_rd_checkpt_validity_marker(struct yaffs_dev *dev, int head)
+static int yaffs2_checkpt_validity_ok(struct yaffs_checkpt_validity *cp)
+{
+	return (cp->struct_type == sizeof(*cp)) &&
+	    (cp->magic == YAFFS_MAGIC) &&
+	    (cp->version == YAFFS_CHECKPOINT_VERSION);
+}
+
+static int yaffs2_rd_checkpt_validity_marker(struct yaffs_dev *dev, u32 head)
 {
 	struct yaffs_checkpt_validity cp;
 	int ok;
@@ -270,20 +294,22 @@ static int yaffs2_rd_checkpt_validity_marker(struct yaffs_dev *dev, int head)
 	ok = (yaffs2_checkpt_rd(dev, &cp, sizeof(cp)) == sizeof(cp));
 
 	if (ok)
-		ok = (cp.struct_type == sizeof(cp)) &&
-		    (cp.magic == YAFFS_MAGIC) &&
-		    (cp.version == YAFFS_CHECKPOINT_VERSION) &&
-		    (cp.head == ((head) ? 1 : 0));
+		ok = yaffs2_checkpt_validity_ok(&cp) && (cp.head == head);
 	return ok ? 1 : 0;
 }
 
 static void yaffs2_dev_to_checkpt_dev(struct yaffs_checkpt_dev *cp,
 				      struct yaffs_dev *dev)
 {
-	cp->n_erased_blocks = dev->n_erased_blocks;
+	/* Blocks the checkpoint already had when this stream was opened
+	 * are counted as erased, like the ones it is about to take. Reading
+	 * the checkpoint back takes all of them off again.
+	 */
+	cp->n_erased_blocks = dev->n_erased_blocks + dev->checkpt_prev_blocks;
 	cp->alloc_block = dev->alloc_block;
 	cp->alloc_page = dev->alloc_page;
-	cp->n_free_chunks = dev->n_free_chunks;
+	cp->n_free_chunks = dev->n_free_chunks +
+	    dev->checkpt_prev_blocks * dev->param.chunks_per_block;
 
 	cp->n_deleted_files = dev->n_deleted_files;
 	cp->n_unlinked_files = dev->n_unlinked_files;
@@ -418,6 +444,8 @@ static int yaffs2_checkpt_obj_to_obj(struct yaffs_obj *obj,
 				parent->variant_type);
 			return 0;
 		}
+		/* Named by its header, so it can go in the parent's index */
+		obj->hdr_chunk = cp->hdr_chunk;
 		yaffs_add_obj_to_dir(parent, obj);
 	}
 
@@ -569,6 +597,11 @@ static int yaffs2_wr_checkpt_objs(struct yaffs_dev *dev)
 					obj->variant_type ==
 					YAFFS_OBJECT_TYPE_FILE)
 					ok = yaffs2_wr_checkpt_tnodes(obj);
+
+				obj->checkpt_dirty = 0;
+				obj->checkpt_saved = 1;
+			} else {
+				obj->checkpt_saved = 0;
 			}
 		}
 	}
@@ -621,7 +654,10 @@ static int yaffs2_rd_checkpt_objs(struct yaffs_dev *dev)
 					ok = yaffs2_rd_checkpt_tnodes(obj);
 				} else if (obj->variant_type ==
 					YAFFS_OBJECT_TYPE_HARDLINK) {
-					list_add(&obj->hard_links, &hard_list);
+					/* A delta can name a link that is
+					 * already fixed up */
+					list_move(&obj->hard_links,
+						  &hard_list);
 				}
 			} else {
 				ok = 0;
@@ -671,6 +707,550 @@ static int yaffs2_rd_checkpt_sum(struct yaffs_dev *dev)
 	return 1;
 }
 
+/*--------------------- Checkpoint deltas --------------------
+ *
+ * Rewriting the whole checkpoint on every save costs as much as the
+ * file system is big. Instead, once a full checkpoint is down, the first
+ * NAND change after a save appends an OPEN marker and the next save
+ * appends a DELTA holding just the blocks, objects and level 0 tnode
+ * groups that changed. Every so often the whole thing is rewritten.
+ *
+ * Blocks are found by comparing against a shadow copy of the block info
+ * as saved, objects by their checkpt_dirty flag and tnode groups (plus
+ * freed objects) through a log kept by yaffs2_checkpt_log_tnode() and
+ * yaffs2_checkpt_log_free().
+ */
+
+static void yaffs2_checkpt_free_shadow(struct yaffs_dev *dev)
+{
+	if (dev->checkpt_shadow_alt && dev->checkpt_shadow)
+		vfree(dev->checkpt_shadow);
+	else
+		kfree(dev->checkpt_shadow);
+	dev->checkpt_shadow = NULL;
+	dev->checkpt_shadow_alt = 0;
+}
+
+static int yaffs2_checkpt_sync_shadow(struct yaffs_dev *dev)
+{
+	u32 n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	u32 bi_bytes = n_blocks * sizeof(struct yaffs_block_info);
+	u32 n_bytes = bi_bytes + n_blocks * dev->chunk_bit_stride;
+
+	if (!dev->checkpt_shadow) {
+		dev->checkpt_shadow = kmalloc(n_bytes, GFP_NOFS);
+		if (!dev->checkpt_shadow) {
+			dev->checkpt_shadow = vmalloc(n_bytes);
+			dev->checkpt_shadow_alt = 1;
+		} else {
+			dev->checkpt_shadow_alt = 0;
+		}
+	}
+	if (!dev->checkpt_shadow)
+		return 0;
+
+	memcpy(dev->checkpt_shadow, dev->block_info, bi_bytes);
+	memcpy(dev->checkpt_shadow + bi_bytes, dev->chunk_bits,
+	       n_blocks * dev->chunk_bit_stride);
+	return 1;
+}
+
+/* The checkpoint on NAND now matches what is in RAM, with n_deltas
+ * deltas since the last full one. Get ready to append to it.
+ */
+static void yaffs2_checkpt_start_chain(struct yaffs_dev *dev, int n_deltas,
+				       int can_append)
+{
+	dev->checkpt_n_deltas = n_deltas;
+	dev->checkpt_chain_open = 0;
+	dev->checkpt_n_log = 0;
+	dev->checkpt_log_overflow = 0;
+	dev->checkpt_can_append = can_append &&
+	    dev->param.checkpt_max_deltas > 0 &&
+	    yaffs2_checkpt_sync_shadow(dev);
+}
+
+static void yaffs2_checkpt_clean_objs(struct yaffs_dev *dev)
+{
+	struct yaffs_obj *obj;
+	struct list_head *lh;
+	int i;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		list_for_each(lh, &dev->obj_bucket[i].list) {
+			obj = list_entry(lh, struct yaffs_obj, hash_link);
+			obj->checkpt_dirty = 0;
+			obj->checkpt_saved = obj->defered_free ? 0 : 1;
+		}
+	}
+}
+
+void yaffs2_checkpt_deinit(struct yaffs_dev *dev)
+{
+	yaffs2_checkpt_free_shadow(dev);
+	kfree(dev->checkpt_log);
+	dev->checkpt_log = NULL;
+	dev->checkpt_n_log = 0;
+	dev->checkpt_max_log = 0;
+	dev->checkpt_can_append = 0;
+	dev->checkpt_chain_open = 0;
+}
+
+static int yaffs2_checkpt_log_cmp(const void *a, const void *b)
+{
+	const struct yaffs_checkpt_log *la = a;
+	const struct yaffs_checkpt_log *lb = b;
+
+	if (la->obj_id != lb->obj_id)
+		return (la->obj_id < lb->obj_id) ? -1 : 1;
+	if (la->group != lb->group)
+		return (la->group < lb->group) ? -1 : 1;
+	return 0;
+}
+
+/* Sort the log by object and group and squeeze out repeats. */
+static int yaffs2_checkpt_log_sort(struct yaffs_dev *dev)
+{
+	struct yaffs_checkpt_log *log = dev->checkpt_log;
+	int i;
+	int n = 0;
+
+	if (dev->checkpt_n_log < 2)
+		return dev->checkpt_n_log;
+
+	sort(log, dev->checkpt_n_log, sizeof(struct yaffs_checkpt_log),
+	     yaffs2_checkpt_log_cmp, NULL);
+
+	for (i = 1; i < dev->checkpt_n_log; i++)
+		if (yaffs2_checkpt_log_cmp(&log[n], &log[i]))
+			log[++n] = log[i];
+
+	dev->checkpt_n_log = n + 1;
+	return dev->checkpt_n_log;
+}
+
+/* First entry for obj_id in the sorted log */
+static int yaffs2_checkpt_log_find(struct yaffs_dev *dev, u32 obj_id)
+{
+	int lo = 0;
+	int hi = dev->checkpt_n_log;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (dev->checkpt_log[mid].obj_id < obj_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int yaffs2_checkpt_log_grow(struct yaffs_dev *dev)
+{
+	struct yaffs_checkpt_log *new_log;
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int limit;
+	int new_max;
+
+	/* Past a quarter of the groups the device can hold, a full
+	 * checkpoint is about as cheap as a delta.
+	 */
+	limit = n_blocks * dev->param.chunks_per_block /
+	    (YAFFS_NTNODES_LEVEL0 * 4);
+	if (limit < YAFFS_CHECKPT_LOG_MIN)
+		limit = YAFFS_CHECKPT_LOG_MIN;
+	if (limit > YAFFS_CHECKPT_LOG_MAX)
+		limit = YAFFS_CHECKPT_LOG_MAX;
+
+	new_max = dev->checkpt_max_log ?
+	    dev->checkpt_max_log * 2 : YAFFS_CHECKPT_LOG_MIN;
+	if (new_max > limit)
+		new_max = limit;
+	if (new_max <= dev->checkpt_max_log)
+		return 0;
+
+	new_log = kmalloc(new_max * sizeof(struct yaffs_checkpt_log),
+			  GFP_NOFS);
+	if (!new_log)
+		return 0;
+
+	if (dev->checkpt_log)
+		memcpy(new_log, dev->checkpt_log,
+		       dev->checkpt_n_log * sizeof(struct yaffs_checkpt_log));
+	kfree(dev->checkpt_log);
+	dev->checkpt_log = new_log;
+	dev->checkpt_max_log = new_max;
+	return 1;
+}
+
+static void yaffs2_checkpt_log(struct yaffs_dev *dev, u32 obj_id, u32 group)
+{
+	struct yaffs_checkpt_log *log = dev->checkpt_log;
+	int n = dev->checkpt_n_log;
+
+	if (!dev->checkpt_can_append || dev->checkpt_log_overflow)
+		return;
+
+	/* Writes tend to hit the same group several times in a row */
+	if (n > 0 && log[n - 1].obj_id == obj_id && log[n - 1].group == group)
+		return;
+
+	if (n >= dev->checkpt_max_log) {
+		/* Squeeze out repeats before asking for more room */
+		n = yaffs2_checkpt_log_sort(dev);
+		if (n >= dev->checkpt_max_log - dev->checkpt_max_log / 4)
+			yaffs2_checkpt_log_grow(dev);
+		if (n >= dev->checkpt_max_log) {
+			yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+				"checkpoint log full, next save is a full one");
+			dev->checkpt_log_overflow = 1;
+			return;
+		}
+		log = dev->checkpt_log;
+	}
+
+	log[n].obj_id = obj_id;
+	log[n].group = group;
+	dev->checkpt_n_log = n + 1;
+}
+
+/* Called before a level 0 tnode entry of a file is changed. */
+void yaffs2_checkpt_log_tnode(struct yaffs_obj *obj, int inode_chunk)
+{
+	obj->checkpt_dirty = 1;
+
+	/* New files are saved whole, no need to log them */
+	if (obj->checkpt_saved)
+		yaffs2_checkpt_log(obj->my_dev, obj->obj_id,
+				   inode_chunk >> YAFFS_TNODES_LEVEL0_BITS);
+}
+
+/* Called when an object is freed. */
+void yaffs2_checkpt_log_free(struct yaffs_obj *obj)
+{
+	if (!obj->checkpt_saved)
+		return;
+
+	obj->checkpt_saved = 0;
+	yaffs2_checkpt_log(obj->my_dev, obj->obj_id, YAFFS_CHECKPT_LOG_FREED);
+}
+
+static int yaffs2_wr_checkpt_block_delta(struct yaffs_dev *dev)
+{
+	u32 n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	struct yaffs_block_info *shadow_bi =
+	    (struct yaffs_block_info *)dev->checkpt_shadow;
+	u8 *shadow_bits = dev->checkpt_shadow +
+	    n_blocks * sizeof(struct yaffs_block_info);
+	u32 stride = dev->chunk_bit_stride;
+	u32 end_marker = ~0;
+	u32 i;
+	int ok = 1;
+
+	for (i = 0; ok && i < n_blocks; i++) {
+		if (!memcmp(&dev->block_info[i], &shadow_bi[i],
+			    sizeof(struct yaffs_block_info)) &&
+		    !memcmp(dev->chunk_bits + i * stride,
+			    shadow_bits + i * stride, stride))
+			continue;
+
+		ok = (yaffs2_checkpt_wr(dev, &i, sizeof(i)) == sizeof(i)) &&
+		    (yaffs2_checkpt_wr(dev, &dev->block_info[i],
+				sizeof(struct yaffs_block_info)) ==
+				sizeof(struct yaffs_block_info)) &&
+		    (yaffs2_checkpt_wr(dev, dev->chunk_bits + i * stride,
+				stride) == stride);
+	}
+
+	if (ok)
+		ok = (yaffs2_checkpt_wr(dev, &end_marker, sizeof(end_marker)) ==
+			sizeof(end_marker));
+	return ok;
+}
+
+static int yaffs2_wr_checkpt_freed(struct yaffs_dev *dev)
+{
+	u32 end_marker = ~0;
+	int i;
+	int ok = 1;
+
+	for (i = 0; ok && i < dev->checkpt_n_log; i++)
+		if (dev->checkpt_log[i].group == YAFFS_CHECKPT_LOG_FREED)
+			ok = (yaffs2_checkpt_wr(dev,
+					&dev->checkpt_log[i].obj_id,
+					sizeof(u32)) == sizeof(u32));
+
+	if (ok)
+		ok = (yaffs2_checkpt_wr(dev, &end_marker, sizeof(end_marker)) ==
+			sizeof(end_marker));
+	return ok;
+}
+
+/* The logged groups of a checkpointed file, in the same form as
+ * yaffs2_wr_checkpt_tnodes() so that yaffs2_rd_checkpt_tnodes() can read
+ * them. Groups that have since been pruned are written as zeros.
+ */
+static int yaffs2_wr_checkpt_tnode_delta(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_checkpt_log *log = dev->checkpt_log;
+	struct yaffs_tnode *tn;
+	u32 end_marker = ~0;
+	u32 base_offset;
+	u8 zero = 0;
+	int i;
+	int j;
+	int ok = 1;
+
+	for (i = yaffs2_checkpt_log_find(dev, obj->obj_id);
+	     ok && i < dev->checkpt_n_log && log[i].obj_id == obj->obj_id;
+	     i++) {
+		if (log[i].group == YAFFS_CHECKPT_LOG_FREED)
+			continue;
+
+		base_offset = log[i].group << YAFFS_TNODES_LEVEL0_BITS;
+		ok = (yaffs2_checkpt_wr(dev, &base_offset,
+				sizeof(base_offset)) == sizeof(base_offset));
+
+		tn = yaffs_find_tnode_0(dev, &obj->variant.file_variant,
+					base_offset);
+		if (ok && tn)
+			ok = (yaffs2_checkpt_wr(dev, tn, dev->tnode_size) ==
+				dev->tnode_size);
+		for (j = 0; ok && !tn && j < dev->tnode_size; j++)
+			ok = (yaffs2_checkpt_wr(dev, &zero, 1) == 1);
+	}
+
+	if (ok)
+		ok = (yaffs2_checkpt_wr(dev, &end_marker, sizeof(end_marker)) ==
+			sizeof(end_marker));
+	return ok;
+}
+
+static int yaffs2_wr_checkpt_obj_delta(struct yaffs_dev *dev)
+{
+	struct yaffs_obj *obj;
+	struct yaffs_checkpt_obj cp;
+	struct list_head *lh;
+	int i;
+	int ok = 1;
+
+	for (i = 0; ok && i < YAFFS_NOBJECT_BUCKETS; i++) {
+		list_for_each(lh, &dev->obj_bucket[i].list) {
+			obj = list_entry(lh, struct yaffs_obj, hash_link);
+			if (!obj->checkpt_dirty || obj->defered_free)
+				continue;
+
+			yaffs2_obj_checkpt_obj(&cp, obj);
+			cp.struct_type = sizeof(cp);
+
+			ok = (yaffs2_checkpt_wr(dev, &cp, sizeof(cp)) ==
+				sizeof(cp));
+			if (ok && obj->variant_type == YAFFS_OBJECT_TYPE_FILE) {
+				if (obj->checkpt_saved)
+					ok = yaffs2_wr_checkpt_tnode_delta(obj);
+				else
+					ok = yaffs2_wr_checkpt_tnodes(obj);
+			}
+			if (!ok)
+				break;
+
+			obj->checkpt_dirty = 0;
+			obj->checkpt_saved = 1;
+		}
+	}
+
+	/* Dump end of list */
+	memset(&cp, 0xff, sizeof(struct yaffs_checkpt_obj));
+	cp.struct_type = sizeof(cp);
+
+	if (ok)
+		ok = (yaffs2_checkpt_wr(dev, &cp, sizeof(cp)) == sizeof(cp));
+
+	return ok ? 1 : 0;
+}
+
+/* Append a delta to an open checkpoint. Returns 0 if the checkpoint has to
+ * be rewritten in full instead.
+ */
+static int yaffs2_wr_checkpt_delta(struct yaffs_dev *dev)
+{
+	struct yaffs_checkpt_dev cp;
+	int ok;
+
+	if (!dev->checkpt_can_append || !dev->checkpt_chain_open ||
+	    dev->checkpt_log_overflow ||
+	    dev->checkpt_n_deltas >= dev->param.checkpt_max_deltas ||
+	    !yaffs2_checkpt_required(dev))
+		return 0;
+
+	yaffs2_checkpt_log_sort(dev);
+
+	/* Stay within the space set aside for a full checkpoint */
+	yaffs_calc_checkpt_blocks_required(dev);
+	ok = yaffs2_checkpt_open_append(dev, dev->checkpoint_blocks_required);
+
+	if (ok) {
+		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+			"write checkpoint delta %d, %d log entries",
+			dev->checkpt_n_deltas + 1, dev->checkpt_n_log);
+		ok = yaffs2_wr_checkpt_validity_marker(dev,
+					YAFFS_CHECKPT_MARK_DELTA);
+	}
+	if (ok) {
+		yaffs2_dev_to_checkpt_dev(&cp, dev);
+		cp.struct_type = sizeof(cp);
+		ok = (yaffs2_checkpt_wr(dev, &cp, sizeof(cp)) == sizeof(cp));
+	}
+	if (ok)
+		ok = yaffs2_wr_checkpt_block_delta(dev);
+	if (ok)
+		ok = yaffs2_wr_checkpt_freed(dev);
+	if (ok)
+		ok = yaffs2_wr_checkpt_obj_delta(dev);
+	if (ok)
+		ok = yaffs2_wr_checkpt_validity_marker(dev,
+					YAFFS_CHECKPT_MARK_TAIL);
+	if (ok)
+		ok = yaffs2_wr_checkpt_sum(dev);
+
+	if (!yaffs_checkpt_close(dev))
+		ok = 0;
+
+	dev->checkpt_last_bytes = dev->checkpt_byte_count;
+
+	if (!ok) {
+		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+			"checkpoint delta failed, rewriting");
+		dev->checkpt_can_append = 0;
+		dev->checkpt_chain_open = 0;
+		return 0;
+	}
+
+	yaffs2_checkpt_start_chain(dev, dev->checkpt_n_deltas + 1, 1);
+	dev->checkpt_delta_saves++;
+	dev->is_checkpointed = 1;
+	return 1;
+}
+
+/* Mark the checkpoint stale before the first change to NAND after a
+ * save, instead of erasing it.
+ */
+static int yaffs2_wr_checkpt_open_marker(struct yaffs_dev *dev)
+{
+	int ok;
+
+	yaffs_calc_checkpt_blocks_required(dev);
+	ok = yaffs2_checkpt_open_append(dev, dev->checkpoint_blocks_required);
+
+	if (ok)
+		ok = yaffs2_wr_checkpt_validity_marker(dev,
+					YAFFS_CHECKPT_MARK_OPEN);
+	if (ok)
+		ok = yaffs2_wr_checkpt_sum(dev);
+
+	if (!yaffs_checkpt_close(dev))
+		ok = 0;
+
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+		"write checkpoint open marker %d", ok);
+	return ok;
+}
+
+static int yaffs2_rd_checkpt_delta(struct yaffs_dev *dev)
+{
+	struct yaffs_checkpt_dev cp;
+	struct yaffs_obj *obj;
+	u32 n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	u32 stride = dev->chunk_bit_stride;
+	u32 val;
+	int ok;
+
+	ok = (yaffs2_checkpt_rd(dev, &cp, sizeof(cp)) == sizeof(cp));
+	if (!ok || cp.struct_type != sizeof(cp))
+		return 0;
+
+	/* Changed blocks */
+	while (ok) {
+		ok = (yaffs2_checkpt_rd(dev, &val, sizeof(val)) == sizeof(val));
+		if (!ok || val == ~0)
+			break;
+		ok = (val < n_blocks) &&
+		    (yaffs2_checkpt_rd(dev, &dev->block_info[val],
+				sizeof(struct yaffs_block_info)) ==
+				sizeof(struct yaffs_block_info)) &&
+		    (yaffs2_checkpt_rd(dev, dev->chunk_bits + val * stride,
+				stride) == stride);
+	}
+
+	/* Freed objects */
+	while (ok) {
+		ok = (yaffs2_checkpt_rd(dev, &val, sizeof(val)) == sizeof(val));
+		if (!ok || val == ~0)
+			break;
+		obj = yaffs_find_by_number(dev, val);
+		if (obj)
+			yaffs_forget_obj(obj);
+	}
+
+	/* Changed objects */
+	if (ok)
+		ok = yaffs2_rd_checkpt_objs(dev);
+
+	/* Set the counters last, moving objects around changes some */
+	if (ok)
+		yaffs_checkpt_dev_to_dev(dev, &cp);
+
+	return ok;
+}
+
+/* Read the segments that follow the full checkpoint. Sets *resume if more
+ * can be appended where they end.
+ */
+static int yaffs2_rd_checkpt_deltas(struct yaffs_dev *dev, int *resume)
+{
+	struct yaffs_checkpt_validity cp;
+	int stale = 0;
+	int n_deltas = 0;
+	int ok = 1;
+	int n;
+
+	while (ok) {
+		yaffs2_checkpt_rd_align(dev);
+		n = yaffs2_checkpt_rd(dev, &cp, sizeof(cp));
+		if (n == 0)
+			break;	/* That's all of it */
+
+		ok = (n == sizeof(cp)) && yaffs2_checkpt_validity_ok(&cp);
+		if (ok && cp.head == YAFFS_CHECKPT_MARK_OPEN) {
+			stale = 1;
+		} else if (ok && cp.head == YAFFS_CHECKPT_MARK_DELTA) {
+			ok = yaffs2_rd_checkpt_delta(dev) &&
+			    yaffs2_rd_checkpt_validity_marker(dev,
+					YAFFS_CHECKPT_MARK_TAIL);
+			stale = 0;
+			n_deltas++;
+		} else {
+			ok = 0;
+		}
+
+		if (ok)
+			ok = yaffs2_rd_checkpt_sum(dev);
+	}
+
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+		"read checkpoint deltas %d ok %d stale %d",
+		n_deltas, ok, stale);
+
+	if (!ok || stale)
+		return 0;
+
+	dev->checkpt_n_deltas = n_deltas;
+	*resume = yaffs2_checkpt_rd_end(dev);
+	return 1;
+}
+
 static int yaffs2_wr_checkpt_data(struct yaffs_dev *dev)
 {
 	int ok = 1;
@@ -681,13 +1261,18 @@ static int yaffs2_wr_checkpt_data(struct yaffs_dev *dev)
 		ok = 0;
 	}
 
+	/* Evicted trees are all rebuilt in one go rather than file by file */
+	if (ok)
+		ok = (yaffs_reload_tnodes(dev, NULL) == YAFFS_OK);
+
 	if (ok)
 		ok = yaffs2_checkpt_open(dev, 1);
 
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 			"write checkpoint validity");
-		ok = yaffs2_wr_checkpt_validity_marker(dev, 1);
+		ok = yaffs2_wr_checkpt_validity_marker(dev,
+					YAFFS_CHECKPT_MARK_HEAD);
 	}
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
@@ -702,7 +1287,8 @@ static int yaffs2_wr_checkpt_data(struct yaffs_dev *dev)
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 			"write checkpoint validity");
-		ok = yaffs2_wr_checkpt_validity_marker(dev, 0);
+		ok = yaffs2_wr_checkpt_validity_marker(dev,
+					YAFFS_CHECKPT_MARK_TAIL);
 	}
 
 	if (ok)
@@ -711,10 +1297,15 @@ static int yaffs2_wr_checkpt_data(struct yaffs_dev *dev)
 	if (!yaffs_checkpt_close(dev))
 		ok = 0;
 
-	if (ok)
+	dev->checkpt_last_bytes = dev->checkpt_byte_count;
+
+	if (ok) {
 		dev->is_checkpointed = 1;
-	else
+		dev->checkpt_full_saves++;
+		yaffs2_checkpt_start_chain(dev, 0, 1);
+	} else {
 		dev->is_checkpointed = 0;
+	}
 
 	return dev->is_checkpointed;
 }
@@ -722,6 +1313,7 @@ static int yaffs2_wr_checkpt_data(struct yaffs_dev *dev)
 static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 {
 	int ok = 1;
+	int resume = 0;
 
 	if (!dev->param.is_yaffs2)
 		ok = 0;
@@ -738,7 +1330,8 @@ static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 			"read checkpoint validity");
-		ok = yaffs2_rd_checkpt_validity_marker(dev, 1);
+		ok = yaffs2_rd_checkpt_validity_marker(dev,
+					YAFFS_CHECKPT_MARK_HEAD);
 	}
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
@@ -753,7 +1346,8 @@ static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 			"read checkpoint validity");
-		ok = yaffs2_rd_checkpt_validity_marker(dev, 0);
+		ok = yaffs2_rd_checkpt_validity_marker(dev,
+					YAFFS_CHECKPT_MARK_TAIL);
 	}
 
 	if (ok) {
@@ -761,24 +1355,44 @@ static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 			"read checkpoint checksum %d", ok);
 	}
+	if (ok)
+		ok = yaffs2_rd_checkpt_deltas(dev, &resume);
+
+	dev->checkpt_last_bytes = dev->checkpt_byte_count;
 
 	if (!yaffs_checkpt_close(dev))
 		ok = 0;
 
-	if (ok)
+	if (ok) {
 		dev->is_checkpointed = 1;
-	else
+		yaffs2_checkpt_clean_objs(dev);
+		yaffs2_checkpt_start_chain(dev, dev->checkpt_n_deltas, resume);
+	} else {
 		dev->is_checkpointed = 0;
+	}
 
 	return ok ? 1 : 0;
 }
 
 void yaffs2_checkpt_invalidate(struct yaffs_dev *dev)
 {
-	if (dev->is_checkpointed || dev->blocks_in_checkpt > 0) {
-		dev->is_checkpointed = 0;
+	/* Mark the checkpoint stale rather than erasing it if a delta can
+	 * be appended to it later.
+	 */
+	if (dev->is_checkpointed && dev->checkpt_can_append) {
+		if (yaffs2_wr_checkpt_open_marker(dev))
+			dev->checkpt_chain_open = 1;
+		else
+			dev->checkpt_can_append = 0;
+	}
+
+	if (!dev->checkpt_chain_open &&
+	    (dev->is_checkpointed || dev->blocks_in_checkpt > 0)) {
+		dev->checkpt_can_append = 0;
 		yaffs2_checkpt_invalidate_stream(dev);
 	}
+
+	dev->is_checkpointed = 0;
 	if (dev->param.sb_dirty_fn)
 		dev->param.sb_dirty_fn(dev);
 }
@@ -793,7 +1407,10 @@ int yaffs_checkpoint_save(struct yaffs_dev *dev)
 	yaffs_verify_blocks(dev);
 	yaffs_verify_free_chunks(dev);
 
-	if (!dev->is_checkpointed) {
+	if (!dev->is_checkpointed && !yaffs2_wr_checkpt_delta(dev)) {
+		/* Compact: throw the chain away and write it all out */
+		dev->checkpt_chain_open = 0;
+		dev->checkpt_can_append = 0;
 		yaffs2_checkpt_invalidate(dev);
 		yaffs2_wr_checkpt_data(dev);
 	}
@@ -930,13 +1547,163 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 	return aseq - bseq;
 }
 
+/*
+ * Mount scan read-ahead.
+ *
+ * yaffs2_scan_fill() does the flash reads for one item of a scan pass and
+ * nothing else, so the OS layer may run it on helper threads ahead of the
+ * scan (see struct yaffs_scan_ahead). Without helpers the scan calls it
+ * inline, one item at a time.
+ */
+#define YAFFS_SCAN_SLOTS_PER_THREAD 4
+
+void yaffs2_scan_fill(struct yaffs_scan_ahead *sa, int item,
+		      struct yaffs_scan_block *sb)
+{
+	struct yaffs_dev *dev = sa->dev;
+	struct yaffs_ext_tags *tags;
+	int n_chunks;
+	int c;
+
+	sb->item = item;
+
+	if (sa->pass == YAFFS_SCAN_PASS_STATE) {
+		sb->block = sa->first_block + item;
+		yaffs_query_init_block_state(dev, sb->block, &sb->state,
+					     &sb->seq_number);
+		return;
+	}
+
+	sb->block = sa->order[item];
+	sb->seq_number = yaffs_get_block_info(dev, sb->block)->seq_number;
+	sb->n_reads = 0;
+	sb->n_ecc_errors = 0;
+	sb->n_tags_read = 0;
+	sb->n_summary_used = 0;
+	sb->n_summary_chunks = 0;
+	sb->sum_bytes = 0;
+	sb->summary_available = dev->sum_tags &&
+				yaffs_summary_peek(dev, sb) == YAFFS_OK;
+
+	if (sb->summary_available)
+		n_chunks = dev->chunks_per_summary;
+	else
+		n_chunks = dev->param.chunks_per_block;
+
+	for (c = 0; c < n_chunks; c++) {
+		tags = &sb->tags[c];
+
+		if (sb->summary_available) {
+			yaffs_summary_unpack(dev, sb->sum_tags, tags, c);
+			tags->seq_number = sb->seq_number;
+			if (tags->obj_id != 0) {
+				sb->n_summary_used++;
+				continue;
+			}
+		}
+
+		yaffs_rd_chunk_tags_raw(dev,
+				sb->block * dev->param.chunks_per_block + c,
+				NULL, tags);
+		sb->n_reads++;
+		sb->n_tags_read++;
+		if (tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+			sb->n_ecc_errors++;
+	}
+}
+
+static void yaffs2_scan_ahead_free(struct yaffs_scan_ahead *sa)
+{
+	int i;
+
+	if (!sa->slots)
+		return;
+
+	for (i = 0; i < sa->window; i++) {
+		kfree(sa->slots[i].tags);
+		kfree(sa->slots[i].sum_tags);
+		kfree(sa->slots[i].buffer);
+	}
+	kfree(sa->slots);
+	sa->slots = NULL;
+}
+
+static int yaffs2_scan_ahead_start(struct yaffs_scan_ahead *sa)
+{
+	struct yaffs_dev *dev = sa->dev;
+	struct yaffs_scan_block *sb;
+	int n_threads = dev->param.n_scan_threads;
+	int i;
+
+	/* Inband tags are read through the shared temporary buffers */
+	if (!dev->param.scan_ahead_start_fn || dev->param.inband_tags ||
+	    n_threads < 0)
+		n_threads = 0;
+
+	sa->n_threads = 0;
+	sa->window = 1;
+	if (n_threads > 0)
+		sa->window = n_threads * YAFFS_SCAN_SLOTS_PER_THREAD;
+
+	sa->slots = kmalloc(sa->window * sizeof(struct yaffs_scan_block),
+			    GFP_NOFS);
+	if (!sa->slots)
+		return YAFFS_FAIL;
+	memset(sa->slots, 0, sa->window * sizeof(struct yaffs_scan_block));
+
+	for (i = 0; sa->pass == YAFFS_SCAN_PASS_TAGS && i < sa->window; i++) {
+		sb = &sa->slots[i];
+		sb->tags = kmalloc(dev->param.chunks_per_block *
+				   sizeof(struct yaffs_ext_tags), GFP_NOFS);
+		sb->sum_tags = kmalloc(yaffs_summary_tags_bytes(dev) + 1,
+				       GFP_NOFS);
+		sb->buffer = kmalloc(dev->param.total_bytes_per_chunk,
+				     GFP_NOFS);
+		if (!sb->tags || !sb->sum_tags || !sb->buffer) {
+			yaffs2_scan_ahead_free(sa);
+			return YAFFS_FAIL;
+		}
+	}
+
+	if (n_threads > 0 && sa->n_items > 1)
+		sa->n_threads = dev->param.scan_ahead_start_fn(sa);
+	if (sa->n_threads > dev->scan_threads)
+		dev->scan_threads = sa->n_threads;
+
+	return YAFFS_OK;
+}
+
+static struct yaffs_scan_block *yaffs2_scan_ahead_get(
+			struct yaffs_scan_ahead *sa, int item)
+{
+	if (sa->n_threads)
+		return sa->dev->param.scan_ahead_get_fn(sa, item);
+
+	yaffs2_scan_fill(sa, item, &sa->slots[0]);
+	return &sa->slots[0];
+}
+
+static void yaffs2_scan_ahead_put(struct yaffs_scan_ahead *sa, int item)
+{
+	if (sa->n_threads)
+		sa->dev->param.scan_ahead_put_fn(sa, item);
+}
+
+static void yaffs2_scan_ahead_end(struct yaffs_scan_ahead *sa)
+{
+	if (sa->n_threads)
+		sa->dev->param.scan_ahead_stop_fn(sa);
+	sa->n_threads = 0;
+	yaffs2_scan_ahead_free(sa);
+}
+
 static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 		struct yaffs_block_info *bi,
 		int blk, int chunk_in_block,
 		int *found_chunks,
 		u8 *chunk_data,
 		struct list_head *hard_list,
-		int summary_available)
+		const struct yaffs_ext_tags *scanned_tags)
 {
 	struct yaffs_obj_hdr *oh;
 	struct yaffs_obj *in;
@@ -953,17 +1720,8 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 	struct yaffs_hardlink_var *hl_var;
 	struct yaffs_symlink_var *sl_var;
 
-	if (summary_available) {
-		result = yaffs_summary_fetch(dev, &tags, chunk_in_block);
-		tags.seq_number = bi->seq_number;
-	}
-
-	if (!summary_available || tags.obj_id == 0) {
-		result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL, &tags);
-		dev->tags_used++;
-	} else {
-		dev->summary_used++;
-	}
+	/* The tags were read ahead by yaffs2_scan_fill() */
+	tags = *scanned_tags;
 
 	/* Let's have a good look at this chunk... */
 
@@ -1262,6 +2020,8 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 					YAFFS_OBJECT_TYPE_DIRECTORY;
 				INIT_LIST_HEAD(&parent->
 						variant.dir_variant.children);
+				parent->variant.dir_variant.n_children = 0;
+				parent->variant.dir_variant.index = NULL;
 			} else if (!parent ||
 				   parent->variant_type !=
 					YAFFS_OBJECT_TYPE_DIRECTORY) {
@@ -1344,10 +2104,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	int blk;
 	int block_iter;
-	int start_iter;
-	int end_iter;
 	int n_to_scan = 0;
-	enum yaffs_block_state state;
 	int c;
 	int deleted;
 	LIST_HEAD(hard_list);
@@ -1358,21 +2115,31 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	int found_chunks;
 	int alloc_failed = 0;
 	struct yaffs_block_index *block_index = NULL;
+	int *scan_order;
 	int alt_block_index = 0;
-	int summary_available;
+	struct yaffs_scan_ahead sa;
+	struct yaffs_scan_block *sb;
+	u32 t0;
+	u32 t1;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
 		dev->internal_start_block, dev->internal_end_block);
 
 	dev->seq_number = YAFFS_LOWEST_SEQUENCE_NUMBER;
+	dev->scan_blocks = 0;
+	dev->scan_summaries = 0;
+	dev->scan_threads = 0;
 
+	/* The sort index, then the blocks in the order they get scanned */
 	block_index =
-		kmalloc(n_blocks * sizeof(struct yaffs_block_index), GFP_NOFS);
+		kmalloc(n_blocks * (sizeof(struct yaffs_block_index) +
+				    sizeof(int)), GFP_NOFS);
 
 	if (!block_index) {
 		block_index =
-		    vmalloc(n_blocks * sizeof(struct yaffs_block_index));
+		    vmalloc(n_blocks * (sizeof(struct yaffs_block_index) +
+					sizeof(int)));
 		alt_block_index = 1;
 	}
 
@@ -1382,23 +2149,38 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			);
 		return YAFFS_FAIL;
 	}
+	scan_order = (int *)(block_index + n_blocks);
 
 	dev->blocks_in_checkpt = 0;
 
 	chunk_data = yaffs_get_temp_buffer(dev);
 
+	t0 = Y_CLOCK_MS();
+
 	/* Scan all the blocks to determine their state */
-	bi = dev->block_info;
-	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
-	     blk++) {
+	memset(&sa, 0, sizeof(sa));
+	sa.dev = dev;
+	sa.pass = YAFFS_SCAN_PASS_STATE;
+	sa.n_items = n_blocks;
+	sa.first_block = dev->internal_start_block;
+	if (yaffs2_scan_ahead_start(&sa) != YAFFS_OK)
+		alloc_failed = 1;
+
+	for (block_iter = 0; !alloc_failed && block_iter < n_blocks;
+	     block_iter++) {
+		sb = yaffs2_scan_ahead_get(&sa, block_iter);
+		blk = sb->block;
+		bi = yaffs_get_block_info(dev, blk);
+
 		yaffs_clear_chunk_bits(dev, blk);
 		bi->pages_in_use = 0;
 		bi->soft_del_pages = 0;
 
-		yaffs_query_init_block_state(dev, blk, &state, &seq_number);
+		bi->block_state = sb->state;
+		bi->seq_number = sb->seq_number;
+		seq_number = sb->seq_number;
 
-		bi->block_state = state;
-		bi->seq_number = seq_number;
+		yaffs2_scan_ahead_put(&sa, block_iter);
 
 		if (bi->seq_number == YAFFS_SEQUENCE_CHECKPOINT_DATA)
 			bi->block_state = YAFFS_BLOCK_STATE_CHECKPOINT;
@@ -1436,8 +2218,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 					blk, seq_number);
 			}
 		}
-		bi++;
 	}
+	yaffs2_scan_ahead_end(&sa);
+
+	t1 = Y_CLOCK_MS();
+	dev->scan_state_ms = t1 - t0;
+	t0 = t1;
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "%d blocks to be sorted...", n_to_scan);
 
@@ -1451,29 +2237,63 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
 
-	/* Now scan the blocks looking at the data. */
-	start_iter = 0;
-	end_iter = n_to_scan - 1;
+	t1 = Y_CLOCK_MS();
+	dev->scan_sort_ms = t1 - t0;
+	t0 = t1;
+
+	/* Now scan the blocks looking at the data, newest first. */
+	for (block_iter = 0; block_iter < n_to_scan; block_iter++)
+		scan_order[block_iter] =
+			block_index[n_to_scan - 1 - block_iter].block;
+
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	memset(&sa, 0, sizeof(sa));
+	sa.dev = dev;
+	sa.pass = YAFFS_SCAN_PASS_TAGS;
+	sa.n_items = n_to_scan;
+	sa.order = scan_order;
+	if (!alloc_failed && yaffs2_scan_ahead_start(&sa) != YAFFS_OK)
+		alloc_failed = 1;
+
 	/* For each block.... backwards */
-	for (block_iter = end_iter;
-	     !alloc_failed && block_iter >= start_iter;
-	     block_iter--) {
+	for (block_iter = 0;
+	     !alloc_failed && block_iter < n_to_scan;
+	     block_iter++) {
 		/* Cooperative multitasking! This loop can run for so
 		   long that watchdog timers expire. */
 		cond_resched();
 
 		/* get the block to scan in the correct order */
-		blk = block_index[block_iter].block;
+		sb = yaffs2_scan_ahead_get(&sa, block_iter);
+		blk = sb->block;
 		bi = yaffs_get_block_info(dev, blk);
 		deleted = 0;
 
-		summary_available = yaffs_summary_read(dev, dev->sum_tags, blk);
+		/* Account for the reads and apply what the summary read
+		 * would have done to the block. */
+		dev->n_page_reads += sb->n_reads;
+		dev->tags_used += sb->n_tags_read;
+		dev->summary_used += sb->n_summary_used;
+		if (sb->n_ecc_errors)
+			yaffs_handle_chunk_error(dev, bi);
+
+		for (c = 0; c < sb->n_summary_chunks; c++) {
+			yaffs_set_chunk_bit(dev, blk,
+					    dev->chunks_per_summary + c);
+			bi->pages_in_use++;
+		}
+		yaffs_summary_load(dev, sb);
+
+		dev->scan_blocks++;
+		if (sb->summary_available) {
+			bi->has_summary = 1;
+			dev->scan_summaries++;
+		}
 
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
-		if (summary_available)
+		if (sb->summary_available)
 			c = dev->chunks_per_summary - 1;
 		else
 			c = dev->param.chunks_per_block - 1;
@@ -1488,11 +2308,13 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			 */
 			if (yaffs2_scan_chunk(dev, bi, blk, c,
 					&found_chunks, chunk_data,
-					&hard_list, summary_available) ==
+					&hard_list, &sb->tags[c]) ==
 					YAFFS_FAIL)
 				alloc_failed = 1;
 		}
 
+		yaffs2_scan_ahead_put(&sa, block_iter);
+
 		if (bi->block_state == YAFFS_BLOCK_STATE_NEEDS_SCAN) {
 			/* If we got this far while scanning, then the block
 			 * is fully allocated. */
@@ -1506,6 +2328,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			yaffs_block_became_dirty(dev, blk);
 		}
 	}
+	yaffs2_scan_ahead_end(&sa);
+
+	t1 = Y_CLOCK_MS();
+	dev->scan_tags_ms = t1 - t0;
+	t0 = t1;
 
 	yaffs_skip_rest_of_block(dev);
 
@@ -1523,6 +2350,14 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_release_temp_buffer(dev, chunk_data);
 
+	dev->scan_fixup_ms = Y_CLOCK_MS() - t0;
+
+	yaffs_trace(YAFFS_TRACE_MOUNT,
+		"yaffs2_scan_backwards: %u blocks, %u summaries, %u helpers, ms: state %u sort %u tags %u fixup %u",
+		dev->scan_blocks, dev->scan_summaries, dev->scan_threads,
+		dev->scan_state_ms, dev->scan_sort_ms, dev->scan_tags_ms,
+		dev->scan_fixup_ms);
+
 	if (alloc_failed)
 		return YAFFS_FAIL;
 
@@ -32,8 +32,13 @@ int yaffs_calc_checkpt_blocks_required(struct yaffs_dev *dev);
 void yaffs2_checkpt_invalidate(struct yaffs_dev *dev);
 int yaffs2_checkpt_save(struct yaffs_dev *dev);
 int yaffs2_checkpt_restore(struct yaffs_dev *dev);
+void yaffs2_checkpt_deinit(struct yaffs_dev *dev);
+void yaffs2_checkpt_log_tnode(struct yaffs_obj *obj, int inode_chunk);
+void yaffs2_checkpt_log_free(struct yaffs_obj *obj);
 
 int yaffs2_handle_hole(struct yaffs_obj *obj, loff_t new_size);
 int yaffs2_scan_backwards(struct yaffs_dev *dev);
+void yaffs2_scan_fill(struct yaffs_scan_ahead *sa, int item,
+		      struct yaffs_scan_block *sb);
 
 #endif
@@ -69,6 +69,9 @@
 #define Y_TIME_CONVERT(x) (x)
 #endif
 
+/* Coarse monotonic milliseconds, for timing long operations like scans */
+#define Y_CLOCK_MS() jiffies_to_msecs(jiffies)
+
 #define compile_time_assertion(assertion) \
 	({ int x = __builtin_choose_expr(assertion, 0, (void)0); (void) x; })
 
@@ -0,0 +1 @@
+#include "../kernel-shim.h"
@@ -0,0 +1,345 @@
+/*
+ * NAND flash simulator for running yaffs2 in userspace.
+ *
+ * The flash is an array of pages, each followed by its spare area, then
+ * one bad block byte per block. It lives in memory or in a file mapped
+ * shared, so an image survives the process and can be mounted again.
+ * Programming only clears bits, as on real NAND.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include "yportenv.h"
+#include "yaffs_guts.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nandsim.h"
+
+static unsigned nandsim_rand(struct nandsim *ns)
+{
+	/* xorshift32, so runs are repeatable for a seed */
+	unsigned x = ns->seed ? ns->seed : 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	ns->seed = x;
+	return x;
+}
+
+static int nandsim_chance(struct nandsim *ns, unsigned ppm)
+{
+	return ppm && (nandsim_rand(ns) % 1000000) < ppm;
+}
+
+static size_t nandsim_page_bytes(struct nandsim *ns)
+{
+	return ns->page_size + ns->spare_size;
+}
+
+static unsigned char *nandsim_page(struct nandsim *ns, int page)
+{
+	return ns->mem + (size_t)page * nandsim_page_bytes(ns);
+}
+
+static unsigned char *nandsim_bad(struct nandsim *ns, int block)
+{
+	return ns->mem + (size_t)ns->n_blocks * ns->pages_per_block *
+	    nandsim_page_bytes(ns) + block;
+}
+
+void nandsim_defaults(struct nandsim *ns, int page_size, int spare_size,
+		      int pages_per_block, int n_blocks)
+{
+	memset(ns, 0, sizeof(*ns));
+	ns->page_size = page_size;
+	ns->spare_size = spare_size;
+	ns->pages_per_block = pages_per_block;
+	ns->n_blocks = n_blocks;
+	ns->flip_bits = 1;
+	ns->ecc_bits = 1;
+	ns->seed = 1;
+	ns->fd = -1;
+
+	/* Typical SLC large page part */
+	ns->t_read = 25000;
+	ns->t_prog = 250000;
+	ns->t_erase = 2000000;
+	ns->t_byte = 25;
+}
+
+void nandsim_reset_counters(struct nandsim *ns)
+{
+	ns->n_reads = 0;
+	ns->n_writes = 0;
+	ns->n_erases = 0;
+	ns->n_flips = 0;
+	ns->n_ecc_fixed = 0;
+	ns->n_ecc_unfixed = 0;
+	ns->n_write_fails = 0;
+	ns->n_erase_fails = 0;
+	ns->busy_ns = 0;
+}
+
+void nandsim_format(struct nandsim *ns)
+{
+	int n_bad = 0;
+	int i;
+
+	memset(ns->mem, 0xff, ns->size);
+	for (i = 0; i < ns->n_blocks; i++) {
+		*nandsim_bad(ns, i) = 0;
+		/* Keep block 0 good, bootloaders count on it */
+		if (i && nandsim_chance(ns, ns->bad_permille * 1000)) {
+			*nandsim_bad(ns, i) = 1;
+			n_bad++;
+		}
+	}
+	if (n_bad)
+		fprintf(stderr, "nandsim: %d factory bad blocks\n", n_bad);
+}
+
+int nandsim_open(struct nandsim *ns, const char *file)
+{
+	struct stat st;
+	int fresh = 1;
+
+	ns->size = (size_t)ns->n_blocks * ns->pages_per_block *
+	    nandsim_page_bytes(ns) + ns->n_blocks;
+
+	if (!file) {
+		ns->mem = malloc(ns->size);
+		if (!ns->mem)
+			return -1;
+		nandsim_format(ns);
+		return 0;
+	}
+
+	ns->fd = open(file, O_RDWR | O_CREAT, 0644);
+	if (ns->fd < 0)
+		return -1;
+
+	if (fstat(ns->fd, &st) < 0)
+		goto fail;
+	if ((size_t)st.st_size == ns->size)
+		fresh = 0;
+	else if (ftruncate(ns->fd, ns->size) < 0)
+		goto fail;
+
+	ns->mem = mmap(NULL, ns->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       ns->fd, 0);
+	if (ns->mem == MAP_FAILED) {
+		ns->mem = NULL;
+		goto fail;
+	}
+
+	if (fresh)
+		nandsim_format(ns);
+	return 0;
+
+fail:
+	close(ns->fd);
+	ns->fd = -1;
+	return -1;
+}
+
+void nandsim_close(struct nandsim *ns)
+{
+	if (!ns->mem)
+		return;
+
+	if (ns->fd >= 0) {
+		munmap(ns->mem, ns->size);
+		close(ns->fd);
+		ns->fd = -1;
+	} else {
+		free(ns->mem);
+	}
+	ns->mem = NULL;
+}
+
+static struct nandsim *dev_to_ns(struct yaffs_dev *dev)
+{
+	return dev->driver_context;
+}
+
+/*
+ * A read disturb: flip_bits bits of the page as read come back wrong.
+ * If the ecc can cope the caller gets good data and is told it was fixed,
+ * otherwise it gets the flipped data.
+ */
+static enum yaffs_ecc_result nandsim_disturb(struct nandsim *ns,
+					      unsigned char *data, int len)
+{
+	int i;
+
+	if (!nandsim_chance(ns, ns->flip_ppm))
+		return YAFFS_ECC_RESULT_NO_ERROR;
+
+	ns->n_flips++;
+	if (ns->ecc_bits && ns->flip_bits <= ns->ecc_bits) {
+		ns->n_ecc_fixed++;
+		return YAFFS_ECC_RESULT_FIXED;
+	}
+
+	for (i = 0; data && len && i < ns->flip_bits; i++) {
+		unsigned bit = nandsim_rand(ns) % (len * 8);
+
+		data[bit / 8] ^= 1 << (bit % 8);
+	}
+
+	if (!ns->ecc_bits)
+		return YAFFS_ECC_RESULT_NO_ERROR;
+
+	ns->n_ecc_unfixed++;
+	return YAFFS_ECC_RESULT_UNFIXED;
+}
+
+static int nandsim_read(struct yaffs_dev *dev, int nand_chunk,
+			u8 *data, int data_len, u8 *oob, int oob_len,
+			enum yaffs_ecc_result *ecc_result)
+{
+	struct nandsim *ns = dev_to_ns(dev);
+	unsigned char *page = nandsim_page(ns, nand_chunk);
+	enum yaffs_ecc_result result;
+
+	ns->n_reads++;
+	ns->busy_ns += ns->t_read +
+	    (unsigned long long)ns->t_byte * ((data ? data_len : 0) + oob_len);
+
+	if (data)
+		memcpy(data, page, data_len);
+	if (oob)
+		memcpy(oob, page + ns->page_size, oob_len);
+
+	result = nandsim_disturb(ns, data, data ? data_len : 0);
+	if (ecc_result)
+		*ecc_result = result;
+
+	if (result == YAFFS_ECC_RESULT_FIXED)
+		dev->n_ecc_fixed++;
+	if (result == YAFFS_ECC_RESULT_UNFIXED) {
+		dev->n_ecc_unfixed++;
+		return YAFFS_FAIL;
+	}
+	return YAFFS_OK;
+}
+
+static int nandsim_read_chunks(struct yaffs_dev *dev, int nand_chunk,
+			       int n_chunks, u8 *data,
+			       enum yaffs_ecc_result *ecc_result)
+{
+	struct nandsim *ns = dev_to_ns(dev);
+	int len = dev->param.total_bytes_per_chunk;
+	enum yaffs_ecc_result result;
+	int i;
+
+	*ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
+	for (i = 0; i < n_chunks; i++) {
+		ns->n_reads++;
+		ns->busy_ns += ns->t_read +
+		    (unsigned long long)ns->t_byte * len;
+		memcpy(data + i * len, nandsim_page(ns, nand_chunk + i), len);
+
+		result = nandsim_disturb(ns, data + i * len, len);
+		if (result > *ecc_result)
+			*ecc_result = result;
+	}
+
+	return (*ecc_result == YAFFS_ECC_RESULT_UNFIXED) ?
+	    YAFFS_FAIL : YAFFS_OK;
+}
+
+static int nandsim_write(struct yaffs_dev *dev, int nand_chunk,
+			 const u8 *data, int data_len,
+			 const u8 *oob, int oob_len)
+{
+	struct nandsim *ns = dev_to_ns(dev);
+	unsigned char *page = nandsim_page(ns, nand_chunk);
+	int i;
+
+	if (ns->crash_after && ns->n_writes + 1 >= ns->crash_after) {
+		/* Power goes half way through the program */
+		for (i = 0; data && i < data_len / 2; i++)
+			page[i] &= data[i];
+		fprintf(stderr, "nandsim: power cut programming page %d\n",
+			nand_chunk);
+		if (ns->fd >= 0)
+			msync(ns->mem, ns->size, MS_SYNC);
+		_exit(3);
+	}
+
+	ns->n_writes++;
+	ns->busy_ns += ns->t_prog +
+	    (unsigned long long)ns->t_byte * ((data ? data_len : 0) + oob_len);
+
+	if (nandsim_chance(ns, ns->write_fail_ppm)) {
+		ns->n_write_fails++;
+		/* Leave some garbage behind */
+		page[nandsim_rand(ns) % ns->page_size] &= 0x5a;
+		return YAFFS_FAIL;
+	}
+
+	for (i = 0; data && i < data_len; i++)
+		page[i] &= data[i];
+	for (i = 0; oob && i < oob_len; i++)
+		page[ns->page_size + i] &= oob[i];
+
+	return YAFFS_OK;
+}
+
+static int nandsim_erase(struct yaffs_dev *dev, int block_no)
+{
+	struct nandsim *ns = dev_to_ns(dev);
+
+	ns->n_erases++;
+	ns->busy_ns += ns->t_erase;
+
+	if (*nandsim_bad(ns, block_no) ||
+	    nandsim_chance(ns, ns->erase_fail_ppm)) {
+		ns->n_erase_fails++;
+		return YAFFS_FAIL;
+	}
+
+	memset(nandsim_page(ns, block_no * ns->pages_per_block), 0xff,
+	       (size_t)ns->pages_per_block * nandsim_page_bytes(ns));
+	return YAFFS_OK;
+}
+
+static int nandsim_mark_bad(struct yaffs_dev *dev, int block_no)
+{
+	*nandsim_bad(dev_to_ns(dev), block_no) = 1;
+	return YAFFS_OK;
+}
+
+static int nandsim_check_bad(struct yaffs_dev *dev, int block_no)
+{
+	return *nandsim_bad(dev_to_ns(dev), block_no) ? YAFFS_FAIL : YAFFS_OK;
+}
+
+void nandsim_attach(struct nandsim *ns, struct yaffs_dev *dev)
+{
+	struct yaffs_param *param = &dev->param;
+
+	param->total_bytes_per_chunk = ns->page_size;
+	param->spare_bytes_per_chunk = ns->spare_size;
+	param->chunks_per_block = ns->pages_per_block;
+	param->start_block = 0;
+	param->end_block = ns->n_blocks - 1;
+	param->use_nand_ecc = ns->ecc_bits > 0;
+
+	dev->driver_context = ns;
+	dev->drv.drv_write_chunk_fn = nandsim_write;
+	dev->drv.drv_read_chunk_fn = nandsim_read;
+	/* yaffs checks its own ecc page by page */
+	if (ns->ecc_bits)
+		dev->drv.drv_read_chunks_fn = nandsim_read_chunks;
+	dev->drv.drv_erase_fn = nandsim_erase;
+	dev->drv.drv_mark_bad_fn = nandsim_mark_bad;
+	dev->drv.drv_check_bad_fn = nandsim_check_bad;
+}
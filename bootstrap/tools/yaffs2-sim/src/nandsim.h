@@ -0,0 +1,76 @@
+/*
+ * NAND flash simulator for running yaffs2 in userspace.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef __NANDSIM_H__
+#define __NANDSIM_H__
+
+struct yaffs_dev;
+
+struct nandsim {
+	/* Geometry */
+	int page_size;		/* data bytes per page */
+	int spare_size;		/* spare bytes per page */
+	int pages_per_block;
+	int n_blocks;
+
+	/* Faults, chances are in parts per million */
+	unsigned flip_ppm;	/* a page read has a bit flip */
+	int flip_bits;		/* bits flipped each time */
+	int ecc_bits;		/* bits per page the ecc corrects, 0 for none */
+	unsigned bad_permille;	/* factory bad blocks */
+	unsigned write_fail_ppm;	/* a page program fails */
+	unsigned erase_fail_ppm;	/* a block erase fails */
+	unsigned long crash_after;	/* cut the power after this many
+					 * programs, 0 for never */
+
+	/* Timing model, in nanoseconds */
+	unsigned t_read;	/* page to cache */
+	unsigned t_prog;	/* cache to page */
+	unsigned t_erase;
+	unsigned t_byte;	/* bus transfer per byte */
+
+	unsigned seed;
+
+	/* Counters */
+	unsigned long n_reads;
+	unsigned long n_writes;
+	unsigned long n_erases;
+	unsigned long n_flips;
+	unsigned long n_ecc_fixed;
+	unsigned long n_ecc_unfixed;
+	unsigned long n_write_fails;
+	unsigned long n_erase_fails;
+	unsigned long long busy_ns;	/* simulated time the chip was busy */
+
+	/* Private */
+	unsigned char *mem;	/* pages then one bad block byte per block */
+	size_t size;
+	int fd;
+};
+
+/* Fills in the timing and fault defaults for a geometry */
+void nandsim_defaults(struct nandsim *ns, int page_size, int spare_size,
+		      int pages_per_block, int n_blocks);
+
+/*
+ * Sets up the flash in memory, or in file if it is not NULL. A new or
+ * wrongly sized file is erased, otherwise what it holds is kept.
+ * Returns 0 or -1 with errno set.
+ */
+int nandsim_open(struct nandsim *ns, const char *file);
+void nandsim_close(struct nandsim *ns);
+
+/* Erases every block and lays down a new set of factory bad blocks */
+void nandsim_format(struct nandsim *ns);
+
+void nandsim_reset_counters(struct nandsim *ns);
+
+/* Fills in dev's geometry and driver functions */
+void nandsim_attach(struct nandsim *ns, struct yaffs_dev *dev);
+
+#endif
@@ -0,0 +1,1084 @@
+/*
+ * Runs the yaffs2 core in userspace on a simulated NAND and benchmarks
+ * it, so it can be profiled with perf or valgrind and exercised without
+ * a kernel.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include "yportenv.h"
+#include "yaffs_guts.h"
+#include "yaffs_trace.h"
+#include "yaffs_ecc.h"
+#include "yaffs_allocator.h"
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "nandsim.h"
+
+unsigned int yaffs_trace_mask = YAFFS_TRACE_BAD_BLOCKS | YAFFS_TRACE_ALWAYS;
+unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
+
+static char *progname;
+
+#define ERR(fmt, ...) do { \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__ ); \
+} while (0)
+
+/* Mount options, as for the kernel where there is an equivalent */
+struct sim_options {
+	int yaffs1;
+	int inband_tags;
+	int no_tags_ecc;
+	int n_caches;
+	int disable_summary;
+	int gc_cost_benefit;
+	int checkpt_max_deltas;
+};
+
+static struct sim_options options = {
+	.n_caches = 10,
+	.checkpt_max_deltas = 16,
+};
+
+static struct nandsim ns;
+static struct yaffs_dev dev;
+static int scale = 100;		/* percent */
+static int verify_errors;
+
+static int scaled(int n)
+{
+	n = (long long)n * scale / 100;
+	return n > 0 ? n : 1;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int sim_mount(int skip_checkpt_rd)
+{
+	struct yaffs_param *param = &dev.param;
+
+	memset(&dev, 0, sizeof(dev));
+	param->name = "nandsim";
+	nandsim_attach(&ns, &dev);
+
+	param->is_yaffs2 = !options.yaffs1;
+	param->inband_tags = options.inband_tags;
+	param->no_tags_ecc = options.no_tags_ecc;
+	param->n_reserved_blocks = 5;
+	param->n_caches = options.n_caches;
+	param->enable_xattr = 1;
+	param->defered_dir_update = 1;
+	param->empty_lost_n_found = 1;
+	param->refresh_period = 500;
+	param->disable_summary = options.disable_summary;
+	param->gc_cost_benefit = options.gc_cost_benefit;
+	param->checkpt_max_deltas = options.checkpt_max_deltas;
+	param->skip_checkpt_rd = skip_checkpt_rd;
+
+	if (yaffs_guts_initialise(&dev) != YAFFS_OK) {
+		ERR("mount failed");
+		return -1;
+	}
+	return 0;
+}
+
+static void sim_unmount(int checkpoint)
+{
+	yaffs_flush_whole_cache(&dev);
+	if (checkpoint && dev.param.is_yaffs2)
+		yaffs_checkpoint_save(&dev);
+	yaffs_deinitialise(&dev);
+}
+
+/* File contents are a function of the file, the offset and a generation */
+static void pattern(u8 *buf, unsigned id, unsigned gen, loff_t offset,
+		    int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		u32 x = (u32)(offset + i) * 2654435761u ^ id * 40503u ^ gen;
+
+		buf[i] = x >> 24;
+	}
+}
+
+static int check(struct yaffs_obj *obj, unsigned id, unsigned gen,
+		 loff_t offset, int len)
+{
+	static u8 want[65536];
+	static u8 got[65536];
+
+	pattern(want, id, gen, offset, len);
+	if (yaffs_file_rd(obj, got, offset, len) != len ||
+	    memcmp(want, got, len)) {
+		if (verify_errors++ < 10)
+			ERR("file %u bad at %lld", id, (long long)offset);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_pattern(struct yaffs_obj *obj, unsigned id, unsigned gen,
+			 loff_t offset, int len)
+{
+	static u8 buf[65536];
+
+	pattern(buf, id, gen, offset, len);
+	return yaffs_wr_file(obj, buf, offset, len, 0) == len ? 0 : -1;
+}
+
+static struct yaffs_obj *create(struct yaffs_obj *dir, const char *fmt,
+				unsigned id)
+{
+	char name[32];
+	struct yaffs_obj *obj;
+
+	snprintf(name, sizeof(name), fmt, id);
+	obj = yaffs_create_file(dir, name, S_IFREG | 0644, 0, 0);
+	if (!obj)
+		ERR("cannot create %s", name);
+	return obj;
+}
+
+/* Header read-ahead as yaffs_vfs.c does it for lookup and readdir, less
+ * the locking */
+static struct yaffs_hdr_prefetch prefetch;
+
+static void hdr_prefetch(const int *chunks, int n)
+{
+	int bytes = dev.data_bytes_per_chunk;
+	int i;
+
+	if (!prefetch.buffer)
+		prefetch.buffer = malloc(YAFFS_HDR_PREFETCH_MAX * ns.page_size);
+	memcpy(prefetch.chunk, chunks, n * sizeof(int));
+	prefetch.n_erasures = dev.n_erasures;
+	for (i = 0; i < n; i++) {
+		if (yaffs_rd_mapped_chunks(&dev, &prefetch.chunk[i], 1,
+					   prefetch.buffer + i * bytes) != YAFFS_OK)
+			prefetch.chunk[i] = -1;
+	}
+	prefetch.n = n;
+	dev.hdr_prefetch = &prefetch;
+}
+
+static struct yaffs_obj *find(struct yaffs_obj *dir, const char *name)
+{
+	int chunks[YAFFS_HDR_PREFETCH_MAX];
+	struct yaffs_obj *obj;
+	int n;
+
+	while ((n = yaffs_dir_lazy_hdrs(dir, chunks,
+					YAFFS_HDR_PREFETCH_MAX)) > 0)
+		hdr_prefetch(chunks, n);
+	n = yaffs_find_by_name_hdrs(dir, name, chunks, YAFFS_HDR_PREFETCH_MAX);
+	if (n > 0)
+		hdr_prefetch(chunks, n);
+	obj = yaffs_find_by_name(dir, name);
+	dev.hdr_prefetch = NULL;
+	return obj;
+}
+
+static struct yaffs_obj *lookup(struct yaffs_obj *dir, const char *fmt,
+				unsigned id)
+{
+	char name[32];
+	struct yaffs_obj *obj;
+
+	snprintf(name, sizeof(name), fmt, id);
+	obj = find(dir, name);
+	if (!obj && verify_errors++ < 10)
+		ERR("%s is missing", name);
+	return obj;
+}
+
+/*
+ * Results. Counters come from the simulator so that they carry across
+ * mounts, gc copies from yaffs.
+ */
+struct sample {
+	double wall;
+	unsigned long long busy_ns;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long erases;
+	unsigned gc_copies;
+};
+
+static void sample(struct sample *s)
+{
+	s->wall = now_ms();
+	s->busy_ns = ns.busy_ns;
+	s->reads = ns.n_reads;
+	s->writes = ns.n_writes;
+	s->erases = ns.n_erases;
+	s->gc_copies = dev.n_gc_copies;
+}
+
+static void report(const char *name, unsigned long ops, double mb,
+		   struct sample *s0)
+{
+	struct sample s1;
+	unsigned long writes;
+	unsigned copies;
+	double nand_ms;
+
+	sample(&s1);
+	writes = s1.writes - s0->writes;
+	copies = s1.gc_copies - s0->gc_copies;
+	nand_ms = (s1.busy_ns - s0->busy_ns) / 1e6;
+
+	printf("%-12s %8lu %9.1f %9.1f %8.2f %8lu %8lu %6lu %8u %6.2f\n",
+	       name, ops, s1.wall - s0->wall, nand_ms,
+	       (mb && nand_ms) ? mb * 1000 / nand_ms : 0.0,
+	       s1.reads - s0->reads, writes, s1.erases - s0->erases, copies,
+	       (writes > copies) ? (double)writes / (writes - copies) : 1.0);
+}
+
+static void header(void)
+{
+	printf("%-12s %8s %9s %9s %8s %8s %8s %6s %8s %6s\n",
+	       "bench", "ops", "wall_ms", "nand_ms", "nand_MB/s",
+	       "reads", "writes", "erases", "gc_copy", "wa");
+}
+
+/* A tree of small files plus a few big ones, as in a root filesystem */
+#define TREE_DIRS 10
+#define TREE_FILES 50
+#define TREE_BIG 4
+#define BIG_SIZE (1024 * 1024)
+
+static int tree_size(unsigned id)
+{
+	return 512 * (id % 16 + 1);
+}
+
+static int tree_build(int dirs)
+{
+	struct yaffs_obj *dir;
+	struct yaffs_obj *obj;
+	char name[32];
+	int d, f;
+	loff_t off;
+
+	for (d = 0; d < dirs; d++) {
+		snprintf(name, sizeof(name), "d%d", d);
+		dir = yaffs_create_dir(yaffs_root(&dev), name,
+				       S_IFDIR | 0755, 0, 0);
+		if (!dir)
+			return -1;
+		for (f = 0; f < TREE_FILES; f++) {
+			unsigned id = d * TREE_FILES + f;
+
+			obj = create(dir, "f%u", id);
+			if (!obj || write_pattern(obj, id, 0, 0, tree_size(id)))
+				return -1;
+		}
+	}
+
+	for (f = 0; f < TREE_BIG; f++) {
+		obj = create(yaffs_root(&dev), "big%u", f);
+		if (!obj)
+			return -1;
+		for (off = 0; off < BIG_SIZE; off += 65536)
+			if (write_pattern(obj, 100000 + f, 0, off, 65536))
+				return -1;
+	}
+	yaffs_flush_whole_cache(&dev);
+	return 0;
+}
+
+/* Lists a tree directory the way readdir does and checks the names */
+static void tree_list(struct yaffs_obj *dir, int d)
+{
+	YCHAR name[YAFFS_MAX_NAME_LENGTH + 1];
+	int chunks[YAFFS_HDR_PREFETCH_MAX];
+	struct list_head *i;
+	int n_ahead = 0;
+	int found = 0;
+	unsigned id;
+
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		struct yaffs_obj *l = list_entry(i, struct yaffs_obj, siblings);
+		int n;
+
+		if (n_ahead == 0) {
+			n = yaffs_dir_name_hdrs(l, chunks,
+						YAFFS_HDR_PREFETCH_MAX,
+						&n_ahead);
+			if (n > 0)
+				hdr_prefetch(chunks, n);
+		}
+		n_ahead--;
+		yaffs_get_obj_name(l, name, YAFFS_MAX_NAME_LENGTH + 1);
+		if (sscanf(name, "f%u", &id) != 1 ||
+		    id / TREE_FILES != (unsigned)d) {
+			if (verify_errors++ < 10)
+				ERR("d%d has %s", d, name);
+		}
+		found++;
+	}
+	dev.hdr_prefetch = NULL;
+
+	if (found != TREE_FILES && verify_errors++ < 10)
+		ERR("d%d lists %d files", d, found);
+}
+
+static void tree_check(int dirs)
+{
+	struct yaffs_obj *dir;
+	struct yaffs_obj *obj;
+	char name[32];
+	int d, f;
+	loff_t off;
+
+	for (d = 0; d < dirs; d++) {
+		snprintf(name, sizeof(name), "d%d", d);
+		dir = find(yaffs_root(&dev), name);
+		if (!dir) {
+			verify_errors++;
+			ERR("%s is missing", name);
+			continue;
+		}
+		tree_list(dir, d);
+		for (f = 0; f < TREE_FILES; f++) {
+			unsigned id = d * TREE_FILES + f;
+
+			obj = lookup(dir, "f%u", id);
+			if (obj)
+				check(obj, id, 0, 0, tree_size(id));
+		}
+	}
+
+	for (f = 0; f < TREE_BIG; f++) {
+		obj = lookup(yaffs_root(&dev), "big%u", f);
+		for (off = 0; obj && off < BIG_SIZE; off += 65536)
+			check(obj, 100000 + f, 0, off, 65536);
+	}
+}
+
+static int bench_mount(void)
+{
+	int dirs = scaled(TREE_DIRS);
+	struct sample s;
+
+	if (sim_mount(0) || tree_build(dirs))
+		return -1;
+	sim_unmount(1);
+
+	sample(&s);
+	if (sim_mount(0))
+		return -1;
+	report("mount-cp", 1, 0, &s);
+	tree_check(dirs);
+	sim_unmount(0);
+
+	sample(&s);
+	if (sim_mount(1))
+		return -1;
+	report("mount-scan", 1, 0, &s);
+	tree_check(dirs);
+	sim_unmount(0);
+	return 0;
+}
+
+/* Appends with an fsync after each, like a log */
+#define SMALL_FILES 2000
+#define SMALL_WRITES 16
+#define SMALL_SIZE 256
+
+static int bench_small(void)
+{
+	int n = scaled(SMALL_FILES);
+	struct yaffs_obj *obj;
+	struct sample s;
+	int i, j;
+
+	if (sim_mount(0))
+		return -1;
+
+	sample(&s);
+	for (i = 0; i < n; i++) {
+		obj = create(yaffs_root(&dev), "s%u", i);
+		if (!obj)
+			return -1;
+		for (j = 0; j < SMALL_WRITES; j++) {
+			if (write_pattern(obj, i, 0, j * SMALL_SIZE,
+					  SMALL_SIZE))
+				return -1;
+			yaffs_flush_file(obj, 1, 1);
+		}
+	}
+	report("small-write", n * SMALL_WRITES,
+	       n * SMALL_WRITES * SMALL_SIZE / 1e6, &s);
+	sim_unmount(1);
+
+	if (sim_mount(0))
+		return -1;
+	sample(&s);
+	for (i = 0; i < n; i++) {
+		obj = lookup(yaffs_root(&dev), "s%u", i);
+		for (j = 0; obj && j < SMALL_WRITES; j++)
+			check(obj, i, 0, j * SMALL_SIZE, SMALL_SIZE);
+	}
+	report("small-read", n * SMALL_WRITES,
+	       n * SMALL_WRITES * SMALL_SIZE / 1e6, &s);
+
+	sample(&s);
+	for (i = 0; i < n; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "s%u", i);
+		yaffs_unlinker(yaffs_root(&dev), name);
+	}
+	yaffs_flush_whole_cache(&dev);
+	report("small-unlink", n, 0, &s);
+	sim_unmount(1);
+	return 0;
+}
+
+/* One big file written and read 64kB at a time */
+#define SEQ_SIZE (32 * 1024 * 1024)
+#define SEQ_IO 65536
+
+static int bench_seq(void)
+{
+	long long size = (long long)SEQ_SIZE * scale / 100;
+	long long limit = (long long)ns.n_blocks * ns.pages_per_block *
+	    ns.page_size * 2 / 5;
+	struct yaffs_obj *obj;
+	struct sample s;
+	loff_t off;
+
+	if (size > limit)
+		size = limit;
+	size -= size % SEQ_IO;
+	if (size < SEQ_IO)
+		size = SEQ_IO;
+
+	if (sim_mount(0))
+		return -1;
+	obj = create(yaffs_root(&dev), "seq%u", 0);
+	if (!obj)
+		return -1;
+
+	sample(&s);
+	for (off = 0; off < size; off += SEQ_IO)
+		if (write_pattern(obj, 0, 0, off, SEQ_IO))
+			return -1;
+	yaffs_flush_file(obj, 1, 1);
+	report("seq-write", size / SEQ_IO, size / 1e6, &s);
+	sim_unmount(1);
+
+	if (sim_mount(0))
+		return -1;
+	obj = lookup(yaffs_root(&dev), "seq%u", 0);
+	sample(&s);
+	for (off = 0; obj && off < size; off += SEQ_IO)
+		check(obj, 0, 0, off, SEQ_IO);
+	report("seq-read", size / SEQ_IO, size / 1e6, &s);
+	sim_unmount(1);
+	return 0;
+}
+
+/*
+ * Fills the device with 1MB files, then overwrites 4kB pages of them at
+ * random, most of the writes going to a few hot files.
+ */
+#define GC_FILL 80		/* percent */
+#define GC_HOT 10		/* percent of the files */
+#define GC_HOT_WRITES 90	/* percent of the writes */
+#define GC_WRITES 20000
+#define GC_PAGE 4096
+#define GC_PAGES (BIG_SIZE / GC_PAGE)
+
+static int bench_gc_mode(const char *name, int cost_benefit)
+{
+	int saved = options.gc_cost_benefit;
+	struct yaffs_obj **files;
+	unsigned char *gens;
+	struct sample s;
+	long long space;
+	int n_files, n_hot, n;
+	int i, f, p;
+	int ret = -1;
+
+	options.gc_cost_benefit = cost_benefit;
+	nandsim_format(&ns);
+	if (sim_mount(0))
+		goto out;
+
+	space = (long long)yaffs_get_n_free_chunks(&dev) *
+	    dev.data_bytes_per_chunk;
+	n_files = space * GC_FILL / 100 / BIG_SIZE;
+	n_hot = n_files * GC_HOT / 100;
+	if (n_hot < 1)
+		n_hot = 1;
+	if (n_files <= n_hot) {
+		ERR("device too small for the gc bench");
+		goto out;
+	}
+
+	files = calloc(n_files, sizeof(*files));
+	gens = calloc(n_files, GC_PAGES);
+	if (!files || !gens)
+		goto out_free;
+
+	for (f = 0; f < n_files; f++) {
+		files[f] = create(yaffs_root(&dev), "g%u", f);
+		if (!files[f])
+			goto out_free;
+		for (p = 0; p < GC_PAGES; p++)
+			if (write_pattern(files[f], f, 0, p * GC_PAGE, GC_PAGE))
+				goto out_free;
+	}
+	yaffs_flush_whole_cache(&dev);
+
+	n = scaled(GC_WRITES);
+	sample(&s);
+	for (i = 0; i < n; i++) {
+		if ((int)(rand() % 100) < GC_HOT_WRITES)
+			f = rand() % n_hot;
+		else
+			f = n_hot + rand() % (n_files - n_hot);
+		p = rand() % GC_PAGES;
+		gens[f * GC_PAGES + p]++;
+		if (write_pattern(files[f], f, gens[f * GC_PAGES + p],
+				  p * GC_PAGE, GC_PAGE))
+			goto out_free;
+	}
+	yaffs_flush_whole_cache(&dev);
+	report(name, n, n * (double)GC_PAGE / 1e6, &s);
+
+	for (f = 0; f < n_files; f++)
+		for (p = 0; p < GC_PAGES; p++)
+			check(files[f], f, gens[f * GC_PAGES + p],
+			      p * GC_PAGE, GC_PAGE);
+	sim_unmount(1);
+	ret = 0;
+
+out_free:
+	free(files);
+	free(gens);
+out:
+	options.gc_cost_benefit = saved;
+	return ret;
+}
+
+static int bench_gc(void)
+{
+	if (bench_gc_mode("gc-greedy", 0))
+		return -1;
+	return bench_gc_mode("gc-cb", 1);
+}
+
+/* Small changes between checkpoints, as with a sync every so often */
+#define CP_ROUNDS 50
+
+static int bench_checkpoint(void)
+{
+	int dirs = scaled(TREE_DIRS);
+	int rounds = scaled(CP_ROUNDS);
+	int n_tree = dirs * TREE_FILES;
+	struct yaffs_obj *obj;
+	double save_ms = 0;
+	double t0;
+	int i, j;
+
+	if (options.yaffs1)
+		return 0;
+
+	if (sim_mount(0) || tree_build(dirs))
+		return -1;
+	sim_unmount(1);
+	if (sim_mount(0))
+		return -1;
+
+	for (i = 0; i < rounds; i++) {
+		struct sample s;
+
+		for (j = 0; j < 3; j++) {
+			unsigned id = rand() % n_tree;
+			char name[32];
+
+			snprintf(name, sizeof(name), "d%u", id / TREE_FILES);
+			obj = yaffs_find_by_name(yaffs_root(&dev), name);
+			obj = obj ? lookup(obj, "f%u", id) : NULL;
+			if (!obj || write_pattern(obj, id, 0, 0, 512))
+				return -1;
+		}
+		obj = create(yaffs_root(&dev), "c%u", i);
+		if (!obj || write_pattern(obj, 200000 + i, 0, 0, 1024))
+			return -1;
+		yaffs_flush_whole_cache(&dev);
+
+		sample(&s);
+		t0 = now_ms();
+		yaffs_checkpoint_save(&dev);
+		save_ms += now_ms() - t0;
+		if (i == rounds - 1)
+			report("checkpoint", 1, 0, &s);
+	}
+	printf("%-12s %u full, %u delta saves, last %u bytes, %.2f ms each\n",
+	       "", dev.checkpt_full_saves, dev.checkpt_delta_saves,
+	       dev.checkpt_last_bytes, save_ms / rounds);
+	sim_unmount(1);
+
+	if (sim_mount(0))
+		return -1;
+	for (i = 0; i < rounds; i++) {
+		obj = lookup(yaffs_root(&dev), "c%u", i);
+		if (obj)
+			check(obj, 200000 + i, 0, 0, 1024);
+	}
+	sim_unmount(0);
+	return 0;
+}
+
+/*
+ * Drops the tnode trees of some 1MB files, as the kernel shrinker would,
+ * then reads, rewrites, checkpoints and deletes them so that the trees are
+ * rebuilt by each of the paths that can need them.
+ */
+#define EV_FILES 16
+#define EV_PAGE 4096
+
+static void evict_all(void)
+{
+	int tnode_pages;
+	int pages;
+	int est;
+	int n;
+
+	pages = yaffs_raw_pages(&dev, &tnode_pages);
+	est = yaffs_evictable_tnodes(&dev);
+	n = yaffs_evict_tnodes(&dev, 1 << 30);
+	printf("%-12s %d tnodes evicted (%d counted), pages %d (%d tnode) -> ",
+	       "", n, est, pages, tnode_pages);
+	pages = yaffs_raw_pages(&dev, &tnode_pages);
+	printf("%d (%d tnode)\n", pages, tnode_pages);
+
+	if (!n && verify_errors++ < 10)
+		ERR("nothing evicted");
+}
+
+static int bench_evict(void)
+{
+	long long limit = (long long)ns.n_blocks * ns.pages_per_block *
+	    ns.page_size * 2 / 5;
+	int n = scaled(EV_FILES);
+	struct yaffs_obj *obj;
+	struct sample s;
+	int i, j;
+
+	if (n > limit / BIG_SIZE)
+		n = limit / BIG_SIZE;
+	if (n < 1)
+		n = 1;
+
+	if (sim_mount(0))
+		return -1;
+	for (i = 0; i < n; i++) {
+		obj = create(yaffs_root(&dev), "e%u", i);
+		if (!obj)
+			return -1;
+		for (j = 0; j < BIG_SIZE; j += EV_PAGE)
+			if (write_pattern(obj, i, 0, j, EV_PAGE))
+				return -1;
+		yaffs_flush_file(obj, 1, 0);
+	}
+	/* Only what the checkpoint already has can go */
+	if (dev.param.is_yaffs2)
+		yaffs_checkpoint_save(&dev);
+
+	evict_all();
+	sample(&s);
+	for (i = 0; i < n; i++) {
+		obj = lookup(yaffs_root(&dev), "e%u", i);
+		for (j = 0; obj && j < BIG_SIZE; j += EV_PAGE)
+			check(obj, i, 0, j, EV_PAGE);
+	}
+	report("evict-read", n, n * BIG_SIZE / 1e6, &s);
+
+	evict_all();
+	sample(&s);
+	for (i = 0; i < n; i++) {
+		obj = lookup(yaffs_root(&dev), "e%u", i);
+		if (!obj || write_pattern(obj, i, 1, (i % 16) * EV_PAGE,
+					  EV_PAGE))
+			return -1;
+		yaffs_flush_file(obj, 1, 0);
+	}
+	report("evict-write", n, n * EV_PAGE / 1e6, &s);
+
+	/* A checkpoint needs every tree */
+	if (dev.param.is_yaffs2)
+		yaffs_checkpoint_save(&dev);
+	evict_all();
+	sim_unmount(1);
+
+	if (sim_mount(0))
+		return -1;
+	for (i = 0; i < n; i++) {
+		obj = lookup(yaffs_root(&dev), "e%u", i);
+		for (j = 0; obj && j < BIG_SIZE; j += EV_PAGE)
+			check(obj, i, (j == (i % 16) * EV_PAGE), j, EV_PAGE);
+	}
+
+	evict_all();
+	sample(&s);
+	for (i = 0; i < n; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "e%u", i);
+		yaffs_unlinker(yaffs_root(&dev), name);
+	}
+	yaffs_flush_whole_cache(&dev);
+	report("evict-unlink", n, 0, &s);
+	printf("%-12s %u trees evicted, %u rebuilt\n", "",
+	       dev.tnode_evictions, dev.tnode_reloads);
+	sim_unmount(1);
+	return 0;
+}
+
+/* Mounts whatever is in the image and reads it all, after a power cut */
+static void walk(struct yaffs_obj *dir, unsigned long *objs, loff_t *bytes)
+{
+	static u8 buf[65536];
+	struct list_head *i;
+	struct yaffs_obj *obj;
+	loff_t len, off;
+
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		obj = list_entry(i, struct yaffs_obj, siblings);
+		obj = yaffs_get_equivalent_obj(obj);
+		(*objs)++;
+		if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY) {
+			walk(obj, objs, bytes);
+		} else if (obj->variant_type == YAFFS_OBJECT_TYPE_FILE) {
+			len = yaffs_get_obj_length(obj);
+			for (off = 0; off < len; off += sizeof(buf))
+				yaffs_file_rd(obj, buf, off, sizeof(buf));
+			*bytes += len;
+		}
+	}
+}
+
+static int bench_scan(void)
+{
+	unsigned long objs = 0;
+	loff_t bytes = 0;
+	struct sample s;
+
+	sample(&s);
+	if (sim_mount(0))
+		return -1;
+	walk(yaffs_root(&dev), &objs, &bytes);
+	report("scan", objs, bytes / 1e6, &s);
+	sim_unmount(0);
+	return 0;
+}
+
+/* The word ecc against the table, over every length and alignment up to
+ * a NAND page, then how fast each does the 256 byte blocks of a page */
+#define ECC_ROUNDS 20
+#define ECC_BLOCKS 200000
+
+typedef void (*ecc_lines_fn) (const unsigned char *data, unsigned n_bytes,
+			      unsigned char *col_parity,
+			      unsigned *line_parity);
+
+static double ecc_rate(ecc_lines_fn fn, const u8 *data, int n)
+{
+	unsigned char col_parity;
+	unsigned line_parity;
+	unsigned x = 0;
+	double t0 = now_ms();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		fn(data + (i & 7) * 256, 256, &col_parity, &line_parity);
+		x ^= col_parity ^ line_parity;
+	}
+	/* keep the calls */
+	if (x == 0x12345678)
+		printf(" ");
+	return n * 256.0 / 1e3 / (now_ms() - t0);
+}
+
+static int bench_ecc(void)
+{
+	static u8 buf[2048 + 8];
+	unsigned char col_a, col_b;
+	unsigned line_a, line_b;
+	int rounds = scaled(ECC_ROUNDS);
+	int n = scaled(ECC_BLOCKS);
+	unsigned long checks = 0;
+	struct sample s;
+	int r, len, offset, i;
+
+	sample(&s);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < (int)sizeof(buf); i++)
+			buf[i] = rand();
+		for (len = 0; len <= 2048; len++) {
+			for (offset = 0; offset < 8; offset++) {
+				yaffs_ecc_lines_table(buf + offset, len,
+						      &col_a, &line_a);
+				yaffs_ecc_lines_word(buf + offset, len,
+						     &col_b, &line_b);
+				checks++;
+				if ((col_a != col_b || line_a != line_b) &&
+				    verify_errors++ < 10)
+					ERR("word ecc wrong for %d bytes at %d",
+					    len, offset);
+			}
+		}
+	}
+	report("ecc-check", checks, 0, &s);
+
+	printf("%-12s table %.1f MB/s, word %.1f MB/s\n", "",
+	       ecc_rate(yaffs_ecc_lines_table, buf, n),
+	       ecc_rate(yaffs_ecc_lines_word, buf, n));
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run) (void);
+	int format;
+} benches[] = {
+	{ "mount", bench_mount, 1 },
+	{ "small", bench_small, 1 },
+	{ "seq", bench_seq, 1 },
+	{ "gc", bench_gc, 1 },
+	{ "checkpoint", bench_checkpoint, 1 },
+	{ "evict", bench_evict, 1 },
+	{ "scan", bench_scan, 0 },
+	{ "ecc", bench_ecc, 0 },
+	{ NULL, NULL, 0 }
+};
+
+static void run_bench(int i)
+{
+	if (benches[i].format)
+		nandsim_format(&ns);
+	if (benches[i].run())
+		verify_errors++;
+}
+
+static int parse_options(char *str)
+{
+	char *opt;
+
+	for (opt = strtok(str, ","); opt; opt = strtok(NULL, ",")) {
+		if (!strcmp(opt, "yaffs1"))
+			options.yaffs1 = 1;
+		else if (!strcmp(opt, "inband-tags"))
+			options.inband_tags = 1;
+		else if (!strcmp(opt, "tags-ecc-off"))
+			options.no_tags_ecc = 1;
+		else if (!strcmp(opt, "no-cache"))
+			options.n_caches = 0;
+		else if (!strncmp(opt, "n-caches=", 9))
+			options.n_caches = atoi(opt + 9);
+		else if (!strcmp(opt, "disable-summary"))
+			options.disable_summary = 1;
+		else if (!strcmp(opt, "gc-cost-benefit"))
+			options.gc_cost_benefit = 1;
+		else if (!strncmp(opt, "checkpoint-deltas=", 18))
+			options.checkpt_max_deltas = atoi(opt + 18);
+		else {
+			ERR("bad yaffs option \"%s\"", opt);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void usage(int status)
+{
+	FILE *stream = (status != EXIT_SUCCESS) ? stderr : stdout;
+
+	fprintf(stream,
+"Usage: %s [options] [bench ...]\n"
+"\n"
+"Benches: mount small seq gc checkpoint evict (the default), scan,\n"
+"which mounts an existing image as it is, e.g. after a power cut, and\n"
+"ecc, which checks the word at a time ecc against the table and times\n"
+"both.\n"
+"\n"
+"Options:\n"
+"  -g <page>,<spare>,<pages per block>,<blocks>\n"
+"                  NAND geometry (default 2048,64,64,1024)\n"
+"  -f <file>       keep the NAND in file rather than memory\n"
+"  -o <opts>       yaffs options: yaffs1, inband-tags, tags-ecc-off,\n"
+"                  no-cache, n-caches=<n>, disable-summary,\n"
+"                  gc-cost-benefit, checkpoint-deltas=<n>\n"
+"  -e <ppm>        chance of a bit flip per page read\n"
+"  -F <bits>       bits flipped each time (default 1)\n"
+"  -E <bits>       bits per page the ecc corrects (default 1). With 0\n"
+"                  yaffs1 does its own ecc, over the first 512 bytes of\n"
+"                  a page; yaffs2 has none for data, so flips there go\n"
+"                  uncorrected\n"
+"  -B <permille>   factory bad blocks\n"
+"  -W <ppm>        chance of a page program failing\n"
+"  -X <ppm>        chance of a block erase failing\n"
+"  -P <n>          cut the power at the n-th page program\n"
+"  -T <read>,<prog>,<erase>,<byte>\n"
+"                  NAND timings in ns (default 25000,250000,2000000,25)\n"
+"  -n <percent>    scale the workloads (default 100)\n"
+"  -s <seed>       random seed\n"
+"  -t <mask>       yaffs trace mask\n"
+"  -h              show this help\n",
+		progname);
+	exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	int page = 2048, spare = 64, ppb = 64, blocks = 1024;
+	unsigned t_read = 0, t_prog = 0, t_erase = 0, t_byte = 0;
+	unsigned flip_ppm = 0, bad_permille = 0;
+	unsigned write_fail_ppm = 0, erase_fail_ppm = 0;
+	int flip_bits = 1, ecc_bits = 1;
+	unsigned long crash_after = 0;
+	int timings = 0;
+	char *file = NULL;
+	unsigned seed = 1;
+	int c, i, j;
+
+	progname = argv[0];
+
+	while ((c = getopt(argc, argv, "g:f:o:e:F:E:B:W:X:P:T:n:s:t:h")) != -1) {
+		switch (c) {
+		case 'g':
+			if (sscanf(optarg, "%d,%d,%d,%d",
+				   &page, &spare, &ppb, &blocks) != 4)
+				usage(EXIT_FAILURE);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'o':
+			if (parse_options(optarg))
+				usage(EXIT_FAILURE);
+			break;
+		case 'e':
+			flip_ppm = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			flip_bits = atoi(optarg);
+			break;
+		case 'E':
+			ecc_bits = atoi(optarg);
+			break;
+		case 'B':
+			bad_permille = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			write_fail_ppm = strtoul(optarg, NULL, 0);
+			break;
+		case 'X':
+			erase_fail_ppm = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			crash_after = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			if (sscanf(optarg, "%u,%u,%u,%u", &t_read, &t_prog,
+				   &t_erase, &t_byte) != 4)
+				usage(EXIT_FAILURE);
+			timings = 1;
+			break;
+		case 'n':
+			scale = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			yaffs_trace_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (page < 512 || spare < 16 || ppb < 2 || blocks < 16 || scale < 1)
+		usage(EXIT_FAILURE);
+
+	nandsim_defaults(&ns, page, spare, ppb, blocks);
+	ns.flip_ppm = flip_ppm;
+	ns.flip_bits = flip_bits;
+	ns.ecc_bits = ecc_bits;
+	ns.bad_permille = bad_permille;
+	ns.write_fail_ppm = write_fail_ppm;
+	ns.erase_fail_ppm = erase_fail_ppm;
+	ns.crash_after = crash_after;
+	ns.seed = seed;
+	if (timings) {
+		ns.t_read = t_read;
+		ns.t_prog = t_prog;
+		ns.t_erase = t_erase;
+		ns.t_byte = t_byte;
+	}
+	srand(seed);
+
+	if (nandsim_open(&ns, file)) {
+		ERR("cannot set up the flash: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	yaffs_ecc_init();
+	header();
+
+	if (optind == argc) {
+		/* The default set, everything that starts from scratch */
+		for (j = 0; benches[j].name; j++)
+			if (benches[j].format)
+				run_bench(j);
+	}
+
+	for (i = optind; i < argc; i++) {
+		for (j = 0; benches[j].name; j++)
+			if (!strcmp(argv[i], benches[j].name))
+				break;
+		if (!benches[j].name) {
+			ERR("unknown bench \"%s\"", argv[i]);
+			usage(EXIT_FAILURE);
+		}
+		run_bench(j);
+	}
+
+	if (ns.n_flips || ns.n_write_fails || ns.n_erase_fails)
+		printf("faults: %lu flips (%lu fixed, %lu not), "
+		       "%lu program and %lu erase failures\n",
+		       ns.n_flips, ns.n_ecc_fixed, ns.n_ecc_unfixed,
+		       ns.n_write_fails, ns.n_erase_fails);
+
+	nandsim_close(&ns);
+
+	if (verify_errors) {
+		ERR("%d verify errors", verify_errors);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+#!/bin/sh
+#
+# Garbage collection efficiency of yaffs2 on a nandsim MTD device.
+#
+# Run it inside a QEMU guest whose kernel has nandsim and yaffs2 as modules.
+# For each gc mode it loads a fresh nandsim, fills it with files, then
+# overwrites random pages with most writes going to a small hot set, and
+# reports the NAND page writes, gc copies and erasures this took, taken
+# from /proc/yaffs. Write amplification is page writes / host page writes.
+#
+# Usage: yaffs2-gc-bench.sh [options]
+#   -f <percent>  how full to fill the device (default 80)
+#   -h <percent>  share of the files that are hot (default 10)
+#   -k <percent>  share of the writes that go to hot files (default 90)
+#   -w <n>        number of 4kB overwrites (default 20000)
+#   -o <opts>     extra yaffs2 mount options
+#   -d "<args>"   nandsim delay arguments (default none)
+#   -g "<modes>"  gc modes to run (default "greedy cost-benefit")
+#
+# This is free software, licensed under the GNU General Public License v2.
+#
+
+FILL=80
+HOT=10
+HOT_WRITES=90
+WRITES=20000
+OPTS=
+DELAYS=
+MODES="greedy cost-benefit"
+MNT=/tmp/yaffs2-bench
+
+while getopts "f:h:k:w:o:d:g:" opt; do
+	case "$opt" in
+		f) FILL="$OPTARG";;
+		h) HOT="$OPTARG";;
+		k) HOT_WRITES="$OPTARG";;
+		w) WRITES="$OPTARG";;
+		o) OPTS="$OPTARG";;
+		d) DELAYS="$OPTARG";;
+		g) MODES="$OPTARG";;
+		*) sed -n '11,19s/^# \{0,1\}//p' "$0"; exit 1;;
+	esac
+done
+
+die() {
+	echo "$*" >&2
+	exit 1
+}
+
+# sum of one /proc/yaffs counter over all mounted devices
+yaffs_stat() {
+	awk -v key="$1" '$1 ~ "^" key "\\.\\." { n += $2 } END { print n + 0 }' \
+		/proc/yaffs
+}
+
+run_mode() {
+	mode="$1"
+	opts="$OPTS"
+	case "$mode" in
+		greedy) ;;
+		cost-benefit) opts="${opts:+$opts,}gc-cost-benefit";;
+		*) die "unknown gc mode $mode";;
+	esac
+
+	# 128MiB, 2KiB pages, 128KiB blocks
+	modprobe nandsim first_id_byte=0xec second_id_byte=0xf1 $DELAYS ||
+		die "cannot load nandsim"
+	mtd=$(awk -F: '/NAND simulator/ { sub("mtd", "", $1); print $1; exit }' \
+		/proc/mtd)
+	[ -n "$mtd" ] || die "no nandsim device in /proc/mtd"
+
+	mkdir -p "$MNT"
+	mount -t yaffs2 ${opts:+-o "$opts"} "/dev/mtdblock$mtd" "$MNT" ||
+		die "cannot mount /dev/mtdblock$mtd"
+
+	# one 1MB file per MB of the fill
+	size_mb=$(df -k "$MNT" | awk 'NR == 2 { print int($2 / 1024) }')
+	files=$((size_mb * FILL / 100))
+	hot=$((files * HOT / 100))
+	[ "$hot" -ge 1 ] || hot=1
+	[ "$files" -gt "$hot" ] || die "device too small for the fill"
+
+	i=0
+	while [ "$i" -lt "$files" ]; do
+		dd if=/dev/urandom of="$MNT/f$i" bs=1024k count=1 2>/dev/null ||
+			die "cannot fill the device"
+		i=$((i + 1))
+	done
+	sync
+
+	writes0=$(yaffs_stat n_page_writes)
+	copies0=$(yaffs_stat n_gc_copies)
+	erasures0=$(yaffs_stat n_erasures)
+	blocks0=$(yaffs_stat n_gc_blocks)
+
+	awk -v n="$WRITES" -v files="$files" -v hot="$hot" \
+	    -v hot_writes="$HOT_WRITES" 'BEGIN {
+		srand(1)
+		for (i = 0; i < n; i++) {
+			if (rand() * 100 < hot_writes)
+				f = int(rand() * hot)
+			else
+				f = hot + int(rand() * (files - hot))
+			print f, int(rand() * 256)
+		}
+	}' | while read -r f page; do
+		dd if=/dev/urandom of="$MNT/f$f" bs=4k count=1 seek="$page" \
+			conv=notrunc 2>/dev/null
+	done
+	sync
+
+	writes=$(($(yaffs_stat n_page_writes) - writes0))
+	copies=$(($(yaffs_stat n_gc_copies) - copies0))
+	erasures=$(($(yaffs_stat n_erasures) - erasures0))
+	blocks=$(($(yaffs_stat n_gc_blocks) - blocks0))
+
+	umount "$MNT"
+	rmmod nandsim
+
+	awk -v mode="$mode" -v w="$writes" -v c="$copies" -v e="$erasures" \
+	    -v b="$blocks" 'BEGIN {
+		wa = (w > c) ? w / (w - c) : 0
+		printf "%-14s %12d %10d %10d %10d %6.3f\n", mode, w, c, b, e, wa
+	}'
+}
+
+lsmod | grep -q '^nandsim ' && die "nandsim is already loaded"
+
+printf "%-14s %12s %10s %10s %10s %6s\n" \
+	mode page_writes gc_copies gc_blocks erasures wa
+for mode in $MODES; do
+	run_mode "$mode"
+done
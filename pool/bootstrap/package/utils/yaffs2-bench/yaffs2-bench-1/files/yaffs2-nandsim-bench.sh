@@ -0,0 +1,102 @@
+#!/bin/sh
+#
+# Sequential read throughput of yaffs2 on a nandsim MTD device.
+#
+# Run it inside a QEMU guest whose kernel has nandsim and yaffs2, built in
+# or as modules. It writes a file, remounts so nothing is left in the page
+# cache, then times dd reads of it at a few block sizes and reports MB/s
+# along with the NAND page reads and batched (multi page) reads yaffs did,
+# taken from /proc/yaffs.
+#
+# Usage: yaffs2-nandsim-bench.sh [options]
+#   -s <MB>       file size (default 16)
+#   -b "<kB> .."  read block sizes (default "4 64 1024")
+#   -r <n>        runs per block size (default 3)
+#   -o <opts>     extra yaffs2 mount options
+#   -d "<args>"   nandsim delay arguments
+#                 (default "access_delay=25 output_cycle=25")
+#   -m <n>        use existing /dev/mtdblock<n> instead of loading nandsim
+#
+# This is free software, licensed under the GNU General Public License v2.
+#
+
+SIZE=16
+BLOCKS="4 64 1024"
+RUNS=3
+OPTS=
+DELAYS="access_delay=25 output_cycle=25"
+MTD=
+MNT=/tmp/yaffs2-bench
+
+while getopts "s:b:r:o:d:m:" opt; do
+	case "$opt" in
+		s) SIZE="$OPTARG";;
+		b) BLOCKS="$OPTARG";;
+		r) RUNS="$OPTARG";;
+		o) OPTS="$OPTARG";;
+		d) DELAYS="$OPTARG";;
+		m) MTD="$OPTARG";;
+		*) sed -n '11,19s/^# \{0,1\}//p' "$0"; exit 1;;
+	esac
+done
+
+die() {
+	echo "$*" >&2
+	exit 1
+}
+
+# centiseconds since boot
+now() {
+	awk '{ printf "%d\n", $1 * 100 }' /proc/uptime
+}
+
+# sum of one /proc/yaffs counter over all mounted devices
+yaffs_stat() {
+	awk -v key="$1" '$1 ~ "^" key "\\.\\." { n += $2 } END { print n + 0 }' \
+		/proc/yaffs
+}
+
+if [ -z "$MTD" ]; then
+	# 128MiB, 2KiB pages, 128KiB blocks
+	modprobe nandsim first_id_byte=0xec second_id_byte=0xf1 $DELAYS ||
+		die "cannot load nandsim"
+	MTD=$(awk -F: '/NAND simulator/ { sub("mtd", "", $1); print $1; exit }' \
+		/proc/mtd)
+	[ -n "$MTD" ] || die "no nandsim device in /proc/mtd"
+fi
+
+mkdir -p "$MNT"
+mount -t yaffs2 ${OPTS:+-o "$OPTS"} "/dev/mtdblock$MTD" "$MNT" ||
+	die "cannot mount /dev/mtdblock$MTD"
+
+echo "writing ${SIZE}MB"
+dd if=/dev/urandom of="$MNT/blob" bs=1024k count="$SIZE" 2>/dev/null
+sync
+umount "$MNT"
+mount -t yaffs2 ${OPTS:+-o "$OPTS"} "/dev/mtdblock$MTD" "$MNT" ||
+	die "cannot remount /dev/mtdblock$MTD"
+
+printf "%8s %4s %10s %12s %12s\n" bs_kb run mb_per_sec page_reads multi_reads
+for bs in $BLOCKS; do
+	run=1
+	while [ "$run" -le "$RUNS" ]; do
+		sync
+		echo 3 > /proc/sys/vm/drop_caches
+		reads0=$(yaffs_stat n_page_reads)
+		multi0=$(yaffs_stat n_multi_reads)
+		t0=$(now)
+		dd if="$MNT/blob" of=/dev/null bs="${bs}k" 2>/dev/null
+		t1=$(now)
+		reads1=$(yaffs_stat n_page_reads)
+		multi1=$(yaffs_stat n_multi_reads)
+		awk -v bs="$bs" -v run="$run" -v mb="$SIZE" -v cs=$((t1 - t0)) \
+		    -v r=$((reads1 - reads0)) -v m=$((multi1 - multi0)) 'BEGIN {
+			if (cs < 1) cs = 1
+			printf "%8d %4d %10.2f %12d %12d\n", bs, run,
+				mb * 100 / cs, r, m
+		}'
+		run=$((run + 1))
+	done
+done
+
+umount "$MNT"
@@ -0,0 +1,488 @@
+/*
+ * yaffs2-fs-stress - concurrent reader/writer/metadata load on a directory
+ *
+ * Every reader thread owns one file and reads it start to end over and
+ * over, dropping it from the page cache first so each pass goes to the
+ * flash.  Writer threads overwrite random records of their own file and
+ * fsync every few writes, which also keeps the garbage collector busy.
+ * Stat threads stat() random entries of a directory of small files and
+ * readdir threads list that directory.
+ *
+ * Each class is first run alone and then all of them together for the
+ * same time.  Comparing the mixed numbers with the solo ones shows how
+ * much the classes get in each other's way, e.g. before and after a
+ * file system locking change.
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+enum {
+	CLASS_READ,
+	CLASS_WRITE,
+	CLASS_STAT,
+	CLASS_READDIR,
+	N_CLASSES
+};
+
+static const char *class_name[N_CLASSES] = {
+	"read", "write", "stat", "readdir"
+};
+
+/* log2 buckets with four sub-buckets per octave, in microseconds */
+#define HIST_BUCKETS	(32 * 4)
+
+struct stats {
+	uint64_t ops;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t hist[HIST_BUCKETS];
+};
+
+struct worker {
+	pthread_t thread;
+	int class;
+	int index;
+	unsigned int seed;
+	struct stats st;
+};
+
+static const char *dir = ".";
+static int duration = 10;
+static int n_threads[N_CLASSES] = { 2, 1, 1, 1 };
+static int file_kb = 4096;
+static int io_kb = 64;
+static int record_kb = 4;
+static int fsync_every = 8;
+static int n_small = 256;
+static int drop_caches;
+static int mixed_only;
+
+static volatile int stop;
+static char *meta_dir;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_bucket(uint64_t us)
+{
+	int msb, sub;
+
+	if (us < 4)
+		return us;
+	msb = 63 - __builtin_clzll(us);
+	sub = (us >> (msb - 2)) & 3;
+	if (msb * 4 + sub >= HIST_BUCKETS)
+		return HIST_BUCKETS - 1;
+	return msb * 4 + sub;
+}
+
+static uint64_t bucket_floor(int b)
+{
+	if (b < 4)
+		return b;
+	return (uint64_t)(4 + (b & 3)) << (b / 4 - 2);
+}
+
+static void account(struct stats *st, uint64_t t0, ssize_t bytes, int err)
+{
+	uint64_t us = now_us() - t0;
+
+	if (err) {
+		st->errors++;
+		return;
+	}
+	st->ops++;
+	st->bytes += bytes;
+	st->total_us += us;
+	if (us > st->max_us)
+		st->max_us = us;
+	st->hist[hist_bucket(us)]++;
+}
+
+static uint64_t percentile(const struct stats *st, int per_mille)
+{
+	uint64_t want, seen = 0;
+	int b;
+
+	if (!st->ops)
+		return 0;
+	want = (st->ops * per_mille + 999) / 1000;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += st->hist[b];
+		if (seen >= want)
+			return bucket_floor(b);
+	}
+	return st->max_us;
+}
+
+static void file_path(char *buf, size_t len, const char *kind, int index)
+{
+	snprintf(buf, len, "%s/stress-%s-%d", dir, kind, index);
+}
+
+static int make_file(const char *path, int kb)
+{
+	char buf[4096];
+	int fd, i;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	for (i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = rand();
+	for (i = 0; i < kb / 4; i++) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			close(fd);
+			return -1;
+		}
+	}
+	fsync(fd);
+	close(fd);
+	return 0;
+}
+
+static void uncache(int fd)
+{
+	if (drop_caches) {
+		int pfd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+		if (pfd >= 0) {
+			if (write(pfd, "1\n", 2) < 0)
+				;
+			close(pfd);
+		}
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void do_read(struct worker *w)
+{
+	char path[256];
+	char *buf = malloc(io_kb * 1024);
+	int fd;
+
+	file_path(path, sizeof(path), "read", w->index);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || !buf) {
+		w->st.errors++;
+		free(buf);
+		return;
+	}
+	while (!stop) {
+		uncache(fd);
+		lseek(fd, 0, SEEK_SET);
+		while (!stop) {
+			uint64_t t0 = now_us();
+			ssize_t n = read(fd, buf, io_kb * 1024);
+
+			if (n == 0)
+				break;
+			account(&w->st, t0, n, n < 0);
+			if (n < 0)
+				break;
+		}
+	}
+	close(fd);
+	free(buf);
+}
+
+static void do_write(struct worker *w)
+{
+	char path[256];
+	char *buf = malloc(record_kb * 1024);
+	int n_records = file_kb / record_kb;
+	int fd, i, writes = 0;
+
+	file_path(path, sizeof(path), "write", w->index);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || !buf || n_records < 1) {
+		w->st.errors++;
+		free(buf);
+		return;
+	}
+	for (i = 0; i < record_kb * 1024; i++)
+		buf[i] = rand_r(&w->seed);
+	while (!stop) {
+		off_t off = (off_t)(rand_r(&w->seed) % n_records) *
+			record_kb * 1024;
+		uint64_t t0 = now_us();
+		ssize_t n;
+		int err;
+
+		buf[0]++;
+		n = pwrite(fd, buf, record_kb * 1024, off);
+		err = n != record_kb * 1024;
+		if (!err && ++writes % fsync_every == 0)
+			err = fsync(fd) < 0;
+		account(&w->st, t0, n, err);
+	}
+	close(fd);
+	free(buf);
+}
+
+static void do_stat(struct worker *w)
+{
+	char path[256];
+	struct stat sb;
+
+	while (!stop) {
+		uint64_t t0;
+
+		snprintf(path, sizeof(path), "%s/%d", meta_dir,
+			 rand_r(&w->seed) % n_small);
+		t0 = now_us();
+		account(&w->st, t0, 0, stat(path, &sb) < 0);
+	}
+}
+
+static void do_readdir(struct worker *w)
+{
+	while (!stop) {
+		uint64_t t0 = now_us();
+		DIR *d = opendir(meta_dir);
+		int n = 0;
+
+		if (!d) {
+			w->st.errors++;
+			continue;
+		}
+		while (readdir(d))
+			n++;
+		closedir(d);
+		account(&w->st, t0, 0, n < n_small);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	switch (w->class) {
+	case CLASS_READ:
+		do_read(w);
+		break;
+	case CLASS_WRITE:
+		do_write(w);
+		break;
+	case CLASS_STAT:
+		do_stat(w);
+		break;
+	case CLASS_READDIR:
+		do_readdir(w);
+		break;
+	}
+	return NULL;
+}
+
+static int setup(void)
+{
+	char path[256];
+	int c, i;
+
+	for (c = CLASS_READ; c <= CLASS_WRITE; c++) {
+		for (i = 0; i < n_threads[c]; i++) {
+			file_path(path, sizeof(path), class_name[c], i);
+			if (make_file(path, file_kb) < 0) {
+				perror(path);
+				return -1;
+			}
+		}
+	}
+
+	if (asprintf(&meta_dir, "%s/stress-meta", dir) < 0)
+		return -1;
+	mkdir(meta_dir, 0755);
+	for (i = 0; i < n_small; i++) {
+		int fd;
+
+		snprintf(path, sizeof(path), "%s/%d", meta_dir, i);
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0) {
+			perror(path);
+			return -1;
+		}
+		if (write(fd, path, strlen(path)) < 0)
+			;
+		close(fd);
+	}
+	sync();
+	return 0;
+}
+
+static void cleanup(void)
+{
+	char path[256];
+	int c, i;
+
+	for (c = CLASS_READ; c <= CLASS_WRITE; c++) {
+		for (i = 0; i < n_threads[c]; i++) {
+			file_path(path, sizeof(path), class_name[c], i);
+			unlink(path);
+		}
+	}
+	for (i = 0; i < n_small; i++) {
+		snprintf(path, sizeof(path), "%s/%d", meta_dir, i);
+		unlink(path);
+	}
+	rmdir(meta_dir);
+}
+
+/* run the classes set in mask for duration seconds and print a line each */
+static void run(const char *phase, unsigned int mask)
+{
+	struct worker *workers;
+	struct stats sum[N_CLASSES];
+	int total = 0, c, i, n = 0;
+	uint64_t t0, elapsed;
+
+	for (c = 0; c < N_CLASSES; c++)
+		if (mask & (1 << c))
+			total += n_threads[c];
+	if (!total)
+		return;
+
+	workers = calloc(total, sizeof(*workers));
+	if (!workers)
+		return;
+
+	stop = 0;
+	t0 = now_us();
+	for (c = 0; c < N_CLASSES; c++) {
+		if (!(mask & (1 << c)))
+			continue;
+		for (i = 0; i < n_threads[c]; i++, n++) {
+			workers[n].class = c;
+			workers[n].index = i;
+			workers[n].seed = t0 + n;
+			pthread_create(&workers[n].thread, NULL, worker_main,
+				       &workers[n]);
+		}
+	}
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < total; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_us() - t0;
+
+	memset(sum, 0, sizeof(sum));
+	for (i = 0; i < total; i++) {
+		struct stats *s = &sum[workers[i].class];
+		struct stats *ws = &workers[i].st;
+		int b;
+
+		s->ops += ws->ops;
+		s->errors += ws->errors;
+		s->bytes += ws->bytes;
+		s->total_us += ws->total_us;
+		if (ws->max_us > s->max_us)
+			s->max_us = ws->max_us;
+		for (b = 0; b < HIST_BUCKETS; b++)
+			s->hist[b] += ws->hist[b];
+	}
+
+	for (c = 0; c < N_CLASSES; c++) {
+		struct stats *s = &sum[c];
+
+		if (!(mask & (1 << c)))
+			continue;
+		printf("%-6s %-8s %3d %10.1f %8.2f %8llu %8llu %8llu %8llu %6llu\n",
+		       phase, class_name[c], n_threads[c],
+		       s->ops * 1e6 / elapsed, s->bytes / (double)elapsed,
+		       (unsigned long long)(s->ops ? s->total_us / s->ops : 0),
+		       (unsigned long long)percentile(s, 500),
+		       (unsigned long long)percentile(s, 990),
+		       (unsigned long long)s->max_us,
+		       (unsigned long long)s->errors);
+	}
+	free(workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <dir>\n"
+		"  -t <sec>   time per phase (default %d)\n"
+		"  -r <n>     reader threads (default %d)\n"
+		"  -w <n>     writer threads (default %d)\n"
+		"  -s <n>     stat threads (default %d)\n"
+		"  -l <n>     readdir threads (default %d)\n"
+		"  -f <kB>    size of each reader/writer file (default %d)\n"
+		"  -b <kB>    read size (default %d)\n"
+		"  -k <kB>    write record size (default %d)\n"
+		"  -y <n>     fsync every n writes (default %d)\n"
+		"  -n <n>     files in the stat/readdir directory (default %d)\n"
+		"  -D         drop all caches instead of fadvise before a pass\n"
+		"  -M         skip the solo phases, run only the mixed one\n",
+		prog, duration, n_threads[CLASS_READ], n_threads[CLASS_WRITE],
+		n_threads[CLASS_STAT], n_threads[CLASS_READDIR], file_kb,
+		io_kb, record_kb, fsync_every, n_small);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int all = 0;
+	int c, opt;
+
+	while ((opt = getopt(argc, argv, "t:r:w:s:l:f:b:k:y:n:DM")) != -1) {
+		switch (opt) {
+		case 't': duration = atoi(optarg); break;
+		case 'r': n_threads[CLASS_READ] = atoi(optarg); break;
+		case 'w': n_threads[CLASS_WRITE] = atoi(optarg); break;
+		case 's': n_threads[CLASS_STAT] = atoi(optarg); break;
+		case 'l': n_threads[CLASS_READDIR] = atoi(optarg); break;
+		case 'f': file_kb = atoi(optarg); break;
+		case 'b': io_kb = atoi(optarg); break;
+		case 'k': record_kb = atoi(optarg); break;
+		case 'y': fsync_every = atoi(optarg); break;
+		case 'n': n_small = atoi(optarg); break;
+		case 'D': drop_caches = 1; break;
+		case 'M': mixed_only = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || duration < 1 || io_kb < 1 ||
+	    record_kb < 1 || fsync_every < 1 || n_small < 1 || file_kb < 4)
+		usage(argv[0]);
+	dir = argv[optind];
+
+	srand(getpid());
+	if (setup() < 0)
+		return 1;
+
+	printf("%-6s %-8s %3s %10s %8s %8s %8s %8s %8s %6s\n",
+	       "phase", "class", "thr", "ops/s", "MB/s", "avg_us",
+	       "p50_us", "p99_us", "max_us", "errors");
+	for (c = 0; c < N_CLASSES; c++) {
+		if (n_threads[c] > 0)
+			all |= 1 << c;
+		if (!mixed_only)
+			run("solo", (1 << c) & all);
+	}
+	run("mixed", all);
+
+	cleanup();
+	return 0;
+}
@@ -70,8 +70,8 @@ do
       mkdir -p $TARGET_DIR/$TARGET
       dbg "rm -rf $TARGET_DIR/$TARGET"
       rm -rf $TARGET_DIR/$TARGET
-      dbg "cp -afL $SOURCE_DIR/$SOURCE $TARGET_DIR/$TARGET"
-      cp -afL $SOURCE_DIR/$SOURCE $TARGET_DIR/$TARGET
+      dbg "cp -afL $WORKSPACE_CP_FLAGS $SOURCE_DIR/$SOURCE $TARGET_DIR/$TARGET"
+      cp -afL $WORKSPACE_CP_FLAGS $SOURCE_DIR/$SOURCE $TARGET_DIR/$TARGET
     elif [ "$FIRST_CHAR" = "d" ] ; then
       dbg "mkdir -p $TARGET_DIR/$TARGET"
       mkdir -p $TARGET_DIR/$TARGET